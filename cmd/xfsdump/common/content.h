@@ -100,6 +100,10 @@ extern intgen_t content_stream_dump( ix_t strmix );
 	/* does stream dump
 	 */
 
+extern void content_stream_checkin( ix_t strmix );
+	/* notes that a stream will dump no more media files
+	 */
+
 #endif /* DUMP */
 #ifdef RESTORE
 extern size_t perssz;
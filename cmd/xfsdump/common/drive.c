@@ -42,6 +42,7 @@
 #include "dlog.h"
 #include "path.h"
 #include "getopt.h"
+#include "stream.h"
 #include "global.h"
 #include "drive.h"
 
@@ -117,8 +118,19 @@ drive_init1( int argc, char *argv[ ], bool_t singlethreaded )
 		}
 	}
 
-	/* validate drive count
+	/* validate drive count. when single-threaded, dump runs each
+	 * stream in a process of its own; restore can read only one.
 	 */
+	if ( drivecnt > STREAM_SIMMAX ) {
+		mlog( MLOG_NORMAL,
+		      "too many -%c arguments: "
+		      "maximum is %d\n",
+		      GETOPT_DUMPDEST,
+		      STREAM_SIMMAX );
+		usage( );
+		return BOOL_FALSE;
+	}
+#ifdef RESTORE
 	if ( singlethreaded && drivecnt > 1 ) {
 		mlog( MLOG_NORMAL,
 		      "too many -%c arguments: "
@@ -128,6 +140,7 @@ drive_init1( int argc, char *argv[ ], bool_t singlethreaded )
 		usage( );
 		return BOOL_FALSE;
 	}
+#endif /* RESTORE */
 
 	/* allocate an array to hold ptrs to drive descriptors
 	 */
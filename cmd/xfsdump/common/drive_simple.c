@@ -39,6 +39,10 @@
 #include <errno.h>
 #include <malloc.h>
 #include <sched.h>
+#include <aio.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <sys/uio.h>
 
 #include "types.h"
 #include "util.h"
@@ -47,6 +51,7 @@
 #include "global.h"
 #include "drive.h"
 #include "media.h"
+#include "getopt.h"
 #include "arch_xlate.h"
 
 #ifdef RMT
@@ -78,15 +83,138 @@ extern int rmtwrite( int, const void *, uint);
 /* drive context - drive-specific context
  * buf must be page-aligned and at least 1 page in size
  */
-#define PGPERBUF	64	/* private read buffer */
+#define PGPERBUF	64	/* default buffer size */
 #define BUFSZ		( PGPERBUF * PGSZ )
+#define BUFSZ_MAX	( 0x1000000 )
+
+/* number of buffers in the write-behind ring
+ */
+#define RINGLEN_MIN	1
+#define RINGLEN_MAX	10
+#define RINGLEN_DEFAULT	3
 
 /* operational mode
  */
 typedef enum { OM_NONE, OM_READ, OM_WRITE } om_t;
 
+/* write-behind buffer. when dumping to a local file or pipe, each full
+ * buffer is queued with aio_write and the next one in the ring is
+ * filled while it drains.
+ */
+struct wbuf {
+	char *wb_bufp;		/* page-aligned buffer */
+	struct aiocb64 wb_aiocb;	/* control block of queued write */
+	bool_t wb_pendingpr;	/* write queued, not yet retired */
+};
+
+typedef struct wbuf wbuf_t;
+
+/* framing of the media file. when compressing or checksumming, the
+ * stream following the media file header is written as a sequence of
+ * frames, one per buffer, each padded to FRAME_ALIGN. the stream ends
+ * with an empty frame marked FRAME_EOD.
+ */
+#define FRAME_MAGIC	0x58465a46	/* "XFZF" */
+#define FRAME_HDR_SZ	32
+#define FRAME_ALIGN	BBSIZE
+
+#define FRAME_DEFLATE	0x1	/* payload is deflated */
+#define FRAME_CRC	0x2	/* fh_datacrc is valid */
+#define FRAME_EOD	0x4	/* last frame of the media file */
+
+struct frame_hdr {
+	u_int32_t fh_magic;		/*   4   4 */
+		/* FRAME_MAGIC
+		 */
+	u_int32_t fh_flags;		/*   4   8 */
+		/* FRAME_DEFLATE, FRAME_CRC, FRAME_EOD
+		 */
+	u_int32_t fh_rawsz;		/*   4   c */
+		/* stream bytes carried by this frame
+		 */
+	u_int32_t fh_datasz;		/*   4  10 */
+		/* payload bytes following the frame hdr, excluding padding
+		 */
+	off64_t fh_stroff;		/*   8  18 */
+		/* stream offset of the first byte carried
+		 */
+	u_int32_t fh_datacrc;		/*   4  1c */
+		/* crc32c of the stream bytes carried
+		 */
+	u_int32_t fh_hdrcrc;		/*   4  20 */
+		/* crc32c of this hdr, calculated with this field zero
+		 */
+};
+
+typedef struct frame_hdr frame_hdr_t;
+
+/* drive-specific portion of the media file header (dh_specific)
+ */
+#define SH_FRAMED	0x1	/* stream after the media file hdr is framed */
+
+struct simple_hdr {
+	drive_mark_t sh_firstmark;	/* offset of first mark, or 0 */
+	u_int32_t sh_flags;		/* SH_FRAMED */
+	u_int32_t sh_bufsz;		/* most stream bytes in a frame */
+};
+
+typedef struct simple_hdr simple_hdr_t;
+
+/* framing buffer. each full buffer is framed by a thread of its own
+ * (compressed and/or checksummed when dumping, verified and expanded
+ * when restoring), so that several are in progress at once. frames are
+ * written and read in stream order.
+ */
+typedef enum { ZB_IDLE, ZB_QUEUED, ZB_DONE } zbstate_t;
+
+struct zbuf {
+	char *zb_bufp;		/* page-aligned stream buffer */
+	char *zb_framep;	/* frame hdr followed by payload */
+	char *zb_datap;		/* where the stream bytes are */
+	size_t zb_rawsz;	/* stream bytes in buffer */
+	size_t zb_prefixsz;	/* leading bytes written unframed (dump) */
+	size_t zb_payloadsz;	/* payload bytes in frame */
+	u_int32_t zb_flags;	/* frame flags */
+	u_int32_t zb_datacrc;	/* frame crc of stream bytes */
+	off64_t zb_stroff;	/* stream offset of first byte */
+	off64_t zb_seq;		/* position in frame order (dump) */
+	zbstate_t zb_state;	/* protected by dc_zlock */
+	intgen_t zb_rval;	/* drive error, if any */
+	char *zb_errmsg;	/* reason for the error */
+	pthread_t zb_thread;	/* thread framing this buffer */
+	drive_t *zb_drivep;	/* drive the thread works for */
+};
+
+typedef struct zbuf zbuf_t;
+
 struct drive_context {
-	char dc_buf[ BUFSZ ];	/* input/output buffer */
+	char *dc_buf;		/* input/output buffer */
+	size_t dc_bufsz;	/* size of each buffer */
+	char *dc_privbufp;	/* buffer used when the ring is not */
+	size_t dc_ringlen;	/* number of buffers in ring */
+	wbuf_t *dc_wbufp;	/* write-behind ring, or NULL */
+	ix_t dc_wbufix;		/* ring entry holding dc_buf */
+	off64_t dc_wbase;	/* file offset of stream start, -1 if pipe */
+	off64_t dc_committed;	/* stream bytes known to be written */
+	bool_t dc_errorpr;	/* a queued write failed */
+	bool_t dc_compresspr;	/* compress frames (dump) */
+	bool_t dc_recchksumpr;	/* checksum frames (dump) */
+	bool_t dc_framedpr;	/* stream after media file hdr is framed */
+	size_t dc_zbufsz;	/* stream bytes per framing buffer */
+	zbuf_t *dc_zbufp;	/* framing buffer ring, or NULL */
+	size_t dc_zthreadcnt;	/* framing threads running */
+	ix_t dc_zbufix;		/* ring entry holding dc_buf */
+	ix_t dc_zfillix;	/* next ring entry to read a frame into */
+	off64_t dc_zseq;	/* sequence number of next frame queued */
+	off64_t dc_zseqnext;	/* sequence number of next frame written */
+	off64_t dc_physoff;	/* media file bytes written or read */
+	bool_t dc_zquitpr;	/* framing threads should exit */
+	bool_t dc_zeodpr;	/* no more frames to be read */
+	intgen_t dc_zrval;	/* error returned for all further reads */
+	char *dc_leftp;		/* frame bytes read along with media file hdr */
+	size_t dc_leftcnt;	/* how many of those are left */
+	pthread_mutex_t dc_zlock;/* protects the framing ring */
+	pthread_cond_t dc_zcond;/* signals framing ring state changes */
 	om_t dc_mode;		/* current mode of operation */
 	ix_t dc_fmarkcnt;	/* how many file marks to the left */
 	char *dc_ownedp;	/* first byte owned by caller */
@@ -140,6 +268,37 @@ static intgen_t do_erase( drive_t * );
 static intgen_t do_get_device_class( drive_t * );
 static void do_quit( drive_t * );
 
+/* write-behind functions
+ */
+#ifdef DUMP
+static intgen_t wbuf_queue( drive_t *drivep );
+static intgen_t wbuf_retire( drive_t *drivep, wbuf_t *wbufp );
+static intgen_t wbuf_drain( drive_t *drivep );
+#endif /* DUMP */
+
+/* framing functions
+ */
+static void simple_hdr_xlate( drive_hdr_t *, drive_hdr_t * );
+static u_int32_t crc32c( char *, size_t );
+static void frame_hdr_set( frame_hdr_t *, u_int32_t, size_t, size_t,
+			   off64_t, u_int32_t );
+static bool_t zbuf_alloc( drive_t *, size_t, bool_t );
+static void zbuf_free( drive_t * );
+static void *zbuf_thread( void * );
+static intgen_t zbuf_wait( drive_t *, zbuf_t * );
+static intgen_t zbuf_unframe( drive_t *, zbuf_t * );
+static intgen_t zbuf_read( drive_t *, char *, size_t );
+static intgen_t zbuf_read_frame( drive_t *, zbuf_t * );
+static intgen_t zbuf_fill( drive_t * );
+#ifdef DUMP
+static intgen_t zbuf_frame( drive_t *, zbuf_t * );
+static intgen_t zbuf_put( drive_t *, struct iovec *, intgen_t, off64_t );
+static intgen_t zbuf_queue( drive_t * );
+static intgen_t zbuf_retire( drive_t *, zbuf_t * );
+static intgen_t zbuf_drain( drive_t * );
+static intgen_t zbuf_end( drive_t * );
+#endif /* DUMP */
+
 
 /* definition of locally defined global variables ****************************/
 
@@ -157,6 +316,14 @@ drive_strategy_t drive_strategy_simple = {
 
 /* definition of locally defined static variables *****************************/
 
+/* crc32c (castagnoli) lookup table, filled in by zbuf_alloc
+ */
+static u_int32_t crc32c_table[ 256 ];
+
+/* zeros used to pad frames
+ */
+static char frame_pad[ FRAME_ALIGN ];
+
 /* drive operators
  */
 static drive_ops_t drive_ops = {
@@ -201,7 +368,7 @@ ds_match( int argc, char *argv[], drive_t *drivep, bool_t singlethreaded )
 
 	/* sanity checks
 	 */
-	ASSERT( ! ( sizeofmember( drive_context_t, dc_buf ) % PGSZ ));
+	ASSERT( ! ( BUFSZ % PGSZ ));
 
 	/* determine if this is an rmt file. if so, give a weak match:
 	 * might be an ordinary file accessed via the rmt protocol.
@@ -240,20 +407,90 @@ static bool_t
 ds_instantiate( int argc, char *argv[], drive_t *drivep, bool_t singlethreaded )
 {
 	drive_context_t *contextp;
+	intgen_t c;
 
 	/* hook up the drive ops
 	 */
 	drivep->d_opsp = &drive_ops;
 
-	/* initialize the drive context - allocate a page-aligned
-	 * structure, so the buffer is page-aligned.
+	/* initialize the drive context
 	 */
-	contextp = ( drive_context_t * )memalign( PGSZ,
-						  sizeof( drive_context_t ));
+	contextp = ( drive_context_t * )calloc( 1, sizeof( drive_context_t ));
 	ASSERT( contextp );
-	ASSERT( ! ( ( intgen_t )contextp & PGMASK ));
-	ASSERT( ( void * )contextp->dc_buf == ( void * )contextp );
-	memset( ( void * )contextp, 0, sizeof( *contextp ));
+	drivep->d_contextp = ( void * )contextp;
+
+	/* scan the command line for the buffer size, the I/O buffer
+	 * ring length and whether to compress or checksum
+	 */
+	contextp->dc_bufsz = BUFSZ;
+	contextp->dc_ringlen = RINGLEN_DEFAULT;
+	optind = 1;
+	opterr = 0;
+	while ( ( c = getopt( argc, argv, GETOPT_CMDSTRING )) != EOF ) {
+		switch ( c ) {
+		case GETOPT_BLOCKSIZE:
+			if ( ! optarg || optarg[ 0 ] == '-' ) {
+				mlog( MLOG_NORMAL | MLOG_WARNING | MLOG_DRIVE,
+				      "-%c argument missing\n",
+				      optopt );
+				return BOOL_FALSE;
+			}
+			contextp->dc_bufsz = ( size_t )atoi( optarg );
+			if ( contextp->dc_bufsz < PGSZ
+			     ||
+			     contextp->dc_bufsz > BUFSZ_MAX ) {
+				mlog( MLOG_NORMAL | MLOG_ERROR | MLOG_DRIVE,
+				      "-%c argument must be "
+				      "between %u and %u: ignoring %u\n",
+				      optopt,
+				      PGSZ,
+				      BUFSZ_MAX,
+				      contextp->dc_bufsz );
+				return BOOL_FALSE;
+			}
+			contextp->dc_bufsz = ( contextp->dc_bufsz + PGMASK )
+					     &
+					     ~PGMASK;
+			break;
+		case GETOPT_RINGLEN:
+			if ( ! optarg || optarg[ 0 ] == '-' ) {
+				mlog( MLOG_NORMAL | MLOG_WARNING | MLOG_DRIVE,
+				      "-%c argument missing\n",
+				      optopt );
+				return BOOL_FALSE;
+			}
+			contextp->dc_ringlen = ( size_t )atoi( optarg );
+			if ( contextp->dc_ringlen < RINGLEN_MIN
+			     ||
+			     contextp->dc_ringlen > RINGLEN_MAX ) {
+				mlog( MLOG_NORMAL | MLOG_ERROR | MLOG_DRIVE,
+				      "-%c argument must be "
+				      "between %u and %u: ignoring %u\n",
+				      optopt,
+				      RINGLEN_MIN,
+				      RINGLEN_MAX,
+				      contextp->dc_ringlen );
+				return BOOL_FALSE;
+			}
+			break;
+#ifdef DUMP
+		case GETOPT_COMPRESS:
+			contextp->dc_compresspr = BOOL_TRUE;
+			break;
+		case GETOPT_RECCHKSUM:
+			contextp->dc_recchksumpr = BOOL_TRUE;
+			break;
+#endif /* DUMP */
+		}
+	}
+
+	/* the buffer must be page-aligned. it is used for reading, and for
+	 * writing if the ring is not.
+	 */
+	contextp->dc_privbufp = ( char * )memalign( PGSZ, contextp->dc_bufsz );
+	ASSERT( contextp->dc_privbufp );
+	contextp->dc_buf = contextp->dc_privbufp;
+
 
 	/* scan drive device pathname to see if remote tape
 	 */
@@ -383,14 +620,46 @@ ds_instantiate( int argc, char *argv[], drive_t *drivep, bool_t singlethreaded )
 		}
 	}
 
+#ifdef DUMP
+	/* unless the file is remote, set up a ring of buffers so that
+	 * writes to the file or pipe proceed while the next buffer is
+	 * being filled. a compressed stream is framed through a ring of
+	 * its own, set up by begin_write.
+	 */
+	if ( ! contextp->dc_isrmtpr
+	     &&
+	     ! contextp->dc_compresspr
+	     &&
+	     contextp->dc_ringlen > 1 ) {
+		ix_t ix;
+
+		mlog( MLOG_NITTY | MLOG_DRIVE,
+		      "write-behind ring: %u buffers of %u bytes\n",
+		      contextp->dc_ringlen,
+		      contextp->dc_bufsz );
+		contextp->dc_wbufp = ( wbuf_t * )calloc( contextp->dc_ringlen,
+							 sizeof( wbuf_t ));
+		ASSERT( contextp->dc_wbufp );
+		contextp->dc_wbufp[ 0 ].wb_bufp = contextp->dc_privbufp;
+		for ( ix = 1 ; ix < contextp->dc_ringlen ; ix++ ) {
+			contextp->dc_wbufp[ ix ].wb_bufp =
+				( char * )memalign( PGSZ, contextp->dc_bufsz );
+			if ( ! contextp->dc_wbufp[ ix ].wb_bufp ) {
+				mlog( MLOG_NORMAL | MLOG_ERROR | MLOG_DRIVE,
+				      "unable to allocate memory "
+				      "for I/O buffer ring\n" );
+				return BOOL_FALSE;
+			}
+		}
+	}
+#endif /* DUMP */
+
 	/* initialize the operational mode. fmarkcnt is bumped on each
 	 * end_read and end_write, set back to 0 on rewind.
 	 */
 	contextp->dc_mode = OM_NONE;
 	contextp->dc_fmarkcnt = 0;
 
-	drivep->d_contextp = ( void * )contextp;
-
 	drivep->d_cap_est = -1;
 	drivep->d_rate_est = -1;
 
@@ -470,6 +739,7 @@ do_begin_read( drive_t *drivep )
 	/* prepare the drive context
 	 */
 	contextp->dc_ownedp = 0;
+	contextp->dc_buf = contextp->dc_privbufp;
 	contextp->dc_emptyp = &contextp->dc_buf[ 0 ];
 	contextp->dc_nextp = contextp->dc_emptyp;
 	contextp->dc_bufstroff = 0;
@@ -531,8 +801,7 @@ do_begin_read( drive_t *drivep )
 
 	xlate_global_hdr(tmphdr, grhdrp, 1);
 	xlate_drive_hdr(tmpdh, dh, 1);
-	*(( drive_mark_t * )dh->dh_specific) =
-		INT_GET(*(( drive_mark_t * )tmpdh->dh_specific), ARCH_CONVERT);
+	simple_hdr_xlate(tmpdh, dh);
 	xlate_media_hdr(tmpmh, mh, 1);
 	xlate_content_hdr(tmpch, ch, 1);
 	xlate_content_inode_hdr(tmpcih, cih, 1);
@@ -579,6 +848,46 @@ do_begin_read( drive_t *drivep )
 		drivep->d_capabilities |= DRIVE_CAP_NEXTMARK;
 	}
 
+	/* if the rest of the media file is framed, set up the ring of
+	 * buffers to be verified and expanded into. any frame bytes read
+	 * along with the header are read again from dc_leftp.
+	 */
+	contextp->dc_framedpr = BOOL_FALSE;
+	zbuf_free( drivep );
+	if ( ( ( simple_hdr_t * )drhdrp->dh_specific )->sh_flags & SH_FRAMED ) {
+		size_t bufsz = ( ( simple_hdr_t * )drhdrp->dh_specific )->sh_bufsz;
+
+		if ( grhdrp->gh_version < GLOBAL_HDR_VERSION_3 ) {
+			mlog( MLOG_NORMAL | MLOG_ERROR | MLOG_DRIVE,
+			      "media file header version %d "
+			      "cannot be framed\n",
+			      grhdrp->gh_version );
+			return DRIVE_ERROR_FORMAT;
+		}
+		if ( bufsz < PGSZ || bufsz > BUFSZ_MAX ) {
+			mlog( MLOG_NORMAL | MLOG_ERROR | MLOG_DRIVE,
+			      "media file header frame size invalid: %u\n",
+			      bufsz );
+			return DRIVE_ERROR_FORMAT;
+		}
+		if ( ! zbuf_alloc( drivep, bufsz, contextp->dc_ringlen > 1 )) {
+			return DRIVE_ERROR_CORE;
+		}
+		contextp->dc_framedpr = BOOL_TRUE;
+		contextp->dc_leftp = contextp->dc_nextp;
+		contextp->dc_leftcnt = ( size_t )( contextp->dc_emptyp
+						   -
+						   contextp->dc_nextp );
+		contextp->dc_physoff = contextp->dc_bufstroff
+				       +
+				       ( off64_t )( contextp->dc_nextp
+						    -
+						    contextp->dc_buf );
+		contextp->dc_bufstroff = contextp->dc_physoff;
+		contextp->dc_buf = contextp->dc_emptyp;
+		contextp->dc_nextp = contextp->dc_emptyp;
+	}
+
 	/* note that a successful begin_read ocurred
 	 */
 	contextp->dc_mode = OM_READ;
@@ -616,9 +925,22 @@ do_read( drive_t *drivep,
 	ASSERT( contextp->dc_emptyp >= contextp->dc_nextp );
 	remainingcnt = ( size_t )( contextp->dc_emptyp - contextp->dc_nextp );
 
-	/* if no unread bytes in buffer, refill
+	/* if no unread bytes in buffer and the media file is framed,
+	 * move on to the next frame.
 	 */
-	if ( remainingcnt == 0 ) {
+	if ( remainingcnt == 0 && contextp->dc_framedpr ) {
+		*rvalp = zbuf_fill( drivep );
+		if ( *rvalp ) {
+			return 0;
+		}
+		remainingcnt = ( size_t )( contextp->dc_emptyp
+					   -
+					   contextp->dc_nextp );
+		ASSERT( remainingcnt > 0 );
+
+	/* otherwise if no unread bytes in buffer, refill
+	 */
+	} else if ( remainingcnt == 0 ) {
 		size_t bufhowfullcnt;
 		int nread;
 
@@ -632,7 +954,9 @@ do_read( drive_t *drivep,
 
 		/* attempt to fill the buffer. nread may be less if at EOF
 		 */
-		nread = read( contextp->dc_fd, contextp->dc_buf, BUFSZ );
+		nread = read( contextp->dc_fd,
+			      contextp->dc_buf,
+			      contextp->dc_bufsz );
 		if ( nread < 0 ) {
 			*rvalp = DRIVE_ERROR_DEVICE;
 			return 0;
@@ -646,7 +970,7 @@ do_read( drive_t *drivep,
 		/* record the ptrs to the first empty byte and the next
 		 * byte to be read
 		 */
-		ASSERT( nread <= BUFSZ );
+		ASSERT( ( size_t )nread <= contextp->dc_bufsz );
 		contextp->dc_emptyp = contextp->dc_buf + nread;
 		contextp->dc_nextp = contextp->dc_buf;
 
@@ -900,9 +1224,41 @@ do_begin_write( drive_t *drivep )
 		return DRIVE_ERROR_EOM;
 	}
 
-	/* indicate in the header that there is no recorded mark.
+#ifdef DUMP
+	/* if compressing, set up the ring of buffers to be framed and
+	 * written by threads of their own while the next buffer is being
+	 * filled. this is done here, as the threads must belong to the
+	 * process writing the stream. rmt is not threadsafe, so frames
+	 * going to a remote file are done one at a time. checksums (-C)
+	 * ride in the frames; on their own they do not change the format.
+	 */
+	zbuf_free( drivep );
+	contextp->dc_framedpr = contextp->dc_compresspr;
+	if ( contextp->dc_framedpr ) {
+		if ( ! zbuf_alloc( drivep,
+				   contextp->dc_bufsz,
+				   ! contextp->dc_isrmtpr
+				   &&
+				   contextp->dc_ringlen > 1 )) {
+			return DRIVE_ERROR_CORE;
+		}
+	}
+#endif /* DUMP */
+
+	/* indicate in the header that there is no recorded mark, and
+	 * whether the stream is framed. a framed media file gets a header
+	 * version older xfsrestores reject, rather than misread.
 	 */
 	*( ( off64_t * )dwhdrp->dh_specific ) = 0;
+	if ( contextp->dc_framedpr ) {
+		gwhdrp->gh_version = GLOBAL_HDR_VERSION_3;
+		( ( simple_hdr_t * )dwhdrp->dh_specific )->sh_flags = SH_FRAMED;
+		( ( simple_hdr_t * )dwhdrp->dh_specific )->sh_bufsz =
+						( u_int32_t )contextp->dc_zbufsz;
+	} else {
+		( ( simple_hdr_t * )dwhdrp->dh_specific )->sh_flags = 0;
+		( ( simple_hdr_t * )dwhdrp->dh_specific )->sh_bufsz = 0;
+	}
 	
 	/* prepare the drive context. initially the caller does not own
 	 * any of the write buffer, so the next portion of the buffer to
@@ -910,11 +1266,23 @@ do_begin_write( drive_t *drivep )
 	 * it always points to the byte after the end of the buffer. markcnt
 	 * keeps track of the number marks the caller has set in the media file.
 	 */
+	contextp->dc_buf = contextp->dc_zbufp
+			   ?
+			   contextp->dc_zbufp[ 0 ].zb_bufp
+			   :
+			   contextp->dc_privbufp;
+	contextp->dc_wbufix = 0;
 	contextp->dc_ownedp = 0;
 	contextp->dc_nextp = contextp->dc_buf;
-	contextp->dc_emptyp = contextp->dc_buf + sizeof( contextp->dc_buf );
+	contextp->dc_emptyp = contextp->dc_buf + contextp->dc_bufsz;
 	contextp->dc_bufstroff = 0;
+	contextp->dc_committed = 0;
+	contextp->dc_errorpr = BOOL_FALSE;
 	contextp->dc_markcnt = 0;
+	contextp->dc_zbufix = 0;
+	contextp->dc_zseq = 0;
+	contextp->dc_zseqnext = 0;
+	contextp->dc_physoff = 0;
 
 	/* truncate the destination if it supports read.
 	 */
@@ -930,6 +1298,13 @@ do_begin_write( drive_t *drivep )
 		}
 	}
 
+#ifdef DUMP
+	/* queued writes are given explicit file offsets, so note where
+	 * the stream starts. a pipe has no offset.
+	 */
+	contextp->dc_wbase = lseek64( contextp->dc_fd, ( off64_t )0, SEEK_CUR );
+#endif /* DUMP */
+
 	/* set the mode
 	 */
 	contextp->dc_mode = OM_WRITE;
@@ -944,9 +1319,7 @@ do_begin_write( drive_t *drivep )
 
 	xlate_global_hdr(gwhdrp, tmphdr, 1);
 	xlate_drive_hdr(dh, tmpdh, 1);
-	INT_SET(*(( drive_mark_t * )tmpdh->dh_specific),
-		ARCH_CONVERT,
-		*(( drive_mark_t * )dh->dh_specific));
+	simple_hdr_xlate(dh, tmpdh);
 	xlate_media_hdr(mh, tmpmh, 1);
 	xlate_content_hdr(ch, tmpch, 1);
 	xlate_content_inode_hdr(cih, tmpcih, 1);
@@ -1065,13 +1438,42 @@ do_set_mark( drive_t *drivep,
 			global_hdr_t		*gwhdrp = drivep->d_gwritehdrp;
 			drive_hdr_t		*dwhdrp = drivep->d_writehdrp;
 			off64_t			newoff;
+			off64_t			curoff;
 			/* REFERENCED */
 			intgen_t		nwritten;
 
+#ifdef DUMP
+			/* the queued write of the header must complete
+			 * before it is rewritten. if a queued write
+			 * failed, so does the mark: it stays queued and
+			 * is discarded uncommitted when the media file
+			 * is ended.
+			 */
+			if ( contextp->dc_wbufp && wbuf_drain( drivep )) {
+				contextp->dc_errorpr = BOOL_TRUE;
+			}
+			if ( contextp->dc_zbufp
+			     &&
+			     ! contextp->dc_errorpr
+			     &&
+			     zbuf_drain( drivep )) {
+				contextp->dc_errorpr = BOOL_TRUE;
+			}
+#endif /* DUMP */
+
 			/* assert the header has been flushed
 			 */
 			ASSERT( contextp->dc_bufstroff >= sizeof( *gwhdrp ));
 
+			/* when framed, the media file offset is not the
+			 * stream offset
+			 */
+			curoff = contextp->dc_framedpr
+				 ?
+				 contextp->dc_physoff
+				 :
+				 contextp->dc_bufstroff;
+
 			/* record mark in hdr
 			 */
 			INT_SET(*( ( drive_mark_t * )dwhdrp->dh_specific ), ARCH_CONVERT, mark);
@@ -1082,8 +1484,13 @@ do_set_mark( drive_t *drivep,
 
 			/* seek to beginning
 			 */
-			newoff = lseek64( contextp->dc_fd, ( off64_t )0, SEEK_SET );
-			if ( newoff < 0 ) {
+			if ( contextp->dc_errorpr ) {
+				mlog( MLOG_NORMAL | MLOG_WARNING | MLOG_DRIVE,
+				      "could not save first mark: "
+				      "a queued write failed\n" );
+			} else if ( ( newoff = lseek64( contextp->dc_fd,
+							( off64_t )0,
+							SEEK_SET )) < 0 ) {
 				mlog( MLOG_NORMAL | MLOG_WARNING | MLOG_DRIVE,
 				      "could not save first mark: %d (%s)\n",
 				      errno,
@@ -1116,9 +1523,7 @@ do_set_mark( drive_t *drivep,
 				tmpcih = (content_inode_hdr_t *)tmpch->ch_specific;
 				xlate_global_hdr(gwhdrp, tmphdr, 1);
 				xlate_drive_hdr(dh, tmpdh, 1);
-				INT_SET(*(( drive_mark_t * )tmpdh->dh_specific),
-					ARCH_CONVERT,
-					*(( drive_mark_t * )dh->dh_specific));
+				simple_hdr_xlate(dh, tmpdh);
 				xlate_media_hdr(mh, tmpmh, 1);
 				xlate_content_hdr(ch, tmpch, 1);
 				xlate_content_inode_hdr(cih, tmpcih, 1);
@@ -1150,9 +1555,9 @@ do_set_mark( drive_t *drivep,
 				free(tmphdr);
 
 				newoff = lseek64( contextp->dc_fd,
-						  contextp->dc_bufstroff,
+						  curoff,
 						  SEEK_SET );
-				ASSERT( newoff == contextp->dc_bufstroff );
+				ASSERT( newoff == curoff );
 			}
 		}
 	}
@@ -1160,7 +1565,9 @@ do_set_mark( drive_t *drivep,
 	/* if all written are committed, send the mark back immediately.
 	 * otherwise put the mark record on the tail of the queue.
 	 */
-	if ( contextp->dc_nextp == contextp->dc_buf ) {
+	if ( contextp->dc_nextp == contextp->dc_buf
+	     &&
+	     contextp->dc_committed == contextp->dc_bufstroff ) {
 		ASSERT( drivep->d_markrecheadp == 0 );
 		( * cbfuncp )( cbcontextp, markrecp, BOOL_TRUE );
 		return;
@@ -1273,6 +1680,22 @@ do_write( drive_t *drivep, char *bufp, size_t writesz )
 		return 0; /* returning unused buffer */
 	}
 
+#ifdef DUMP
+	/* if buffer is full, queue it and move on to the next one in the
+	 * ring.
+	 */
+	if ( contextp->dc_nextp == contextp->dc_emptyp
+	     &&
+	     contextp->dc_wbufp ) {
+		return wbuf_queue( drivep );
+	}
+	if ( contextp->dc_nextp == contextp->dc_emptyp
+	     &&
+	     contextp->dc_zbufp ) {
+		return zbuf_queue( drivep );
+	}
+#endif /* DUMP */
+
 	/* if buffer is full, flush it
 	 */
 	if ( contextp->dc_nextp == contextp->dc_emptyp ) {
@@ -1281,12 +1704,12 @@ do_write( drive_t *drivep, char *bufp, size_t writesz )
 		mlog( MLOG_DEBUG | MLOG_DRIVE,
 		      "flushing write buf addr 0x%x size 0x%x\n",
 		      contextp->dc_buf,
-		      sizeof( contextp->dc_buf ));
+		      contextp->dc_bufsz );
 
 		contextp->dc_nextp = 0;
 		nwritten = write( contextp->dc_fd,
 				  contextp->dc_buf,
-				  sizeof( contextp->dc_buf ));
+				  contextp->dc_bufsz );
 		if ( nwritten < 0 ) {
 			mlog( MLOG_NORMAL | MLOG_WARNING | MLOG_DRIVE,
 			      "write to %s failed: %d (%s)\n",
@@ -1296,9 +1719,10 @@ do_write( drive_t *drivep, char *bufp, size_t writesz )
 			nwritten = 0;
 		}
 		contextp->dc_bufstroff += ( off64_t )nwritten;
+		contextp->dc_committed = contextp->dc_bufstroff;
 		drive_mark_commit( drivep, contextp->dc_bufstroff );
 		contextp->dc_nextp = contextp->dc_buf;
-		if ( ( size_t )nwritten < sizeof( contextp->dc_buf )) {
+		if ( ( size_t )nwritten < contextp->dc_bufsz ) {
 			return DRIVE_ERROR_EOM;
 		}
 	}
@@ -1360,6 +1784,39 @@ do_end_write( drive_t *drivep, off64_t *ncommittedp )
 	ASSERT( contextp->dc_nextp );
 	ASSERT( contextp->dc_nextp < contextp->dc_emptyp );
 
+#ifdef DUMP
+	/* wait for everything queued so far to be written. if it could
+	 * not be, nothing more can follow it.
+	 */
+	if ( contextp->dc_wbufp ) {
+		intgen_t rval = wbuf_drain( drivep );
+		if ( rval ) {
+			drive_mark_discard( drivep );
+			*ncommittedp = contextp->dc_committed;
+			contextp->dc_mode = OM_NONE;
+			return rval;
+		}
+	}
+
+	/* frame what remains in the buffer, wait for all frames to be
+	 * written and end the media file with an EOD frame.
+	 */
+	if ( contextp->dc_zbufp ) {
+		intgen_t rval = zbuf_end( drivep );
+		if ( rval ) {
+			drive_mark_discard( drivep );
+			*ncommittedp = contextp->dc_committed;
+			contextp->dc_mode = OM_NONE;
+			return rval;
+		}
+		contextp->dc_fmarkcnt++;
+		ASSERT( contextp->dc_fmarkcnt == 1 );
+		*ncommittedp = contextp->dc_bufstroff;
+		contextp->dc_mode = OM_NONE;
+		return 0;
+	}
+#endif /* DUMP */
+
 	/* calculate length of un-written portion of buffer
 	 */
 	ASSERT( contextp->dc_nextp >= contextp->dc_buf );
@@ -1520,6 +1977,21 @@ do_quit( drive_t *drivep )
 	ASSERT( contextp->dc_mode == OM_NONE );
 	ASSERT( contextp );
 
+	/* free the write-behind ring. its first buffer is the private one.
+	 */
+	if ( contextp->dc_wbufp ) {
+		ix_t ix;
+		for ( ix = 1 ; ix < contextp->dc_ringlen ; ix++ ) {
+			free( ( void * )contextp->dc_wbufp[ ix ].wb_bufp );
+		}
+		free( ( void * )contextp->dc_wbufp );
+		contextp->dc_wbufp = 0;
+	}
+
+	/* stop the framing threads and free their buffers
+	 */
+	zbuf_free( drivep );
+
 	/* close file
 	 */
 	if ( contextp->dc_fd > 1 ) {
@@ -1529,6 +2001,955 @@ do_quit( drive_t *drivep )
 
 	/* free context
 	 */
+	free( ( void * )contextp->dc_privbufp );
 	free( ( void * )contextp );
 	drivep->d_contextp = 0;
 }
+
+#ifdef DUMP
+
+/* wbuf_queue - queue a write of the full buffer and make the next buffer
+ * in the ring current, first waiting for the write it was last used for.
+ */
+static intgen_t
+wbuf_queue( drive_t *drivep )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	wbuf_t *wbufp = &contextp->dc_wbufp[ contextp->dc_wbufix ];
+	struct aiocb64 *aiocbp = &wbufp->wb_aiocb;
+
+	ASSERT( wbufp->wb_bufp == contextp->dc_buf );
+	ASSERT( ! wbufp->wb_pendingpr );
+
+	mlog( MLOG_DEBUG | MLOG_DRIVE,
+	      "queueing write buf addr 0x%x size 0x%x\n",
+	      contextp->dc_buf,
+	      contextp->dc_bufsz );
+
+	memset( ( void * )aiocbp, 0, sizeof( *aiocbp ));
+	aiocbp->aio_fildes = contextp->dc_fd;
+	aiocbp->aio_buf = wbufp->wb_bufp;
+	aiocbp->aio_nbytes = contextp->dc_bufsz;
+	aiocbp->aio_offset = contextp->dc_bufstroff;
+	if ( contextp->dc_wbase > 0 ) {
+		aiocbp->aio_offset += contextp->dc_wbase;
+	}
+	aiocbp->aio_sigevent.sigev_notify = SIGEV_NONE;
+	if ( aio_write64( aiocbp )) {
+		mlog( MLOG_NORMAL | MLOG_WARNING | MLOG_DRIVE,
+		      "write to %s failed: %d (%s)\n",
+		      drivep->d_pathname,
+		      errno,
+		      strerror( errno ));
+		contextp->dc_errorpr = BOOL_TRUE;
+		return DRIVE_ERROR_EOM;
+	}
+	wbufp->wb_pendingpr = BOOL_TRUE;
+	contextp->dc_bufstroff += ( off64_t )contextp->dc_bufsz;
+
+	contextp->dc_wbufix = ( contextp->dc_wbufix + 1 ) % contextp->dc_ringlen;
+	wbufp = &contextp->dc_wbufp[ contextp->dc_wbufix ];
+	contextp->dc_buf = wbufp->wb_bufp;
+	contextp->dc_nextp = contextp->dc_buf;
+	contextp->dc_emptyp = contextp->dc_buf + contextp->dc_bufsz;
+
+	if ( wbufp->wb_pendingpr ) {
+		return wbuf_retire( drivep, wbufp );
+	}
+
+	return 0;
+}
+
+/* wbuf_retire - wait for a queued write to complete. writes are retired
+ * in the order queued, so a completed write commits all marks up to
+ * its end.
+ */
+static intgen_t
+wbuf_retire( drive_t *drivep, wbuf_t *wbufp )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	struct aiocb64 *aiocbp = &wbufp->wb_aiocb;
+	const struct aiocb64 *listp[ 1 ];
+	intgen_t err;
+	ssize_t nwritten;
+
+	ASSERT( wbufp->wb_pendingpr );
+
+	listp[ 0 ] = aiocbp;
+	while ( ( err = aio_error64( aiocbp )) == EINPROGRESS ) {
+		( void )aio_suspend64( listp, 1, 0 );
+	}
+	nwritten = aio_return64( aiocbp );
+	wbufp->wb_pendingpr = BOOL_FALSE;
+
+	if ( err ) {
+		mlog( MLOG_NORMAL | MLOG_WARNING | MLOG_DRIVE,
+		      "write to %s failed: %d (%s)\n",
+		      drivep->d_pathname,
+		      err,
+		      strerror( err ));
+		contextp->dc_errorpr = BOOL_TRUE;
+	} else if ( ( size_t )nwritten < contextp->dc_bufsz ) {
+		contextp->dc_errorpr = BOOL_TRUE;
+	}
+	if ( contextp->dc_errorpr ) {
+		return DRIVE_ERROR_EOM;
+	}
+
+	contextp->dc_committed += ( off64_t )nwritten;
+	drive_mark_commit( drivep, contextp->dc_committed );
+
+	return 0;
+}
+
+/* wbuf_drain - wait for all queued writes, oldest first, then leave the
+ * file offset where synchronous writes would have left it. returns the
+ * first write error, if any.
+ */
+static intgen_t
+wbuf_drain( drive_t *drivep )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	intgen_t rval = 0;
+	ix_t ix;
+
+	for ( ix = 1 ; ix <= contextp->dc_ringlen ; ix++ ) {
+		wbuf_t *wbufp = &contextp->dc_wbufp[ ( contextp->dc_wbufix + ix )
+						     %
+						     contextp->dc_ringlen ];
+		if ( wbufp->wb_pendingpr ) {
+			intgen_t rv = wbuf_retire( drivep, wbufp );
+			if ( rv && ! rval ) {
+				rval = rv;
+			}
+		}
+	}
+
+	if ( contextp->dc_wbase >= 0 ) {
+		( void )lseek64( contextp->dc_fd,
+				 contextp->dc_wbase + contextp->dc_bufstroff,
+				 SEEK_SET );
+	}
+
+	if ( ! rval && contextp->dc_errorpr ) {
+		rval = DRIVE_ERROR_EOM;
+	}
+	return rval;
+}
+
+#endif /* DUMP */
+
+/* simple_hdr_xlate - endian convert the drive-specific portion of the
+ * media file header. the conversion is its own inverse.
+ */
+static void
+simple_hdr_xlate( drive_hdr_t *dh1, drive_hdr_t *dh2 )
+{
+	simple_hdr_t *sh1 = ( simple_hdr_t * )dh1->dh_specific;
+	simple_hdr_t *sh2 = ( simple_hdr_t * )dh2->dh_specific;
+
+	sh2->sh_firstmark = INT_GET( sh1->sh_firstmark, ARCH_CONVERT );
+	sh2->sh_flags = INT_GET( sh1->sh_flags, ARCH_CONVERT );
+	sh2->sh_bufsz = INT_GET( sh1->sh_bufsz, ARCH_CONVERT );
+}
+
+/* crc32c - castagnoli crc of a buffer, as used by iSCSI and SCTP
+ */
+static u_int32_t
+crc32c( char *bufp, size_t bufsz )
+{
+	u_char_t *p = ( u_char_t * )bufp;
+	u_int32_t crc = ~( u_int32_t )0;
+
+	while ( bufsz-- ) {
+		crc = crc32c_table[ ( crc ^ *p++ ) & 0xff ] ^ ( crc >> 8 );
+	}
+
+	return ~crc;
+}
+
+/* frame_hdr_set - fill in a frame hdr in media byte order, and
+ * checksum it.
+ */
+static void
+frame_hdr_set( frame_hdr_t *fhp,
+	       u_int32_t flags,
+	       size_t rawsz,
+	       size_t datasz,
+	       off64_t stroff,
+	       u_int32_t datacrc )
+{
+	memset( ( void * )fhp, 0, FRAME_HDR_SZ );
+	INT_SET( fhp->fh_magic, ARCH_CONVERT, FRAME_MAGIC );
+	INT_SET( fhp->fh_flags, ARCH_CONVERT, flags );
+	INT_SET( fhp->fh_rawsz, ARCH_CONVERT, ( u_int32_t )rawsz );
+	INT_SET( fhp->fh_datasz, ARCH_CONVERT, ( u_int32_t )datasz );
+	INT_SET( fhp->fh_stroff, ARCH_CONVERT, stroff );
+	INT_SET( fhp->fh_datacrc, ARCH_CONVERT, datacrc );
+	INT_SET( fhp->fh_hdrcrc,
+		 ARCH_CONVERT,
+		 crc32c( ( char * )fhp, FRAME_HDR_SZ ));
+}
+
+/* zbuf_alloc - set up a ring of dc_ringlen framing buffers, each
+ * holding up to bufsz stream bytes. if threadpr, start a thread for
+ * each.
+ */
+static bool_t
+zbuf_alloc( drive_t *drivep, size_t bufsz, bool_t threadpr )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	size_t framesz;
+	ix_t ix;
+
+	ASSERT( sizeof( frame_hdr_t ) == FRAME_HDR_SZ );
+	ASSERT( sizeof( simple_hdr_t ) <= sizeofmember( drive_hdr_t,
+							 dh_specific ));
+	ASSERT( ! contextp->dc_zbufp );
+
+	/* fill in the crc table
+	 */
+	for ( ix = 0 ; ix < 256 ; ix++ ) {
+		u_int32_t crc = ( u_int32_t )ix;
+		intgen_t bit;
+		for ( bit = 0 ; bit < 8 ; bit++ ) {
+			crc = ( crc >> 1 ) ^ ( ( crc & 1 ) ? 0x82f63b78 : 0 );
+		}
+		crc32c_table[ ix ] = crc;
+	}
+
+	/* the frame buffer must hold the largest a buffer can deflate to
+	 */
+	framesz = FRAME_HDR_SZ + ( size_t )compressBound( ( uLong )bufsz );
+	framesz = ( framesz + FRAME_ALIGN - 1 ) & ~( size_t )( FRAME_ALIGN - 1 );
+
+	mlog( MLOG_NITTY | MLOG_DRIVE,
+	      "framing ring: %u buffers of %u bytes%s\n",
+	      contextp->dc_ringlen,
+	      bufsz,
+	      threadpr ? ", threaded" : "" );
+
+	contextp->dc_zbufsz = bufsz;
+	contextp->dc_zquitpr = BOOL_FALSE;
+	contextp->dc_zthreadcnt = 0;
+	contextp->dc_zbufix = 0;
+	contextp->dc_zfillix = 0;
+	contextp->dc_zeodpr = BOOL_FALSE;
+	contextp->dc_zrval = 0;
+	pthread_mutex_init( &contextp->dc_zlock, 0 );
+	pthread_cond_init( &contextp->dc_zcond, 0 );
+	contextp->dc_zbufp = ( zbuf_t * )calloc( contextp->dc_ringlen,
+						 sizeof( zbuf_t ));
+	ASSERT( contextp->dc_zbufp );
+
+	for ( ix = 0 ; ix < contextp->dc_ringlen ; ix++ ) {
+		zbuf_t *zbufp = &contextp->dc_zbufp[ ix ];
+
+		zbufp->zb_bufp = ( char * )memalign( PGSZ, bufsz );
+		zbufp->zb_framep = ( char * )memalign( PGSZ, framesz );
+		if ( ! zbufp->zb_bufp || ! zbufp->zb_framep ) {
+			mlog( MLOG_NORMAL | MLOG_ERROR | MLOG_DRIVE,
+			      "unable to allocate memory "
+			      "for framing buffer ring\n" );
+			zbuf_free( drivep );
+			return BOOL_FALSE;
+		}
+		zbufp->zb_state = ZB_IDLE;
+		zbufp->zb_drivep = drivep;
+	}
+
+	if ( ! threadpr ) {
+		return BOOL_TRUE;
+	}
+
+	for ( ix = 0 ; ix < contextp->dc_ringlen ; ix++ ) {
+		zbuf_t *zbufp = &contextp->dc_zbufp[ ix ];
+		intgen_t rval;
+
+		rval = pthread_create( &zbufp->zb_thread,
+				       0,
+				       zbuf_thread,
+				       ( void * )zbufp );
+		if ( rval ) {
+			mlog( MLOG_NORMAL | MLOG_WARNING | MLOG_DRIVE,
+			      "unable to start framing thread: %s: "
+			      "framing in line\n",
+			      strerror( rval ));
+			break;
+		}
+		contextp->dc_zthreadcnt++;
+	}
+
+	/* without a thread for every buffer, do without threads
+	 */
+	if ( contextp->dc_zthreadcnt < contextp->dc_ringlen ) {
+		size_t cnt = contextp->dc_zthreadcnt;
+
+		pthread_mutex_lock( &contextp->dc_zlock );
+		contextp->dc_zquitpr = BOOL_TRUE;
+		pthread_cond_broadcast( &contextp->dc_zcond );
+		pthread_mutex_unlock( &contextp->dc_zlock );
+		for ( ix = 0 ; ix < cnt ; ix++ ) {
+			pthread_join( contextp->dc_zbufp[ ix ].zb_thread, 0 );
+		}
+		contextp->dc_zthreadcnt = 0;
+		contextp->dc_zquitpr = BOOL_FALSE;
+	}
+
+	return BOOL_TRUE;
+}
+
+/* zbuf_free - stop the framing threads and free the framing ring
+ */
+static void
+zbuf_free( drive_t *drivep )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	ix_t ix;
+
+	if ( ! contextp->dc_zbufp ) {
+		return;
+	}
+
+	if ( contextp->dc_zthreadcnt ) {
+		pthread_mutex_lock( &contextp->dc_zlock );
+		contextp->dc_zquitpr = BOOL_TRUE;
+		pthread_cond_broadcast( &contextp->dc_zcond );
+		pthread_mutex_unlock( &contextp->dc_zlock );
+		for ( ix = 0 ; ix < contextp->dc_zthreadcnt ; ix++ ) {
+			pthread_join( contextp->dc_zbufp[ ix ].zb_thread, 0 );
+		}
+		contextp->dc_zthreadcnt = 0;
+	}
+
+	for ( ix = 0 ; ix < contextp->dc_ringlen ; ix++ ) {
+		zbuf_t *zbufp = &contextp->dc_zbufp[ ix ];
+		if ( zbufp->zb_bufp ) {
+			free( ( void * )zbufp->zb_bufp );
+		}
+		if ( zbufp->zb_framep ) {
+			free( ( void * )zbufp->zb_framep );
+		}
+	}
+	free( ( void * )contextp->dc_zbufp );
+	contextp->dc_zbufp = 0;
+	pthread_cond_destroy( &contextp->dc_zcond );
+	pthread_mutex_destroy( &contextp->dc_zlock );
+}
+
+/* zbuf_thread - frames its buffer each time it is queued
+ */
+static void *
+zbuf_thread( void *arg )
+{
+	zbuf_t *zbufp = ( zbuf_t * )arg;
+	drive_t *drivep = zbufp->zb_drivep;
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+
+	pthread_mutex_lock( &contextp->dc_zlock );
+	for ( ; ; ) {
+		intgen_t rval;
+
+		while ( zbufp->zb_state != ZB_QUEUED && ! contextp->dc_zquitpr ) {
+			pthread_cond_wait( &contextp->dc_zcond,
+					   &contextp->dc_zlock );
+		}
+		if ( zbufp->zb_state != ZB_QUEUED ) {
+			break;
+		}
+		pthread_mutex_unlock( &contextp->dc_zlock );
+
+#ifdef DUMP
+		if ( contextp->dc_mode == OM_WRITE ) {
+			rval = zbuf_frame( drivep, zbufp );
+		} else
+#endif /* DUMP */
+		rval = zbuf_unframe( drivep, zbufp );
+
+		pthread_mutex_lock( &contextp->dc_zlock );
+		zbufp->zb_rval = rval;
+		zbufp->zb_state = ZB_DONE;
+		pthread_cond_broadcast( &contextp->dc_zcond );
+	}
+	pthread_mutex_unlock( &contextp->dc_zlock );
+
+	return 0;
+}
+
+/* zbuf_wait - wait for a queued buffer to be framed. returns the
+ * drive error encountered while framing, if any.
+ */
+static intgen_t
+zbuf_wait( drive_t *drivep, zbuf_t *zbufp )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+
+	ASSERT( zbufp->zb_state != ZB_IDLE );
+
+	pthread_mutex_lock( &contextp->dc_zlock );
+	while ( zbufp->zb_state != ZB_DONE ) {
+		pthread_cond_wait( &contextp->dc_zcond, &contextp->dc_zlock );
+	}
+	pthread_mutex_unlock( &contextp->dc_zlock );
+
+	if ( zbufp->zb_rval && zbufp->zb_errmsg ) {
+		mlog( MLOG_NORMAL | MLOG_WARNING | MLOG_DRIVE,
+		      "frame at stream offset %lld: %s\n",
+		      zbufp->zb_stroff,
+		      zbufp->zb_errmsg );
+	}
+
+	return zbufp->zb_rval;
+}
+
+#ifdef DUMP
+
+/* zbuf_frame - compress and/or checksum the stream bytes in the buffer
+ * and write them out as a frame, in turn. bytes preceding the first
+ * frame (the media file header) are written as is. called by the
+ * buffer's thread, or in line if there are none.
+ */
+static intgen_t
+zbuf_frame( drive_t *drivep, zbuf_t *zbufp )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	char *datap = zbufp->zb_bufp + zbufp->zb_prefixsz;
+	size_t datasz = zbufp->zb_rawsz - zbufp->zb_prefixsz;
+	struct iovec iov[ 4 ];
+	intgen_t iovcnt = 0;
+	size_t framesz;
+
+	zbufp->zb_errmsg = 0;
+
+	if ( zbufp->zb_prefixsz ) {
+		iov[ iovcnt ].iov_base = zbufp->zb_bufp;
+		iov[ iovcnt ].iov_len = zbufp->zb_prefixsz;
+		iovcnt++;
+	}
+
+	/* the first buffer may hold nothing but the media file header
+	 */
+	if ( datasz ) {
+		u_int32_t flags = 0;
+		u_int32_t datacrc = 0;
+
+		zbufp->zb_datap = datap;
+		zbufp->zb_payloadsz = datasz;
+
+		/* keep the deflated payload only if it is smaller
+		 */
+		if ( contextp->dc_compresspr ) {
+			uLongf destlen = compressBound( ( uLong )datasz );
+			if ( compress2( ( Bytef * )zbufp->zb_framep
+					+
+					FRAME_HDR_SZ,
+					&destlen,
+					( Bytef * )datap,
+					( uLong )datasz,
+					Z_BEST_SPEED ) == Z_OK
+			     &&
+			     ( size_t )destlen < datasz ) {
+				flags |= FRAME_DEFLATE;
+				zbufp->zb_datap = zbufp->zb_framep
+						  +
+						  FRAME_HDR_SZ;
+				zbufp->zb_payloadsz = ( size_t )destlen;
+			}
+		}
+		if ( contextp->dc_recchksumpr ) {
+			flags |= FRAME_CRC;
+			datacrc = crc32c( datap, datasz );
+		}
+		frame_hdr_set( ( frame_hdr_t * )zbufp->zb_framep,
+			       flags,
+			       datasz,
+			       zbufp->zb_payloadsz,
+			       zbufp->zb_stroff + ( off64_t )zbufp->zb_prefixsz,
+			       datacrc );
+
+		/* the hdr and a deflated payload are contiguous
+		 */
+		iov[ iovcnt ].iov_base = zbufp->zb_framep;
+		iov[ iovcnt ].iov_len = FRAME_HDR_SZ;
+		if ( flags & FRAME_DEFLATE ) {
+			iov[ iovcnt ].iov_len += zbufp->zb_payloadsz;
+		} else {
+			iovcnt++;
+			iov[ iovcnt ].iov_base = datap;
+			iov[ iovcnt ].iov_len = datasz;
+		}
+		iovcnt++;
+		framesz = FRAME_HDR_SZ + zbufp->zb_payloadsz;
+		if ( framesz % FRAME_ALIGN ) {
+			iov[ iovcnt ].iov_base = frame_pad;
+			iov[ iovcnt ].iov_len = FRAME_ALIGN - framesz % FRAME_ALIGN;
+			iovcnt++;
+		}
+	}
+
+	return zbuf_put( drivep, iov, iovcnt, zbufp->zb_seq );
+}
+
+/* zbuf_put - write out the frame with the given sequence number once
+ * all before it have been placed. frames going to a file are given
+ * explicit offsets, so that only their placement is serialized; frames
+ * going to a pipe are written one at a time.
+ */
+static intgen_t
+zbuf_put( drive_t *drivep, struct iovec *iov, intgen_t iovcnt, off64_t seq )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	bool_t positionalpr = ( contextp->dc_wbase >= 0
+				&&
+				! contextp->dc_isrmtpr );
+	off64_t offset;
+	size_t putsz = 0;
+	ssize_t nwritten;
+	intgen_t ix;
+
+	for ( ix = 0 ; ix < iovcnt ; ix++ ) {
+		putsz += iov[ ix ].iov_len;
+	}
+
+	pthread_mutex_lock( &contextp->dc_zlock );
+	while ( contextp->dc_zseqnext != seq ) {
+		pthread_cond_wait( &contextp->dc_zcond, &contextp->dc_zlock );
+	}
+	offset = contextp->dc_physoff;
+	if ( positionalpr ) {
+		contextp->dc_physoff += ( off64_t )putsz;
+		contextp->dc_zseqnext++;
+		pthread_cond_broadcast( &contextp->dc_zcond );
+	}
+	pthread_mutex_unlock( &contextp->dc_zlock );
+
+	if ( positionalpr ) {
+		nwritten = pwritev( contextp->dc_fd,
+				    iov,
+				    iovcnt,
+				    contextp->dc_wbase + offset );
+	} else {
+		nwritten = 0;
+		for ( ix = 0 ; ix < iovcnt ; ix++ ) {
+			intgen_t rval;
+			rval = write( contextp->dc_fd,
+				      iov[ ix ].iov_base,
+				      iov[ ix ].iov_len );
+			if ( rval < 0 ) {
+				nwritten = -1;
+				break;
+			}
+			nwritten += rval;
+			if ( ( size_t )rval < iov[ ix ].iov_len ) {
+				break;
+			}
+		}
+		pthread_mutex_lock( &contextp->dc_zlock );
+		contextp->dc_physoff += ( off64_t )putsz;
+		contextp->dc_zseqnext++;
+		pthread_cond_broadcast( &contextp->dc_zcond );
+		pthread_mutex_unlock( &contextp->dc_zlock );
+	}
+
+	if ( nwritten < 0 ) {
+		mlog( MLOG_NORMAL | MLOG_WARNING | MLOG_DRIVE,
+		      "write to %s failed: %d (%s)\n",
+		      drivep->d_pathname,
+		      errno,
+		      strerror( errno ));
+		return DRIVE_ERROR_EOM;
+	}
+	if ( ( size_t )nwritten < putsz ) {
+		return DRIVE_ERROR_EOM;
+	}
+
+	return 0;
+}
+
+/* zbuf_queue - queue the full buffer to be framed and written, and
+ * make the next buffer in the ring current, first waiting for the
+ * frame it last held.
+ */
+static intgen_t
+zbuf_queue( drive_t *drivep )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	zbuf_t *zbufp = &contextp->dc_zbufp[ contextp->dc_zbufix ];
+
+	ASSERT( zbufp->zb_bufp == contextp->dc_buf );
+	ASSERT( zbufp->zb_state == ZB_IDLE );
+
+	zbufp->zb_rawsz = ( size_t )( contextp->dc_nextp - contextp->dc_buf );
+	zbufp->zb_stroff = contextp->dc_bufstroff;
+	zbufp->zb_prefixsz = 0;
+	if ( zbufp->zb_stroff == 0 ) {
+		ASSERT( zbufp->zb_rawsz >= GLOBAL_HDR_SZ );
+		zbufp->zb_prefixsz = GLOBAL_HDR_SZ;
+	}
+	zbufp->zb_seq = contextp->dc_zseq++;
+
+	mlog( MLOG_DEBUG | MLOG_DRIVE,
+	      "queueing frame buf addr 0x%x size 0x%x\n",
+	      contextp->dc_buf,
+	      zbufp->zb_rawsz );
+
+	if ( contextp->dc_zthreadcnt ) {
+		pthread_mutex_lock( &contextp->dc_zlock );
+		zbufp->zb_state = ZB_QUEUED;
+		pthread_cond_broadcast( &contextp->dc_zcond );
+		pthread_mutex_unlock( &contextp->dc_zlock );
+	} else {
+		zbufp->zb_rval = zbuf_frame( drivep, zbufp );
+		zbufp->zb_state = ZB_DONE;
+	}
+	contextp->dc_bufstroff += ( off64_t )zbufp->zb_rawsz;
+
+	contextp->dc_zbufix = ( contextp->dc_zbufix + 1 ) % contextp->dc_ringlen;
+	zbufp = &contextp->dc_zbufp[ contextp->dc_zbufix ];
+	contextp->dc_buf = zbufp->zb_bufp;
+	contextp->dc_nextp = contextp->dc_buf;
+	contextp->dc_emptyp = contextp->dc_buf + contextp->dc_bufsz;
+
+	if ( zbufp->zb_state != ZB_IDLE ) {
+		return zbuf_retire( drivep, zbufp );
+	}
+
+	return 0;
+}
+
+/* zbuf_retire - wait for a queued buffer to be framed and written.
+ * buffers are retired in the order queued, so this commits all marks
+ * up to the end of its stream bytes.
+ */
+static intgen_t
+zbuf_retire( drive_t *drivep, zbuf_t *zbufp )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	intgen_t rval;
+
+	rval = zbuf_wait( drivep, zbufp );
+	zbufp->zb_state = ZB_IDLE;
+	if ( rval ) {
+		contextp->dc_errorpr = BOOL_TRUE;
+	}
+	if ( contextp->dc_errorpr ) {
+		return DRIVE_ERROR_EOM;
+	}
+
+	contextp->dc_committed = zbufp->zb_stroff + ( off64_t )zbufp->zb_rawsz;
+	drive_mark_commit( drivep, contextp->dc_committed );
+
+	return 0;
+}
+
+/* zbuf_drain - wait for all queued buffers, oldest first, then leave
+ * the file offset at the end of the frames written. returns the first
+ * error, if any.
+ */
+static intgen_t
+zbuf_drain( drive_t *drivep )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	intgen_t rval = 0;
+	ix_t ix;
+
+	for ( ix = 1 ; ix <= contextp->dc_ringlen ; ix++ ) {
+		zbuf_t *zbufp = &contextp->dc_zbufp[ ( contextp->dc_zbufix + ix )
+						     %
+						     contextp->dc_ringlen ];
+		if ( zbufp->zb_state != ZB_IDLE ) {
+			intgen_t rv = zbuf_retire( drivep, zbufp );
+			if ( rv && ! rval ) {
+				rval = rv;
+			}
+		}
+	}
+
+	if ( contextp->dc_wbase >= 0 && ! contextp->dc_isrmtpr ) {
+		( void )lseek64( contextp->dc_fd,
+				 contextp->dc_wbase + contextp->dc_physoff,
+				 SEEK_SET );
+	}
+
+	if ( ! rval && contextp->dc_errorpr ) {
+		rval = DRIVE_ERROR_EOM;
+	}
+	return rval;
+}
+
+/* zbuf_end - frame the partial buffer, drain the ring, and end the media
+ * file with an EOD frame.
+ */
+static intgen_t
+zbuf_end( drive_t *drivep )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	char hdr[ FRAME_ALIGN ];
+	struct iovec iov[ 1 ];
+	intgen_t rval = 0;
+	intgen_t rv;
+
+	if ( contextp->dc_nextp > contextp->dc_buf ) {
+		rval = zbuf_queue( drivep );
+	}
+	rv = zbuf_drain( drivep );
+	if ( ! rval ) {
+		rval = rv;
+	}
+	if ( rval ) {
+		return rval;
+	}
+
+	memset( ( void * )hdr, 0, sizeof( hdr ));
+	frame_hdr_set( ( frame_hdr_t * )hdr,
+		       FRAME_EOD,
+		       0,
+		       0,
+		       contextp->dc_bufstroff,
+		       0 );
+	iov[ 0 ].iov_base = hdr;
+	iov[ 0 ].iov_len = sizeof( hdr );
+
+	return zbuf_put( drivep, iov, 1, contextp->dc_zseq++ );
+}
+
+#endif /* DUMP */
+
+/* zbuf_unframe - verify the frame read into the buffer and expand it
+ * if deflated. called by the buffer's thread, or in line if there
+ * are none.
+ */
+static intgen_t
+zbuf_unframe( drive_t *drivep, zbuf_t *zbufp )
+{
+	char *payloadp = zbufp->zb_framep + FRAME_HDR_SZ;
+
+	zbufp->zb_errmsg = 0;
+
+	if ( zbufp->zb_flags & FRAME_DEFLATE ) {
+		uLongf destlen = ( uLongf )zbufp->zb_rawsz;
+		if ( uncompress( ( Bytef * )zbufp->zb_bufp,
+				 &destlen,
+				 ( Bytef * )payloadp,
+				 ( uLong )zbufp->zb_payloadsz ) != Z_OK
+		     ||
+		     ( size_t )destlen != zbufp->zb_rawsz ) {
+			zbufp->zb_errmsg = "cannot inflate";
+			return DRIVE_ERROR_CORRUPTION;
+		}
+		zbufp->zb_datap = zbufp->zb_bufp;
+	} else {
+		if ( zbufp->zb_payloadsz != zbufp->zb_rawsz ) {
+			zbufp->zb_errmsg = "payload size mismatch";
+			return DRIVE_ERROR_CORRUPTION;
+		}
+		zbufp->zb_datap = payloadp;
+	}
+
+	if ( ( zbufp->zb_flags & FRAME_CRC )
+	     &&
+	     crc32c( zbufp->zb_datap, zbufp->zb_rawsz ) != zbufp->zb_datacrc ) {
+		zbufp->zb_errmsg = "checksum error";
+		return DRIVE_ERROR_CORRUPTION;
+	}
+
+	return 0;
+}
+
+/* zbuf_read - read from the media file, first taking any bytes read
+ * along with the media file header. returns the number of bytes read,
+ * less than asked for only at the end of the media file, or -1.
+ */
+static intgen_t
+zbuf_read( drive_t *drivep, char *bufp, size_t wantedcnt )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	size_t donecnt = 0;
+
+	if ( contextp->dc_leftcnt ) {
+		donecnt = min( wantedcnt, contextp->dc_leftcnt );
+		memcpy( ( void * )bufp, ( void * )contextp->dc_leftp, donecnt );
+		contextp->dc_leftp += donecnt;
+		contextp->dc_leftcnt -= donecnt;
+	}
+
+	while ( donecnt < wantedcnt ) {
+		intgen_t nread;
+
+		nread = read( contextp->dc_fd,
+			      bufp + donecnt,
+			      wantedcnt - donecnt );
+		if ( nread < 0 ) {
+			return -1;
+		}
+		if ( nread == 0 ) {
+			break;
+		}
+		donecnt += ( size_t )nread;
+	}
+	contextp->dc_physoff += ( off64_t )donecnt;
+
+	return ( intgen_t )donecnt;
+}
+
+/* zbuf_read_frame - read the next frame from the media file into the
+ * buffer. a media file cut short by an interrupted dump ends as if
+ * with an EOD frame.
+ */
+static intgen_t
+zbuf_read_frame( drive_t *drivep, zbuf_t *zbufp )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	frame_hdr_t *fhp = ( frame_hdr_t * )zbufp->zb_framep;
+	u_int32_t hdrcrc;
+	size_t framesz;
+	intgen_t nread;
+
+	nread = zbuf_read( drivep, zbufp->zb_framep, FRAME_HDR_SZ );
+	if ( nread < 0 ) {
+		return DRIVE_ERROR_DEVICE;
+	}
+	if ( nread < FRAME_HDR_SZ ) {
+		return DRIVE_ERROR_EOD;
+	}
+
+	hdrcrc = INT_GET( fhp->fh_hdrcrc, ARCH_CONVERT );
+	fhp->fh_hdrcrc = 0;
+	if ( INT_GET( fhp->fh_magic, ARCH_CONVERT ) != FRAME_MAGIC
+	     ||
+	     crc32c( ( char * )fhp, FRAME_HDR_SZ ) != hdrcrc ) {
+		mlog( MLOG_NORMAL | MLOG_WARNING | MLOG_DRIVE,
+		      "frame header corrupt at media file offset %lld\n",
+		      contextp->dc_physoff - FRAME_HDR_SZ );
+		return DRIVE_ERROR_CORRUPTION;
+	}
+
+	zbufp->zb_flags = INT_GET( fhp->fh_flags, ARCH_CONVERT );
+	zbufp->zb_rawsz = INT_GET( fhp->fh_rawsz, ARCH_CONVERT );
+	zbufp->zb_payloadsz = INT_GET( fhp->fh_datasz, ARCH_CONVERT );
+	zbufp->zb_stroff = INT_GET( fhp->fh_stroff, ARCH_CONVERT );
+	zbufp->zb_datacrc = INT_GET( fhp->fh_datacrc, ARCH_CONVERT );
+
+	if ( zbufp->zb_flags & FRAME_EOD ) {
+		return DRIVE_ERROR_EOD;
+	}
+
+	if ( zbufp->zb_rawsz == 0
+	     ||
+	     zbufp->zb_rawsz > contextp->dc_zbufsz
+	     ||
+	     zbufp->zb_payloadsz
+	     >
+	     ( size_t )compressBound( ( uLong )contextp->dc_zbufsz )) {
+		mlog( MLOG_NORMAL | MLOG_WARNING | MLOG_DRIVE,
+		      "frame header sizes invalid at media file offset %lld\n",
+		      contextp->dc_physoff - FRAME_HDR_SZ );
+		return DRIVE_ERROR_CORRUPTION;
+	}
+
+	framesz = FRAME_HDR_SZ + zbufp->zb_payloadsz;
+	framesz = ( framesz + FRAME_ALIGN - 1 ) & ~( size_t )( FRAME_ALIGN - 1 );
+	nread = zbuf_read( drivep,
+			   zbufp->zb_framep + FRAME_HDR_SZ,
+			   framesz - FRAME_HDR_SZ );
+	if ( nread < 0 ) {
+		return DRIVE_ERROR_DEVICE;
+	}
+	if ( ( size_t )nread < framesz - FRAME_HDR_SZ ) {
+		return DRIVE_ERROR_EOD;
+	}
+
+	return 0;
+}
+
+/* zbuf_fill - give back the buffer just read, read frames into all free
+ * buffers in the ring and queue them to be verified and expanded, then
+ * make the oldest current. once a frame is bad, the stream cannot be
+ * carried on past it: the same error is returned until the media file
+ * is begun again.
+ */
+static intgen_t
+zbuf_fill( drive_t *drivep )
+{
+	drive_context_t *contextp = ( drive_context_t * )drivep->d_contextp;
+	zbuf_t *zbufp = &contextp->dc_zbufp[ contextp->dc_zbufix ];
+	off64_t stroff;
+	intgen_t rval;
+
+	if ( contextp->dc_zrval ) {
+		return contextp->dc_zrval;
+	}
+
+	/* the next frame must carry on from the buffer just read
+	 */
+	stroff = contextp->dc_bufstroff
+		 +
+		 ( off64_t )( contextp->dc_emptyp - contextp->dc_buf );
+
+	if ( zbufp->zb_state == ZB_DONE
+	     &&
+	     contextp->dc_buf == zbufp->zb_datap ) {
+		zbufp->zb_state = ZB_IDLE;
+		contextp->dc_zbufix = ( contextp->dc_zbufix + 1 )
+				      %
+				      contextp->dc_ringlen;
+	}
+
+	/* a frame which cannot be read is passed along as an error, so
+	 * that the frames before it are still delivered.
+	 */
+	while ( ! contextp->dc_zeodpr ) {
+		zbuf_t *fillp = &contextp->dc_zbufp[ contextp->dc_zfillix ];
+
+		if ( fillp->zb_state != ZB_IDLE ) {
+			break;
+		}
+		rval = zbuf_read_frame( drivep, fillp );
+		if ( rval ) {
+			contextp->dc_zeodpr = BOOL_TRUE;
+			fillp->zb_rval = rval;
+			fillp->zb_errmsg = 0;
+			fillp->zb_state = ZB_DONE;
+		} else if ( contextp->dc_zthreadcnt ) {
+			pthread_mutex_lock( &contextp->dc_zlock );
+			fillp->zb_state = ZB_QUEUED;
+			pthread_cond_broadcast( &contextp->dc_zcond );
+			pthread_mutex_unlock( &contextp->dc_zlock );
+		} else {
+			fillp->zb_rval = zbuf_unframe( drivep, fillp );
+			fillp->zb_state = ZB_DONE;
+		}
+		contextp->dc_zfillix = ( contextp->dc_zfillix + 1 )
+				       %
+				       contextp->dc_ringlen;
+	}
+
+	zbufp = &contextp->dc_zbufp[ contextp->dc_zbufix ];
+	if ( zbufp->zb_state == ZB_IDLE ) {
+		return DRIVE_ERROR_EOD;
+	}
+	rval = zbuf_wait( drivep, zbufp );
+	if ( ! rval && zbufp->zb_stroff != stroff ) {
+		mlog( MLOG_NORMAL | MLOG_WARNING | MLOG_DRIVE,
+		      "frame out of sequence: "
+		      "stream offset %lld, expected %lld\n",
+		      zbufp->zb_stroff,
+		      stroff );
+		rval = DRIVE_ERROR_CORRUPTION;
+	}
+	if ( rval ) {
+		zbufp->zb_state = ZB_IDLE;
+		contextp->dc_zbufix = ( contextp->dc_zbufix + 1 )
+				      %
+				      contextp->dc_ringlen;
+		contextp->dc_zrval = rval;
+		return rval;
+	}
+
+	contextp->dc_buf = zbufp->zb_datap;
+	contextp->dc_nextp = contextp->dc_buf;
+	contextp->dc_emptyp = contextp->dc_buf + zbufp->zb_rawsz;
+	contextp->dc_bufstroff = zbufp->zb_stroff;
+
+	return 0;
+}
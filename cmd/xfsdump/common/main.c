@@ -106,6 +106,10 @@ static void mrh_sighandler( int );
 #endif
 static void sighandler( int );
 static int childmain( void * );
+#ifdef DUMP
+static intgen_t forkstreams( void );
+static void killstreams( void );
+#endif /* DUMP */
 static bool_t sigint_dialog( void );
 static char *sigintstr( void );
 #ifdef DUMP
@@ -158,6 +162,11 @@ static intgen_t prbcld_xc;
 static intgen_t prbcld_signo;
 /* REFERENCED */
 static intgen_t sigstray_received;
+#ifdef DUMP
+static pid_t streampid[ STREAM_SIMMAX ];
+	/* processes dumping each stream, if single-threaded
+	 */
+#endif /* DUMP */
 static bool_t progrpt_enabledpr;
 static time_t progrpt_interval;
 static time_t progrpt_deadline;
@@ -625,7 +634,11 @@ main( int argc, char *argv[] )
 			return EXIT_ERROR;
 		}
 #ifdef DUMP
-		exitcode = content_stream_dump( 0 );
+		if ( drivecnt > 1 ) {
+			exitcode = forkstreams( );
+		} else {
+			exitcode = content_stream_dump( 0 );
+		}
 #endif /* DUMP */
 #ifdef RESTORE
 		exitcode = content_stream_restore( 0 );
@@ -985,6 +998,7 @@ usage( void )
 	ULO( "<seconds between progress reports>",	GETOPT_PROGRESS );
 	ULO( "<subtree> ...",				GETOPT_SUBTREE );
 	ULO( "<verbosity {silent, verbose, trace}>",	GETOPT_VERBOSITY );
+	ULO( "(compress media files)",			GETOPT_COMPRESS );
 #ifdef EXTATTR
 	ULO( "(don't dump extended file attributes)",	GETOPT_NOEXTATTR );
 #endif /* EXTATTR */
@@ -994,9 +1008,7 @@ usage( void )
 #ifdef BASED
 	ULO( "<base dump session id>",			GETOPT_BASED );
 #endif /* BASED */
-#ifdef REVEAL
-	ULO( "(generate tape record checksums)",	GETOPT_RECCHKSUM );
-#endif /* REVEAL */
+	ULO( "(generate record checksums)",		GETOPT_RECCHKSUM );
 	ULO( "(pre-erase media)",			GETOPT_ERASE );
 	ULO( "(don't prompt)",				GETOPT_FORCE );
 #ifdef REVEAL
@@ -1523,6 +1535,16 @@ sighandler( int signo )
 	if ( miniroot || pipeline ) {
 		intgen_t rval;
 
+#ifdef DUMP
+		/* a forked stream process just quits. the parent stops
+		 * the others before cleaning up.
+		 */
+		if ( pid != parentpid ) {
+			_exit( EXIT_INTERRUPT );
+		}
+		killstreams( );
+#endif /* DUMP */
+
 		mlog( MLOG_TRACE | MLOG_NOTE | MLOG_NOLOCK | MLOG_PROC,
 		      "received signal %d (%s): cleanup and exit\n",
 		      signo,
@@ -1702,6 +1724,113 @@ childmain( void *arg1 )
 	exit( exitcode );
 }
 
+#ifdef DUMP
+/* forkstreams - when single-threaded, dump each stream in a process of
+ * its own. the stream contexts are in shared memory, so content_complete
+ * can still tell which streams were completely dumped. streams are
+ * reaped in whatever order they exit, and checked in, so that the
+ * others are not left waiting to dump the session inventory. returns
+ * the worst of the streams' exit codes.
+ */
+static intgen_t
+forkstreams( void )
+{
+	intgen_t exitcode;
+	size_t livecnt;
+	ix_t stix;
+
+	for ( stix = 0 ; stix < drivecnt ; stix++ ) {
+		pid_t pid;
+
+		pid = fork( );
+		if ( pid < 0 ) {
+			mlog( MLOG_NORMAL | MLOG_ERROR | MLOG_PROC,
+			      "unable to create process for stream %u: %s\n",
+			      stix,
+			      strerror( errno ));
+			killstreams( );
+			return EXIT_ERROR;
+		}
+		if ( pid == 0 ) {
+			drive_t *drivep = drivepp[ stix ];
+
+			stream_register( getpid( ), ( intgen_t )stix );
+			exitcode = content_stream_dump( stix );
+			( * drivep->d_opsp->do_quit )( drivep );
+
+			/* leave the atexit cleanup to the parent
+			 */
+			_exit( exitcode );
+		}
+		mlog( MLOG_NITTY | MLOG_PROC,
+		      "process created for stream %u: pid %d\n",
+		      stix,
+		      pid );
+		streampid[ stix ] = pid;
+	}
+
+	exitcode = EXIT_NORMAL;
+	livecnt = drivecnt;
+	while ( livecnt ) {
+		for ( stix = 0 ; stix < drivecnt ; stix++ ) {
+			intgen_t stat;
+			intgen_t xc;
+			pid_t pid;
+
+			if ( streampid[ stix ] <= 0 ) {
+				continue;
+			}
+			pid = waitpid( streampid[ stix ], &stat, WNOHANG );
+			if ( pid == 0 ) {
+				continue;
+			}
+			streampid[ stix ] = 0;
+			livecnt--;
+			content_stream_checkin( stix );
+			if ( pid < 0 ) {
+				continue;
+			}
+			if ( WIFSIGNALED( stat )) {
+				mlog( MLOG_NORMAL | MLOG_ERROR | MLOG_PROC,
+				      "stream %u faulted: "
+				      "signal number %d (%s)\n",
+				      stix,
+				      WTERMSIG( stat ),
+				      sig_numstring( WTERMSIG( stat )));
+				xc = EXIT_FAULT;
+			} else {
+				xc = WEXITSTATUS( stat );
+			}
+			if ( xc > exitcode ) {
+				exitcode = xc;
+			}
+		}
+		if ( livecnt ) {
+			sleep( 1 );
+		}
+	}
+
+	return exitcode;
+}
+
+/* killstreams - stop any stream processes created by forkstreams and
+ * wait for them, so none is still writing the inventory during cleanup.
+ */
+static void
+killstreams( void )
+{
+	ix_t stix;
+
+	for ( stix = 0 ; stix < STREAM_SIMMAX ; stix++ ) {
+		if ( streampid[ stix ] > 0 ) {
+			( void )kill( streampid[ stix ], SIGTERM );
+			( void )waitpid( streampid[ stix ], 0, 0 );
+			streampid[ stix ] = 0;
+		}
+	}
+}
+#endif /* DUMP */
+
 
 /* ARGSUSED */
 static void
@@ -36,17 +36,6 @@
 
 extern usptr_t	*arena;
 
-thread_control *
-thread_control_init(thread_control *mask, int num_threads)
-{
-	if ((mask->mutex = usnewsema(arena, 1)) == NULL)
-		return(NULL);
-
-	mask->num_working = 0;
-
-	return(mask);
-}
-
 wbuf *
 wbuf_init(wbuf *buf, int data_size, int data_alignment, int min_io_size, int id)
 {
@@ -63,62 +52,167 @@ wbuf_init(wbuf *buf, int data_size, int data_alignment, int min_io_size, int id)
 	return(buf);
 }
 
-void
-buf_read_start(void)
+buffer_ring *
+ring_init(buffer_ring *ring, int nbufs, int data_size, int data_alignment,
+		int min_io_size)
 {
+	int	i;
+
+	if ((ring->mutex = usnewsema(arena, 1)) == NULL)
+		return(NULL);
+	if ((ring->free = usnewsema(arena, nbufs)) == NULL)
+		return(NULL);
+	if ((ring->bufs = calloc(nbufs, sizeof(wbuf))) == NULL)
+		return(NULL);
+	if ((ring->freelist = calloc(nbufs, sizeof(int))) == NULL)
+		return(NULL);
+	if ((ring->queue = calloc(nbufs, sizeof(int))) == NULL)
+		return(NULL);
+	if ((ring->pending = calloc(nbufs, sizeof(int))) == NULL)
+		return(NULL);
+
+	for (i = 0; i < nbufs; i++)  {
+		if (wbuf_init(&ring->bufs[i], data_size, data_alignment,
+				min_io_size, i) == NULL)
+			return(NULL);
+		ring->freelist[i] = i;
+	}
+
+	ring->size = nbufs;
+	ring->head = 0;
+	ring->nfree = nbufs;
+
+	return(ring);
 }
 
-void
-buf_read_end(thread_control *tmask, usema_t *mainwait)
+/*
+ * hand a reader a free buffer to fill, waiting for the targets to
+ * finish with one if need be
+ */
+
+wbuf *
+ring_get(buffer_ring *ring)
 {
-	uspsema(tmask->mutex);
+	wbuf	*buf;
 
-	tmask->num_working--;
+	uspsema(ring->free);
 
-	if (tmask->num_working == 0)  {
-		usvsema(mainwait);
-	}
+	uspsema(ring->mutex);
+	ASSERT(ring->nfree > 0);
+	buf = &ring->bufs[ring->freelist[--ring->nfree]];
+	usvsema(ring->mutex);
 
-	usvsema(tmask->mutex);
+	return(buf);
+}
+
+static void
+ring_free(buffer_ring *ring, wbuf *buf)
+{
+	ring->freelist[ring->nfree++] = buf->id;
+	usvsema(ring->free);
 }
 
 /*
- * me should be set to (1 << (thread_id%32)),
- * the tmask bit is already set to INACTIVE (1)
+ * give back a buffer from ring_get() without queueing it
  */
 
 void
-buf_read_error(thread_control *tmask, usema_t *mainwait, thread_id id)
+ring_put(buffer_ring *ring, wbuf *buf)
 {
-	uspsema(tmask->mutex);
+	uspsema(ring->mutex);
+	ring_free(ring, buf);
+	usvsema(ring->mutex);
+}
 
-	tmask->num_working--;
-	target_states[id] = INACTIVE;
+/*
+ * queue a buffer from ring_get() for all active targets, returns
+ * the number of targets the caller has to wake up.
+ */
+
+int
+ring_queue(buffer_ring *ring, wbuf *buf, int ntargets)
+{
+	int	i, count = 0;
+
+	uspsema(ring->mutex);
 
-	if (tmask->num_working == 0)  {
-		usvsema(mainwait);
+	for (i = 0; i < ntargets; i++)  {
+		if (target_states[i] == ACTIVE)
+			count++;
 	}
 
-	usvsema(tmask->mutex);
+	ring->queue[ring->head % ring->size] = buf->id;
+	ring->pending[buf->id] = count;
+	ring->head++;
+
+	if (count == 0)
+		ring_free(ring, buf);
+
+	usvsema(ring->mutex);
+
+	return(count);
+}
+
+/*
+ * the buffer queued as number seq -- only valid for a target that
+ * hasn't written it yet
+ */
+
+wbuf *
+ring_buf(buffer_ring *ring, int seq)
+{
+	return(&ring->bufs[ring->queue[seq % ring->size]]);
+}
+
+static void
+ring_release(buffer_ring *ring, int seq)
+{
+	wbuf	*buf = ring_buf(ring, seq);
+
+	ASSERT(ring->pending[buf->id] > 0);
 
+	if (--ring->pending[buf->id] == 0)
+		ring_free(ring, buf);
 }
 
 void
-buf_write_start(void)
+ring_done(buffer_ring *ring, int seq)
 {
+	uspsema(ring->mutex);
+	ring_release(ring, seq);
+	usvsema(ring->mutex);
 }
 
+/*
+ * a target died -- mark it inactive and drop its claim on every
+ * buffer it hadn't written yet so the readers don't wait for it.
+ */
+
 void
-buf_write_end(thread_control *tmask, usema_t *mainwait)
+ring_error(buffer_ring *ring, thread_id id, int seq)
 {
-	uspsema(tmask->mutex);
+	uspsema(ring->mutex);
 
-	tmask->num_working--;
+	target_states[id] = INACTIVE;
 
-	if (tmask->num_working == 0)  {
-		usvsema(mainwait);
-	}
+	for (; seq < ring->head; seq++)
+		ring_release(ring, seq);
 
-	usvsema(tmask->mutex);
+	usvsema(ring->mutex);
 }
 
+/*
+ * wait until every queued buffer has been written by every target,
+ * the caller mustn't be holding any buffers itself.
+ */
+
+void
+ring_drain(buffer_ring *ring)
+{
+	int	i;
+
+	for (i = 0; i < ring->size; i++)
+		uspsema(ring->free);
+	for (i = 0; i < ring->size; i++)
+		usvsema(ring->free);
+}
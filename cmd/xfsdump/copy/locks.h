@@ -76,12 +76,38 @@ typedef struct working_buffer  {
 	char		*data;		/* pointer to data buffer */
 } wbuf;
 
-typedef struct thread_state_control  {
+/*
+ * The readers fill a ring of working buffers and each target thread
+ * writes them out in the order they were queued, so reading overlaps
+ * writing and a fast target can run up to "size" buffers ahead of the
+ * slowest one.  A buffer goes back on the free list once every target
+ * that was active when it was queued has written it (or died).
+ *
+ * There can be several readers, each filling its own buffer, so
+ * buffers are queued in whatever order the readers finish them.
+ * Queued buffers get consecutive sequence numbers, and queue[seq %
+ * size] says which buffer went out as number "seq".  Each target
+ * thread remembers the sequence number of the next buffer it has to
+ * write and gets one V on its semaphore per buffer queued.  With only
+ * "size" buffers, a queue slot can't be reused before every target
+ * is past it.
+ *
+ * The ring's locking is built on the IRIX sproc/usema calls, which are
+ * only stubbed out above, as is the rest of xfs_copy's threading.
+ * Until that is ported to pthreads none of this runs on Linux.
+ */
+
+typedef struct buffer_ring  {
 	usema_t		*mutex;
-/*	int		num_threads; */
-	int		num_working;
-	wbuf		*buffer;
-} thread_control;
+	usema_t		*free;		/* counts buffers on the free list */
+	int		size;		/* number of buffers */
+	int		head;		/* sequence # of the next buffer queued */
+	int		nfree;
+	int		*freelist;	/* ids of free buffers */
+	int		*queue;		/* buffer id by sequence # */
+	int		*pending;	/* targets yet to write each buffer */
+	wbuf		*bufs;
+} buffer_ring;
 
 typedef int thread_id;
 typedef int tm_index;			/* index into thread mask array */
@@ -89,24 +115,30 @@ typedef __uint32_t thread_mask;		/* a thread mask */
 
 /* function declarations */
 
-thread_control *
-thread_control_init(thread_control *mask, int num_threads);
-
 wbuf *
 wbuf_init(wbuf *buf, int data_size, int data_alignment, int min_io_size, int id);
 
-void
-buf_read_start(void);
+buffer_ring *
+ring_init(buffer_ring *ring, int nbufs, int data_size, int data_alignment,
+		int min_io_size);
 
-void
-buf_read_end(thread_control *tmask, usema_t *mainwait);
+wbuf *
+ring_get(buffer_ring *ring);
 
 void
-buf_read_error(thread_control *tmask, usema_t *wait, thread_id id);
+ring_put(buffer_ring *ring, wbuf *buf);
+
+int
+ring_queue(buffer_ring *ring, wbuf *buf, int ntargets);
+
+wbuf *
+ring_buf(buffer_ring *ring, int seq);
 
 void
-buf_write_start(void);
+ring_done(buffer_ring *ring, int seq);
 
 void
-buf_write_end(thread_control *tmask, usema_t *mainwait);
+ring_error(buffer_ring *ring, thread_id id, int seq);
 
+void
+ring_drain(buffer_ring *ring);
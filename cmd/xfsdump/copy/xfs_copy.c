@@ -36,6 +36,7 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #undef ustat
 #include <sys/ustat.h>
 
@@ -48,7 +49,8 @@
 #define ARENA_NAME	"/usr/tmp/xfs_copy.arenaXXXXXX"
 #define LOGFILE_NAME	"/usr/tmp/xfs_copy.log.XXXXXX"
 #define MAX_TARGETS	100
-#define MAX_THREADS	(MAX_TARGETS + 2)
+#define MAX_READERS	32
+#define MAX_THREADS	(MAX_TARGETS + MAX_READERS + 2)
 #define T_STACKSIZE	(1024*16)
 
 char *arena_name;
@@ -86,21 +88,48 @@ pid_t	*target_pids;
 int	*target_states;
 int	*target_errors;
 int	*target_err_types;
+__uint64_t	*target_bytes;		/* bytes written to each target */
+double		*target_secs;		/* time each target spent writing */
 
 typedef struct thread_args {
 	int		id;
 	usema_t		*wait;
 	int		fd;
+	int		seq;		/* next buffer in the ring to write */
 } t_args;
 
+typedef struct reader_args {
+	int		id;
+	usema_t		*wait;		/* parks the reader when it's done */
+	wbuf		btree_buf;	/* private buffer for btree blocks */
+} r_args;
+
 usptr_t		*arena;
 #define	ANYCHILD	-1
-#define	NUM_BUFS	1
+#define	NUM_BUFS	8	/* default depth of the buffer ring */
+
+#define	NUM_READERS	4	/* default # of AG reader threads */
+
+int		num_bufs = NUM_BUFS;
+buffer_ring	w_ring;
+
+int		num_readers = NUM_READERS;
+r_args		*rarg;
+pid_t		*reader_pids;
+usema_t		*readers_done;	/* one V per reader out of AGs */
 
-wbuf		w_buf;
-wbuf		btree_buf;
+xfs_mount_t	*mp;			/* source filesystem */
+xfs_agnumber_t	num_ags;
+xfs_agnumber_t	next_ag;		/* next AG for a reader to copy */
+usema_t		*ag_lock;		/* protects next_ag */
+uuid_t		fsid;
+int		wbuf_miniosize;
+int		wblocks;		/* BBs in a full ring buffer */
 
-thread_control	glob_masks;
+__uint64_t	numblocks;		/* progress so far, in BBs */
+__uint64_t	*ag_bytes;		/* bytes read from each AG */
+double		*ag_secs;		/* time spent copying each AG */
+usema_t		*stats_lock;		/* protects the above */
 
 t_args	*targ;
 /*
@@ -110,8 +139,6 @@ pid_t	source_pid;
 int	source_state;
 */
 
-usema_t	*mainwait;
-
 
 /*
  * An on-disk allocation group header is composed of 4 structures,
@@ -253,6 +280,15 @@ do_error(char *prefix)
 	do_error2(prefix, errno, 1);
 }
 
+double
+seconds(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return(tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
 /*
  * don't have to worry about alignment and mins because those
  * are taken care of when the buffer's read in
@@ -263,6 +299,8 @@ void
 begin_reader(void *arg, size_t ignore)
 {
 	t_args	*args = arg;
+	wbuf	*buf;
+	double	start;
 	int	res;
 	int	error = 0;
 
@@ -270,23 +308,28 @@ begin_reader(void *arg, size_t ignore)
 	usinit(arena);
 
 	for (;;) {
+		/* one V per buffer queued for us */
+
 		uspsema(args->wait);
 
-		buf_read_start();
+		buf = ring_buf(&w_ring, args->seq);
+		start = seconds();
 
 		/* write */
-		if (target_positions[args->id] != w_buf.position)  {
-			if (lseek64(args->fd, w_buf.position, SEEK_SET) < 0)  {
+		if (target_positions[args->id] != buf->position)  {
+			if (lseek64(args->fd, buf->position, SEEK_SET) < 0)  {
 				error = 1;
 				target_err_types[args->id] = 1;
 			} else  {
-				target_positions[args->id] = w_buf.position;
+				target_positions[args->id] = buf->position;
 			}
 		}
 
-		if ((res = write(target_fds[args->id], w_buf.data,
-				w_buf.length)) == w_buf.length)  {
+		if ((res = write(target_fds[args->id], buf->data,
+				buf->length)) == buf->length)  {
 			target_positions[args->id] += res;
+			target_bytes[args->id] += res;
+			target_secs[args->id] += seconds() - start;
 		} else  {
 			error = 2;
 		}
@@ -295,7 +338,8 @@ begin_reader(void *arg, size_t ignore)
 			goto handle_error;
 		}
 
-		buf_read_end(&glob_masks, mainwait);
+		ring_done(&w_ring, args->seq);
+		args->seq++;
 	}
 	/* NOTREACHED */
 
@@ -303,9 +347,9 @@ handle_error:
 	/* error will be logged by primary thread */
 
 	target_errors[args->id] = errno;
-	target_positions[args->id] = w_buf.position;
+	target_positions[args->id] = buf->position;
 
-	buf_read_error(&glob_masks, mainwait, args->id);
+	ring_error(&w_ring, args->id, args->seq);
 	exit(1);
 }
 
@@ -328,6 +372,14 @@ killall(void)
 			usvsema(targ[i].wait);
 		}
 	}
+
+	for (i = 0; i < num_readers; i++)  {
+		if (reader_pids != NULL && reader_pids[i] > 0)  {
+			/* and the AG readers */
+			kill(reader_pids[i], SIGKILL);
+			usvsema(rarg[i].wait);
+		}
+	}
 }
 
 void
@@ -387,6 +439,23 @@ handler()
 		}
 	}
 
+	for (i = 0; reader_pids != NULL && i < num_readers; i++)  {
+		if (reader_pids[i] == pid)  {
+			/* read errors are logged by the reader itself */
+
+			reader_pids[i] = 0;
+			fprintf(logerr,
+		"%s:  AG reader thread %d died, copies are incomplete\n",
+				progname, i);
+			fprintf(stderr,
+		"%s:  AG reader thread %d died, copies are incomplete\n",
+				progname, i);
+			fprintf(stderr, "Check logfile \"%s\" for more details\n",
+				logfile_name);
+			exit(1);
+		}
+	}
+
 	/* unknown child -- something very wrong */
 
 	fprintf(logerr, "%s: UNKNOWN CHILD DIED - THIS SHOULD NEVER HAPPEN!\n",
@@ -401,8 +470,9 @@ void
 usage(void)
 {
 	fprintf(stderr,
-		"Usage: %s [-d] fromdev|fromfile todev [todev todev ...]\n"
-		"       %s [-d] fromdev|fromfile tofile\n", progname, progname);
+		"Usage: %s [-d] [-b nbufs] [-r readers] fromdev|fromfile todev [todev ...]\n"
+		"       %s [-d] [-b nbufs] [-r readers] fromdev|fromfile tofile\n",
+		progname, progname);
 	exit(1);
 }
 
@@ -429,13 +499,15 @@ bump_bar(int tenths)
 	fflush(stdout);
 }
 
-static xfs_off_t source_position = -1;
+/*
+ * several AG readers share the source descriptor, so reads are
+ * positioned
+ */
 
 void
 read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 {
 	int		res = 0;
-	xfs_off_t	lres = 0;
 	xfs_off_t	newpos;
 	size_t		diff;
 
@@ -448,19 +520,7 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		buf->length += diff;
 	}
 
-	if (source_position != buf->position)  {
-		lres = lseek64(fd, buf->position, SEEK_SET);
-		if (lres < 0LL)  {
-			fprintf(logerr,
-				"%s:  lseek64 failure at offset %lld\n",
-				progname, source_position);
-			do_error("Aborting XFS copy - reason");
-			exit(1);
-		}
-		source_position = buf->position;
-	}
-
-	ASSERT(source_position % source_sectorsize == 0);
+	ASSERT(buf->position % source_sectorsize == 0);
 
 	/* round up length for direct i/o if necessary */
 
@@ -475,19 +535,18 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		abort();
 	}
 
-	if ((res = read(fd, buf->data, buf->length)) < 0)  {
+	if ((res = pread64(fd, buf->data, buf->length, buf->position)) < 0)  {
 		fprintf(logerr, "%s:  read failure at offset %lld\n",
-				progname, source_position);
+				progname, buf->position);
 		do_error("Aborting XFS copy - reason");
 		exit(1);
 	}
 
 	if (res < buf->length &&
-	    source_position + res == mp->m_sb.sb_dblocks * source_blocksize)
+	    buf->position + res == mp->m_sb.sb_dblocks * source_blocksize)
 		res = buf->length;
 	else
 		ASSERT(res == buf->length);
-	source_position += res;
 	buf->length = res;
 }
 
@@ -546,18 +605,35 @@ read_ag_header(int fd, xfs_agnumber_t agno, wbuf *buf, ag_header_t *ag,
 	return(1);
 }
 
+/*
+ * get a ring buffer to read into.  Dying targets have to be reaped
+ * while the main thread waits for them, hence the SIGCLD dance.
+ */
+
+wbuf *
+get_wbuf(void)
+{
+	wbuf	*buf;
+
+	sigrelse(SIGCLD);
+	buf = ring_get(&w_ring);
+	sighold(SIGCLD);
+
+	return(buf);
+}
+
+/*
+ * queue a buffer from get_wbuf() for the targets -- it is written
+ * behind the reader's back while it goes on reading into the next one
+ */
+
 void
-write_wbuf(void)
+write_wbuf(wbuf *buf)
 {
 	int i;
 
-	/* verify target threads */
-
-	for (i = 0; i < num_targets; i++)  {
-		if (target_states[i] != INACTIVE)  {
-			glob_masks.num_working++;
-		}
-	}
+	if (ring_queue(&w_ring, buf, num_targets) == 0)
+		return;
 
 	/* release target threads */
 
@@ -568,12 +644,337 @@ write_wbuf(void)
 			usvsema(targ[i].wait);
 		}
 	}
+}
 
+/*
+ * wait for the targets to catch up with everything queued so far
+ */
+
+void
+drain_wbufs(void)
+{
 	sigrelse(SIGCLD);
-	uspsema(mainwait);
+	ring_drain(&w_ring);
 	sighold(SIGCLD);
 }
 
+void
+bump_progress(__uint64_t nblocks)
+{
+	uspsema(stats_lock);
+	numblocks += nblocks;
+	while (howfar < 10 && numblocks > barcount[howfar])  {
+		bump_bar(howfar);
+		howfar++;
+	}
+	usvsema(stats_lock);
+}
+
+/*
+ * rounded up for direct i/o, the last buffer of AG agno can run past
+ * the end of the AG and over the next AG's superblock, which that
+ * AG's reader writes with the new uuid -- maybe before this buffer
+ * goes out.  give our copy of it the new uuid too, so it doesn't
+ * matter which write lands last.
+ */
+
+void
+fix_next_sb(xfs_agnumber_t agno, wbuf *buf)
+{
+	xfs_off_t	sbpos;
+	xfs_sb_t	*sb;
+
+	if (duplicate_uuids || agno + 1 >= num_ags)
+		return;
+
+	sbpos = (xfs_off_t) XFS_AG_DADDR(mp, agno + 1, XFS_SB_DADDR)
+			<< BBSHIFT;
+	if (sbpos < buf->position ||
+	    sbpos + sizeof(xfs_sb_t) > buf->position + buf->length)
+		return;
+
+	sb = (xfs_sb_t *) (buf->data + (sbpos - buf->position));
+
+	ASSERT(sb->sb_magicnum == XFS_SB_MAGIC);
+
+	uuid_copy(sb->sb_uuid, fsid);
+}
+
+/*
+ * copy sizeb basic blocks of AG agno starting at begin, a ring
+ * buffer at a time
+ */
+
+void
+copy_range(xfs_agnumber_t agno, xfs_daddr_t begin, int sizeb)
+{
+	wbuf		*buf;
+	xfs_off_t	wpos;
+	__uint64_t	nblocks;
+	int		size;
+
+	/* round size up to ensure we copy a range bigger than required */
+
+	size = roundup(sizeb << BBSHIFT, wbuf_miniosize);
+	wpos = (xfs_off_t) begin << BBSHIFT;
+
+	while (size > 0)  {
+		buf = get_wbuf();
+		buf->position = wpos;
+
+		/*
+		 * let lower layer do alignment
+		 */
+		if (size > buf->size)  {
+			buf->length = buf->size;
+			size -= buf->size;
+			sizeb -= wblocks;
+			nblocks = wblocks;
+		} else  {
+			buf->length = size;
+			nblocks = sizeb;
+			size = 0;
+		}
+
+		read_wbuf(source_fd, buf, mp);
+		fix_next_sb(agno, buf);
+		wpos = buf->position + buf->length;
+		ag_bytes[agno] += buf->length;
+#ifndef NO_COPY
+		write_wbuf(buf);
+#else
+		ring_put(&w_ring, buf);
+#endif
+		bump_progress(nblocks);
+	}
+}
+
+/*
+ * copy the AG header and every range of AG agno that isn't on the
+ * free space (bno) btree
+ */
+
+void
+copy_ag(r_args *rarg, xfs_agnumber_t agno)
+{
+	wbuf		*btree_buf = &rarg->btree_buf;
+	wbuf		*buf;
+	ag_header_t	ag_hdr;
+	xfs_alloc_block_t *block;
+	xfs_alloc_ptr_t	*ptr;
+	xfs_alloc_rec_t	*rec_ptr;
+	xfs_agblock_t	bno;
+	xfs_daddr_t	begin, next_begin, ag_begin, new_begin, ag_end;
+	xfs_off_t	pos;
+	uint		btree_levels, current_level;
+	double		start;
+	int		i;
+
+	start = seconds();
+
+	/* read in first blocks of the ag */
+
+	buf = get_wbuf();
+	read_ag_header(source_fd, agno, buf, &ag_hdr, mp,
+		source_blocksize, source_sectorsize);
+
+	/* reset uuid and if applicable the in_progress bit */
+
+	if (!duplicate_uuids)
+		uuid_copy(ag_hdr.xfs_sb->sb_uuid, fsid);
+
+	if (agno == 0)  {
+		ag_hdr.xfs_sb->sb_inprogress = 1;
+	}
+
+	/* save what we need (agf) in the btree buffer */
+
+	bcopy(ag_hdr.xfs_agf, btree_buf->data, source_sectorsize);
+	ag_hdr.xfs_agf = (xfs_agf_t *) btree_buf->data;
+	btree_buf->length = source_blocksize;
+
+	/* align first data copy but don't overwrite ag header */
+
+	ASSERT(buf->position % source_sectorsize == 0);
+
+	ag_begin = (buf->position + buf->length) >> BBSHIFT;
+	ag_bytes[agno] += buf->length;
+
+	/* write the ag header out */
+
+	write_wbuf(buf);
+
+	/* traverse btree until we get to the leftmost leaf node */
+
+	bno = ag_hdr.xfs_agf->agf_roots[XFS_BTNUM_BNOi];
+	current_level = 0;
+	btree_levels = ag_hdr.xfs_agf->agf_levels[XFS_BTNUM_BNOi];
+
+	ag_end = XFS_AGB_TO_DADDR(mp, agno,
+			ag_hdr.xfs_agf->agf_length - 1)
+			+ source_blocksize/BBSIZE;
+
+	for (;;) {
+		/* none of this touches the ring buffers */
+
+		ASSERT(current_level < btree_levels);
+
+		current_level++;
+
+		btree_buf->position = pos =
+			(xfs_off_t)XFS_AGB_TO_DADDR(mp,agno,bno) << BBSHIFT;
+		btree_buf->length = source_blocksize;
+
+		read_wbuf(source_fd, btree_buf, mp);
+		block = (xfs_alloc_block_t *) ((char *) btree_buf->data
+				+ pos - btree_buf->position);
+
+		ASSERT(block->bb_magic == XFS_ABTB_MAGIC);
+
+		if (block->bb_level == 0)
+			break;;
+
+		ptr = XFS_BTREE_PTR_ADDR(sourceb_blocksize, xfs_alloc,
+			block, 1, mp->m_alloc_mxr[1]),
+
+		bno = *ptr;
+	}
+
+	next_begin = ag_begin;
+
+	/* handle the rest of the ag */
+
+	for (;;) {
+		if (block->bb_level != 0)  {
+	fprintf(logerr, "WARNING:  source filesystem inconsistent.\n");
+	fprintf(stderr, "WARNING:  source filesystem inconsistent.\n");
+	fprintf(logerr,
+		"  A leaf btree rec isn't a leaf.  Aborting now.\n");
+	fprintf(stderr,
+		"  A leaf btree rec isn't a leaf.  Aborting now.\n");
+			exit(1);
+		}
+
+		rec_ptr = XFS_BTREE_REC_ADDR(source_blocksize, xfs_alloc,
+				block, 1, mp->m_alloc_mxr[0]);
+
+		for (i = 0; i < block->bb_numrecs; i++, rec_ptr++)  {
+			/* calculate in daddr's */
+
+			begin = next_begin;
+
+			/*
+			 * protect against pathological case of a
+			 * hole right after the ag header in a
+			 * mis-aligned case
+			 */
+
+			if (begin < ag_begin)
+				begin = ag_begin;
+
+			copy_range(agno, begin, XFS_AGB_TO_DADDR(mp, agno,
+				rec_ptr->ar_startblock) - begin);
+
+			/* round next starting point down */
+
+			new_begin = XFS_AGB_TO_DADDR(mp, agno,
+					rec_ptr->ar_startblock +
+					rec_ptr->ar_blockcount);
+			next_begin = rounddown(new_begin,
+					wbuf_miniosize >> BBSHIFT);
+		}
+
+		if (block->bb_rightsib == NULLAGBLOCK)
+			break;
+
+		/* read in next btree record block */
+
+		btree_buf->position = pos = (xfs_off_t)XFS_AGB_TO_DADDR(mp,
+			agno, block->bb_rightsib) << BBSHIFT;
+		btree_buf->length = source_blocksize;
+
+		/* let read_wbuf handle alignment */
+
+		read_wbuf(source_fd, btree_buf, mp);
+
+		block = (xfs_alloc_block_t *) ((char *) btree_buf->data
+				+ pos - btree_buf->position);
+
+		ASSERT(block->bb_magic == XFS_ABTB_MAGIC);
+	}
+
+	/*
+	 * write out range of used blocks after last range
+	 * of free blocks in AG
+	 */
+	if (next_begin < ag_end)
+		copy_range(agno, next_begin, ag_end - next_begin);
+
+	ag_secs[agno] = seconds() - start;
+}
+
+/*
+ * AG reader thread -- copies AGs until there are none left, so
+ * several AGs are being walked and read at once.  like the target
+ * threads, these are sprocs sharing usema locks, which are still
+ * stubs on Linux (see locks.h).
+ */
+
+/* ARGSUSED */
+void
+begin_ag_reader(void *arg, size_t ignore)
+{
+	r_args		*args = arg;
+	xfs_agnumber_t	agno;
+
+	usinit(arena);
+
+	for (;;)  {
+		uspsema(ag_lock);
+		agno = next_ag++;
+		usvsema(ag_lock);
+
+		if (agno >= num_ags || kids == 0)
+			break;
+
+		copy_ag(args, agno);
+	}
+
+	usvsema(readers_done);
+
+	/* park until killall() */
+
+	for (;;)
+		uspsema(args->wait);
+}
+
+void
+print_summary(FILE *fp, double elapsed)
+{
+	xfs_agnumber_t	agno;
+	__uint64_t	total = 0;
+	int		i;
+
+	fprintf(fp, "AG   bytes read        secs      MB/s\n");
+	for (agno = 0; agno < num_ags; agno++)  {
+		total += ag_bytes[agno];
+		fprintf(fp, "%-4u %-16llu %8.2f %9.2f\n", agno,
+			ag_bytes[agno], ag_secs[agno], ag_secs[agno] > 0 ?
+			ag_bytes[agno] / ag_secs[agno] / (1024 * 1024) : 0.0);
+	}
+	fprintf(fp, "read %llu bytes in %.2f secs, %.2f MB/s\n", total,
+		elapsed, elapsed > 0 ? total / elapsed / (1024 * 1024) : 0.0);
+
+	fprintf(fp, "target bytes written     secs      MB/s  busy\n");
+	for (i = 0; i < num_targets; i++)  {
+		fprintf(fp, "%-6d %-16llu %8.2f %9.2f %4.0f%%  %s\n", i,
+			target_bytes[i], target_secs[i], target_secs[i] > 0 ?
+			target_bytes[i] / target_secs[i] / (1024 * 1024) : 0.0,
+			elapsed > 0 ? 100 * target_secs[i] / elapsed : 0.0,
+			target_names[i]);
+	}
+}
+
 
 #define findrawpath(x)  x
 
@@ -582,29 +983,17 @@ main(int argc, char **argv)
 {
 	int		i, write_last_block = 0;
 	int		open_flags;
-	xfs_off_t	pos;
-	size_t		length;
-	int		c, size, sizeb, first_residue, tmp_residue;
-	__uint64_t	numblocks = 0;
-	int		wblocks = 0;
+	int		c, first_residue, tmp_residue;
 	int		num_threads = 0;
 	struct dioattr	d_info;
 	int		wbuf_size;
 	int		wbuf_align;
-	int		wbuf_miniosize;
-	uuid_t		fsid;
-	uint		btree_levels, current_level;
 	ag_header_t	ag_hdr;
-	xfs_mount_t	*mp;
 	xfs_mount_t	mbuf;
 	xfs_buf_t	*sbp;
 	xfs_sb_t	*sb;
-	xfs_agnumber_t	num_ags, agno;
-	xfs_agblock_t	bno;
-	xfs_daddr_t	begin, next_begin, ag_begin, new_begin, ag_end;
-	xfs_alloc_block_t *block;
-	xfs_alloc_ptr_t	*ptr;
-	xfs_alloc_rec_t	*rec_ptr;
+	wbuf		*w_buf;
+	double		start;
 	extern char	*optarg;
 	extern int	optind;
 	libxfs_init_t	xargs;
@@ -643,11 +1032,27 @@ main(int argc, char **argv)
 
 	duplicate_uuids = 0;
 
-	while ((c = getopt(argc, argv, "dV")) != EOF)  {
+	while ((c = getopt(argc, argv, "b:dr:V")) != EOF)  {
 		switch (c) {
+		case 'b':
+			num_bufs = atoi(optarg);
+			if (num_bufs < 1)  {
+				fprintf(stderr, "%s: -b needs at least 1 "
+					"buffer\n", progname);
+				usage();
+			}
+			break;
 		case 'd':
 			duplicate_uuids = 1;
 			break;
+		case 'r':
+			num_readers = atoi(optarg);
+			if (num_readers < 1 || num_readers > MAX_READERS)  {
+				fprintf(stderr, "%s: -r must be between 1 "
+					"and %d\n", progname, MAX_READERS);
+				usage();
+			}
+			break;
 		case 'V':
 			printf("%s version %s\n", progname, VERSION);
 			break;
@@ -719,6 +1124,13 @@ main(int argc, char **argv)
 		target_err_types[i] = 0;
 	}
 
+	if ((target_bytes = calloc(num_targets, sizeof(__uint64_t))) == NULL ||
+	    (target_secs = calloc(num_targets, sizeof(double))) == NULL)  {
+		fprintf(logerr, "Couldn't allocate target statistics\n");
+		do_error("Aborting XFS copy - reason");
+		exit(1);
+	}
+
 	if ((target_fds = malloc(sizeof(int)*num_targets)) == NULL)  {
 		fprintf(logerr, "%s: couldn't malloc target fd array\n",
 			progname);
@@ -1148,32 +1560,51 @@ fprintf(logerr, "\t\tunmounted or mounted read-only.  Copy proceeding...\n");
 
 	/* initialize locks and bufs */
 
-	if (thread_control_init(&glob_masks, num_targets+1) == NULL)  {
-		fprintf(logerr, "Couldn't initialize global thread mask\n");
+	if (ring_init(&w_ring, num_bufs, wbuf_size, wbuf_align,
+					wbuf_miniosize) == NULL)  {
+		fprintf(logerr, "Error initializing %d wbufs\n", num_bufs);
+		fprintf(logerr, "Try a smaller number of buffers\n");
 		do_error("Aborting XFS copy - reason");
 		exit(1);
 	}
 
-	if (wbuf_init(&w_buf, wbuf_size, wbuf_align,
-					wbuf_miniosize, 0) == NULL)  {
-		fprintf(logerr, "Error initializing wbuf 0\n");
+	wblocks = wbuf_size / BBSIZE;
+
+	/* one AG reader per AG at most */
+
+	num_ags = mp->m_sb.sb_agcount;
+	if (num_readers > num_ags)
+		num_readers = num_ags;
+
+	if ((rarg = calloc(num_readers, sizeof(r_args))) == NULL)  {
+		fprintf(logerr, "Couldn't malloc space for reader args\n");
 		do_error("Aborting XFS copy - reason");
 		exit(1);
 	}
 
-	wblocks = wbuf_size / BBSIZE;
-
-	if (wbuf_init(&btree_buf, MAX(MAX(source_blocksize, source_sectorsize),
+	for (i = 0; i < num_readers; i++)  {
+		if (wbuf_init(&rarg[i].btree_buf,
+				MAX(MAX(source_blocksize, source_sectorsize),
 					wbuf_miniosize), wbuf_align,
-					wbuf_miniosize, 1) == NULL)  {
-		fprintf(logerr, "Error initializing btree buf 1\n");
+				wbuf_miniosize, num_bufs + i) == NULL)  {
+			fprintf(logerr, "Error initializing btree buf %d\n",
+				num_bufs + i);
+			do_error("Aborting XFS copy - reason");
+			exit(1);
+		}
+	}
+
+	if ((ag_lock = usnewsema(arena, 1)) == NULL ||
+	    (stats_lock = usnewsema(arena, 1)) == NULL ||
+	    (readers_done = usnewsema(arena, 0)) == NULL)  {
+		fprintf(logerr, "Error creating reader semaphores.\n");
 		do_error("Aborting XFS copy - reason");
 		exit(1);
 	}
 
-	if ((mainwait = usnewsema(arena, 0)) == NULL)  {
-		fprintf(logerr, "Error creating first semaphore.\n");
-		fprintf(logerr, "Something's really wrong.\n");
+	if ((ag_bytes = calloc(num_ags, sizeof(__uint64_t))) == NULL ||
+	    (ag_secs = calloc(num_ags, sizeof(double))) == NULL)  {
+		fprintf(logerr, "Couldn't allocate AG statistics\n");
 		do_error("Aborting XFS copy - reason");
 		exit(1);
 	}
@@ -1204,6 +1635,7 @@ fprintf(logerr, "\t\tunmounted or mounted read-only.  Copy proceeding...\n");
 	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
 		tcarg->id = i;
 		tcarg->fd = target_fds[i];
+		tcarg->seq = 0;
 
 		target_states[i] = ACTIVE;
 
@@ -1224,8 +1656,6 @@ fprintf(logerr, "\t\tunmounted or mounted read-only.  Copy proceeding...\n");
 
 	/* set up statistics */
 
-	num_ags = mp->m_sb.sb_agcount;
-
 	source_blocks = mp->m_sb.sb_blocksize / BBSIZE
 			* ((__uint64_t)mp->m_sb.sb_dblocks
 			    - (__uint64_t)mp->m_sb.sb_fdblocks + 10 * num_ags);
@@ -1234,265 +1664,47 @@ fprintf(logerr, "\t\tunmounted or mounted read-only.  Copy proceeding...\n");
 		barcount[i] = (source_blocks/10)*i;
 
 	kids = num_targets;
-	block = (xfs_alloc_block_t *) btree_buf.data;
-
-	for (agno = 0; agno < num_ags && kids > 0; agno++)  {
-		/* read in first blocks of the ag */
-
-		read_ag_header(source_fd, agno, &w_buf, &ag_hdr, mp,
-			source_blocksize, source_sectorsize);
-
-		/* reset uuid and if applicable the in_progress bit */
-
-		if (!duplicate_uuids)
-			uuid_copy(ag_hdr.xfs_sb->sb_uuid, fsid);
 
-		if (agno == 0)  {
-			ag_hdr.xfs_sb->sb_inprogress = 1;
-		}
-
-		/* save what we need (agf) in the btree buffer */
-
-		bcopy(ag_hdr.xfs_agf, btree_buf.data, source_sectorsize);
-		ag_hdr.xfs_agf = (xfs_agf_t *) btree_buf.data;
-		btree_buf.length = source_blocksize;
-
-		/* write the ag header out */
-
-		write_wbuf();
-
-		/* traverse btree until we get to the leftmost leaf node */
-
-		bno = ag_hdr.xfs_agf->agf_roots[XFS_BTNUM_BNOi];
-		current_level = 0;
-		btree_levels = ag_hdr.xfs_agf->agf_levels[XFS_BTNUM_BNOi];
-
-		ag_end = XFS_AGB_TO_DADDR(mp, agno,
-				ag_hdr.xfs_agf->agf_length - 1)
-				+ source_blocksize/BBSIZE;
-
-		for (;;) {
-			/* none of this touches the w_buf buffer */
-
-			ASSERT(current_level < btree_levels);
+	/* start the AG readers and wait for them to run out of AGs */
 
-			current_level++;
+	start = seconds();
+	next_ag = 0;
 
-			btree_buf.position = pos =
-				(xfs_off_t)XFS_AGB_TO_DADDR(mp,agno,bno) << BBSHIFT;
-			btree_buf.length = source_blocksize;
-
-			read_wbuf(source_fd, &btree_buf, mp);
-			block = (xfs_alloc_block_t *) ((char *) btree_buf.data
-					+ pos - btree_buf.position);
-
-			ASSERT(block->bb_magic == XFS_ABTB_MAGIC);
-
-			if (block->bb_level == 0)
-				break;;
-
-			ptr = XFS_BTREE_PTR_ADDR(sourceb_blocksize, xfs_alloc,
-				block, 1, mp->m_alloc_mxr[1]),
-
-			bno = *ptr;
-		}
-
-		/* align first data copy but don't overwrite ag header */
-
-		pos = w_buf.position >> BBSHIFT;
-		length = w_buf.length >> BBSHIFT;
-#if 0
-		/*
-		 * we know pos and length are aligned, now calculate
-		 * address of the first real ag blocks in the ag and
-		 * make sure it's aligned properly
-		 */
-
-		next_begin = XFS_AG_DADDR(mp, agno, first_agbno);
-		
-		if (next_begin % (w_buf.min_io_size >> BBSHIFT) != 0)  {
-			/* have to align -- duplicate read_ag_header actions */
-
-			next_begin = rounddown(next_begin,
-					w_buf.min_io_size >> BBSHIFT);
-
-			if (next_begin < pos)  {
-				/*
-				 * bump it back up to next boundary,
-				 * the ag header write already copied
-				 * the first few disk blocks
-				 */
+	if ((reader_pids = calloc(num_readers, sizeof(pid_t))) == NULL)  {
+		fprintf(logerr, "Couldn't malloc AG reader pid array\n");
+		do_error("Aborting XFS copy - reason");
+		exit(1);
+	}
 
-				next_begin = roundup(next_begin+1,
-					w_buf.min_io_size >> BBSHIFT);
-			}
+	for (i = 0; i < num_readers; i++)  {
+		rarg[i].id = i;
+		if ((rarg[i].wait = usnewsema(arena, 0)) == NULL)  {
+			fprintf(logerr,
+				"error creating reader semaphore %d\n", i);
+			do_error("Aborting XFS copy - reason");
+			exit(1);
 		}
-#else
-		next_begin = pos + length;
-#endif
-		ag_begin = next_begin;
-
-		ASSERT(w_buf.position % source_sectorsize == 0);
-
-		/* handle the rest of the ag */
-
-		for (;;) {
-			if (block->bb_level != 0)  {
-		fprintf(logerr, "WARNING:  source filesystem inconsistent.\n");
-		fprintf(stderr, "WARNING:  source filesystem inconsistent.\n");
-		fprintf(logerr,
-			"  A leaf btree rec isn't a leaf.  Aborting now.\n");
-		fprintf(stderr,
-			"  A leaf btree rec isn't a leaf.  Aborting now.\n");
-				exit(1);
-			}
 
-			rec_ptr = XFS_BTREE_REC_ADDR(source_blocksize, xfs_alloc,
-					block, 1, mp->m_alloc_mxr[0]);
-
-			for (i = 0; i < block->bb_numrecs; i++, rec_ptr++)  {
-				/* calculate in daddr's */
-
-				begin = next_begin;
-
-				/*
-				 * protect against pathological case of a
-				 * hole right after the ag header in a
-				 * mis-aligned case
-				 */
-
-				if (begin < ag_begin)
-					begin = ag_begin;
-
-				/*
-				 * round size up to ensure we copy a
-				 * range bigger than required
-				 */
-
-				sizeb = XFS_AGB_TO_DADDR(mp, agno,
-					rec_ptr->ar_startblock) - begin;
-				size = roundup(sizeb << BBSHIFT, wbuf_miniosize);
-
-#if 0
-				if (w_buf.min_io_size != wbuf_miniosize)  {
-					fprintf(stderr,
-		"assert error:  w_buf.min_io_size = %d, wbuf_miniosize = %d\n",
-						w_buf.min_io_size,
-						wbuf_miniosize);
-					killall();
-					abort();
-				}
-#endif
-				if (size > 0)  {
-					/* copy extent */
-
-					w_buf.position = (xfs_off_t) begin
-								<< BBSHIFT;
-
-					while (size > 0)  {
-						/*
-						 * let lower layer do alignment
-						 */
-						if (size > w_buf.size)  {
-							w_buf.length = w_buf.size;
-							size -= w_buf.size;
-							sizeb -= wblocks;
-							numblocks += wblocks;
-						} else  {
-							w_buf.length = size;
-							numblocks += sizeb;
-							size = 0;
-						}
-
-						read_wbuf(source_fd, &w_buf, mp);
-#ifndef NO_COPY
-						write_wbuf();
-#endif
-						w_buf.position += w_buf.length;
-
-						while (howfar < 10 && numblocks 
-							> barcount[howfar])  {
-							bump_bar(howfar);
-							howfar++;
-						}
-					}
-				}
-
-				/* round next starting point down */
-
-				new_begin = XFS_AGB_TO_DADDR(mp, agno,
-						rec_ptr->ar_startblock +
-						rec_ptr->ar_blockcount);
-				next_begin = rounddown(new_begin,
-						w_buf.min_io_size >> BBSHIFT);
-			}
-
-			if (block->bb_rightsib == NULLAGBLOCK)
-				break;
-
-			/* read in next btree record block */
-
-			btree_buf.position = pos = (xfs_off_t)XFS_AGB_TO_DADDR(mp,
-				agno, block->bb_rightsib) << BBSHIFT;
-			btree_buf.length = source_blocksize;
-
-			/* let read_wbuf handle alignment */
-
-			read_wbuf(source_fd, &btree_buf, mp);
-
-			block = (xfs_alloc_block_t *) ((char *) btree_buf.data
-					+ pos - btree_buf.position);
+		reader_pids[i] = sprocsp(begin_ag_reader, PR_SALL, &rarg[i],
+					NULL, T_STACKSIZE);
 
-			ASSERT(block->bb_magic == XFS_ABTB_MAGIC);
+		if (reader_pids[i] < 0)  {
+			fprintf(logerr,
+				"error creating sproc for AG reader %d\n", i);
+			do_error("Aborting XFS copy - reason");
+			exit(1);
 		}
+	}
 
-		/*
-		 * write out range of used blocks after last range
-		 * of free blocks in AG
-		 */
-		if (next_begin < ag_end)  {
-			begin = next_begin;
-
-			sizeb = ag_end - begin;
-			size = roundup(sizeb << BBSHIFT, wbuf_miniosize);
-
-			if (size > 0)  {
-				/* copy extent */
-
-				w_buf.position = (xfs_off_t) begin
-							<< BBSHIFT;
-
-				while (size > 0)  {
-					/*
-					 * let lower layer do alignment
-					 */
-					if (size > w_buf.size)  {
-						w_buf.length = w_buf.size;
-						size -= w_buf.size;
-						sizeb -= wblocks;
-						numblocks += wblocks;
-					} else  {
-						w_buf.length = size;
-						numblocks += sizeb;
-						size = 0;
-					}
-
-					read_wbuf(source_fd, &w_buf, mp);
-#ifndef NO_COPY
-					write_wbuf();
-#endif
-					w_buf.position += w_buf.length;
-
-					while (howfar < 10 && numblocks 
-						> barcount[howfar])  {
-						bump_bar(howfar);
-						howfar++;
-					}
-				}
-			}
-		}
+	for (i = 0; i < num_readers; i++)  {
+		sigrelse(SIGCLD);
+		uspsema(readers_done);
+		sighold(SIGCLD);
 	}
 
+	if (kids > 0)
+		drain_wbufs();
+
 	if (kids > 0)  {
 		if (write_last_block)
 			if (ftruncate64(target_fds[0], mp->m_sb.sb_dblocks *
@@ -1505,7 +1717,8 @@ fprintf(logerr, "\t\tunmounted or mounted read-only.  Copy proceeding...\n");
 			
 		/* reread and rewrite the first ag */
 
-		read_ag_header(source_fd, 0, &w_buf, &ag_hdr, mp,
+		w_buf = get_wbuf();
+		read_ag_header(source_fd, 0, w_buf, &ag_hdr, mp,
 			source_blocksize, source_sectorsize);
 
 		ag_hdr.xfs_sb->sb_inprogress = 0;
@@ -1513,10 +1726,14 @@ fprintf(logerr, "\t\tunmounted or mounted read-only.  Copy proceeding...\n");
 		if (!duplicate_uuids)
 			uuid_copy(ag_hdr.xfs_sb->sb_uuid, fsid);
 
-		write_wbuf();
+		write_wbuf(w_buf);
+		drain_wbufs();
 		bump_bar(10);
 	}
 
+	print_summary(stdout, seconds() - start);
+	print_summary(logerr, seconds() - start);
+
 	check_errors();
 	killall();
 
@@ -35,6 +35,7 @@
 
 #include <sys/stat.h>
 #include <sys/prctl.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -183,10 +184,21 @@ struct context {
 	xfs_ino_t cc_stat_lastino;
 			/* monotonic strm nondir ino dumped
 			 */
+	size64_t cc_stat_nondirdone;
+			/* number of non-directory inodes dumped by strm
+			 */
+	size64_t cc_stat_datadone;
+			/* size in bytes of non-dirs dumped by strm
+			 */
 	bool_t cc_completepr;
 			/* set if stream completely dumped. useful for
 			 * determining if dump was interrupted
 			 */
+	bool_t cc_checkedinpr;
+			/* set when stream is through dumping media files,
+			 * or its process is gone. forked streams wait on
+			 * these before dumping the session inventory
+			 */
 	bool_t cc_Media_useterminatorpr;
 			/* true if stream terminators are expected and
 			 * will be used
@@ -206,11 +218,13 @@ typedef struct context context_t;
 /* extent group context, used by dump_file()
  */
 #define BMAP_LEN	512
+#define READAHEAD_SZ	( 4 * 1024 * 1024 )	/* readahead window */
 
 struct extent_group_context {
 	getbmapx_t eg_bmap[ BMAP_LEN ];
 	getbmapx_t *eg_nextbmapp;	/* ptr to the next extent to dump */
 	getbmapx_t *eg_endbmapp;		/* to detect extent exhaustion */
+	off64_t eg_raoffset;		/* readahead requested up to here */
 	intgen_t eg_fd;			/* file desc. */
 	intgen_t eg_bmapix;		/* debug info only, not used */
 	intgen_t eg_gbmcnt;		/* debug, counts getbmapx calls for ino*/
@@ -255,6 +269,7 @@ extern void usage( void );
 extern bool_t preemptchk( int );
 extern char *homedir;
 extern bool_t miniroot;
+extern pid_t parentpid;
 extern bool_t pipeline;
 extern bool_t stdoutpiped;
 extern char *sistr;
@@ -310,6 +325,7 @@ static rv_t init_extent_group_context( jdm_fshandle_t *,
 				       xfs_bstat_t *,
 				       extent_group_context_t * );
 static void cleanup_extent_group_context( extent_group_context_t * );
+static void extent_group_readahead( extent_group_context_t *, off64_t );
 static rv_t dump_extent_group( drive_t *drivep,
 			       context_t *contextp,
 			       xfs_bstat_t *,
@@ -325,6 +341,7 @@ static bool_t dump_session_inv( drive_t *drivep,
 			        media_hdr_t *mwhdrp,
 			        content_inode_hdr_t *scwhdrp );
 static rv_t write_pad( drive_t *drivep, size_t );
+static size_t streams_checkedin( void );
 
 static void mark_callback( void *, drive_markrec_t *, bool_t );
 
@@ -352,6 +369,7 @@ static void update_cc_Media_useterminatorpr( drive_t *drivep,
 static void set_mcflag( ix_t thrdix );
 static void clr_mcflag( ix_t thrdix );
 
+static void sum_stat_done( size64_t *nondirdonep, size64_t *datadonep );
 static bool_t check_complete_flags( void );
 
 #ifdef EXTATTR
@@ -459,15 +477,9 @@ static pds_t sc_stat_pds[ STREAM_SIMMAX ];
 static size64_t sc_stat_nondircnt = 0;
 	/* total number of non-directory inodes to be dumped (all strms)
 	 */
-static size64_t sc_stat_nondirdone = 0;
-	/* total number of non-directory inodes dumped (all strms)
-	 */
 static size64_t sc_stat_datasz = 0;
 	/* total size in bytes of non-dirs to be dumped (all strms)
 	 */
-static size64_t sc_stat_datadone = 0;
-	/* total size in bytes of non-dirs dumped (all strms)
-	 */
 static size_t sc_thrdsarrivedcnt = 0;
 	/* each thread checks in by bumping this count under lock.
 	 * used to decide when its ok to begin waiting for all threads
@@ -479,7 +491,8 @@ static size_t sc_thrdsdonecnt = 0;
 	 * can proceed with inventory dumps
 	 */
 static context_t *sc_contextp;
-	/* an array of per-stream context descriptors
+	/* an array of per-stream context descriptors. shared with the
+	 * streams when they run as separate processes.
 	 */
 static bool_t sc_mcflag[ STREAM_SIMMAX ];
 	/* media change flag
@@ -1551,8 +1564,21 @@ baseuuidbypass:
 
 	/* allocate and populate per-stream context descriptors
 	 */
-	sc_contextp = ( context_t * )calloc( drivecnt, sizeof( context_t ));
-	ASSERT( sc_contextp );
+	if ( drivecnt > 1 ) {
+		sc_contextp = ( context_t * )mmap( 0,
+						   drivecnt
+						   *
+						   sizeof( context_t ),
+						   PROT_READ | PROT_WRITE,
+						   MAP_SHARED | MAP_ANONYMOUS,
+						   -1,
+						   0 );
+		ASSERT( sc_contextp != ( context_t * )MAP_FAILED );
+	} else {
+		sc_contextp = ( context_t * )calloc( drivecnt,
+						     sizeof( context_t ));
+		ASSERT( sc_contextp );
+	}
 	for ( strmix = 0 ; strmix < drivecnt ; strmix++ ) {
 		context_t *contextp = &sc_contextp[ strmix ];
 
@@ -1900,10 +1926,7 @@ content_statline( char **linespp[ ] )
 
 	/* get the accumulated totals for non-dir inos and data bytes dumped
 	 */
-	lock( );
-	nondirdone = sc_stat_nondirdone;
-	datadone = sc_stat_datadone;
-	unlock( );
+	sum_stat_done( &nondirdone, &datadone );
 
 	/* calculate percentage of data dumped
 	 */
@@ -2180,6 +2203,22 @@ content_stream_dump( ix_t strmix )
 		inv_stmt = INV_TOKEN_NULL;
 	}
 
+	/* if running as a separate process, the inventory files must not
+	 * be shared with the other streams' processes
+	 */
+	if ( inv_stmt != INV_TOKEN_NULL
+	     &&
+	     miniroot
+	     &&
+	     getpid( ) != parentpid ) {
+		if ( ! inv_writesession_detach( sc_inv_sestoken )) {
+			mlog( MLOG_NORMAL | MLOG_WARNING,
+			      "unable to reopen inventory: "
+			      "inventory will not be updated\n" );
+			inv_stmt = INV_TOKEN_NULL;
+		}
+	}
+
 	/* loop, dumping media files, until the entire stream is dumped.
 	 * each time we hit EOM/EOF, repeat the inomap and directory dump.
 	 * dump the non-dirs beginning with the current startpoint.
@@ -2610,6 +2649,7 @@ decision_more:
 	lock( );
 	sc_thrdsdonecnt++;
 	unlock( );
+	content_stream_checkin( strmix );
 
 	/* dump the session inventory and terminator here, if the drive
 	 * supports multiple media files. must wait until all
@@ -2635,6 +2675,18 @@ decision_more:
 			while ( sc_thrdsdonecnt < stream_cnt( )) {
 				sleep( 1 );
 			}
+		} else if ( drivecnt > 1 ) {
+			/* streams in processes of their own share only
+			 * their contexts. a stream which quit early is
+			 * checked in by the parent when it is reaped.
+			 */
+			mlog( MLOG_VERBOSE,
+			      "waiting for synchonized "
+			      "session inventory dump\n" );
+			sc_stat_pds[ strmix ].pds_phase = PDS_INVSYNC;
+			while ( streams_checkedin( ) < drivecnt ) {
+				sleep( 1 );
+			}
 		}
 		/* proceeed
 		 */
@@ -2658,6 +2710,32 @@ decision_more:
 	return EXIT_NORMAL;
 }
 
+/* content_stream_checkin - note that a stream will dump no more media
+ * files. called by the stream, or by the parent when a stream's process
+ * has exited.
+ */
+void
+content_stream_checkin( ix_t strmix )
+{
+	sc_contextp[ strmix ].cc_checkedinpr = BOOL_TRUE;
+}
+
+static size_t
+streams_checkedin( void )
+{
+	size_t cnt;
+	ix_t strmix;
+
+	cnt = 0;
+	for ( strmix = 0 ; strmix < drivecnt ; strmix++ ) {
+		if ( sc_contextp[ strmix ].cc_checkedinpr ) {
+			cnt++;
+		}
+	}
+
+	return cnt;
+}
+
 /* indicates if the dump was complete.
  * easy to tell: initially contextp->cc_completepr is false for each stream.
  * only set true if stream complete. if any stream NOT complete,
@@ -2668,15 +2746,18 @@ content_complete( void )
 {
 	time_t elapsed;
 	bool_t completepr;
+	size64_t nondirdone;
+	size64_t datadone;
 	intgen_t i;
 
 	completepr = check_complete_flags( );
 
 	elapsed = time( 0 ) - sc_stat_starttime;
 
+	sum_stat_done( &nondirdone, &datadone );
 	mlog( MLOG_VERBOSE,
 	      "dump size (non-dir files) : %llu bytes\n",
-	      sc_stat_datadone );
+	      datadone );
 
 	if ( completepr ) {
 		if( sc_savequotas ) {
@@ -3917,9 +3998,7 @@ dump_file( void *arg1,
 				    fshandlep,
 				    statp );
 		if ( statp->bs_ino > contextp->cc_stat_lastino ) {
-			lock( );
-			sc_stat_nondirdone++;
-			unlock( );
+			contextp->cc_stat_nondirdone++;
 			contextp->cc_stat_lastino = statp->bs_ino;
 		}
 		break; /* drop out of switch to extattr dump */
@@ -3937,9 +4016,7 @@ dump_file( void *arg1,
 		 */
 		rv = dump_file_spec( drivep, contextp, fshandlep, statp );
 		if ( statp->bs_ino > contextp->cc_stat_lastino ) {
-			lock( );
-			sc_stat_nondirdone++;
-			unlock( );
+			contextp->cc_stat_nondirdone++;
 			contextp->cc_stat_lastino = statp->bs_ino;
 		}
 		break; /* drop out of switch to extattr dump */
@@ -3948,9 +4025,7 @@ dump_file( void *arg1,
 		/* don't dump these
 		 */
 		if ( statp->bs_ino > contextp->cc_stat_lastino ) {
-			lock( );
-			sc_stat_nondirdone++;
-			unlock( );
+			contextp->cc_stat_nondirdone++;
 			contextp->cc_stat_lastino = statp->bs_ino;
 		}
 		return RV_OK;
@@ -3964,9 +4039,7 @@ dump_file( void *arg1,
 		      statp->bs_ino,
 		      statp->bs_mode );
 		if ( statp->bs_ino > contextp->cc_stat_lastino ) {
-			lock( );
-			sc_stat_nondirdone++;
-			unlock( );
+			contextp->cc_stat_nondirdone++;
 			contextp->cc_stat_lastino = statp->bs_ino;
 		}
 		return RV_OK;
@@ -4176,11 +4249,9 @@ dump_file_reg( drive_t *drivep,
 			break;
 		}
 
-		/* update global stat
+		/* update stream stat
 		 */
-		lock( );
-		sc_stat_datadone += ( size64_t )bc;
-		unlock( );
+		contextp->cc_stat_datadone += ( size64_t )bc;
 
 		/* dump LAST extent hdr. one of these is placed at the
 		 * end of each dumped file. necessary to detect the
@@ -4351,7 +4422,7 @@ init_extent_group_context( jdm_fshandle_t *fshandlep,
 	gcp->eg_bmap[ 0 ].bmv_offset = 0;
 	gcp->eg_bmap[ 0 ].bmv_length = -1;
 	gcp->eg_bmap[ 0 ].bmv_count = BMAP_LEN;
-	gcp->eg_bmap[ 0 ].bmv_iflags = BMV_IF_NO_DMAPI_READ;
+	gcp->eg_bmap[ 0 ].bmv_iflags = BMV_IF_NO_DMAPI_READ | BMV_IF_PREALLOC;
 	gcp->eg_nextbmapp = &gcp->eg_bmap[ 1 ];
 	gcp->eg_endbmapp = &gcp->eg_bmap[ 1 ];
 	gcp->eg_bmapix = 0;
@@ -4361,6 +4432,10 @@ init_extent_group_context( jdm_fshandle_t *fshandlep,
 		return RV_ERROR;
 	}
 
+	/* the file is read once, front to back
+	 */
+	( void )posix_fadvise64( gcp->eg_fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+
 	/* Check if a mandatory lock is set on the file to try and 
 	 * avoid blocking indefinitely on the reads later. Note that
 	 * someone could still set a mandatory lock and hose xfsdump
@@ -4395,6 +4470,55 @@ cleanup_extent_group_context( extent_group_context_t *gcp )
 	( void )close( gcp->eg_fd );
 }
 
+/* extent_group_readahead - ask for the data in the current bmap lying
+ * within READAHEAD_SZ of offset to be read in, so that reading the next
+ * extents overlaps with writing this one to the media. requests are
+ * made half a window at a time.
+ */
+static void
+extent_group_readahead( extent_group_context_t *gcp, off64_t offset )
+{
+	getbmapx_t *bmapp;
+	off64_t endoffset;
+
+	if ( gcp->eg_raoffset >= offset + READAHEAD_SZ / 2 ) {
+		return;
+	}
+	if ( gcp->eg_raoffset < offset ) {
+		gcp->eg_raoffset = offset;
+	}
+	endoffset = offset + READAHEAD_SZ;
+
+	for ( bmapp = gcp->eg_nextbmapp ; bmapp < gcp->eg_endbmapp ; bmapp++ ) {
+		off64_t extoffset;
+		off64_t extend;
+
+		if ( bmapp->bmv_block == -1
+		     ||
+		     bmapp->bmv_length <= 0
+		     ||
+		     ( bmapp->bmv_oflags & BMV_OF_PREALLOC )) {
+			continue;
+		}
+		extoffset = bmapp->bmv_offset * ( off64_t )BBSIZE;
+		extend = extoffset + bmapp->bmv_length * ( off64_t )BBSIZE;
+		if ( extoffset >= endoffset ) {
+			break;
+		}
+		if ( extend <= gcp->eg_raoffset ) {
+			continue;
+		}
+		extoffset = max( extoffset, gcp->eg_raoffset );
+		extend = min( extend, endoffset );
+		( void )posix_fadvise64( gcp->eg_fd,
+					 extoffset,
+					 extend - extoffset,
+					 POSIX_FADV_WILLNEED );
+	}
+
+	gcp->eg_raoffset = endoffset;
+}
+
 static rv_t
 dump_extent_group( drive_t *drivep,
 		   context_t *contextp,
@@ -4442,6 +4566,7 @@ dump_extent_group( drive_t *drivep,
 	ASSERT( ( nextoffset & ( BBSIZE - 1 )) == 0 );
 
 	for ( ; ; ) {
+		getbmapx_t *bmapp;
 		off64_t offset;
 		off64_t extsz;
 
@@ -4573,8 +4698,12 @@ dump_extent_group( drive_t *drivep,
 		/* if the next bmap entry represents a hole, go to the next
 		 * one in the bmap, and rescan to check above assumptions.
 		 * bump nextoffset to after the hole, if beyond current value.
+		 * unwritten preallocated extents read as zeros, so are
+		 * dumped as holes.
 		 */
-		if ( gcp->eg_nextbmapp->bmv_block == -1 ) {
+		if ( gcp->eg_nextbmapp->bmv_block == -1
+		     ||
+		     ( gcp->eg_nextbmapp->bmv_oflags & BMV_OF_PREALLOC )) {
 			off64_t tmpoffset;
 
 #ifdef EXTATTR
@@ -4652,6 +4781,28 @@ dump_extent_group( drive_t *drivep,
 		 */
 		offset = gcp->eg_nextbmapp->bmv_offset * ( off64_t )BBSIZE;
 		extsz = gcp->eg_nextbmapp->bmv_length * ( off64_t )BBSIZE;
+
+		/* take in the data extents which directly follow this one
+		 * in the file, so they are read and dumped as one.
+		 */
+		for ( bmapp = gcp->eg_nextbmapp + 1
+		      ;
+		      bmapp < gcp->eg_endbmapp
+		      ;
+		      bmapp++ ) {
+			if ( bmapp->bmv_block == -1
+			     ||
+			     bmapp->bmv_length <= 0
+			     ||
+			     ( bmapp->bmv_oflags & BMV_OF_PREALLOC )
+			     ||
+			     bmapp->bmv_offset * ( off64_t )BBSIZE
+			     !=
+			     offset + extsz ) {
+				break;
+			}
+			extsz += bmapp->bmv_length * ( off64_t )BBSIZE;
+		}
 		mlog( MLOG_NITTY,
 		      "extent offset %lld sz %lld; nextoffset %lld\n",
 		      offset,
@@ -4869,8 +5020,8 @@ dump_extent_group( drive_t *drivep,
 		 * asked for, pad out the extent with zeros. necessary
 		 * because the extent hdr is already out there!
 		 */
+		extent_group_readahead( gcp, offset );
 		while ( extsz ) {
-			off64_t new_off;
 			intgen_t nread;
 			size_t reqsz;
 			size_t actualsz;
@@ -4885,15 +5036,7 @@ dump_extent_group( drive_t *drivep,
 							    reqsz,
 							    &actualsz );
 			ASSERT( actualsz <= reqsz );
-			new_off = lseek64( gcp->eg_fd, offset, SEEK_SET );
-			if ( new_off == ( off64_t )( -1 )) {
-				mlog( MLOG_NORMAL,
-				      "can't lseek ino %llu\n",
-				      statp->bs_ino );
-				nread = 0;
-			} else {
-				nread = read( gcp->eg_fd, bufp, actualsz);
-			}
+			nread = pread64( gcp->eg_fd, bufp, actualsz, offset );
 			if ( nread < 0 ) {
 #ifdef HIDDEN
 				struct statvfs64 s;
@@ -4903,7 +5046,7 @@ dump_extent_group( drive_t *drivep,
 				     ((s.f_flag & ST_LOCAL) != 0) )
 				   mlog( MLOG_NORMAL,
 		"can't read ino %llu at offset %d (act=%d req=%d) rt=%d\n",
-		statp->bs_ino, new_off, actualsz , reqsz, isrealtime );
+		statp->bs_ino, offset, actualsz , reqsz, isrealtime );
 #endif /* HIDDEN */
 
 				nread = 0;
@@ -6617,6 +6760,25 @@ check_complete_flags( void )
 	return completepr;
 }
 
+/* sum_stat_done - totals the progress counters kept by each stream
+ */
+static void
+sum_stat_done( size64_t *nondirdonep, size64_t *datadonep )
+{
+	ix_t strmix;
+
+	*nondirdonep = 0;
+	*datadonep = 0;
+	if ( ! sc_contextp ) {
+		return;
+	}
+	for ( strmix = 0 ; strmix < drivecnt ; strmix++ ) {
+		context_t *contextp = &sc_contextp[ strmix ];
+		*nondirdonep += contextp->cc_stat_nondirdone;
+		*datadonep += contextp->cc_stat_datadone;
+	}
+}
+
 /* on linux we use xfsdq instead of repquota */
 #define REPQUOTA "xfsdq"
 
@@ -37,6 +37,8 @@
 #include <errno.h>
 #include <time.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 
 #include "types.h"
@@ -65,10 +67,45 @@
 	/* size (in bytes) of buf passed to diriter (when not recursive)
 	 */
 
+#define ADDTHRDMAX	8
+	/* max number of threads scanning the fs in phase 2
+	 */
+
+#define ADDDONEFLUSH	1024
+	/* inos a phase 2 thread counts before updating *inomap_statdonep
+	 */
+
+/* context for one ino range of the phase 2 scan. when the scan is split
+ * across threads, each range builds a private array of map segments and
+ * private counts, merged into the inomap by cb_add_merge() in ino order.
+ */
+struct addctx {
+	xfs_ino_t ac_startino;	/* first ino of range */
+	xfs_ino_t ac_endino;	/* first ino past range; 0 if unbounded */
+	bool_t ac_threaded;	/* add to ac_segp rather than the inomap */
+	bool_t ac_pruneneeded;
+	off64_t ac_dircnt;
+	off64_t ac_nondircnt;
+	off64_t ac_datasz;
+	off64_t ac_hdrsz;
+	size64_t ac_done;	/* inos not yet counted in *inomap_statdonep */
+	seg_t *ac_segp;
+	size_t ac_segcnt;
+	size_t ac_segmax;
+	jdm_fshandle_t *ac_fshandlep;
+	intgen_t ac_fsfd;
+	intgen_t ac_rval;	/* return from bigstat_iter() */
+	bool_t ac_joinable;
+	pthread_t ac_thread;
+};
+
+typedef struct addctx addctx_t;
+
 /* declarations of externally defined global symbols *************************/
 
 extern bool_t preemptchk( int );
 extern size_t pgsz;
+extern bool_t miniroot;
 #ifdef DMEXTATTR
 extern hsm_fs_ctxt_t *hsm_fs_ctxtp;
 #endif /* DMEXTATTR */
@@ -91,6 +128,16 @@ static void cb_context( bool_t last,
 			size_t );
 static void cb_postmortem( void );
 static intgen_t cb_add( void *, jdm_fshandle_t *, intgen_t, xfs_bstat_t * );
+static void cb_add_map( addctx_t *, xfs_ino_t, intgen_t );
+static intgen_t cb_add_scan( jdm_fshandle_t *,
+			     intgen_t,
+			     bool_t *,
+			     xfs_bstat_t *,
+			     size_t );
+static size_t cb_add_rangecnt( intgen_t, size_t *, intgen_t * );
+static void *cb_add_thread( void * );
+static void cb_add_merge( addctx_t * );
+static void cb_add_fold( addctx_t *, bool_t * );
 static bool_t cb_inoinresumerange( xfs_ino_t );
 static bool_t cb_inoresumed( xfs_ino_t );
 static intgen_t cb_prune( void *, jdm_fshandle_t *, intgen_t,  xfs_bstat_t * );
@@ -118,10 +165,6 @@ static intgen_t cb_del( void *,
 			char * );
 static void cb_accuminit_sz( void );
 static void cb_accuminit_ctx( void * );
-static intgen_t cb_accumulate( void *,
-			       jdm_fshandle_t *,
-			       intgen_t,
-			       xfs_bstat_t * );
 static void cb_spinit( void );
 static intgen_t cb_startpt( void *,
 			    jdm_fshandle_t *,
@@ -129,6 +172,7 @@ static intgen_t cb_startpt( void *,
 			    xfs_bstat_t * );
 static off64_t quantity2offset( jdm_fshandle_t *, xfs_bstat_t *, off64_t );
 static off64_t estimate_dump_space( xfs_bstat_t * );
+static off64_t estimate_hdr_space( xfs_bstat_t * );
 
 /* inomap primitives
  */
@@ -273,7 +317,8 @@ inomap_build( jdm_fshandle_t *fshandlep,
 	 * to represent the minimal tree containing only changes will remain.
 	 * the bigstat iterator is used here, along with a inomap constructor
 	 * callback. set a flag if any ino not put in a dump state. This will
-	 * be used to decide if any pruning can be done.
+	 * be used to decide if any pruning can be done. the scan is split
+	 * by allocation group across several threads if possible.
 	 */
 	mlog( MLOG_VERBOSE | MLOG_INOMAP,
 	      "ino map phase 2: "
@@ -281,18 +326,12 @@ inomap_build( jdm_fshandle_t *fshandlep,
 	*inomap_statdonep = 0;
 	*inomap_statphasep = 2;
 	pruneneeded = BOOL_FALSE;
-	stat = 0;
 	cb_accuminit_sz( );
-	rval = bigstat_iter( fshandlep,
-			     fsfd,
-			     BIGSTAT_ITER_ALL,
-			     ( xfs_ino_t )0,
-			     cb_add,
-			     ( void * )&pruneneeded,
-			     &stat,
-			     preemptchk,
-			     bstatbufp,
-			     bstatbuflen );
+	rval = cb_add_scan( fshandlep,
+			    fsfd,
+			    &pruneneeded,
+			    bstatbufp,
+			    bstatbuflen );
 	*inomap_statphasep = 0;
 	if ( rval ) {
 		free( ( void * )bstatbufp );
@@ -388,50 +427,13 @@ inomap_build( jdm_fshandle_t *fshandlep,
 
 	cb_accuminit_ctx( inomap_state_contextp );
 
-	/* calculate the total dump space needed for non-directories.
-	 * no needed if no pruning was done, since already done during
-	 * phase 2.
+	/* the total dump space needed for non-directories was summed
+	 * during phase 2, and cb_del() subtracts each file pruned in
+	 * phase 3, so no further scan is needed.
 	 */
-	if ( pruneneeded || subtreecnt > 0 ) {
-		cb_accuminit_sz( );
-
-		mlog( MLOG_VERBOSE | MLOG_INOMAP,
-		      "ino map phase 4: "
-		      "estimating dump size\n" );
-		*inomap_statdonep = 0;
-		*inomap_statphasep = 4;
-		stat = 0;
-		rval = bigstat_iter( fshandlep,
-				     fsfd,
-				     BIGSTAT_ITER_NONDIR,
-				     ( xfs_ino_t )0,
-				     cb_accumulate,
-				     0,
-				     &stat,
-				     preemptchk,
-				     bstatbufp,
-				     bstatbuflen );
-		*inomap_statphasep = 0;
-		if ( rval ) {
-			inomap_state_freecontext( inomap_state_contextp );
-			free( ( void * )bstatbufp );
-			free( ( void * )getdentbufp );
-			return BOOL_FALSE;
-		}
-
-		if ( preemptchk( PREEMPT_FULL )) {
-			inomap_state_freecontext( inomap_state_contextp );
-			free( ( void * )bstatbufp );
-			free( ( void * )getdentbufp );
-			return BOOL_FALSE;
-		}
-
-		inomap_state_postaccum( inomap_state_contextp );
-	} else {
-		mlog( MLOG_VERBOSE | MLOG_INOMAP,
-		      "ino map phase 4: "
-		      "skipping (size estimated in phase 2)\n" );
-	}
+	mlog( MLOG_VERBOSE | MLOG_INOMAP,
+	      "ino map phase 4: "
+	      "skipping (size estimated in phase 2)\n" );
 
 	/* initialize the callback context for startpoint calculation
 	 */
@@ -545,6 +547,7 @@ static startpt_t *cb_startptp;	/* set by cb_context() */
 static size_t cb_startptcnt;	/* set by cb_context() */
 static size_t cb_startptix;	/* set by cb_spinit(), incr. by cb_startpt */
 static off64_t cb_datasz;	/* set by cb_context() */
+static off64_t cb_hdrsz;	/* set by cb_context() */
 static off64_t cb_accum;	/* set by cb_context(), cb_spinit() */
 static off64_t cb_incr;		/* set by cb_spinit(), used by cb_startpt() */
 static off64_t cb_target;	/* set by cb_spinit(), used by cb_startpt() */
@@ -553,6 +556,10 @@ static off64_t cb_nondircnt;	/* number of non-dirs CHANGED */
 static char *cb_getdentbufp;
 static size_t cb_getdentbufsz;
 static size_t cb_maxrecursionlevel;
+static pthread_mutex_t cb_addlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cb_addcond = PTHREAD_COND_INITIALIZER;
+static size_t cb_addrunning;	/* phase 2 threads not yet done */
+static volatile bool_t cb_addabort; /* set by cb_add_scan() on interrupt */
 
 /* cb_context - initializes the call back context for the add and prune
  * phases of inomap_build().
@@ -600,7 +607,9 @@ cb_postmortem( void )
 /* cb_add - called for all inodes in the file system. checks
  * mod and create times to decide if should be dumped. sets all
  * unmodified directories to be dumped for supprt. notes if any
- * files or directories have not been modified.
+ * files or directories have not been modified. arg1 is the addctx_t
+ * of the ino range being scanned; counts are kept there and folded
+ * into the cb_ globals by cb_add_fold().
  */
 /* ARGSUSED */
 static intgen_t
@@ -609,6 +618,7 @@ cb_add( void *arg1,
 	intgen_t fsfd,
 	xfs_bstat_t *statp )
 {
+	register addctx_t *ap = ( addctx_t * )arg1;
 	register time_t mtime = statp->bs_mtime.tv_sec;
 	register time_t ctime = statp->bs_ctime.tv_sec;
 	register time_t ltime = max( mtime, ctime );
@@ -617,7 +627,25 @@ cb_add( void *arg1,
 	bool_t changed;
 	bool_t resumed;
 
-	( *inomap_statdonep )++;
+	/* stop at the end of this range; the next belongs to another thread
+	 */
+	if ( ap->ac_endino && ino >= ap->ac_endino ) {
+		return 1;
+	}
+
+	if ( ap->ac_threaded ) {
+		if ( cb_addabort ) {
+			return 1;
+		}
+		if ( ++ap->ac_done >= ADDDONEFLUSH ) {
+			pthread_mutex_lock( &cb_addlock );
+			*inomap_statdonep += ap->ac_done;
+			pthread_mutex_unlock( &cb_addlock );
+			ap->ac_done = 0;
+		}
+	} else {
+		( *inomap_statdonep )++;
+	}
 
 	/* skip if no links
 	 */
@@ -661,30 +689,330 @@ cb_add( void *arg1,
 
 	if ( changed ) {
 		if ( mode == S_IFDIR ) {
-			map_add( ino, MAP_DIR_CHANGE );
-			cb_dircnt++;
+			cb_add_map( ap, ino, MAP_DIR_CHANGE );
+			ap->ac_dircnt++;
 		} else {
-			map_add( ino, MAP_NDR_CHANGE );
-			cb_nondircnt++;
-			cb_datasz += estimate_dump_space( statp );
+			cb_add_map( ap, ino, MAP_NDR_CHANGE );
+			ap->ac_nondircnt++;
+			ap->ac_datasz += estimate_dump_space( statp );
+			ap->ac_hdrsz += estimate_hdr_space( statp );
 		}
 	} else if ( resumed ) {
 		ASSERT( mode != S_IFDIR );
 		ASSERT( changed );
 	} else {
 		if ( mode == S_IFDIR ) {
-			register bool_t *pruneneededp = ( bool_t * )arg1;
-			*pruneneededp = BOOL_TRUE;
-			map_add( ino, MAP_DIR_SUPPRT );
-			cb_dircnt++;
+			ap->ac_pruneneeded = BOOL_TRUE;
+			cb_add_map( ap, ino, MAP_DIR_SUPPRT );
+			ap->ac_dircnt++;
+		} else {
+			cb_add_map( ap, ino, MAP_NDR_NOCHNG );
+		}
+	}
+
+	return 0;
+}
+
+/* cb_add_map - adds an ino to the inomap, or to the private segment
+ * array of a threaded range. mirrors map_add().
+ */
+static void
+cb_add_map( addctx_t *ap, xfs_ino_t ino, intgen_t state )
+{
+	seg_t *segp;
+
+	if ( ! ap->ac_threaded ) {
+		map_add( ino, state );
+		return;
+	}
+
+	if ( ap->ac_segcnt ) {
+		segp = &ap->ac_segp[ ap->ac_segcnt - 1 ];
+		ASSERT( ino > segp->base );
+	} else {
+		segp = 0;
+	}
+	if ( ! segp || ino >= segp->base + INOPERSEG ) {
+		if ( ap->ac_segcnt == ap->ac_segmax ) {
+			ap->ac_segmax = ap->ac_segmax ?
+					ap->ac_segmax * 2 : SEGPERHNK;
+			ap->ac_segp = ( seg_t * )realloc( ( void * )ap->ac_segp,
+					      ap->ac_segmax * sizeof( seg_t ));
+			ASSERT( ap->ac_segp );
+		}
+		segp = &ap->ac_segp[ ap->ac_segcnt++ ];
+		memset( ( void * )segp, 0, sizeof( seg_t ));
+		SEG_SET_BASE( segp, ino );
+	}
+	SEG_ADD_BITS( segp, ino, state );
+}
+
+/* cb_add_scan - phase 2 of inomap_build(). if the fs has several
+ * allocation groups and we have several cpus, the ino space is split
+ * into contiguous runs of AGs, each scanned by its own thread with its
+ * own bulkstat buffer. the caller's thread keeps the progress display
+ * and interrupt checks going meanwhile, then merges the ranges into the
+ * inomap in ino order, as map_add() requires. otherwise scans serially.
+ */
+static intgen_t
+cb_add_scan( jdm_fshandle_t *fshandlep,
+	     intgen_t fsfd,
+	     bool_t *pruneneededp,
+	     xfs_bstat_t *bstatbufp,
+	     size_t bstatbuflen )
+{
+	addctx_t *addctxp;
+	addctx_t *ap;
+	size_t rangecnt;
+	size_t rangeix;
+	size_t agcnt;
+	intgen_t aginolog;
+	intgen_t stat;
+	intgen_t rval;
+
+	rangecnt = cb_add_rangecnt( fsfd, &agcnt, &aginolog );
+	if ( rangecnt <= 1 ) {
+		addctx_t addctx;
+
+		memset( ( void * )&addctx, 0, sizeof( addctx ));
+		stat = 0;
+		rval = bigstat_iter( fshandlep,
+				     fsfd,
+				     BIGSTAT_ITER_ALL,
+				     ( xfs_ino_t )0,
+				     cb_add,
+				     ( void * )&addctx,
+				     &stat,
+				     preemptchk,
+				     bstatbufp,
+				     bstatbuflen );
+		cb_add_fold( &addctx, pruneneededp );
+		return rval;
+	}
+
+	mlog( MLOG_VERBOSE | MLOG_INOMAP,
+	      "scanning %u allocation groups with %u threads\n",
+	      ( unsigned int )agcnt,
+	      ( unsigned int )rangecnt );
+
+	addctxp = ( addctx_t * )calloc( rangecnt, sizeof( addctx_t ));
+	ASSERT( addctxp );
+	for ( rangeix = 0 ; rangeix < rangecnt ; rangeix++ ) {
+		ap = &addctxp[ rangeix ];
+		ap->ac_startino = ( xfs_ino_t )( rangeix * agcnt / rangecnt )
+				  <<
+				  aginolog;
+		if ( rangeix < rangecnt - 1 ) {
+			ap->ac_endino = ( xfs_ino_t )( ( rangeix + 1 )
+						       * agcnt / rangecnt )
+					<<
+					aginolog;
+		}
+		ap->ac_threaded = BOOL_TRUE;
+		ap->ac_fshandlep = fshandlep;
+		ap->ac_fsfd = fsfd;
+	}
+
+	cb_addabort = BOOL_FALSE;
+	cb_addrunning = rangecnt;
+	for ( rangeix = 0 ; rangeix < rangecnt ; rangeix++ ) {
+		ap = &addctxp[ rangeix ];
+		rval = pthread_create( &ap->ac_thread,
+				       0,
+				       cb_add_thread,
+				       ( void * )ap );
+		if ( rval ) {
+			mlog( MLOG_VERBOSE | MLOG_WARNING | MLOG_INOMAP,
+			      "unable to create inomap thread: %s: "
+			      "scanning range inline\n",
+			      strerror( rval ));
+			( void )cb_add_thread( ( void * )ap );
 		} else {
-			map_add( ino, MAP_NDR_NOCHNG );
+			ap->ac_joinable = BOOL_TRUE;
+		}
+	}
+
+	/* wait for the threads, polling for interrupts once a second
+	 */
+	pthread_mutex_lock( &cb_addlock );
+	while ( cb_addrunning > 0 ) {
+		struct timespec ts;
+
+		clock_gettime( CLOCK_REALTIME, &ts );
+		ts.tv_sec++;
+		( void )pthread_cond_timedwait( &cb_addcond, &cb_addlock, &ts );
+		pthread_mutex_unlock( &cb_addlock );
+		( void )preemptchk( PREEMPT_PROGRESSONLY );
+		if ( ! cb_addabort && preemptchk( PREEMPT_FULL )) {
+			cb_addabort = BOOL_TRUE;
+		}
+		pthread_mutex_lock( &cb_addlock );
+	}
+	pthread_mutex_unlock( &cb_addlock );
+
+	rval = 0;
+	for ( rangeix = 0 ; rangeix < rangecnt ; rangeix++ ) {
+		ap = &addctxp[ rangeix ];
+		if ( ap->ac_joinable ) {
+			( void )pthread_join( ap->ac_thread, 0 );
 		}
+		if ( ! rval ) {
+			rval = ap->ac_rval;
+		}
+		if ( ! rval && ! cb_addabort ) {
+			cb_add_merge( ap );
+			cb_add_fold( ap, pruneneededp );
+		}
+		if ( ap->ac_segp ) {
+			free( ( void * )ap->ac_segp );
+		}
+	}
+	free( ( void * )addctxp );
+
+	if ( ! rval && cb_addabort ) {
+		rval = EINTR;
+	}
+
+	return rval;
+}
+
+/* cb_add_rangecnt - decides how many threads should share the phase 2
+ * scan. returns by reference the AG count and the log2 of the number
+ * of inos an AG can hold, from which the AG's first ino is derived.
+ */
+static size_t
+cb_add_rangecnt( intgen_t fsfd, size_t *agcntp, intgen_t *aginologp )
+{
+	xfs_fsop_geom_t geo;
+	intgen_t agblklog;
+	intgen_t inopblog;
+	long cpucnt;
+	size_t rangecnt;
+
+	if ( miniroot ) {
+		return 1;
+	}
+#ifdef DMEXTATTR
+	/* the HSM estimate may not be safe to call from several threads
+	 */
+	if ( hsm_fs_ctxtp ) {
+		return 1;
+	}
+#endif /* DMEXTATTR */
+
+	if ( ioctl( fsfd, XFS_IOC_FSGEOMETRY, &geo ) < 0 ) {
+		return 1;
+	}
+	cpucnt = sysconf( _SC_NPROCESSORS_ONLN );
+	if ( cpucnt <= 1 || geo.agcount <= 1 ) {
+		return 1;
+	}
+
+	for ( agblklog = 0
+	      ;
+	      ( ( u_int64_t )1 << agblklog ) < ( u_int64_t )geo.agblocks
+	      ;
+	      agblklog++ )
+		;
+	for ( inopblog = 0
+	      ;
+	      ( geo.inodesize << inopblog ) < geo.blocksize
+	      ;
+	      inopblog++ )
+		;
+
+	rangecnt = ( size_t )cpucnt;
+	if ( rangecnt > ADDTHRDMAX ) {
+		rangecnt = ADDTHRDMAX;
+	}
+	if ( rangecnt > ( size_t )geo.agcount ) {
+		rangecnt = ( size_t )geo.agcount;
 	}
 
+	*agcntp = ( size_t )geo.agcount;
+	*aginologp = agblklog + inopblog;
+	return rangecnt;
+}
+
+/* cb_add_thread - scans one ino range of phase 2. uses a private
+ * bulkstat buffer, and leaves interrupt checks to cb_add_scan().
+ */
+static void *
+cb_add_thread( void *arg )
+{
+	addctx_t *ap = ( addctx_t * )arg;
+	xfs_bstat_t *bstatbufp;
+	size_t bstatbuflen;
+	intgen_t stat;
+
+	bstatbuflen = BSTATBUFLEN;
+	bstatbufp = ( xfs_bstat_t * )malloc( bstatbuflen
+					      *
+					      sizeof( xfs_bstat_t ));
+	ASSERT( bstatbufp );
+
+	stat = 0;
+	ap->ac_rval = bigstat_iter( ap->ac_fshandlep,
+				    ap->ac_fsfd,
+				    BIGSTAT_ITER_ALL,
+				    ap->ac_startino,
+				    cb_add,
+				    ( void * )ap,
+				    &stat,
+				    0,
+				    bstatbufp,
+				    bstatbuflen );
+	free( ( void * )bstatbufp );
+
+	pthread_mutex_lock( &cb_addlock );
+	*inomap_statdonep += ap->ac_done;
+	ap->ac_done = 0;
+	cb_addrunning--;
+	pthread_cond_signal( &cb_addcond );
+	pthread_mutex_unlock( &cb_addlock );
+
 	return 0;
 }
 
+/* cb_add_merge - adds the inos of a threaded range to the inomap.
+ * must be called for each range in ino order.
+ */
+static void
+cb_add_merge( addctx_t *ap )
+{
+	seg_t *segp;
+	seg_t *endsegp;
+	xfs_ino_t ino;
+	intgen_t state;
+
+	for ( segp = ap->ac_segp, endsegp = segp + ap->ac_segcnt
+	      ;
+	      segp < endsegp
+	      ;
+	      segp++ ) {
+		for ( ino = segp->base ; ino < segp->base + INOPERSEG ; ino++ ) {
+			SEG_GET_BITS( segp, ino, state );
+			if ( state != MAP_INO_UNUSED ) {
+				map_add( ino, state );
+			}
+		}
+	}
+}
+
+/* cb_add_fold - adds the counts of a scanned range to the cb_ globals
+ */
+static void
+cb_add_fold( addctx_t *ap, bool_t *pruneneededp )
+{
+	if ( ap->ac_pruneneeded ) {
+		*pruneneededp = BOOL_TRUE;
+	}
+	cb_dircnt += ap->ac_dircnt;
+	cb_nondircnt += ap->ac_nondircnt;
+	cb_datasz += ap->ac_datasz;
+	cb_hdrsz += ap->ac_hdrsz;
+}
+
 static bool_t
 cb_inoinresumerange( xfs_ino_t ino )
 {
@@ -942,6 +1270,8 @@ cb_del( void *arg1,
 		cb_dircnt--;
 	} else if ( oldstate == MAP_NDR_CHANGE ) {
 		cb_nondircnt--;
+		cb_datasz -= estimate_dump_space( statp );
+		cb_hdrsz -= estimate_hdr_space( statp );
 	}
 
 	return 0;
@@ -951,6 +1281,7 @@ static void
 cb_accuminit_sz( void )
 {
 	cb_datasz = 0;
+	cb_hdrsz = 0;
 }
 
 static void
@@ -959,37 +1290,11 @@ cb_accuminit_ctx( void *inomap_state_contextp )
 	cb_inomap_state_contextp = inomap_state_contextp;
 }
 
-/* used by inomap_build() to add up the dump space needed for
- * all non-directory files.
- */
-/* ARGSUSED */
-static intgen_t
-cb_accumulate( void *arg1,
-	       jdm_fshandle_t *fshandlep,
-	       intgen_t fsfd,
-	       xfs_bstat_t *statp )
-{
-	register intgen_t state;
-
-	( *inomap_statdonep )++;
-
-	/* skip if no links
-	 */
-	if ( statp->bs_nlink == 0 ) {
-		return 0;
-	}
-
-	state = inomap_state( cb_inomap_state_contextp, statp->bs_ino );
-	if ( state == MAP_NDR_CHANGE ) {
-		cb_datasz += estimate_dump_space( statp );
-	}
-
-	return 0;
-}
-
 /* cb_spinit - initializes context for the startpoint calculation phase of
  * inomap_build. cb_startptix is the index of the next startpoint to
- * record. cb_incr is the dump space distance between each startpoint.
+ * record. cb_incr is the dump space distance between each startpoint,
+ * counting file and extent headers as well as data, so each stream
+ * gets about the same number of bytes to write.
  * cb_target is the target accum value for the next startpoint.
  * cb_accum accumulates the dump space.
  */
@@ -997,7 +1302,7 @@ static void
 cb_spinit( void )
 {
 	cb_startptix = 0;
-	cb_incr = cb_datasz / ( off64_t )cb_startptcnt;
+	cb_incr = ( cb_datasz + cb_hdrsz ) / ( off64_t )cb_startptcnt;
 	cb_target = 0; /* so first ino will push us over the edge */
 	cb_accum = 0;
 }
@@ -1050,7 +1355,7 @@ cb_startpt( void *arg1,
 
 	ASSERT( cb_startptix < cb_startptcnt );
 
-	estimate = estimate_dump_space( statp );
+	estimate = estimate_dump_space( statp ) + estimate_hdr_space( statp );
 	cb_accum += estimate;
 
 	/* loop until no new start points found. loop is necessary
@@ -2046,3 +2351,21 @@ estimate_dump_space( xfs_bstat_t *statp )
 		return 0;
 	}
 }
+
+/* estimate_hdr_space - the headers dumped with each non-directory file:
+ * a file header, plus an extent header for each extent and one to mark
+ * the end. for small files these outweigh the data.
+ */
+static off64_t
+estimate_hdr_space( xfs_bstat_t *statp )
+{
+	switch ( statp->bs_mode & S_IFMT ) {
+	case S_IFREG:
+	case S_IFLNK:
+		return FILEHDR_SZ
+		       +
+		       ( off64_t )( statp->bs_extents + 1 ) * EXTENTHDR_SZ;
+	default:
+		return FILEHDR_SZ;
+	}
+}
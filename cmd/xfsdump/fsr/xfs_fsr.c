@@ -66,6 +66,7 @@
 #include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <sys/time.h>
 #include <sys/vfs.h>
 #include <sys/statvfs.h>
 #include <attributes.h>
@@ -81,6 +82,11 @@ int argv_blksz_dio;
 extern int max_ext_size;
 static int npasses = 10;
 static int startpass = 0;
+static int nworkers = 1;		/* files reorganized at once */
+static int ncopiers = 1;		/* processes sharing the -r limit */
+static int cflag;			/* compact free space instead */
+static int compacting;			/* moving files, not packing them */
+static int ratelimit = 0;		/* MB/s copied, 0 for no limit */
 
 struct getbmap  *outmap = NULL;
 int             outmap_size = 0;
@@ -101,6 +107,40 @@ static __int64_t	minimumfree = 2048;
 #define BUFFER_MAX	(1<<24)
 #define min(x, y) ((x) < (y) ? (x) : (y))
 
+/*
+ * A file worth reorganizing, and how badly it needs it.
+ */
+typedef struct fsrcand {
+	xfs_ino_t	ino;
+	double		rank;		/* extents per megabyte of data */
+} fsrcand_t;
+
+/*
+ * Free space in one AG by power-of-two size class, as the by-size
+ * free space btree on disk showed it at the start of the pass.
+ */
+#define	FREESP_NCLASS	32
+typedef struct agfree {
+	__uint64_t	count[FREESP_NCLASS];	/* free extents in class */
+	__uint64_t	blocks[FREESP_NCLASS];	/* free blocks in class */
+	char		*tmpdir;		/* temp directory in this AG */
+} agfree_t;
+
+/*
+ * Free space compaction works on fixed slices of each AG, and moves
+ * the small files out of the slices whose free space is most broken
+ * up so that it can merge into large runs.
+ */
+#define	COMPACT_NREGIONS	64	/* slices per AG */
+#define	COMPACT_MINEXTS		8	/* free extents to be worth it */
+typedef struct region {
+	__uint32_t	agno;
+	xfs_agblock_t	start;
+	__uint64_t	nfree;		/* free extents starting here */
+	__uint64_t	freeblks;	/* blocks in them */
+	int		target;		/* files here are to be moved */
+} region_t;
+
 static time_t howlong = 7200;		/* default seconds of reorganizing */
 static char *leftofffile = "/var/tmp/.fsrlast_xfs";/* where we left off last */
 static char *mtab = MOUNTED;
@@ -109,6 +149,7 @@ static time_t endtime;
 static time_t starttime;
 static xfs_ino_t	leftoffino = 0;
 static int	pagesize;
+static agfree_t	*agfree;		/* per-AG free space, if known */
 
 void usage(int ret);
 static int  fsrfile(char *fname, xfs_ino_t ino);
@@ -117,7 +158,11 @@ static int  fsrfile_common( char *fname, char *tname, char *mnt,
 static int  packfile(char *fname, char *tname, int fd, 
                      xfs_bstat_t *statp, int flag);
 static void fsrdir(char *dirname);
-static int  fsrfs(char *mntdir, xfs_ino_t ino, int targetrange);
+static int  fsrfs(char *mntdir, int targetrange);
+static int  fsrcompact(char *mntdir);
+static int  fsrfs_worker(char *mntdir, int fsfd, jdm_fshandle_t *fshandlep,
+			 fsrcand_t *cand, int ncand, int worker);
+static void throttle(struct timeval *start, off64_t copied);
 static void initallfs(char *mtab);
 static void fsrallfs(int howlong, char *leftofffile);
 static void fsrall_cleanup(int timeout);
@@ -131,6 +176,21 @@ int read_fd_bmap(int, xfs_bstat_t *, int *);
 int cmp(const void *, const void *);
 static void tmp_init(char *mnt);
 static char * tmp_next(char *mnt);
+static char * tmp_place(char *mnt, xfs_bstat_t *statp, int avoidag);
+static void freesp_init(char *mnt);
+static void freesp_free(void);
+static void freesp_class(__uint32_t agno, xfs_agblock_t bno, xfs_extlen_t len,
+			 void *arg);
+static int  freesp_walk(int fd, __uint32_t agno, int btnum,
+			void (*fn)(__uint32_t, xfs_agblock_t, xfs_extlen_t,
+				   void *), void *arg);
+static void freesp_report(char *mnt, char *when);
+static int  freesp_open(char *mnt);
+static void region_count(__uint32_t agno, xfs_agblock_t bno, xfs_extlen_t len,
+			 void *arg);
+static int  region_cmp(const void *, const void *);
+static int  region_pinned(int fd, region_t *regions);
+static int  freesp_extents(agfree_t *af, __uint64_t blocks, int take);
 static void tmp_close(char *mnt);
 int xfs_getgeom(int , xfs_fsop_geom_t * );
 static int getmntany (FILE *, struct mntent *, struct mntent *);
@@ -219,11 +279,14 @@ main(int argc, char **argv)
 
 	gflag = ! isatty(0);
 
-	while ((c = getopt(argc, argv, "C:p:e:MgsdnvTt:f:m:b:N:FV")) != -1 )
+	while ((c = getopt(argc, argv, "C:p:e:McgsdnvTt:f:m:b:N:FVj:r:")) != -1 )
 		switch (c) {
 		case 'M':
 			Mflag = 1;
 			break;
+		case 'c':
+			cflag = 1;
+			break;
 		case 'g':
 			gflag = 1;
 			break;
@@ -257,6 +320,13 @@ main(int argc, char **argv)
 		case 'p':
 			npasses = atoi(optarg);
 			break;
+		case 'j':
+			if ((nworkers = atoi(optarg)) < 1)
+				usage(1);
+			break;
+		case 'r':
+			ratelimit = atoi(optarg);
+			break;
 		case 'V':
 			printf("%s version %s\n", progname, VERSION);
 			break;
@@ -319,7 +389,10 @@ main(int argc, char **argv)
 				}
 			}
 			if (mntp != NULL) {
-				fsrfs(mntp->mnt_dir, 0, 100);
+				if (cflag)
+					fsrcompact(mntp->mnt_dir);
+				else
+					fsrfs(mntp->mnt_dir, 100);
 			} else if (S_ISCHR(sb.st_mode)) {
 				fprintf(stderr, 
 					"%s: char special not supported: %s\n",
@@ -458,7 +531,6 @@ fsrallfs(int howlong, char *leftofffile)
 	char buf[SMBUFSZ];
 	int mdonly = Mflag;
 	char *ptr;
-	xfs_ino_t startino = 0;
 	fsdesc_t *fsp;
 	
 	fsrprintf("xfs_fsr -m %s -t %d -f %s ...\n", mtab, howlong, leftofffile);
@@ -491,16 +563,14 @@ fsrallfs(int howlong, char *leftofffile)
 			if (! found)
 				fs = fsbase;
 
+			/*
+			 * Older versions also recorded an inode to resume
+			 * from; every pass now ranks the whole filesystem,
+			 * so it is ignored.
+			 */
 			ptr = strchr(buf, ' ');
-			if (ptr) {
+			if (ptr)
 				startpass = atoi(++ptr);
-				ptr = strchr(ptr, ' ');
-				if (ptr) {
-					startino = strtoll(++ptr, 
-					                   (char **)NULL, 
-					                   10);
-				}
-			}
 
 			/* Init pass counts */
 			for (fsp = fsbase; fsp < fs; fsp++) {
@@ -514,9 +584,8 @@ fsrallfs(int howlong, char *leftofffile)
 	}
 
 	if (vflag) {
-		fsrprintf("START: pass=%d ino=%llu %s %s\n", 
-			  fs->npass, (unsigned long long)startino,
-			  fs->dev, fs->mnt);
+		fsrprintf("START: pass=%d %s %s\n",
+			  fs->npass, fs->dev, fs->mnt);
 	}
 
 	signal(SIGABRT, aborter);
@@ -545,7 +614,10 @@ fsrallfs(int howlong, char *leftofffile)
 			exit(1);
 			break;
 		case 0:
-			error = fsrfs(fs->mnt, startino, TARGETRANGE);
+			if (cflag)
+				error = fsrcompact(fs->mnt);
+			else
+				error = fsrfs(fs->mnt, TARGETRANGE);
 			exit (error);
 			break;
 		case 'C':
@@ -564,7 +636,6 @@ fsrallfs(int howlong, char *leftofffile)
 			}
 			break;
 		}
-		startino = 0;  /* reset after the first time through */
 		fs->npass++;
 		fs++;
 	}
@@ -604,22 +675,31 @@ fsrall_cleanup(int timeout)
 
 /*
  * fsrfs -- reorganize a file system
+ *
+ * The whole filesystem is bulkstat'ed first and its fragmented files
+ * ranked by extents per byte, so that the time available goes to the
+ * worst files; each pass then works through the top targetrange
+ * percent of that ranking, spread over nworkers processes.
  */
 static int
-fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
+fsrfs(char *mntdir, int targetrange)
 {
 
-	int	fsfd, fd;
-	int	count = 0;
-	int	ret;
+	int	fsfd;
+	int	i;
+	int	maxcand = 0;
+	int	ncand = 0;
+	int	nrunning = 0;
+	int	status;
+	int	timedout = 0;
+	pid_t	pid;
 	size_t buflenout;
 	xfs_bstat_t buf[GRABSZ];
-	char	fname[64];
-	char	*tname;
+	fsrcand_t *cand = NULL;
 	jdm_fshandle_t	*fshandlep;
-	xfs_ino_t	lastino = startino;
+	xfs_ino_t	lastino = 0;
 
-	fsrprintf("%s startino=%llu\n", mntdir, (unsigned long long)startino);
+	fsrprintf("%s\n", mntdir);
 
 	fshandlep = jdm_getfshandle( mntdir );
 	if ( ! fshandlep ) {
@@ -640,80 +720,322 @@ fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 		return -1;
 	}
 
-	tmp_init(mntdir);
-
 	sync();
 	while (! xfs_bulkstat(fsfd, &lastino, GRABSZ, &buf[0], &buflenout)) {
 		xfs_bstat_t *p;
 		xfs_bstat_t *endp;
 
-		if (buflenout == 0 )
-			goto out0;
-                
+		if (buflenout == 0)
+			break;
+		for ( p = buf, endp = (buf + buflenout); p < endp ; p++ ) {
+			/* Do some obvious checks now */
+			if (((p->bs_mode & S_IFMT) != S_IFREG) ||
+			     (p->bs_extents < 2) || (p->bs_size <= 0))
+				continue;
+			if (ncand == maxcand) {
+				maxcand = maxcand ? maxcand * 2 : GRABSZ;
+				cand = (fsrcand_t *)realloc(cand,
+						maxcand * sizeof(*cand));
+				if (cand == NULL) {
+					fsrprintf("realloc failed: %s\n",
+						strerror(errno));
+					exit(1);
+				}
+			}
+			cand[ncand].ino = p->bs_ino;
+			cand[ncand].rank = (double)p->bs_extents * (1 << 20) /
+					   p->bs_size;
+			ncand++;
+		}
+	}
+	if (vflag)
+		fsrprintf("%s: %d fragmented files\n", mntdir, ncand);
+
+	/* Each pass defrags the worst targetrange percent of the files */
+	qsort((char *)cand, ncand, sizeof(*cand), cmp);
+	ncand = (ncand * targetrange + 99) / 100;
 
-                    
+	tmp_init(mntdir);
+	freesp_init(mntdir);
+
+	if (nworkers == 1) {
+		timedout = fsrfs_worker(mntdir, fsfd, fshandlep,
+					cand, ncand, 0);
+	} else {
+		/* don't let the workers inherit and repeat buffered output */
+		fflush(stdout);
+		fflush(stderr);
+		ncopiers = nworkers;
+		for (i = 0; i < nworkers; i++) {
+			pid = fork();
+			if (pid == 0) {
+				status = fsrfs_worker(mntdir, fsfd, fshandlep,
+						      cand, ncand, i);
+				fflush(stdout);
+				fflush(stderr);
+				_exit(status);
+			} else if (pid < 0) {
+				/* do this share of the work ourselves */
+				fsrprintf("couldn't fork worker: %s\n",
+					  strerror(errno));
+				timedout |= fsrfs_worker(mntdir, fsfd,
+						fshandlep, cand, ncand, i);
+			} else
+				nrunning++;
+		}
+		while (nrunning > 0 && wait(&status) > 0) {
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 1)
+				timedout = 1;
+			nrunning--;
+		}
+		ncopiers = 1;
+	}
+	free(cand);
+
+	if (timedout || (endtime && endtime < time(0))) {
+		tmp_close(mntdir);
+		close(fsfd);
+		fsrall_cleanup(1);
+		exit(1);
+	}
+	tmp_close(mntdir);
+	close(fsfd);
+	return 0;
+}
+
+/*
+ * fsrcompact -- coalesce the free space of a file system
+ *
+ * The free extents of each AG are read from its by-block btree and
+ * counted per slice.  The slices with the most free extents, that
+ * are also free enough for emptying them to be worth it, are marked,
+ * and the small files with data in them are copied out to other AGs
+ * and swapped in, so that the holes they leave run together.
+ */
+static int
+fsrcompact(char *mntdir)
+{
+	int		agno;
+	size_t		buflenout;
+	xfs_bstat_t	buf[GRABSZ];
+	int		devfd;
+	int		fd;
+	char		fname[64];
+	jdm_fshandle_t	*fshandlep;
+	int		fsfd;
+	int		i;
+	xfs_ino_t	lastino = 0;
+	__uint64_t	maxblocks;
+	int		nmoved = 0;
+	int		nregions;
+	int		ntarget = 0;
+	region_t	*regions;
+	xfs_agblock_t	size;
+	region_t	*sorted;
+	char		*tname;
+
+	fsrprintf("%s: compacting free space\n", mntdir);
+
+	fshandlep = jdm_getfshandle( mntdir );
+	if ( ! fshandlep ) {
+		fsrprintf("unable to get handle: %s: %s\n", 
+		          mntdir, strerror( errno ));
+		return -1;
+	}
+
+	if ((fsfd = open(mntdir, O_RDONLY)) < 0) {
+		fsrprintf("unable to open: %s: %s\n", 
+		          mntdir, strerror( errno ));
+		return -1;
+	}
 
-		/* Each loop through, defrag targetrange percent of the files */
-		count = (buflenout * targetrange) / 100;
+	if (xfs_getgeom(fsfd, &fsgeom) < 0 ) {
+		fsrprintf("Skipping %s: could not get XFS geom\n",
+			  mntdir);
+		close(fsfd);
+		return -1;
+	}
 
-		qsort((char *)buf, buflenout, sizeof(struct xfs_bstat), cmp);
+	sync();
+	tmp_init(mntdir);
+	freesp_init(mntdir);
+	if (agfree == NULL || (devfd = freesp_open(mntdir)) < 0) {
+		fsrprintf("%s: cannot read free space, not compacting\n",
+			  mntdir);
+		tmp_close(mntdir);
+		close(fsfd);
+		return -1;
+	}
+	freesp_report(mntdir, "before");
+
+	nregions = fsgeom.agcount * COMPACT_NREGIONS;
+	size = (fsgeom.agblocks + COMPACT_NREGIONS - 1) / COMPACT_NREGIONS;
+	regions = (region_t *)calloc(nregions, sizeof(*regions));
+	sorted = (region_t *)malloc(nregions * sizeof(*sorted));
+	if (regions == NULL || sorted == NULL) {
+		fsrprintf("malloc failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < nregions; i++) {
+		regions[i].agno = i / COMPACT_NREGIONS;
+		regions[i].start = (i % COMPACT_NREGIONS) * size;
+	}
+	for (agno = 0; agno < fsgeom.agcount; agno++) {
+		if (freesp_walk(devfd, agno, XFS_BTNUM_BNO, region_count,
+				regions) < 0) {
+			fsrprintf("%s: cannot read free space of ag %d\n",
+				  mntdir, agno);
+			close(devfd);
+			free(regions);
+			free(sorted);
+			tmp_close(mntdir);
+			close(fsfd);
+			return -1;
+		}
+	}
+	close(devfd);
+
+	/* Mark the worst TARGETRANGE percent, if at least a quarter free */
+	memcpy(sorted, regions, nregions * sizeof(*sorted));
+	qsort((char *)sorted, nregions, sizeof(*sorted), region_cmp);
+	for (i = 0; i < nregions &&
+		    ntarget < (nregions * TARGETRANGE + 99) / 100; i++) {
+		if (sorted[i].nfree < COMPACT_MINEXTS)
+			break;
+		if (sorted[i].freeblks * 4 < size)
+			continue;
+		regions[sorted[i].agno * COMPACT_NREGIONS +
+			sorted[i].start / size].target = 1;
+		ntarget++;
+	}
+	free(sorted);
+	if (vflag)
+		fsrprintf("%s: %d of %d slices to compact\n",
+			  mntdir, ntarget, nregions);
+
+	/* Only files that are small next to a slice are worth moving */
+	maxblocks = size / 4;
+	compacting = 1;
+	while (ntarget &&
+	       ! xfs_bulkstat(fsfd, &lastino, GRABSZ, &buf[0], &buflenout)) {
+		xfs_bstat_t *p;
+		xfs_bstat_t *endp;
 
+		if (buflenout == 0)
+			break;
 		for ( p = buf, endp = (buf + buflenout); p < endp ; p++ ) {
-			/* Do some obvious checks now */
 			if (((p->bs_mode & S_IFMT) != S_IFREG) ||
-			     (p->bs_extents < 2)) 
+			    (p->bs_size <= 0) ||
+			    (p->bs_xflags & XFS_XFLAG_REALTIME) ||
+			    ((p->bs_size + fsgeom.blocksize - 1) /
+			     fsgeom.blocksize > maxblocks))
 				continue;
-
-			if((fd = jdm_open(fshandlep, p, O_RDWR)) < 0) {
-				/* This probably means the file was
-				 * removed while in progress of handling
-				 * it.  Just quietly ignore this file.
-				 */
-				if (dflag)
-					fsrprintf("could not open: ino %llu\n",
-						  p->bs_ino);
+			if ((fd = jdm_open(fshandlep, p, O_RDWR)) < 0)
+				continue;
+			if ((agno = region_pinned(fd, regions)) < 0 ||
+			    (tname = tmp_place(mntdir, p, agno)) == NULL) {
+				close(fd);
 				continue;
 			}
+			sprintf(fname, "ino=%llu",
+				(unsigned long long)p->bs_ino);
+			if (fsrfile_common(fname, tname, mntdir, fd, p) == 0)
+				nmoved++;
+			close(fd);
+		}
+		if (endtime && endtime < time(0))
+			break;
+	}
+	compacting = 0;
+	free(regions);
+	if (vflag)
+		fsrprintf("%s: moved %d files\n", mntdir, nmoved);
 
-			/* Don't know the pathname, so make up something */
-			sprintf(fname, "ino=%llu", (unsigned long long)p->bs_ino);
+	sync();
+	freesp_free();
+	freesp_init(mntdir);
+	freesp_report(mntdir, "after");
 
-			/* Get a tmp file name */
-			tname = tmp_next(mntdir);
+	tmp_close(mntdir);
+	close(fsfd);
+	return 0;
+}
 
-			ret = fsrfile_common(fname, tname, mntdir, fd, p);
-			
-			leftoffino = p->bs_ino;
+/*
+ * Reorganize every nworkers'th file of the ranked list, starting at
+ * the worst.  Each file is looked up again since it may have changed
+ * or gone away since the ranking.  Returns 1 if time ran out.
+ */
+static int
+fsrfs_worker(
+	char		*mntdir,
+	int		fsfd,
+	jdm_fshandle_t	*fshandlep,
+	fsrcand_t	*cand,
+	int		ncand,
+	int		worker)
+{
+	int		fd;
+	char		fname[64];
+	int		i;
+	xfs_ino_t	ino;
+	xfs_bstat_t	statbuf;
+	char		*tname;
 
-			close(fd);
+	/* start each worker's temporary files in a different AG */
+	tmp_agi = worker % fsgeom.agcount;
 
-			if (ret == 0) {
-				if (--count <= 0)
-					break;
-			}
+	for (i = worker; i < ncand; i += nworkers) {
+		if (endtime && endtime < time(0))
+			return 1;
+
+		ino = cand[i].ino;
+		if (xfs_bulkstat_single(fsfd, &ino, &statbuf) < 0 ||
+		    statbuf.bs_ino != cand[i].ino ||
+		    (statbuf.bs_mode & S_IFMT) != S_IFREG ||
+		    statbuf.bs_extents < 2)
+			continue;
+
+		if ((fd = jdm_open(fshandlep, &statbuf, O_RDWR)) < 0) {
+			/* This probably means the file was
+			 * removed while in progress of handling
+			 * it.  Just quietly ignore this file.
+			 */
+			if (dflag)
+				fsrprintf("could not open: ino %llu\n",
+					  statbuf.bs_ino);
+			continue;
 		}
-		if (endtime && endtime < time(0)) {
-			tmp_close(mntdir);
-			close(fsfd);
-			fsrall_cleanup(1);
-			exit(1);
+
+		/* Don't know the pathname, so make up something */
+		sprintf(fname, "ino=%llu", (unsigned long long)statbuf.bs_ino);
+
+		/* Get a tmp file name, in the AG best able to take it */
+		if ((tname = tmp_place(mntdir, &statbuf, -1)) == NULL) {
+			if (vflag)
+				fsrprintf("%s: free space too fragmented to "
+					  "improve, ignoring\n", fname);
+			close(fd);
+			continue;
 		}
+
+		(void)fsrfile_common(fname, tname, mntdir, fd, &statbuf);
+
+		close(fd);
 	}
-out0:
-	tmp_close(mntdir);
-	close(fsfd);
 	return 0;
 }
 		
 /*
- * To compare bstat structs for qsort.
+ * To compare ranked files for qsort, worst first.
  */
 int
 cmp(const void *s1, const void *s2)
 {
-	return( ((xfs_bstat_t *)s2)->bs_extents -
-	        ((xfs_bstat_t *)s1)->bs_extents);
+	double	r1 = ((fsrcand_t *)s1)->rank;
+	double	r2 = ((fsrcand_t *)s2)->rank;
 
+	return (r1 < r2) - (r1 > r2);
 }
 
 /*
@@ -977,6 +1299,9 @@ packfile(char *fname, char *tname, int fd, xfs_bstat_t *statp, int do_rt)
 	struct fsxattr  tfsx;
 	char		ffname[SMBUFSZ];
 	int		ffd = 0;
+	int		fdflags;
+	off64_t		copied = 0;
+	struct timeval	copystart;
 
 	/*
 	 * Work out the extent map - nextents will be set to the
@@ -986,7 +1311,7 @@ packfile(char *fname, char *tname, int fd, xfs_bstat_t *statp, int do_rt)
 	 */
 	nextents = read_fd_bmap(fd, statp, &cur_nextents);
 
-	if ( cur_nextents == 1 || cur_nextents <= nextents ) {
+	if (!compacting && ( cur_nextents == 1 || cur_nextents <= nextents )) {
 		if (vflag)
 			fsrprintf("%s already fully defragmented.\n", fname);
 		return 1; /* indicates no change/no error */
@@ -1076,6 +1401,16 @@ packfile(char *fname, char *tname, int fd, xfs_bstat_t *statp, int do_rt)
 		unlink(ffname);
 	}
 
+	/*
+	 * Read the original with direct I/O as well, so that a large
+	 * copy neither pollutes nor is slowed by the page cache.  The
+	 * reads are already sized and aligned for the temp file.
+	 */
+	if ((fdflags = fcntl(fd, F_GETFL)) >= 0)
+		(void)fcntl(fd, F_SETFL, fdflags | O_DIRECT);
+
+	gettimeofday(&copystart, NULL);
+
 	/* Loop through block map copying the file. */
 	for (extent = 0; extent < nextents; extent++) {
 		pos = outmap[extent].bmv_offset;
@@ -1102,6 +1437,8 @@ packfile(char *fname, char *tname, int fd, xfs_bstat_t *statp, int do_rt)
 			if (ioctl(tfd, XFS_IOC_RESVSP64, &space) < 0) {
 				fsrprintf("could not pre-alloc tmp space: %s\n",
 					  tname);
+				if (fdflags >= 0)
+					(void)fcntl(fd, F_SETFL, fdflags);
 				close(tfd);
 				free(fbuf);
 				return -1;
@@ -1161,9 +1498,13 @@ packfile(char *fname, char *tname, int fd, xfs_bstat_t *statp, int do_rt)
 					           tname);
 					}
 				}
+				if (fdflags >= 0)
+					(void)fcntl(fd, F_SETFL, fdflags);
 				free(fbuf);
 				return -1;
 			}
+			copied += ct;
+			throttle(&copystart, copied);
 			if (nfrags) {
 				/* Do a matching write to the tmp file */
 				wc = wc_b4;
@@ -1174,6 +1515,8 @@ packfile(char *fname, char *tname, int fd, xfs_bstat_t *statp, int do_rt)
 			}
 		}
 	}
+	if (fdflags >= 0)
+		(void)fcntl(fd, F_SETFL, fdflags);
 	ftruncate64(tfd, statp->bs_size);
 	if (ffd) close(ffd);
 	fsync(tfd);
@@ -1189,7 +1532,8 @@ packfile(char *fname, char *tname, int fd, xfs_bstat_t *statp, int do_rt)
 
 	/* Check if the extent count improved */
 	new_nextents = getnextents(tfd);
-	if (cur_nextents <= new_nextents) {
+	if (cur_nextents < new_nextents ||
+	    (!compacting && cur_nextents == new_nextents)) {
 		if (vflag)
 			fsrprintf("No improvement made: %s\n", fname);
 		close(tfd);
@@ -1229,6 +1573,32 @@ packfile(char *fname, char *tname, int fd, xfs_bstat_t *statp, int do_rt)
 	return 0;
 }
 
+/*
+ * Keep this process's copy rate down to its share of the -r limit,
+ * so that reorganizing leaves room for the filesystem's other users.
+ * Only forked workers share it; otherwise ncopiers is 1.
+ */
+static void
+throttle(struct timeval *start, off64_t copied)
+{
+	double		elapsed;
+	double		due;
+	struct timeval	now;
+	struct timespec	ts;
+
+	if (ratelimit <= 0)
+		return;
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - start->tv_sec) +
+		  (now.tv_usec - start->tv_usec) / 1000000.0;
+	due = (double)copied * ncopiers / ((double)ratelimit * (1 << 20));
+	if (due > elapsed) {
+		ts.tv_sec = (time_t)(due - elapsed);
+		ts.tv_nsec = (long)((due - elapsed - ts.tv_sec) * 1000000000.0);
+		nanosleep(&ts, NULL);
+	}
+}
+
 char *
 gettmpname(char *fname)
 {
@@ -1537,12 +1907,400 @@ tmp_next(char *mnt)
 	return(buf);
 }
 
+/*
+ * Pick the temp file for a file being reorganized.  With the free
+ * space of each AG known, the temp file goes in a directory in the
+ * AG that could hold the data in the fewest extents, since new file
+ * data is allocated near its directory.  Returns NULL if no AG could
+ * do better than the file's present layout, so that the copy is not
+ * made just to be thrown away.  When compacting free space, a file
+ * is moved as long as it gets no worse, and never within avoidag;
+ * with an avoidag there is no falling back to the plain temp dirs,
+ * which could put the copy right back in it.
+ */
+static char *
+tmp_place(char *mnt, xfs_bstat_t *statp, int avoidag)
+{
+	static char	buf[SMBUFSZ];
+	int		best = -1;
+	int		bestn = 0;
+	__uint64_t	blocks;
+	int		i;
+	int		n;
+
+	if (agfree == NULL || nfrags ||
+	    (statp->bs_xflags & XFS_XFLAG_REALTIME))
+		return avoidag < 0 ? tmp_next(mnt) : NULL;
+
+	blocks = (statp->bs_size + fsgeom.blocksize - 1) / fsgeom.blocksize;
+	for (i = 0; i < fsgeom.agcount; i++) {
+		if (agfree[i].tmpdir == NULL || i == avoidag)
+			continue;
+		n = freesp_extents(&agfree[i], blocks, 0);
+		if (n && (best < 0 || n < bestn)) {
+			best = i;
+			bestn = n;
+		}
+	}
+	if (best < 0)
+		return avoidag < 0 ? tmp_next(mnt) : NULL;
+	if (bestn > statp->bs_extents ||
+	    (!compacting && bestn == statp->bs_extents))
+		return NULL;
+	if (dflag)
+		fsrprintf("ino=%llu: ag %d, expect %d extents\n",
+			  (unsigned long long)statp->bs_ino, best, bestn);
+
+	/* account for the space this copy is about to use */
+	(void)freesp_extents(&agfree[best], blocks, 1);
+
+	sprintf(buf, "%s/tmp%d", agfree[best].tmpdir, getpid());
+	return(buf);
+}
+
+/*
+ * Estimate the fewest free extents of an AG that would hold the
+ * given number of blocks, taking the largest first; 0 if they would
+ * not fit at all.  With take set, the extents are also removed from
+ * the AG's totals.
+ */
+static int
+freesp_extents(agfree_t *af, __uint64_t blocks, int take)
+{
+	__uint64_t	avg;
+	int		c;
+	__uint64_t	count;
+	int		n = 0;
+	__uint64_t	used;
+
+	for (c = FREESP_NCLASS - 1; c >= 0 && blocks > 0; c--) {
+		if (af->count[c] == 0)
+			continue;
+		avg = af->blocks[c] / af->count[c];
+		count = (blocks + avg - 1) / avg;
+		if (count > af->count[c])
+			count = af->count[c];
+		used = count == af->count[c] ? af->blocks[c] : count * avg;
+		if (used > blocks)
+			used = blocks;
+		if (take) {
+			af->count[c] -= count;
+			af->blocks[c] = af->count[c] ? af->blocks[c] - used : 0;
+		}
+		blocks -= used;
+		n += (int)count;
+	}
+	return blocks > 0 ? 0 : n;
+}
+
+/*
+ * Open the device underneath a mounted filesystem to read its free
+ * space btrees.
+ */
+static int
+freesp_open(char *mnt)
+{
+	char		*dev = NULL;
+	int		fd;
+	FILE		*mtabp;
+	struct mntent	mntent;
+	struct mntent	mntpref;
+
+	if ((mtabp = setmntent(mtab, "r")) != NULL) {
+		bzero(&mntpref, sizeof(mntpref));
+		mntpref.mnt_dir = mnt;
+		if (getmntany(mtabp, &mntent, &mntpref) == 0)
+			dev = strdup(mntent.mnt_fsname);
+		endmntent(mtabp);
+	}
+	if (dev == NULL)
+		return -1;
+	fd = open(dev, O_RDONLY|O_DIRECT);
+	if (fd < 0 && dflag)
+		fsrprintf("cannot read free space from %s: %s\n",
+			  dev, strerror(errno));
+	free(dev);
+	return fd;
+}
+
+/*
+ * Read the free space of every AG from the device, and find out
+ * which AG each temp directory ended up in.  This is done read-only
+ * underneath the mounted filesystem, so the result is only a guide;
+ * if anything about it fails we go back to rotating through the
+ * temp directories.
+ */
+static void
+freesp_init(char *mnt)
+{
+	char		buf[SMBUFSZ];
+	int		fd;
+	int		i;
+	int		inolog;
+	struct stat64	sb;
+	__uint32_t	agno;
+
+	if (nfrags || (fd = freesp_open(mnt)) < 0)
+		return;
+	agfree = (agfree_t *)calloc(fsgeom.agcount, sizeof(*agfree));
+	if (agfree == NULL) {
+		close(fd);
+		return;
+	}
+	for (agno = 0; agno < fsgeom.agcount; agno++) {
+		if (freesp_walk(fd, agno, XFS_BTNUM_CNT, freesp_class,
+				&agfree[agno]) < 0) {
+			if (dflag)
+				fsrprintf("cannot read free space of ag %u\n",
+					  agno);
+			freesp_free();
+			close(fd);
+			return;
+		}
+	}
+	close(fd);
+
+	/* an inode number is its AG number above the AG inode number */
+	for (inolog = 0; (1U << inolog) < fsgeom.agblocks; inolog++)
+		;
+	for (i = fsgeom.blocksize / fsgeom.inodesize; i > 1; i >>= 1)
+		inolog++;
+	for (i = 0; i < fsgeom.agcount; i++) {
+		sprintf(buf, "%s/.fsr/ag%d",
+			( (strcmp(mnt, "/") == 0) ? "" : mnt), i);
+		if (stat64(buf, &sb) < 0)
+			continue;
+		agno = (__uint32_t)(sb.st_ino >> inolog);
+		if (agno < fsgeom.agcount && agfree[agno].tmpdir == NULL)
+			agfree[agno].tmpdir = strdup(buf);
+	}
+}
+
+static void
+freesp_free(void)
+{
+	int	i;
+
+	if (agfree == NULL)
+		return;
+	for (i = 0; i < fsgeom.agcount; i++)
+		free(agfree[i].tmpdir);
+	free(agfree);
+	agfree = NULL;
+}
+
+/*
+ * Count one free extent into its AG's size classes.
+ */
+/* ARGSUSED */
+static void
+freesp_class(__uint32_t agno, xfs_agblock_t bno, xfs_extlen_t len, void *arg)
+{
+	agfree_t	*af = (agfree_t *)arg;
+	int		c;
+
+	for (c = 0; c < FREESP_NCLASS - 1 && (2U << c) <= len; c++)
+		;
+	af->count[c]++;
+	af->blocks[c] += len;
+}
+
+/*
+ * Call fn for every free extent of one AG, in the order of the
+ * by-block (XFS_BTNUM_BNO) or by-size (XFS_BTNUM_CNT) btree, by
+ * walking along its leaves.
+ */
+static int
+freesp_walk(
+	int		fd,
+	__uint32_t	agno,
+	int		btnum,
+	void		(*fn)(__uint32_t, xfs_agblock_t, xfs_extlen_t, void *),
+	void		*arg)
+{
+	xfs_agblock_t		agbno;
+	xfs_agf_t		*agf;
+	xfs_btree_sblock_t	*block;
+	char			*buf;
+	int			i;
+	int			level;
+	__uint32_t		magic;
+	int			maxrecs;
+	xfs_agblock_t		nleaves = 0;
+	off64_t			off;
+	xfs_alloc_rec_t		*rec;
+	size_t			size;
+
+	magic = btnum == XFS_BTNUM_BNO ? XFS_ABTB_MAGIC : XFS_ABTC_MAGIC;
+	size = fsgeom.blocksize < 1024 ? 1024 : fsgeom.blocksize;
+	if ((buf = memalign(pagesize, size)) == NULL)
+		return -1;
+	off = (off64_t)agno * fsgeom.agblocks * fsgeom.blocksize;
+	if (pread64(fd, buf, size, off) != size)
+		goto fail;
+	agf = (xfs_agf_t *)(buf + BBTOB(XFS_AGF_DADDR));
+	if (INT_GET(agf->agf_magicnum, ARCH_CONVERT) != XFS_AGF_MAGIC)
+		goto fail;
+	agbno = INT_GET(agf->agf_roots[btnum], ARCH_CONVERT);
+	level = INT_GET(agf->agf_levels[btnum], ARCH_CONVERT);
+
+	maxrecs = (fsgeom.blocksize - sizeof(xfs_btree_sblock_t)) /
+		  (sizeof(xfs_alloc_key_t) + sizeof(xfs_alloc_ptr_t));
+	block = (xfs_btree_sblock_t *)buf;
+	while (agbno != NULLAGBLOCK) {
+		if (agbno >= fsgeom.agblocks)
+			goto fail;
+		if (pread64(fd, buf, fsgeom.blocksize,
+			    off + (off64_t)agbno * fsgeom.blocksize) !=
+		    fsgeom.blocksize ||
+		    INT_GET(block->bb_magic, ARCH_CONVERT) != magic)
+			goto fail;
+		if (--level > 0) {
+			/* follow the leftmost pointer down */
+			agbno = INT_GET(*(xfs_alloc_ptr_t *)(buf +
+					sizeof(xfs_btree_sblock_t) +
+					maxrecs * sizeof(xfs_alloc_key_t)),
+					ARCH_CONVERT);
+			continue;
+		}
+		/* a rightsib loop would otherwise never end */
+		if (++nleaves > fsgeom.agblocks)
+			goto fail;
+		rec = (xfs_alloc_rec_t *)(block + 1);
+		for (i = 0; i < INT_GET(block->bb_numrecs, ARCH_CONVERT); i++)
+			(*fn)(agno,
+			      INT_GET(rec[i].ar_startblock, ARCH_CONVERT),
+			      INT_GET(rec[i].ar_blockcount, ARCH_CONVERT), arg);
+		agbno = INT_GET(block->bb_rightsib, ARCH_CONVERT);
+		level = 1;
+	}
+	free(buf);
+	return 0;
+fail:
+	free(buf);
+	return -1;
+}
+
+/*
+ * Print the free extent histogram of the whole filesystem, in the
+ * form xfs_db's freesp command uses.  The btrees are read from the
+ * device under the mounted filesystem, which may not have written
+ * its latest changes back yet even after a sync(), so the numbers
+ * are only approximate.
+ */
+static void
+freesp_report(char *mnt, char *when)
+{
+	__uint64_t	blocks[FREESP_NCLASS];
+	__uint64_t	count[FREESP_NCLASS];
+	int		c;
+	int		i;
+	__uint64_t	total = 0;
+
+	if (agfree == NULL)
+		return;
+	bzero(blocks, sizeof(blocks));
+	bzero(count, sizeof(count));
+	for (i = 0; i < fsgeom.agcount; i++) {
+		for (c = 0; c < FREESP_NCLASS; c++) {
+			count[c] += agfree[i].count[c];
+			blocks[c] += agfree[i].blocks[c];
+			total += agfree[i].blocks[c];
+		}
+	}
+	fsrprintf("%s: free space %s compaction (approximate):\n",
+		  mnt, when);
+	fsrprintf("%10s %10s %10s %10s %6s\n",
+		  "from", "to", "extents", "blocks", "pct");
+	for (c = 0; c < FREESP_NCLASS; c++) {
+		if (count[c] == 0)
+			continue;
+		fsrprintf("%10llu %10llu %10llu %10llu %6.2f\n",
+			  1ULL << c, (2ULL << c) - 1,
+			  (unsigned long long)count[c],
+			  (unsigned long long)blocks[c],
+			  total ? blocks[c] * 100.0 / total : 0.0);
+	}
+}
+
+/*
+ * Count one free extent into the slice of its AG it starts in.
+ */
+static void
+region_count(__uint32_t agno, xfs_agblock_t bno, xfs_extlen_t len, void *arg)
+{
+	region_t	*r;
+	xfs_agblock_t	size;
+
+	size = (fsgeom.agblocks + COMPACT_NREGIONS - 1) / COMPACT_NREGIONS;
+	r = (region_t *)arg + agno * COMPACT_NREGIONS + bno / size;
+	r->nfree++;
+	r->freeblks += len;
+}
+
+/*
+ * To sort slices with the most broken up free space first.
+ */
+static int
+region_cmp(const void *s1, const void *s2)
+{
+	__uint64_t	n1 = ((region_t *)s1)->nfree;
+	__uint64_t	n2 = ((region_t *)s2)->nfree;
+
+	return (n1 < n2) - (n1 > n2);
+}
+
+/*
+ * Return the AG of the first extent of a file that lies in a slice
+ * marked for compaction, or -1 if the file pins none of them.  The
+ * slices are indexed by AG and block, so this must be called before
+ * they are sorted.
+ */
+static int
+region_pinned(int fd, region_t *regions)
+{
+	__uint64_t	agno;
+	__uint64_t	bblocks;
+	__uint64_t	fsb;
+	int		i;
+	struct getbmap	map[MAPSIZE];
+	xfs_agblock_t	size;
+
+	bblocks = fsgeom.blocksize / BBSIZE;
+	size = (fsgeom.agblocks + COMPACT_NREGIONS - 1) / COMPACT_NREGIONS;
+
+	map[0].bmv_offset = 0;
+	map[0].bmv_block = 0;
+	map[0].bmv_entries = 0;
+	map[0].bmv_count = MAPSIZE;
+	map[0].bmv_length = -1;
+
+	do {
+		if (ioctl(fd, XFS_IOC_GETBMAP, map) < 0)
+			return -1;
+		for (i = 1; i <= map[0].bmv_entries; i++) {
+			if (map[i].bmv_block == -1)
+				continue;
+			fsb = map[i].bmv_block / bblocks;
+			agno = fsb / fsgeom.agblocks;
+			if (agno >= fsgeom.agcount)
+				continue;
+			if (regions[agno * COMPACT_NREGIONS +
+				    (fsb % fsgeom.agblocks) / size].target)
+				return (int)agno;
+		}
+	} while (map[0].bmv_entries == (MAPSIZE-1));
+	return -1;
+}
+
 static void
 tmp_close(char *mnt)
 {
 	static char	buf[SMBUFSZ];
 	int i;
 
+	freesp_free();
+
 	/* No data is ever actually written so we can just do rmdir's */
 	for (i=0; i < fsgeom.agcount; i++) {
 		sprintf(buf, "%s/.fsr/ag%d", mnt, i);
@@ -282,6 +282,48 @@ inv_writesession_close( inv_sestoken_t tok )
 
 
 
+/*----------------------------------------------------------------------*/
+/* inv_writesession_detach                                              */
+/*                                                                      */
+/* Called in a process forked to write one stream of the session. The  */
+/* inherited inventory files share their offsets and flock()s with the  */
+/* other streams, so reopen them to give this process its own.         */
+/*----------------------------------------------------------------------*/
+bool_t
+inv_writesession_detach( inv_sestoken_t tok )
+{
+	int		*fdp[ 2 ];
+	char		path[ 32 ];
+	int		i, fd, oflags;
+
+	ASSERT ( tok != INV_TOKEN_NULL );
+	fdp[ 0 ] = &tok->sd_invtok->d_invindex_fd;
+	fdp[ 1 ] = &tok->sd_invtok->d_stobj_fd;
+
+	for ( i = 0; i < 2; i++ ) {
+		if ( *fdp[ i ] < 0 )
+			continue;
+		oflags = fcntl( *fdp[ i ], F_GETFL );
+		sprintf( path, "/proc/self/fd/%d", *fdp[ i ] );
+		fd = open( path, oflags & O_ACCMODE );
+		if ( oflags < 0 || fd < 0 ) {
+			mlog( MLOG_NORMAL | MLOG_INV, 
+			      "INV: unable to reopen inventory file: %s\n",
+			      strerror( errno ) );
+			return BOOL_FALSE;
+		}
+		if ( dup2( fd, *fdp[ i ] ) < 0 ) {
+			close( fd );
+			return BOOL_FALSE;
+		}
+		close( fd );
+	}
+
+	return BOOL_TRUE;
+}
+
+
+
 /*----------------------------------------------------------------------*/
 /* inventory_stream_open                                                */
 /*                                                                      */
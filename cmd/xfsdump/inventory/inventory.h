@@ -230,6 +230,10 @@ extern bool_t
 inv_writesession_close( 
 	inv_sestoken_t  tok );
 
+extern bool_t
+inv_writesession_detach( 
+	inv_sestoken_t  tok );
+
 extern inv_stmtoken_t
 inv_stream_open(
 	inv_sestoken_t 	tok,
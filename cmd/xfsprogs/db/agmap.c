@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+#include <libxfs.h>
+#include <errno.h>
+#include "agmap.h"
+#include "init.h"
+#include "malloc.h"
+#include "output.h"
+
+struct agmap {
+	int		bits;		/* per block; 32 and 64 are words */
+	int		nmaps;
+	char		**data;		/* in-core maps, NULL if not loaded */
+	size_t		*bytes;		/* size of each map */
+	xfs_off_t	*spill;		/* offset in spill file, -1 if none */
+	char		*dirty;		/* changed since last spilled */
+	__uint64_t	*used;		/* agmap_tick at last use */
+	struct agmap	*next;		/* list of all maps */
+};
+
+static agmap_t		*agmap_list;
+static __uint64_t	agmap_max;	/* memory ceiling, 0 for none */
+static __uint64_t	agmap_resident;	/* bytes of maps in core */
+static __uint64_t	agmap_tick;
+static FILE		*agmap_fp;	/* spill file */
+static xfs_off_t	agmap_fend;	/* end of spill file */
+
+static void		agmap_io(int wr, char *p, size_t len, xfs_off_t off);
+static char		*agmap_load(agmap_t *map, int i);
+static void		agmap_reclaim(__uint64_t need);
+static void		agmap_spill(agmap_t *map, int i);
+static void		agmap_spillerr(char *what);
+
+agmap_t *
+agmap_alloc(
+	int		bits,
+	int		nmaps,
+	__uint64_t	size,
+	__uint64_t	lastsize)
+{
+	int		i;
+	agmap_t		*map;
+	__uint64_t	n;
+
+	map = xcalloc(1, sizeof(*map));
+	map->bits = bits;
+	map->nmaps = nmaps;
+	map->data = xcalloc(nmaps, sizeof(*map->data));
+	map->bytes = xcalloc(nmaps, sizeof(*map->bytes));
+	map->spill = xcalloc(nmaps, sizeof(*map->spill));
+	map->dirty = xcalloc(nmaps, sizeof(*map->dirty));
+	map->used = xcalloc(nmaps, sizeof(*map->used));
+	for (i = 0; i < nmaps; i++) {
+		n = i == nmaps - 1 ? lastsize : size;
+		/*
+		 * Packed entries are fetched two bytes at a time, so
+		 * leave a byte of slack at the end.
+		 */
+		if (bits == 64)
+			map->bytes[i] = n * sizeof(__uint64_t);
+		else if (bits == 32)
+			map->bytes[i] = n * sizeof(__uint32_t);
+		else
+			map->bytes[i] = (n * bits + 7) / 8 + 1;
+		map->spill[i] = -1;
+	}
+	map->next = agmap_list;
+	agmap_list = map;
+	return map;
+}
+
+void
+agmap_free(
+	agmap_t		*map)
+{
+	int		i;
+	agmap_t		**mpp;
+
+	for (i = 0; i < map->nmaps; i++) {
+		if (map->data[i]) {
+			xfree(map->data[i]);
+			agmap_resident -= map->bytes[i];
+		}
+	}
+	for (mpp = &agmap_list; *mpp != map; mpp = &(*mpp)->next)
+		continue;
+	*mpp = map->next;
+	xfree(map->data);
+	xfree(map->bytes);
+	xfree(map->spill);
+	xfree(map->dirty);
+	xfree(map->used);
+	xfree(map);
+	if (agmap_list == NULL && agmap_fp) {
+		fclose(agmap_fp);
+		agmap_fp = NULL;
+		agmap_fend = 0;
+	}
+}
+
+__uint64_t
+agmap_get(
+	agmap_t		*map,
+	int		i,
+	__uint64_t	n)
+{
+	__uint64_t	off;
+	unsigned char	*p;
+
+	p = (unsigned char *)agmap_load(map, i);
+	if (map->bits == 64)
+		return ((__uint64_t *)p)[n];
+	if (map->bits == 32)
+		return ((__uint32_t *)p)[n];
+	off = n * map->bits;
+	p += off >> 3;
+	return ((p[0] | (p[1] << 8)) >> (off & 7)) & ((1 << map->bits) - 1);
+}
+
+/*
+ * Maps can be bigger than a single read or write will move.
+ */
+static void
+agmap_io(
+	int		wr,
+	char		*p,
+	size_t		len,
+	xfs_off_t	off)
+{
+	ssize_t		n;
+
+	while (len) {
+		if (wr)
+			n = pwrite64(fileno(agmap_fp), p, len, off);
+		else
+			n = pread64(fileno(agmap_fp), p, len, off);
+		if (n == 0)
+			errno = EIO;
+		if (n <= 0)
+			agmap_spillerr(wr ? "write" : "read");
+		p += n;
+		len -= n;
+		off += n;
+	}
+}
+
+/*
+ * A ceiling too low to hold the largest map of each kind for two
+ * allocation groups at once would have every lookup spill and reload
+ * a whole map, so it is raised to that.
+ */
+void
+agmap_limit(
+	__uint64_t	maxbytes)
+{
+	int		i;
+	size_t		largest;
+	agmap_t		*map;
+	__uint64_t	minbytes;
+
+	minbytes = 0;
+	for (map = agmap_list; map; map = map->next) {
+		largest = 0;
+		for (i = 0; i < map->nmaps; i++)
+			largest = MAX(largest, map->bytes[i]);
+		minbytes += 2 * largest;
+	}
+	if (maxbytes && maxbytes < minbytes) {
+		dbprintf("block map memory limit raised to %lluMB\n",
+			(unsigned long long)((minbytes + (1 << 20) - 1) >> 20));
+		maxbytes = minbytes;
+	}
+	agmap_max = maxbytes;
+	agmap_reclaim(0);
+}
+
+static char *
+agmap_load(
+	agmap_t		*map,
+	int		i)
+{
+	char		*p;
+
+	map->used[i] = ++agmap_tick;
+	if ((p = map->data[i]) != NULL)
+		return p;
+	agmap_reclaim(map->bytes[i]);
+	if (map->spill[i] < 0)
+		p = xcalloc(map->bytes[i], 1);
+	else {
+		p = xmalloc(map->bytes[i]);
+		agmap_io(0, p, map->bytes[i], map->spill[i]);
+	}
+	map->data[i] = p;
+	map->dirty[i] = 0;
+	agmap_resident += map->bytes[i];
+	return p;
+}
+
+/*
+ * Push out least recently used maps until there is room for need
+ * more bytes, or nothing is left in core.  The caller's map is not
+ * resident yet so it can't be chosen.
+ */
+static void
+agmap_reclaim(
+	__uint64_t	need)
+{
+	int		i;
+	agmap_t		*map;
+	int		vi;
+	agmap_t		*vmap;
+
+	while (agmap_max && agmap_resident + need > agmap_max) {
+		vmap = NULL;
+		vi = 0;
+		for (map = agmap_list; map; map = map->next) {
+			for (i = 0; i < map->nmaps; i++) {
+				if (map->data[i] == NULL)
+					continue;
+				if (vmap == NULL ||
+				    map->used[i] < vmap->used[vi]) {
+					vmap = map;
+					vi = i;
+				}
+			}
+		}
+		if (vmap == NULL)
+			break;
+		agmap_spill(vmap, vi);
+	}
+}
+
+void
+agmap_set(
+	agmap_t		*map,
+	int		i,
+	__uint64_t	n,
+	__uint64_t	val)
+{
+	unsigned int	mask;
+	__uint64_t	off;
+	unsigned char	*p;
+	int		shift;
+	unsigned int	w;
+
+	p = (unsigned char *)agmap_load(map, i);
+	map->dirty[i] = 1;
+	if (map->bits == 64) {
+		((__uint64_t *)p)[n] = val;
+		return;
+	}
+	if (map->bits == 32) {
+		((__uint32_t *)p)[n] = (__uint32_t)val;
+		return;
+	}
+	off = n * map->bits;
+	p += off >> 3;
+	shift = (int)(off & 7);
+	mask = ((1 << map->bits) - 1) << shift;
+	w = (p[0] | (p[1] << 8)) & ~mask;
+	w |= ((unsigned int)val << shift) & mask;
+	p[0] = (unsigned char)w;
+	p[1] = (unsigned char)(w >> 8);
+}
+
+/*
+ * A map that was never changed since it was last loaded needn't be
+ * written: either the spill file already has it or it is all zeroes.
+ */
+static void
+agmap_spill(
+	agmap_t		*map,
+	int		i)
+{
+	if (map->dirty[i]) {
+		if (agmap_fp == NULL && (agmap_fp = tmpfile()) == NULL)
+			agmap_spillerr("create");
+		if (map->spill[i] < 0) {
+			map->spill[i] = agmap_fend;
+			agmap_fend += map->bytes[i];
+		}
+		agmap_io(1, map->data[i], map->bytes[i], map->spill[i]);
+	}
+	xfree(map->data[i]);
+	map->data[i] = NULL;
+	agmap_resident -= map->bytes[i];
+}
+
+static void
+agmap_spillerr(
+	char		*what)
+{
+	dbprintf("%s: can't %s block map spill file: %s\n", progname, what,
+		strerror(errno));
+	exit(1);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+/*
+ * Per-AG block maps for blockget.  A map holds one small value per
+ * block of each allocation group (plus the realtime device, as the
+ * last map), packed to "bits" bits per block; 32- and 64-bit maps
+ * hold whole words.  Maps are allocated when first touched.  If a
+ * memory ceiling has been set with agmap_limit(), the least recently
+ * used maps are written out to an unlinked temporary file when a new
+ * one has to be brought in, and read back when they are next used.
+ * The ceiling is raised to hold at least two of each kind of map, as
+ * blockget works on two allocation groups at a time.
+ */
+
+typedef struct agmap	agmap_t;
+
+extern agmap_t		*agmap_alloc(int bits, int nmaps, __uint64_t size,
+				     __uint64_t lastsize);
+extern void		agmap_free(agmap_t *map);
+extern __uint64_t	agmap_get(agmap_t *map, int i, __uint64_t n);
+extern void		agmap_limit(__uint64_t maxbytes);
+extern void		agmap_set(agmap_t *map, int i, __uint64_t n,
+				  __uint64_t val);
@@ -34,6 +34,7 @@
 #include <math.h>
 #include <getopt.h>
 #include <sys/time.h>
+#include "agmap.h"
 #include "bmap.h"
 #include "check.h"
 #include "command.h"
@@ -43,6 +44,7 @@
 #include "type.h"
 #include "mount.h"
 #include "malloc.h"
+#include "prefetch.h"
 
 typedef enum {
 	DBM_UNKNOWN,	DBM_AGF,	DBM_AGFL,	DBM_AGI,
@@ -54,6 +56,7 @@ typedef enum {
 	DBM_SYMLINK,
 	DBM_NDBM
 } dbm_t;
+#define	DBMAP_BITS	5	/* enough for DBM_NDBM */
 
 typedef struct inodata {
 	struct inodata	*next;
@@ -65,6 +68,7 @@ typedef struct inodata {
 	xfs_ino_t	ino;
 	struct inodata	*parent;
 	char		*name;
+	__uint32_t	tabix;		/* index in inotab, plus one */
 } inodata_t;
 #define	MIN_INODATA_HASH_SIZE	256
 #define	MAX_INODATA_HASH_SIZE	65536
@@ -122,7 +126,7 @@ static xfs_agino_t	agicount;
 static xfs_agino_t	agifreecount;
 static xfs_fsblock_t	*blist;
 static int		blist_size;
-static char		**dbmap;	/* really dbm_t:8 */
+static agmap_t		*dbmap;		/* dbm_t, DBMAP_BITS each */
 static dirhash_t	**dirhash;
 static int		error;
 static __uint64_t	fdblocks;
@@ -131,9 +135,14 @@ static __uint64_t	icount;
 static __uint64_t	ifree;
 static inodata_t	***inodata;
 static int		inodata_hash_size;
-static inodata_t	***inomap;
+static agmap_t		*inomap;	/* inotab index, plus one */
+static inodata_t	**inotab;
+static __uint32_t	inotab_count;
+static __uint32_t	inotab_size;
+static __uint64_t	mapmem;
 static int		nflag;
 static int		pflag;
+static int		pfthreads;
 static qdata_t		**qgdata;
 static int		qgdo;
 static qdata_t		**qudata;
@@ -178,6 +187,12 @@ static int		verbose;
 #define	CHECK_BLISTA(a,b)	\
 	(blist_size && check_blist(XFS_AGB_TO_FSB(mp, a, b)))
 
+#define	GET_DBMAP(a,b)		((dbm_t)agmap_get(dbmap, a, b))
+#define	SET_DBMAP(a,b,t)	agmap_set(dbmap, a, b, (__uint64_t)(t))
+#define	GET_INOMAP(a,b)		get_inomap(a, b)
+#define	SET_INOMAP(a,b,id)	\
+	agmap_set(inomap, a, b, (id) ? (id)->tabix : 0)
+
 typedef void	(*scan_lbtree_f_t)(xfs_btree_lblock_t	*block,
 				   int			level,
 				   dbm_t		type,
@@ -262,6 +277,7 @@ static int		dir_hash_see(xfs_dahash_t hash,
 				     xfs_dir2_dataptr_t addr);
 static inodata_t	*find_inode(xfs_ino_t ino, int add);
 static void		free_inodata(xfs_agnumber_t agno);
+static inodata_t	*get_inomap(xfs_agnumber_t agno, __uint64_t bno);
 static int		init(int argc, char **argv);
 static char		*inode_name(xfs_ino_t ino, inodata_t **ipp);
 static int		ncheck_f(int argc, char **argv);
@@ -332,6 +348,10 @@ static void		quota_add1(qdata_t **qt, xfs_dqid_t id, int dq,
 				   xfs_qcnt_t rc);
 static void		quota_check(char *s, qdata_t **qt);
 static void		quota_init(void);
+static void		readahead_ag(xfs_agnumber_t agno);
+static void		readahead_lptrs(xfs_bmbt_ptr_t *pp, int n);
+static void		readahead_sptrs(xfs_agnumber_t agno,
+					xfs_agblock_t *pp, int n);
 static void		scan_ag(xfs_agnumber_t agno);
 static void		scan_freelist(xfs_agf_t *agf);
 static void		scan_lbtree(xfs_fsblock_t root, int nlevels,
@@ -375,7 +395,7 @@ static const cmdinfo_t	blockfree_cmd =
 	  NULL, "free block usage information", NULL };
 static const cmdinfo_t	blockget_cmd = 
 	{ "blockget", "check", blockget_f, 0, -1, 0,
-	  "[-s|-v] [-n] [-b bno]... [-i ino] ...",
+	  "[-s|-v] [-n] [-m mb] [-t threads] [-b bno]... [-i ino] ...",
 	  "get block usage and check consistency", NULL };
 #ifdef DEBUG
 static const cmdinfo_t	blocktrash_cmd = 
@@ -766,24 +786,22 @@ blockfree_f(
 		return 0;
 	}
 	rt = mp->m_sb.sb_rextents != 0;
-	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		xfree(dbmap[c]);
-		xfree(inomap[c]);
+	for (c = 0; c < mp->m_sb.sb_agcount; c++)
 		free_inodata(c);
-	}
 	if (rt) {
-		xfree(dbmap[c]);
-		xfree(inomap[c]);
 		xfree(sumcompute);
 		xfree(sumfile);
 		sumcompute = sumfile = NULL;
 	}
-	xfree(dbmap);
-	xfree(inomap);
+	agmap_free(dbmap);
+	agmap_free(inomap);
 	xfree(inodata);
+	xfree(inotab);
 	dbmap = NULL;
 	inomap = NULL;
 	inodata = NULL;
+	inotab = NULL;
+	inotab_count = inotab_size = 0;
 	return 0;
 }
 
@@ -807,7 +825,10 @@ blockget_f(
 		return 0;
 	oldprefix = dbprefix;
 	dbprefix |= pflag;
+	prefetch_init(pfthreads);
+	readahead_ag(0);
 	for (agno = 0, sbyell = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		readahead_ag(agno + 1);
 		scan_ag(agno);
 		if (sbver_err > 4 && !sbyell && sbver_err >= agno) {
 			sbyell = 1;
@@ -815,6 +836,7 @@ blockget_f(
 				 "filesystem.\n");
 		}
 	}
+	prefetch_stop();
 	if (blist_size) {
 		xfree(blist);
 		blist = NULL;
@@ -995,11 +1017,11 @@ blocktrash_f(
 	int		min;
 	int		mode;
 	struct timeval	now;
-	char		*p;
 	xfs_drfsbno_t	randb;
 	uint		seed;
 	int		sopt;
 	int		tmask;
+	dbm_t		type;
 
 	if (!dbmap) {
 		dbprintf("must run blockget first\n");
@@ -1105,10 +1127,8 @@ blocktrash_f(
 			lentab[lentablen - 1].max = i;
 	}
 	for (blocks = 0, agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		for (agbno = 0, p = dbmap[agno];
-		     agbno < mp->m_sb.sb_agblocks;
-		     agbno++, p++) {
-			if ((1 << *p) & tmask)
+		for (agbno = 0; agbno < mp->m_sb.sb_agblocks; agbno++) {
+			if ((1 << GET_DBMAP(agno, agbno)) & tmask)
 				blocks++;
 		}
 	}
@@ -1125,14 +1145,15 @@ blocktrash_f(
 		for (bi = 0, agno = 0, done = 0;
 		     !done && agno < mp->m_sb.sb_agcount;
 		     agno++) {
-			for (agbno = 0, p = dbmap[agno];
+			for (agbno = 0;
 			     agbno < mp->m_sb.sb_agblocks;
-			     agbno++, p++) {
-				if (!((1 << *p) & tmask))
+			     agbno++) {
+				type = GET_DBMAP(agno, agbno);
+				if (!((1 << type) & tmask))
 					continue;
 				if (bi++ < randb)
 					continue;
-				blocktrash_b(agno, agbno, (dbm_t)*p,
+				blocktrash_b(agno, agbno, type,
 					&lentab[random() % lentablen], mode);
 				done = 1;
 				break;
@@ -1193,11 +1214,10 @@ blockuse_f(
 		}
 	}
 	while (agbno <= end) {
-		p = &dbmap[agno][agbno];
-		i = inomap[agno][agbno];
+		i = GET_INOMAP(agno, agbno);
 		dbprintf("block %llu (%u/%u) type %s",
 			(xfs_dfsbno_t)XFS_AGB_TO_FSB(mp, agno, agbno),
-			agno, agbno, typename[(dbm_t)*p]);
+			agno, agbno, typename[GET_DBMAP(agno, agbno)]);
 		if (i) {
 			dbprintf(" inode %lld", i->ino);
 			if (shownames && (p = inode_name(i->ino, NULL))) {
@@ -1232,15 +1252,15 @@ check_dbmap(
 	dbm_t		type)
 {
 	xfs_extlen_t	i;
-	char		*p;
+	dbm_t		t;
 
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		if ((dbm_t)*p != type) {
+	for (i = 0; i < len; i++) {
+		if ((t = GET_DBMAP(agno, agbno + i)) != type) {
 			if (!sflag || CHECK_BLISTA(agno, agbno + i))
 				dbprintf("block %u/%u expected type %s got "
 					 "%s\n",
 					agno, agbno + i, typename[type],
-					typename[(dbm_t)*p]);
+					typename[t]);
 			error++;
 		}
 	}
@@ -1266,7 +1286,7 @@ check_inomap(
 	xfs_ino_t	c_ino)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
+	inodata_t	*id;
 	int		rval;
 
 	if (!check_range(agno, agbno, len))  {
@@ -1274,13 +1294,13 @@ check_inomap(
 			agno, agbno, agbno + len - 1, c_ino);
 		return 0;
 	}
-	for (i = 0, rval = 1, idp = &inomap[agno][agbno]; i < len; i++, idp++) {
-		if (*idp) {
-			if (!sflag || (*idp)->ilist ||
+	for (i = 0, rval = 1; i < len; i++) {
+		if ((id = GET_INOMAP(agno, agbno + i)) != NULL) {
+			if (!sflag || id->ilist ||
 			    CHECK_BLISTA(agno, agbno + i))
 				dbprintf("block %u/%u claimed by inode %lld, "
 					 "previous inum %lld\n",
-					agno, agbno + i, c_ino, (*idp)->ino);
+					agno, agbno + i, c_ino, id->ino);
 			error++;
 			rval = 0;
 		}
@@ -1368,15 +1388,16 @@ check_rdbmap(
 	dbm_t		type)
 {
 	xfs_extlen_t	i;
-	char		*p;
+	dbm_t		t;
 
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		if ((dbm_t)*p != type) {
+	for (i = 0; i < len; i++) {
+		t = GET_DBMAP(mp->m_sb.sb_agcount, bno + i);
+		if (t != type) {
 			if (!sflag || CHECK_BLIST(bno + i))
 				dbprintf("rtblock %llu expected type %s got "
 					 "%s\n",
 					bno + i, typename[type],
-					typename[(dbm_t)*p]);
+					typename[t]);
 			error++;
 		}
 	}
@@ -1389,7 +1410,7 @@ check_rinomap(
 	xfs_ino_t	c_ino)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
+	inodata_t	*id;
 	int		rval;
 
 	if (!check_rrange(bno, len)) {
@@ -1397,14 +1418,13 @@ check_rinomap(
 			bno, bno + len - 1, c_ino);
 		return 0;
 	}
-	for (i = 0, rval = 1, idp = &inomap[mp->m_sb.sb_agcount][bno];
-	     i < len;
-	     i++, idp++) {
-		if (*idp) {
-			if (!sflag || (*idp)->ilist || CHECK_BLIST(bno + i))
+	for (i = 0, rval = 1; i < len; i++) {
+		id = GET_INOMAP(mp->m_sb.sb_agcount, bno + i);
+		if (id) {
+			if (!sflag || id->ilist || CHECK_BLIST(bno + i))
 				dbprintf("rtblock %llu claimed by inode %lld, "
 					 "previous inum %lld\n",
-					bno + i, c_ino, (*idp)->ino);
+					bno + i, c_ino, id->ino);
 			error++;
 			rval = 0;
 		}
@@ -1462,7 +1482,6 @@ check_set_dbmap(
 {
 	xfs_extlen_t	i;
 	int		mayprint;
-	char		*p;
 
 	if (!check_range(agno, agbno, len))  {
 		dbprintf("blocks %u/%u..%u claimed by block %u/%u\n", agno,
@@ -1471,8 +1490,8 @@ check_set_dbmap(
 	}
 	check_dbmap(agno, agbno, len, type1);
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		*p = (char)type2;
+	for (i = 0; i < len; i++) {
+		SET_DBMAP(agno, agbno + i, type2);
 		if (mayprint && (verbose || CHECK_BLISTA(agno, agbno + i)))
 			dbprintf("setting block %u/%u to %s\n", agno, agbno + i,
 				typename[type2]);
@@ -1488,14 +1507,13 @@ check_set_rdbmap(
 {
 	xfs_extlen_t	i;
 	int		mayprint;
-	char		*p;
 
 	if (!check_rrange(bno, len))
 		return;
 	check_rdbmap(bno, len, type1);
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		*p = (char)type2;
+	for (i = 0; i < len; i++) {
+		SET_DBMAP(mp->m_sb.sb_agcount, bno + i, type2);
 		if (mayprint && (verbose || CHECK_BLIST(bno + i)))
 			dbprintf("setting rtblock %llu to %s\n",
 				bno + i, typename[type2]);
@@ -1536,15 +1554,16 @@ checknot_dbmap(
 	int		typemask)
 {
 	xfs_extlen_t	i;
-	char		*p;
+	dbm_t		t;
 
 	if (!check_range(agno, agbno, len))
 		return;
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		if ((1 << *p) & typemask) {
+	for (i = 0; i < len; i++) {
+		t = GET_DBMAP(agno, agbno + i);
+		if ((1 << t) & typemask) {
 			if (!sflag || CHECK_BLISTA(agno, agbno + i))
 				dbprintf("block %u/%u type %s not expected\n",
-					agno, agbno + i, typename[(dbm_t)*p]);
+					agno, agbno + i, typename[t]);
 			error++;
 		}
 	}
@@ -1557,15 +1576,16 @@ checknot_rdbmap(
 	int		typemask)
 {
 	xfs_extlen_t	i;
-	char		*p;
+	dbm_t		t;
 
 	if (!check_rrange(bno, len))
 		return;
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		if ((1 << *p) & typemask) {
+	for (i = 0; i < len; i++) {
+		t = GET_DBMAP(mp->m_sb.sb_agcount, bno + i);
+		if ((1 << t) & typemask) {
 			if (!sflag || CHECK_BLIST(bno + i))
 				dbprintf("rtblock %llu type %s not expected\n",
-					bno + i, typename[(dbm_t)*p]);
+					bno + i, typename[t]);
 			error++;
 		}
 	}
@@ -1683,9 +1703,30 @@ find_inode(
 	ent->ino = ino;
 	ent->next = htab[ih];
 	htab[ih] = ent;
+	if (inotab_count == inotab_size) {
+		inotab_size = inotab_size ? inotab_size * 2 : 1024;
+		inotab = xrealloc(inotab, inotab_size * sizeof(*inotab));
+	}
+	inotab[inotab_count++] = ent;
+	ent->tabix = inotab_count;
 	return ent;
 }
 
+/*
+ * The inode map holds a 32-bit index into inotab for each block,
+ * rather than a pointer, to halve its size.
+ */
+static inodata_t *
+get_inomap(
+	xfs_agnumber_t	agno,
+	__uint64_t	bno)
+{
+	__uint32_t	ix;
+
+	ix = (__uint32_t)agmap_get(inomap, agno, bno);
+	return ix ? inotab[ix - 1] : NULL;
+}
+
 static void
 free_inodata(
 	xfs_agnumber_t	agno)
@@ -1725,27 +1766,32 @@ init(
 		return 0;
 	}
 	rt = mp->m_sb.sb_rextents != 0;
-	dbmap = xmalloc((mp->m_sb.sb_agcount + rt) * sizeof(*dbmap));
-	inomap = xmalloc((mp->m_sb.sb_agcount + rt) * sizeof(*inomap));
 	inodata = xmalloc(mp->m_sb.sb_agcount * sizeof(*inodata));
 	inodata_hash_size =
 		(int)MAX(MIN(mp->m_sb.sb_icount /
 				(INODATA_AVG_HASH_LENGTH * mp->m_sb.sb_agcount),
 			     MAX_INODATA_HASH_SIZE),
 			 MIN_INODATA_HASH_SIZE);
-	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		dbmap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**dbmap));
-		inomap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**inomap));
+	for (c = 0; c < mp->m_sb.sb_agcount; c++)
 		inodata[c] = xcalloc(inodata_hash_size, sizeof(**inodata));
-	}
+	/*
+	 * The block maps are filled in lazily, an AG at a time, and
+	 * can be pushed out to a spill file under a memory ceiling.
+	 */
+	dbmap = agmap_alloc(DBMAP_BITS, mp->m_sb.sb_agcount + rt,
+		mp->m_sb.sb_agblocks,
+		rt ? mp->m_sb.sb_rblocks : mp->m_sb.sb_agblocks);
+	inomap = agmap_alloc(32, mp->m_sb.sb_agcount + rt,
+		mp->m_sb.sb_agblocks,
+		rt ? mp->m_sb.sb_rblocks : mp->m_sb.sb_agblocks);
 	if (rt) {
-		dbmap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**dbmap));
-		inomap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**inomap));
 		sumfile = xcalloc(mp->m_rsumsize, 1);
 		sumcompute = xcalloc(mp->m_rsumsize, 1);
 	}
 	nflag = sflag = verbose = optind = 0;
-	while ((c = getopt(argc, argv, "b:i:npsv")) != EOF) {
+	mapmem = 0;
+	pfthreads = PF_DFL_THREADS;
+	while ((c = getopt(argc, argv, "b:i:m:npst:v")) != EOF) {
 		switch (c) {
 		case 'b':
 			bno = atoll(optarg);
@@ -1755,6 +1801,9 @@ init(
 			ino = atoll(optarg);
 			add_ilist(ino);
 			break;
+		case 'm':
+			mapmem = (__uint64_t)atoll(optarg) << 20;
+			break;
 		case 'n':
 			nflag = 1;
 			break;
@@ -1764,6 +1813,9 @@ init(
 		case 's':
 			sflag = 1;
 			break;
+		case 't':
+			pfthreads = atoi(optarg);
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -1772,6 +1824,7 @@ init(
 			return 0;
 		}
 	}
+	agmap_limit(mapmem);
 	error = sbver_err = serious_error = 0;
 	fdblocks = frextents = icount = ifree = 0;
 	sbversion = XFS_SB_VERSION_4;
@@ -3808,6 +3861,50 @@ quota_init(void)
 		qgdata = xcalloc(QDATA_HASH_SIZE, sizeof(qdata_t *));
 }
 
+/*
+ * start reading the header sectors of an AG, the next one is read
+ * while the current one is being checked
+ */
+static void
+readahead_ag(
+	xfs_agnumber_t	agno)
+{
+	if (agno >= mp->m_sb.sb_agcount)
+		return;
+	prefetch_add(XFS_AG_DADDR(mp, agno, XFS_SB_DADDR), 1);
+	prefetch_add(XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR), 1);
+	prefetch_add(XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR), 1);
+	prefetch_add(XFS_AG_DADDR(mp, agno, XFS_AGFL_DADDR), 1);
+}
+
+/*
+ * start reading the children of a btree node before visiting them
+ */
+static void
+readahead_lptrs(
+	xfs_bmbt_ptr_t	*pp,
+	int		n)
+{
+	int		i;
+
+	for (i = 0; i < n; i++)
+		prefetch_add(XFS_FSB_TO_DADDR(mp, INT_GET(pp[i], ARCH_CONVERT)),
+			blkbb);
+}
+
+static void
+readahead_sptrs(
+	xfs_agnumber_t	agno,
+	xfs_agblock_t	*pp,
+	int		n)
+{
+	int		i;
+
+	for (i = 0; i < n; i++)
+		prefetch_add(XFS_AGB_TO_DADDR(mp, agno,
+				INT_GET(pp[i], ARCH_CONVERT)), blkbb);
+}
+
 static void
 scan_ag(
 	xfs_agnumber_t	agno)
@@ -3911,6 +4008,8 @@ scan_ag(
 	    XFS_AGF_BLOCK(mp) != XFS_AGI_BLOCK(mp))
 		set_dbmap(agno, XFS_AGI_BLOCK(mp), 1, DBM_AGI, agno,
 			XFS_SB_BLOCK(mp));
+	readahead_sptrs(agno, &agf->agf_roots[XFS_BTNUM_BNO], 2);
+	readahead_sptrs(agno, &agi->agi_root, 1);
 	scan_freelist(agf);
 	fdblocks--;
 	scan_sbtree(agf,
@@ -4144,6 +4243,7 @@ scanfunc_bmap(
 	}
 	pp = XFS_BTREE_PTR_ADDR(mp->m_sb.sb_blocksize, xfs_bmbt, block, 1,
 		mp->m_bmap_dmxr[0]);
+	readahead_lptrs(pp, INT_GET(block->bb_numrecs, ARCH_CONVERT));
 	for (i = 0; i < INT_GET(block->bb_numrecs, ARCH_CONVERT); i++)
 		scan_lbtree(INT_GET(pp[i], ARCH_CONVERT), level, scanfunc_bmap, type, id, totd, toti,
 			nex, blkmapp, 0, btype);
@@ -4208,6 +4308,7 @@ scanfunc_bno(
 	}
 	pp = XFS_BTREE_PTR_ADDR(mp->m_sb.sb_blocksize, xfs_alloc, block, 1,
 		mp->m_alloc_mxr[1]);
+	readahead_sptrs(seqno, pp, INT_GET(block->bb_numrecs, ARCH_CONVERT));
 	for (i = 0; i < INT_GET(block->bb_numrecs, ARCH_CONVERT); i++)
 		scan_sbtree(agf, INT_GET(pp[i], ARCH_CONVERT), level, 0, scanfunc_bno, TYP_BNOBT);
 }
@@ -4275,6 +4376,7 @@ scanfunc_cnt(
 	}
 	pp = XFS_BTREE_PTR_ADDR(mp->m_sb.sb_blocksize, xfs_alloc, block, 1,
 		mp->m_alloc_mxr[1]);
+	readahead_sptrs(seqno, pp, INT_GET(block->bb_numrecs, ARCH_CONVERT));
 	for (i = 0; i < INT_GET(block->bb_numrecs, ARCH_CONVERT); i++)
 		scan_sbtree(agf, INT_GET(pp[i], ARCH_CONVERT), level, 0, scanfunc_cnt, TYP_CNTBT);
 }
@@ -4324,6 +4426,16 @@ scanfunc_ino(
 		}
 		rp = XFS_BTREE_REC_ADDR(mp->m_sb.sb_blocksize, xfs_inobt, block,
 			1, mp->m_inobt_mxr[0]);
+		/*
+		 * read the inode chunks of this leaf ahead of checking
+		 * the inodes in them
+		 */
+		for (i = 0; i < INT_GET(block->bb_numrecs, ARCH_CONVERT); i++) {
+			agino = INT_GET(rp[i].ir_startino, ARCH_CONVERT);
+			prefetch_add(XFS_AGB_TO_DADDR(mp, seqno,
+					XFS_AGINO_TO_AGBNO(mp, agino)),
+				(int)XFS_FSB_TO_BB(mp, XFS_IALLOC_BLOCKS(mp)));
+		}
 		for (i = 0; i < INT_GET(block->bb_numrecs, ARCH_CONVERT); i++) {
 			agino = INT_GET(rp[i].ir_startino, ARCH_CONVERT);
 			off = XFS_INO_TO_OFFSET(mp, agino);
@@ -4389,6 +4501,7 @@ scanfunc_ino(
 	}
 	pp = XFS_BTREE_PTR_ADDR(mp->m_sb.sb_blocksize, xfs_inobt, block, 1,
 		mp->m_inobt_mxr[1]);
+	readahead_sptrs(seqno, pp, INT_GET(block->bb_numrecs, ARCH_CONVERT));
 	for (i = 0; i < INT_GET(block->bb_numrecs, ARCH_CONVERT); i++)
 		scan_sbtree(agf, INT_GET(pp[i], ARCH_CONVERT), level, 0, scanfunc_ino, TYP_INOBT);
 }
@@ -4413,14 +4526,13 @@ set_inomap(
 	inodata_t	*id)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
 	int		mayprint;
 
 	if (!check_inomap(agno, agbno, len, id->ino))
 		return;
 	mayprint = verbose | id->ilist | blist_size;
-	for (i = 0, idp = &inomap[agno][agbno]; i < len; i++, idp++) {
-		*idp = id;
+	for (i = 0; i < len; i++) {
+		SET_INOMAP(agno, agbno + i, id);
 		if (mayprint &&
 		    (verbose || id->ilist || CHECK_BLISTA(agno, agbno + i)))
 			dbprintf("setting inode to %lld for block %u/%u\n",
@@ -4444,16 +4556,13 @@ set_rinomap(
 	inodata_t	*id)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
 	int		mayprint;
 
 	if (!check_rinomap(bno, len, id->ino))
 		return;
 	mayprint = verbose | id->ilist | blist_size;
-	for (i = 0, idp = &inomap[mp->m_sb.sb_agcount][bno];
-	     i < len;
-	     i++, idp++) {
-		*idp = id;
+	for (i = 0; i < len; i++) {
+		SET_INOMAP(mp->m_sb.sb_agcount, bno + i, id);
 		if (mayprint && (verbose || id->ilist || CHECK_BLIST(bno + i)))
 			dbprintf("setting inode to %lld for rtblock %llu\n",
 				id->ino, bno + i);
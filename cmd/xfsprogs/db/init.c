@@ -47,7 +47,7 @@ char	*fsdevice;
 static void
 usage(void)
 {
-	dbprintf("Usage: %s [-c cmd]... [-p prog] [-l logdev] [-frxV] devname\n", progname);
+	dbprintf("Usage: %s [-c cmd]... [-p prog] [-l logdev] [-dfrxV] devname\n", progname);
 	exit(1);
 }
 
@@ -60,7 +60,7 @@ init(
 	FILE		*cfile = NULL;
 
 	progname = basename(argv[0]);
-	while ((c = getopt(argc, argv, "c:fip:rxVl:")) != EOF) {
+	while ((c = getopt(argc, argv, "c:dfip:rxVl:")) != EOF) {
 		switch (c) {
 		case 'c':
 			if (!cfile)
@@ -76,6 +76,9 @@ init(
                                 exit(1);
                         }
 			break;
+		case 'd':
+			xfsargs.directio = 1;
+			break;
 		case 'f':
 			xfsargs.disfile = 1;
 			break;
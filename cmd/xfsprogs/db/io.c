@@ -43,6 +43,7 @@
 #include "output.h"
 #include "mount.h"
 #include "malloc.h"
+#include "prefetch.h"
 
 static int	pop_f(int argc, char **argv);
 static void     pop_help(void);
@@ -449,13 +450,9 @@ write_bbs(
 	for (j = 0; j < count; j += bbmap ? 1 : count) {
 		if (bbmap)
 			bbno = bbmap->b[j];
-		if (lseek64(xfsargs.dfd, bbno << BBSHIFT, SEEK_SET) < 0) {
-			rval = errno;
-			dbprintf("can't seek in filesystem at bb %lld\n", bbno);
-			return rval;
-		}
 		c = BBTOB(bbmap ? 1 : count);
-		i = (int)write(xfsargs.dfd, (char *)bufp + BBTOB(j), c);
+		i = (int)libxfs_pwrite(xfsargs.ddev, (char *)bufp + BBTOB(j),
+			c, (xfs_off_t)bbno << BBSHIFT);
 		if (i < 0) {
 			rval = errno;
 		} else if (i < c) {
@@ -484,36 +481,32 @@ read_bbs(
         if (!count)
             return EINVAL;
 
+	if (bbmap == NULL && prefetch_take(bbno, count, bufp))
+		return 0;
+
 	c = BBTOB(count);
 	if (*bufp == NULL)
-		buf = xmalloc(c);
+		buf = xmemalign(getpagesize(), c);	/* for direct I/O */
 	else
 		buf = *bufp;
 	for (j = 0; j < count; j += bbmap ? 1 : count) {
 		if (bbmap)
 			bbno = bbmap->b[j];
-		if (lseek64(xfsargs.dfd, bbno << BBSHIFT, SEEK_SET) < 0) {
+		c = BBTOB(bbmap ? 1 : count);
+		i = (int)libxfs_pread(xfsargs.ddev, (char *)buf + BBTOB(j),
+			c, (xfs_off_t)bbno << BBSHIFT);
+		if (i < 0) {
 			rval = errno;
-			dbprintf("can't seek in filesystem at bb %lld\n", bbno);
 			if (*bufp == NULL)
 				xfree(buf);
 			buf = NULL;
-		} else {
-			c = BBTOB(bbmap ? 1 : count);
-			i = (int)read(xfsargs.dfd, (char *)buf + BBTOB(j), c);
-			if (i < 0) {
-				rval = errno;
-				if (*bufp == NULL)
-					xfree(buf);
-				buf = NULL;
-			} else if (i < c) {
-				rval = -1;
-				if (*bufp == NULL)
-					xfree(buf);
-				buf = NULL;
-			} else	
-				rval = 0;
-		}
+		} else if (i < c) {
+			rval = -1;
+			if (*bufp == NULL)
+				xfree(buf);
+			buf = NULL;
+		} else	
+			rval = 0;
 		if (buf == NULL)
 			break;
 	}
@@ -31,6 +31,7 @@
  */
 
 #include <libxfs.h>
+#include <malloc.h>
 #include "init.h"
 #include "malloc.h"
 #include "output.h"
@@ -78,6 +79,21 @@ xmalloc(
 	return NULL;
 }
 
+void *
+xmemalign(
+	size_t	align,
+	size_t	size)
+{
+	void	*ptr;
+
+	ptr = memalign(align, size);
+	if (ptr)
+		return ptr;
+	badmalloc();
+	/* NOTREACHED */
+	return NULL;
+}
+
 void *
 xrealloc(
 	void	*ptr,
@@ -33,5 +33,6 @@
 extern void	*xcalloc(size_t nelem, size_t elsize);
 extern void	xfree(void *ptr);
 extern void	*xmalloc(size_t size);
+extern void	*xmemalign(size_t align, size_t size);
 extern void	*xrealloc(void *ptr, size_t size);
 extern char	*xstrdup(const char *s1);
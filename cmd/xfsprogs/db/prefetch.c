@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+#include <libxfs.h>
+#include <pthread.h>
+#include "data.h"
+#include "malloc.h"
+#include "prefetch.h"
+
+#define	PF_HASHSIZE	1024
+#define	PF_MAXTHREADS	16
+
+typedef enum {
+	PF_QUEUED,	PF_READING,	PF_DONE,	PF_FAILED
+} pfstate_t;
+
+/*
+ * A block is on exactly one of the queue (waiting for a reader), the
+ * done list (read, waiting for read_bbs) or neither (being read).
+ * The done list is in completion order so that if readahead gets
+ * ahead of the check by more than PF_MAXBYTES, the blocks it has
+ * been sitting on longest are the ones thrown away.
+ */
+typedef struct pfbuf {
+	__int64_t	daddr;
+	int		count;
+	pfstate_t	state;
+	void		*buf;
+	struct pfbuf	*hnext;		/* hash chain */
+	struct pfbuf	*next;		/* queue or done list */
+	struct pfbuf	*prev;
+} pfbuf_t;
+
+typedef struct pflist {
+	pfbuf_t		*head;
+	pfbuf_t		*tail;
+} pflist_t;
+
+static pthread_mutex_t	pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	pf_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	pf_read = PTHREAD_COND_INITIALIZER;
+static pthread_t	pf_tids[PF_MAXTHREADS];
+static int		pf_nthreads;
+static int		pf_exit;
+static size_t		pf_bytes;	/* data held or being read */
+static pfbuf_t		*pf_hash[PF_HASHSIZE];
+static pflist_t		pf_queue;
+static pflist_t		pf_done;
+
+static void
+pflist_append(
+	pflist_t	*l,
+	pfbuf_t		*p)
+{
+	p->next = NULL;
+	p->prev = l->tail;
+	if (l->tail)
+		l->tail->next = p;
+	else
+		l->head = p;
+	l->tail = p;
+}
+
+static void
+pflist_remove(
+	pflist_t	*l,
+	pfbuf_t		*p)
+{
+	if (p->prev)
+		p->prev->next = p->next;
+	else
+		l->head = p->next;
+	if (p->next)
+		p->next->prev = p->prev;
+	else
+		l->tail = p->prev;
+	p->next = p->prev = NULL;
+}
+
+static pfbuf_t **
+pf_hashp(
+	__int64_t	daddr)
+{
+	return &pf_hash[(unsigned long)daddr % PF_HASHSIZE];
+}
+
+static pfbuf_t *
+pf_lookup(
+	__int64_t	daddr,
+	int		count)
+{
+	pfbuf_t		*p;
+
+	for (p = *pf_hashp(daddr); p; p = p->hnext)
+		if (p->daddr == daddr && p->count == count)
+			return p;
+	return NULL;
+}
+
+/*
+ * unhash and free a block that is on no list, called with pf_lock
+ */
+static void
+pf_free(
+	pfbuf_t		*p)
+{
+	pfbuf_t		**pp;
+
+	for (pp = pf_hashp(p->daddr); *pp != p; pp = &(*pp)->hnext)
+		;
+	*pp = p->hnext;
+	pf_bytes -= BBTOB(p->count);
+	if (p->buf)
+		xfree(p->buf);
+	xfree(p);
+}
+
+/* ARGSUSED */
+static void *
+pf_reader(
+	void		*arg)
+{
+	pfbuf_t		*p;
+	void		*buf;
+	int		len;
+	ssize_t		n;
+
+	pthread_mutex_lock(&pf_lock);
+	for (;;) {
+		while (!pf_exit && pf_queue.head == NULL)
+			pthread_cond_wait(&pf_work, &pf_lock);
+		if (pf_exit)
+			break;
+		p = pf_queue.head;
+		pflist_remove(&pf_queue, p);
+		p->state = PF_READING;
+		pthread_mutex_unlock(&pf_lock);
+
+		len = BBTOB(p->count);
+		buf = xmemalign(getpagesize(), len);
+		n = libxfs_pread(xfsargs.ddev, buf, len,
+			(xfs_off_t)p->daddr << BBSHIFT);
+
+		pthread_mutex_lock(&pf_lock);
+		if (n == len) {
+			p->buf = buf;
+			p->state = PF_DONE;
+		} else {
+			xfree(buf);
+			p->state = PF_FAILED;
+		}
+		pflist_append(&pf_done, p);
+		pthread_cond_broadcast(&pf_read);
+	}
+	pthread_mutex_unlock(&pf_lock);
+	return NULL;
+}
+
+void
+prefetch_init(
+	int		nthreads)
+{
+	int		i;
+
+	if (nthreads > PF_MAXTHREADS)
+		nthreads = PF_MAXTHREADS;
+	pf_exit = 0;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&pf_tids[i], NULL, pf_reader, NULL))
+			break;
+	}
+	pf_nthreads = i;
+}
+
+void
+prefetch_add(
+	__int64_t	daddr,
+	int		count)
+{
+	pfbuf_t		*p;
+	pfbuf_t		**pp;
+
+	if (pf_nthreads == 0 || count <= 0)
+		return;
+	pthread_mutex_lock(&pf_lock);
+	if (pf_lookup(daddr, count)) {
+		pthread_mutex_unlock(&pf_lock);
+		return;
+	}
+	while (pf_bytes + BBTOB(count) > PF_MAXBYTES && pf_done.head) {
+		p = pf_done.head;
+		pflist_remove(&pf_done, p);
+		pf_free(p);
+	}
+	if (pf_bytes + BBTOB(count) > PF_MAXBYTES) {
+		pthread_mutex_unlock(&pf_lock);
+		return;
+	}
+	p = xcalloc(1, sizeof(*p));
+	p->daddr = daddr;
+	p->count = count;
+	p->state = PF_QUEUED;
+	pp = pf_hashp(daddr);
+	p->hnext = *pp;
+	*pp = p;
+	pf_bytes += BBTOB(count);
+	pflist_append(&pf_queue, p);
+	pthread_cond_signal(&pf_work);
+	pthread_mutex_unlock(&pf_lock);
+}
+
+/*
+ * hand over a prefetched copy of count BBs at daddr, either as the
+ * new *bufp or copied into the caller's *bufp.  returns 0 if there
+ * isn't one and the caller has to read the blocks itself.
+ */
+int
+prefetch_take(
+	__int64_t	daddr,
+	int		count,
+	void		**bufp)
+{
+	pfbuf_t		*p;
+	int		rval = 0;
+
+	if (pf_nthreads == 0)
+		return 0;
+	pthread_mutex_lock(&pf_lock);
+	if ((p = pf_lookup(daddr, count)) == NULL) {
+		pthread_mutex_unlock(&pf_lock);
+		return 0;
+	}
+	if (p->state == PF_QUEUED) {
+		/* not started, quicker to read it ourselves */
+		pflist_remove(&pf_queue, p);
+		pf_free(p);
+		pthread_mutex_unlock(&pf_lock);
+		return 0;
+	}
+	while (p->state == PF_READING)
+		pthread_cond_wait(&pf_read, &pf_lock);
+	pflist_remove(&pf_done, p);
+	if (p->state == PF_DONE) {
+		if (*bufp == NULL) {
+			*bufp = p->buf;
+			p->buf = NULL;
+		} else
+			memcpy(*bufp, p->buf, BBTOB(count));
+		rval = 1;
+	}
+	pf_free(p);
+	pthread_mutex_unlock(&pf_lock);
+	return rval;
+}
+
+/*
+ * stop the readers and throw away anything not used
+ */
+void
+prefetch_stop(void)
+{
+	pfbuf_t		*p;
+	int		i;
+
+	if (pf_nthreads == 0)
+		return;
+	pthread_mutex_lock(&pf_lock);
+	pf_exit = 1;
+	pthread_cond_broadcast(&pf_work);
+	pthread_mutex_unlock(&pf_lock);
+	for (i = 0; i < pf_nthreads; i++)
+		pthread_join(pf_tids[i], NULL);
+	pf_nthreads = 0;
+	while ((p = pf_queue.head) != NULL) {
+		pflist_remove(&pf_queue, p);
+		pf_free(p);
+	}
+	while ((p = pf_done.head) != NULL) {
+		pflist_remove(&pf_done, p);
+		pf_free(p);
+	}
+	ASSERT(pf_bytes == 0);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+/*
+ * Readahead for blockget.  The check walks the filesystem one
+ * set_cur() at a time; where it knows what it is going to read next
+ * (the next AG's headers, the children of a btree node, the inode
+ * chunks of an inobt leaf) it hands the blocks to prefetch_add() and
+ * a few reader threads read them into private buffers in the
+ * background.  read_bbs() then takes the prefetched copy instead of
+ * going to the disk.  Each copy is used once.  Anything that failed
+ * or came back short is simply read again the normal way, so errors
+ * are reported exactly as they would be without readahead.
+ */
+
+#define	PF_DFL_THREADS	4			/* default reader threads */
+#define	PF_MAXBYTES	(32 * 1024 * 1024)	/* readahead memory cap */
+
+extern void	prefetch_init(int nthreads);
+extern void	prefetch_add(__int64_t daddr, int count);
+extern int	prefetch_take(__int64_t daddr, int count, void **bufp);
+extern void	prefetch_stop(void);
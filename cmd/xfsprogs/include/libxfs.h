@@ -106,6 +106,7 @@ typedef struct {
         int             logfd;          /* log subvolume file descriptor */
         int             rtfd;           /* realtime subvolume file descriptor */
 	int		setblksize; 	/* attempt to set device block size */
+	int		directio;	/* bypass the page cache (O_DIRECT) */
 } libxfs_init_t;
 
 #define LIBXFS_ISREADONLY	0x0069	/* disallow all mounted filesystems */
@@ -114,9 +115,12 @@ typedef struct {
 extern char	*progname;
 extern int	libxfs_init (libxfs_init_t *);
 extern int	libxfs_device_to_fd (dev_t);
+extern int	libxfs_device_to_dfd (dev_t);
 extern dev_t	libxfs_device_open (char *, int, int, int);
 extern void	libxfs_device_zero (dev_t, xfs_daddr_t, uint);
 extern void	libxfs_device_close (dev_t);
+extern ssize_t	libxfs_pread (dev_t, void *, size_t, xfs_off_t);
+extern ssize_t	libxfs_pwrite (dev_t, void *, size_t, xfs_off_t);
 
 /* check or write log footer: specify device, log size in blocks & uuid */
 extern int	libxfs_log_clear (dev_t, xfs_daddr_t, uint, uuid_t *, int);
@@ -202,9 +206,22 @@ typedef struct xfs_buf {
 	void		*b_fsprivate;
 	void		*b_fsprivate2;
 	void		*b_fsprivate3;
+	unsigned int	b_flags;	/* LIBXFS_B_* */
+	int		b_refcount;	/* holders, when cached */
+	struct xfs_buf	*b_hnext;	/* buffer cache hash chain */
+	struct xfs_buf	*b_lrunext;	/* buffer cache LRU list */
+	struct xfs_buf	*b_lruprev;
+	char		*b_pool;	/* data from the direct I/O pool */
+	unsigned int	b_poolsize;
 	char		*b_addr;
 	/* b_addr must be the last field */
 } xfs_buf_t;
+
+#define LIBXFS_B_UPTODATE	0x0001	/* contents match (or will) disk */
+#define LIBXFS_B_DIRTY		0x0002	/* needs writing back */
+#define LIBXFS_B_STALE		0x0004	/* purged, free on last release */
+#define LIBXFS_B_NEW		0x0008	/* from getbuf, not yet cached */
+
 #define XFS_BUF_PTR(bp)			((bp)->b_addr)
 #define xfs_buf_offset(bp, offset)	(XFS_BUF_PTR(bp) + (offset))
 #define XFS_BUF_ADDR(bp)		((bp)->b_blkno)
@@ -228,7 +245,61 @@ extern xfs_buf_t	*libxfs_getsb (xfs_mount_t *, int);
 extern int	libxfs_readbufr (dev_t, xfs_daddr_t, xfs_buf_t *, int, int);
 extern int	libxfs_writebuf (xfs_buf_t *, int);
 extern int	libxfs_writebuf_int (xfs_buf_t *, int);
+extern int	libxfs_writebuf_delwri (xfs_buf_t *, int);
+extern int	libxfs_writebufs (xfs_buf_t **, int, int);
+extern void	libxfs_bdirty (xfs_buf_t *);
 extern void	libxfs_putbuf (xfs_buf_t *);
+extern void	libxfs_purgebuf (xfs_buf_t *);
+
+/*
+ * Buffer cache - optional, enabled by libxfs_bcache_init().
+ */
+#define LIBXFS_BHASHSIZE(maxbytes)	((maxbytes) / (4 * 4096) | 1)
+
+extern void	libxfs_bcache_init (unsigned int, size_t);
+extern int	libxfs_bcache_flush (int);
+extern int	libxfs_bcache_enabled (void);
+extern void	libxfs_bcache_purge (void);
+extern void	libxfs_bcache_report (FILE *);
+
+
+/*
+ * Bulk btree loading - builds a short-form (per-AG) btree bottom-up
+ * from records supplied in key order.  The caller fills in the first
+ * group of fields, libxfs_bload_geometry() works out the shape of the
+ * tree for a given number of records, and libxfs_bload() then asks
+ * bl_alloc for every block it needs and bl_getrec for each record in
+ * turn.  bl_getrec formats the record in place in the leaf block and,
+ * if key is not NULL, the key for it as well; it returns 0 if it has
+ * run out of records.
+ */
+typedef struct libxfs_bload_level {
+	int		bll_nblocks;	/* # blocks in level */
+	int		bll_recs_pb;	/* records per block ... */
+	int		bll_modulo;	/* ... plus one for this many */
+	__uint64_t	bll_nrecs;	/* # records (pointers) in level */
+} libxfs_bload_level_t;
+
+typedef struct libxfs_bload {
+	xfs_mount_t	*bl_mp;
+	xfs_agnumber_t	bl_agno;
+	__uint32_t	bl_magic;
+	int		bl_recsize;	/* on-disk leaf record size */
+	int		bl_keysize;	/* on-disk key size */
+	int		bl_fill;	/* % of each block to fill, 0 = 100 */
+	xfs_agblock_t	(*bl_alloc)(void *priv, int level);
+	int		(*bl_getrec)(void *priv, void *rec, void *key);
+	void		*bl_priv;
+
+	int		bl_nlevels;	/* set by libxfs_bload_geometry */
+	xfs_extlen_t	bl_nblocks;
+	libxfs_bload_level_t	bl_level[XFS_BTREE_MAXLEVELS];
+
+	xfs_agblock_t	bl_root;	/* set by libxfs_bload */
+} libxfs_bload_t;
+
+extern xfs_extlen_t	libxfs_bload_geometry (libxfs_bload_t *, __uint64_t);
+extern int	libxfs_bload (libxfs_bload_t *);
 
 
 /*
@@ -275,6 +346,7 @@ extern xfs_trans_t	*libxfs_trans_alloc (xfs_mount_t *, int);
 extern xfs_trans_t	*libxfs_trans_dup (xfs_trans_t *);
 extern int	libxfs_trans_reserve (xfs_trans_t *, uint,uint,uint,uint,uint);
 extern int	libxfs_trans_commit (xfs_trans_t *, uint, xfs_lsn_t *);
+extern int	libxfs_trans_delwri (int);
 extern void	libxfs_trans_cancel (xfs_trans_t *, int);
 extern void	libxfs_mod_sb (xfs_trans_t *, __int64_t);
 
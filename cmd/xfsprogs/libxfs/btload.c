@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+#include <xfs.h>
+
+/*
+ * Bulk btree loader.
+ *
+ * Builds a complete short-form btree (the per-AG free space and inode
+ * btrees) from records that are handed to us already sorted, rather
+ * than inserting them one at a time through a cursor.  The tree is
+ * laid down a level at a time from the leaves up: every block in a
+ * level gets its records (or the keys and pointers of its children)
+ * in one pass, and the level is written out in batches of adjacent
+ * blocks with libxfs_writebufs().  Records are spread evenly over the
+ * blocks of each level, filled to bl_fill percent of capacity.
+ */
+
+#define BLOAD_BATCH	64		/* buffers per libxfs_writebufs() */
+#define BLOAD_MINFILL	50		/* don't go below btree minrecs */
+
+/*
+ * how many records/key-pointer pairs a block at this level can hold
+ */
+static int
+bload_maxrecs(libxfs_bload_t *bl, int level)
+{
+	int	size;
+
+	size = bl->bl_mp->m_sb.sb_blocksize - sizeof(xfs_btree_sblock_t);
+	if (level == 0)
+		return size / bl->bl_recsize;
+	return size / (bl->bl_keysize + sizeof(xfs_agblock_t));
+}
+
+/*
+ * how many we will actually put in each block
+ */
+static int
+bload_target(libxfs_bload_t *bl, int level)
+{
+	int	fill;
+	int	target;
+
+	fill = bl->bl_fill;
+	if (fill <= 0 || fill > 100)
+		fill = 100;
+	else if (fill < BLOAD_MINFILL)
+		fill = BLOAD_MINFILL;
+
+	target = bload_maxrecs(bl, level) * fill / 100;
+	if (target < (level == 0 ? 1 : 2))
+		target = level == 0 ? 1 : 2;
+	return target;
+}
+
+/*
+ * work out the shape of a tree holding nrecs records and return the
+ * total number of blocks it needs.  A tree always has at least one
+ * (possibly empty) leaf block.  A level of more than one block must
+ * give every block at least minrecs (half of maxrecs) or repair will
+ * reject it, so a partial fill never spreads a level over more blocks
+ * than that allows.
+ */
+xfs_extlen_t
+libxfs_bload_geometry(libxfs_bload_t *bl, __uint64_t nrecs)
+{
+	libxfs_bload_level_t	*lp;
+	__uint64_t		maxblocks;
+	int			level;
+
+	bl->bl_nblocks = 0;
+	for (level = 0; level < XFS_BTREE_MAXLEVELS; level++) {
+		lp = &bl->bl_level[level];
+		lp->bll_nrecs = nrecs;
+		lp->bll_nblocks = nrecs == 0 ? 1 :
+				howmany(nrecs, bload_target(bl, level));
+		maxblocks = nrecs / (bload_maxrecs(bl, level) / 2);
+		if (lp->bll_nblocks > maxblocks)
+			lp->bll_nblocks = maxblocks ? maxblocks : 1;
+		lp->bll_recs_pb = nrecs / lp->bll_nblocks;
+		lp->bll_modulo = nrecs % lp->bll_nblocks;
+		bl->bl_nblocks += lp->bll_nblocks;
+		if (lp->bll_nblocks == 1)
+			break;
+		/*
+		 * # of records in the next level up is the # of
+		 * blocks in this one
+		 */
+		nrecs = lp->bll_nblocks;
+	}
+	ASSERT(level < XFS_BTREE_MAXLEVELS);
+	bl->bl_nlevels = level + 1;
+
+	return bl->bl_nblocks;
+}
+
+/*
+ * build and write the tree described by libxfs_bload_geometry().
+ * returns 0 or the first write error; if the record source runs dry
+ * early the remaining leaves are left empty and EINVAL is returned.
+ */
+int
+libxfs_bload(libxfs_bload_t *bl)
+{
+	xfs_mount_t		*mp = bl->bl_mp;
+	libxfs_bload_level_t	*lp;
+	xfs_btree_sblock_t	*block;
+	xfs_buf_t		*bufs[BLOAD_BATCH];
+	xfs_agblock_t		*agbnos;	/* blocks in this level */
+	xfs_agblock_t		*cagbnos;	/* blocks in level below */
+	char			*keys;		/* first key of each block */
+	char			*ckeys;		/* same, level below */
+	char			*kp;
+	xfs_agblock_t		*pp;
+	__uint64_t		child;
+	int			nbufs;
+	int			modulo;
+	int			maxrecs;
+	int			level;
+	int			error;
+	int			empty;
+	int			b;
+	int			i;
+	int			n;
+
+	ASSERT(bl->bl_nlevels > 0);
+
+	agbnos = cagbnos = NULL;
+	keys = ckeys = NULL;
+	error = empty = 0;
+
+	for (level = 0; level < bl->bl_nlevels; level++) {
+		lp = &bl->bl_level[level];
+
+		agbnos = malloc(lp->bll_nblocks * sizeof(xfs_agblock_t));
+		keys = malloc(lp->bll_nblocks * bl->bl_keysize);
+		if (agbnos == NULL || keys == NULL) {
+			fprintf(stderr, "%s: can't allocate btree load "
+				"arrays (%d blocks): %s\n",
+				progname, lp->bll_nblocks, strerror(errno));
+			exit(1);
+		}
+
+		/*
+		 * get all the blocks for the level up front so the
+		 * sibling pointers can be filled in as we go
+		 */
+		for (b = 0; b < lp->bll_nblocks; b++)
+			agbnos[b] = bl->bl_alloc(bl->bl_priv, level);
+
+		maxrecs = bload_maxrecs(bl, level);
+		modulo = lp->bll_modulo;
+		child = 0;
+		nbufs = 0;
+
+		for (b = 0; b < lp->bll_nblocks; b++) {
+			n = lp->bll_recs_pb + (modulo > 0);
+			if (modulo > 0)
+				modulo--;
+
+			bufs[nbufs] = libxfs_getbuf(mp->m_dev,
+					XFS_AGB_TO_DADDR(mp, bl->bl_agno,
+							agbnos[b]),
+					XFS_FSB_TO_BB(mp, 1));
+			block = XFS_BUF_TO_SBLOCK(bufs[nbufs]);
+			bzero(block, mp->m_sb.sb_blocksize);
+
+			INT_SET(block->bb_magic, ARCH_CONVERT, bl->bl_magic);
+			INT_SET(block->bb_level, ARCH_CONVERT, level);
+			INT_SET(block->bb_leftsib, ARCH_CONVERT,
+				b > 0 ? agbnos[b - 1] : NULLAGBLOCK);
+			INT_SET(block->bb_rightsib, ARCH_CONVERT,
+				b < lp->bll_nblocks - 1 ? agbnos[b + 1]
+							: NULLAGBLOCK);
+
+			kp = (char *)(block + 1);
+			if (level == 0)  {
+				for (i = 0; i < n; i++)  {
+					if (empty || !bl->bl_getrec(bl->bl_priv,
+						kp + i * bl->bl_recsize,
+						i == 0 ? keys + b * bl->bl_keysize
+						       : NULL))  {
+						empty = 1;
+						break;
+					}
+				}
+				if (i < n)  {
+					n = i;
+					if (!error)
+						error = EINVAL;
+				}
+			} else  {
+				pp = (xfs_agblock_t *)(kp +
+						maxrecs * bl->bl_keysize);
+				bcopy(ckeys + child * bl->bl_keysize,
+					keys + b * bl->bl_keysize,
+					bl->bl_keysize);
+				for (i = 0; i < n; i++, child++)  {
+					bcopy(ckeys + child * bl->bl_keysize,
+						kp + i * bl->bl_keysize,
+						bl->bl_keysize);
+					INT_SET(pp[i], ARCH_CONVERT,
+						cagbnos[child]);
+				}
+			}
+			INT_SET(block->bb_numrecs, ARCH_CONVERT, n);
+
+			if (++nbufs == BLOAD_BATCH)  {
+				i = libxfs_writebufs(bufs, nbufs, 0);
+				if (i && !error)
+					error = i;
+				nbufs = 0;
+			}
+		}
+		i = libxfs_writebufs(bufs, nbufs, 0);
+		if (i && !error)
+			error = i;
+
+		ASSERT(level == 0 || child == lp->bll_nrecs);
+
+		if (cagbnos != NULL)  {
+			free(cagbnos);
+			free(ckeys);
+		}
+		cagbnos = agbnos;
+		ckeys = keys;
+	}
+
+	bl->bl_root = cagbnos[0];
+	free(cagbnos);
+	free(ckeys);
+
+	return error;
+}
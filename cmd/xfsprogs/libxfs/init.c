@@ -62,8 +62,11 @@ int nextfakedev = -1;	/* device number to give to next fake device */
 static struct dev_to_fd {
 	dev_t dev;
 	int fd;
+	int dfd;	/* O_DIRECT descriptor, -1 if none */
 } dev_map[MAX_DEVS]={{0}};
 
+static int	use_directio;	/* set from libxfs_init_t directio */
+
 static int
 check_ismounted(char *name, char *block, int verbose)
 {
@@ -182,6 +185,42 @@ libxfs_device_to_fd(dev_t device)
 	exit(1);
 }
 
+/* libxfs_device_to_dfd: 
+ *     lookup a device number in the device map
+ *     return the associated O_DIRECT fd, or -1 if there isn't one
+ */
+int
+libxfs_device_to_dfd(dev_t device)
+{
+	int d;
+	
+	for (d=0;d<MAX_DEVS;d++)
+		if (dev_map[d].dev == device) 
+			return dev_map[d].dfd;
+	
+	fprintf(stderr, "%s: device_to_dfd: device %Ld is not open\n", 
+		progname, device);
+	exit(1);
+}
+
+/* device_open_direct:
+ *     in direct I/O mode each device gets a second descriptor opened
+ *     O_DIRECT, used by libxfs_pread/libxfs_pwrite for aligned I/O.
+ *     Not everything supports O_DIRECT (some filesystems holding
+ *     image files don't), so failure just leaves the device buffered.
+ */
+static int
+device_open_direct(char *path, int readonly)
+{
+	int		fd;
+
+	if ((fd = open(path, (readonly ? O_RDONLY : O_RDWR) | O_DIRECT)) < 0)
+		fprintf(stderr, "%s: warning - cannot open %s for direct "
+			"I/O, using buffered I/O: %s\n",
+			progname, path, strerror(errno));
+	return fd;
+}
+
 /* libxfs_device_open:
  *     open a device and return its device number
  */
@@ -237,6 +276,8 @@ libxfs_device_open(char *path, int creat, int readonly, int setblksize)
 		if (!dev_map[d].dev) {
 			dev_map[d].dev=dev;
 			dev_map[d].fd=fd;
+			dev_map[d].dfd=(use_directio && !creat) ?
+				device_open_direct(path, readonly) : -1;
 			
 			return dev;
 		}
@@ -250,12 +291,18 @@ libxfs_device_close(dev_t dev)
 {
 	int     d;
 
+	/* delayed writes must reach the device before it goes away */
+	libxfs_bcache_purge();
+
 	for (d=0;d<MAX_DEVS;d++)
 		if (dev_map[d].dev == dev) {
 			int fd;
 			
 			fd=dev_map[d].fd;
+			if (dev_map[d].dfd >= 0)
+				close(dev_map[d].dfd);
 			dev_map[d].dev=dev_map[d].fd=0;
+			dev_map[d].dfd=-1;
 			
 //XFS_PORT			fsync(fd);
 //XFS_PORT			ioctl(fd, BLKFLSBUF, 0);
@@ -301,6 +348,7 @@ libxfs_init(libxfs_init_t *a)
 	a->ddev = a->logdev = a->rtdev = 0;
 	a->dfd = a->logfd = a->rtfd = -1;
 	a->dsize = a->logBBsize = a->logBBstart = a->rtsize = 0;
+	use_directio = a->directio;
 
 	(void)getcwd(curdir,MAXPATHLEN);
 	needcd = 0;
@@ -770,6 +818,7 @@ libxfs_mount(
 void
 libxfs_umount(xfs_mount_t *mp)
 {
+	libxfs_bcache_purge();
 	manage_zones(1);
 	free(mp->m_perag);
 }
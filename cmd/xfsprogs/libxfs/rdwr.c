@@ -34,12 +34,178 @@
 #include <malloc.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 
 #include <xfs_log.h>
 #include <xfs_log_priv.h>
 
 #define BBTOOFF64(bbs)  (((xfs_off_t)(bbs)) << BBSHIFT)
 #define BDSTRAT_SIZE    (256 * 1024)
+#define ZERO_SIZE	(1024 * 1024)
+
+#if defined(__linux__) && !defined(BLKZEROOUT)
+#define	BLKZEROOUT	_IO(0x12,127)	/* zero a range of a block device */
+#endif
+
+/*
+ * Direct I/O.  When libxfs_init() was asked for it, each device also
+ * has an O_DIRECT descriptor, and transfers whose buffer, length and
+ * offset are all sector aligned go through it - skipping the copy
+ * into the page cache and leaving whatever else is cached on the
+ * machine alone.  Anything else, or anything the device rejects with
+ * EINVAL, falls back to the ordinary descriptor.  The kernel keeps
+ * the two views of the device coherent.
+ */
+#define DIO_ALIGN	BBSIZE
+
+#define dio_aligned(buf,len,off)	\
+	((((unsigned long)(buf) | (len) | (off)) & (DIO_ALIGN - 1)) == 0)
+
+ssize_t
+libxfs_pread(dev_t dev, void *buf, size_t len, xfs_off_t off)
+{
+	int		fd = libxfs_device_to_dfd(dev);
+	ssize_t		sts;
+
+	if (fd >= 0 && dio_aligned(buf, len, off)) {
+		sts = pread64(fd, buf, len, off);
+		if (sts >= 0 || errno != EINVAL)
+			return sts;
+	}
+	return pread64(libxfs_device_to_fd(dev), buf, len, off);
+}
+
+ssize_t
+libxfs_pwrite(dev_t dev, void *buf, size_t len, xfs_off_t off)
+{
+	int		fd = libxfs_device_to_dfd(dev);
+	ssize_t		sts;
+
+	if (fd >= 0 && dio_aligned(buf, len, off)) {
+		sts = pwrite64(fd, buf, len, off);
+		if (sts >= 0 || errno != EINVAL)
+			return sts;
+	}
+	return pwrite64(libxfs_device_to_fd(dev), buf, len, off);
+}
+
+/*
+ * Aligned buffer pool.  Buffers on a direct I/O device can't keep
+ * their data straight after the xfs_buf_t header, so it comes from
+ * memalign() instead.  Released data is kept on per-size free lists
+ * (powers of two, up to DIOPOOL_MAXSHIFT) so the steady churn of
+ * same-sized metadata buffers doesn't go back to the allocator each
+ * time; at most DIOPOOL_MAXBYTES is held on the lists.
+ */
+#define DIOPOOL_MINSHIFT	BBSHIFT
+#define DIOPOOL_MAXSHIFT	16
+#define DIOPOOL_MAXBYTES	(16 * 1024 * 1024)
+
+typedef struct diopool_ent {
+	struct diopool_ent	*next;
+} diopool_ent_t;
+
+static diopool_ent_t	*diopool[DIOPOOL_MAXSHIFT + 1];
+static size_t		diopool_bytes;
+static pthread_mutex_t	diopool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int
+diopool_size(size_t size)
+{
+	int		shift;
+
+	for (shift = DIOPOOL_MINSHIFT; shift <= DIOPOOL_MAXSHIFT; shift++)
+		if (((size_t)1 << shift) >= size)
+			return 1 << shift;
+	return (size + DIO_ALIGN - 1) & ~(DIO_ALIGN - 1);
+}
+
+static int
+diopool_index(unsigned int poolsize)
+{
+	int		shift;
+
+	for (shift = DIOPOOL_MINSHIFT; shift <= DIOPOOL_MAXSHIFT; shift++)
+		if ((1 << shift) == poolsize)
+			return shift;
+	return -1;
+}
+
+static char *
+diopool_alloc(unsigned int poolsize)
+{
+	diopool_ent_t	*ent = NULL;
+	int		i;
+
+	if ((i = diopool_index(poolsize)) >= 0) {
+		pthread_mutex_lock(&diopool_lock);
+		if ((ent = diopool[i]) != NULL) {
+			diopool[i] = ent->next;
+			diopool_bytes -= poolsize;
+		}
+		pthread_mutex_unlock(&diopool_lock);
+	}
+	if (ent == NULL &&
+	    (ent = memalign(getpagesize(), poolsize)) == NULL) {
+		fprintf(stderr, "%s: buf memalign failed (%u bytes): %s\n",
+			progname, poolsize, strerror(errno));
+		exit(1);
+	}
+	bzero(ent, poolsize);
+	return (char *)ent;
+}
+
+static void
+diopool_free(char *p, unsigned int poolsize)
+{
+	diopool_ent_t	*ent = (diopool_ent_t *)p;
+	int		i;
+
+	if ((i = diopool_index(poolsize)) >= 0) {
+		pthread_mutex_lock(&diopool_lock);
+		if (diopool_bytes + poolsize <= DIOPOOL_MAXBYTES) {
+			ent->next = diopool[i];
+			diopool[i] = ent;
+			diopool_bytes += poolsize;
+			ent = NULL;
+		}
+		pthread_mutex_unlock(&diopool_lock);
+	}
+	if (ent != NULL)
+		free(ent);
+}
+
+/*
+ * Have the device zero a range itself if it knows how: BLKZEROOUT on
+ * a block device (which uses write-zeroes or discard where the
+ * hardware supports it) or a punched hole in a regular file.
+ * Returns 0 if the range now reads back as zeroes.
+ */
+static int
+device_zero_fast(int fd, xfs_off_t start, xfs_off_t len)
+{
+	struct stat64	st;
+
+	if (fstat64(fd, &st) < 0)
+		return -1;
+#ifdef BLKZEROOUT
+	if (S_ISBLK(st.st_mode)) {
+		__uint64_t	range[2];
+
+		range[0] = start;
+		range[1] = len;
+		return ioctl(fd, BLKZEROOUT, range);
+	}
+#endif
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (S_ISREG(st.st_mode))
+		return fallocate64(fd, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, start, len);
+#endif
+	return -1;
+}
 
 void
 libxfs_device_zero(dev_t dev, xfs_daddr_t start, uint len)
@@ -47,27 +213,25 @@ libxfs_device_zero(dev_t dev, xfs_daddr_t start, uint len)
 	xfs_daddr_t     bno;
 	uint		nblks;
 	int		size;
-	int		fd;
 	char		*z;
 
-	size = BDSTRAT_SIZE <= BBTOB(len) ? BDSTRAT_SIZE : BBTOB(len);
+	if (device_zero_fast(libxfs_device_to_fd(dev), BBTOOFF64(start),
+			     BBTOOFF64(len)) == 0)
+		return;
+
+	size = ZERO_SIZE <= BBTOB(len) ? ZERO_SIZE : BBTOB(len);
 	if ((z = memalign(getpagesize(), size)) == NULL) {
 		fprintf(stderr, "%s: device_zero can't memalign %d bytes: %s\n",
 			progname, size, strerror(errno));
 		exit(1);
 	}
 	bzero(z, size);
-	fd = libxfs_device_to_fd(dev);
 	for (bno = start; bno < start + len; ) {
 		nblks = (uint)BTOBB(size);
 		if (bno + nblks > start + len)
 			nblks = (uint)(start + len - bno);
-		if (lseek64(fd, BBTOOFF64(bno), SEEK_SET) < 0) {
-			fprintf(stderr, "%s: device_zero lseek64 failed: %s\n",
-				progname, strerror(errno));
-			exit(1);
-		}
-		if (write(fd, z, BBTOB(nblks)) < BBTOB(nblks)) {
+		if (libxfs_pwrite(dev, z, BBTOB(nblks), BBTOOFF64(bno)) <
+							BBTOB(nblks)) {
 			fprintf(stderr, "%s: device_zero write failed: %s\n",
 				progname, strerror(errno));
 			exit(1);
@@ -158,57 +322,534 @@ libxfs_log_clear(
 }
 
 /*
- * Simple I/O interface
+ * Buffer cache
+ *
+ * Without a cache every libxfs_getbuf() hands out a private, freshly
+ * allocated buffer, and libxfs_putbuf() frees it again.  Once a program
+ * calls libxfs_bcache_init(), released buffers are instead kept on a
+ * hash keyed by (dev, blkno, len) and on an LRU list, so metadata that
+ * is read over and over (AG headers, btree blocks, inode clusters) is
+ * only read from disk once.  Holders of the same block share a single
+ * buffer and are counted in b_refcount.
+ *
+ * libxfs_writebuf() still writes at once; the cache only keeps a clean
+ * copy for later readers.  Delayed writes are opt-in: only buffers
+ * released with libxfs_writebuf_delwri() (as transactions do inside
+ * libxfs_trans_delwri()) or marked with libxfs_bdirty() are left dirty,
+ * to be written back when evicted, by libxfs_bcache_flush(), and when
+ * the device is closed.  libxfs_purgebuf() drops a buffer whose block
+ * has been freed, so its contents are neither written nor seen again.
+ *
+ * Buffers from libxfs_getbuf() are about to be filled with new contents
+ * and stay private to the caller until they are written or marked dirty;
+ * only then do they replace any cached copy of the block, so nobody can
+ * read the old disk contents over them, or see them half built.
+ *
+ * The cache may be used from several threads at once.  bc_lock covers
+ * the hash, the LRU, reference counts and buffer flags.  Reads are
+ * done without it, but under one of the bc_iolock stripes so that a
+ * block missing from the cache is only read in once.  Nothing is
+ * written with bc_lock held: a buffer being written back is held and
+ * marked clean, and the lock is dropped around the write.
  */
+#define BCACHE_IOLOCKS	64
 
-xfs_buf_t *
-libxfs_getbuf(dev_t device, xfs_daddr_t blkno, int len)
+typedef struct xfs_bcache {
+	xfs_buf_t	**bc_hash;	/* hash chains */
+	unsigned int	bc_hashsize;
+	xfs_buf_t	*bc_lruhead;	/* most recently released */
+	xfs_buf_t	*bc_lrutail;	/* next candidate for eviction */
+	size_t		bc_maxbytes;	/* soft limit on cached data */
+	size_t		bc_bytes;	/* data currently cached */
+	unsigned int	bc_count;	/* buffers currently cached */
+	__uint64_t	bc_hits;
+	__uint64_t	bc_misses;
+	__uint64_t	bc_writebacks;
+	__uint64_t	bc_evictions;
+	pthread_mutex_t	bc_lock;
+	pthread_mutex_t	bc_iolock[BCACHE_IOLOCKS];
+} xfs_bcache_t;
+
+static xfs_bcache_t	*bcache;
+
+#define bcache_lock()	\
+	do { if (bcache) pthread_mutex_lock(&bcache->bc_lock); } while (0)
+#define bcache_unlock()	\
+	do { if (bcache) pthread_mutex_unlock(&bcache->bc_lock); } while (0)
+
+static int libxfs_bwrite(xfs_buf_t *, int);
+static int libxfs_bufcmp(const void *, const void *);
+static int libxfs_bwritev(xfs_buf_t **, int, int);
+
+static xfs_buf_t *
+libxfs_balloc(dev_t device, xfs_daddr_t blkno, int len)
 {
 	xfs_buf_t	*buf;
 	size_t		total;
+	int		pooled;
 
-	total = sizeof(xfs_buf_t) + BBTOB(len);
+	pooled = libxfs_device_to_dfd(device) >= 0;
+	total = sizeof(xfs_buf_t) + (pooled ? 0 : BBTOB(len));
 	if ((buf = calloc(total, 1)) == NULL) {
 		fprintf(stderr, "%s: buf calloc failed (%d bytes): %s\n",
 			progname, total, strerror(errno));
 		exit(1);
 	}
-	/* by default, we allocate buffer directly after the header */
 	buf->b_blkno = blkno;
 	buf->b_bcount = BBTOB(len);
 	buf->b_dev = device;
-	buf->b_addr = (char *)(&buf->b_addr + 1);	/* must be last field */
+	if (pooled) {
+		/* direct I/O wants aligned memory */
+		buf->b_poolsize = diopool_size(BBTOB(len));
+		buf->b_pool = diopool_alloc(buf->b_poolsize);
+		buf->b_addr = buf->b_pool;
+	} else {
+		/* by default, we allocate buffer directly after the header */
+		buf->b_addr = (char *)(&buf->b_addr + 1); /* must be last */
+	}
 #ifdef IO_DEBUG
 	fprintf(stderr, "getbuf allocated %ubytes, blkno=%llu(%llu), %p\n",
 		BBTOB(len), BBTOOFF64(blkno), blkno, buf);
 #endif
+	return buf;
+}
+
+static void
+libxfs_bfree(xfs_buf_t *buf)
+{
+	xfs_buf_log_item_t	*bip;
+	extern xfs_zone_t	*xfs_buf_item_zone;
+
+	bip = XFS_BUF_FSPRIVATE(buf, xfs_buf_log_item_t *);
+	if (bip)
+		libxfs_zone_free(xfs_buf_item_zone, bip);
+#ifdef IO_DEBUG
+	fprintf(stderr, "putbuf released %ubytes, %p\n", buf->b_bcount, buf);
+#endif
+	if (buf->b_pool)
+		diopool_free(buf->b_pool, buf->b_poolsize);
+	free(buf);
+}
 
-	return(buf);
+static unsigned int
+bcache_hash(dev_t dev, xfs_daddr_t blkno)
+{
+	__uint64_t	key = (__uint64_t)blkno ^ ((__uint64_t)dev << 40);
+
+	key ^= key >> 17;
+	return (unsigned int)(key % bcache->bc_hashsize);
+}
+
+static void
+bcache_lru_remove(xfs_buf_t *buf)
+{
+	if (buf->b_lruprev)
+		buf->b_lruprev->b_lrunext = buf->b_lrunext;
+	else
+		bcache->bc_lruhead = buf->b_lrunext;
+	if (buf->b_lrunext)
+		buf->b_lrunext->b_lruprev = buf->b_lruprev;
+	else
+		bcache->bc_lrutail = buf->b_lruprev;
+	buf->b_lrunext = buf->b_lruprev = NULL;
+}
+
+static void
+bcache_lru_insert(xfs_buf_t *buf)
+{
+	buf->b_lruprev = NULL;
+	buf->b_lrunext = bcache->bc_lruhead;
+	if (bcache->bc_lruhead)
+		bcache->bc_lruhead->b_lruprev = buf;
+	else
+		bcache->bc_lrutail = buf;
+	bcache->bc_lruhead = buf;
+}
+
+static void
+bcache_hash_insert(xfs_buf_t *buf)
+{
+	unsigned int	h = bcache_hash(buf->b_dev, buf->b_blkno);
+
+	buf->b_hnext = bcache->bc_hash[h];
+	bcache->bc_hash[h] = buf;
+	bcache->bc_bytes += buf->b_bcount;
+	bcache->bc_count++;
+}
+
+static void
+bcache_hash_remove(xfs_buf_t *buf)
+{
+	xfs_buf_t	**bpp;
+
+	bpp = &bcache->bc_hash[bcache_hash(buf->b_dev, buf->b_blkno)];
+	for (; *bpp != NULL; bpp = &(*bpp)->b_hnext) {
+		if (*bpp == buf) {
+			*bpp = buf->b_hnext;
+			buf->b_hnext = NULL;
+			bcache->bc_bytes -= buf->b_bcount;
+			bcache->bc_count--;
+			return;
+		}
+	}
+	ASSERT(0);
+}
+
+/*
+ * Drop a reference taken from inside the cache; called with bc_lock
+ * held.
+ */
+static void
+bcache_rele(xfs_buf_t *buf)
+{
+	if (--buf->b_refcount > 0)
+		return;
+	if (buf->b_flags & LIBXFS_B_STALE)
+		libxfs_bfree(buf);
+	else
+		bcache_lru_insert(buf);
+}
+
+/*
+ * Write back a delayed write.  Called with bc_lock held and a
+ * reference on the buffer; the lock is dropped for the write, so
+ * the caller has to look again at anything else it was relying on.
+ * The write can no longer be reported to whoever issued it, so
+ * failure is fatal.
+ */
+static void
+bcache_writeback(xfs_buf_t *buf)
+{
+	ASSERT(buf->b_refcount > 0);
+	buf->b_flags &= ~LIBXFS_B_DIRTY;
+	bcache->bc_writebacks++;
+	bcache_unlock();
+	libxfs_bwrite(buf, 1);
+	bcache_lock();
+	buf->b_flags |= LIBXFS_B_UPTODATE;
+}
+
+/*
+ * Write back (if dirty) and free an unreferenced cached buffer.  If
+ * it was picked up, dirtied or purged while bc_lock was dropped for
+ * the write, it is left to whoever did that.
+ */
+static void
+bcache_evict(xfs_buf_t *buf)
+{
+	ASSERT(buf->b_refcount == 0);
+	bcache_lru_remove(buf);
+	if (buf->b_flags & LIBXFS_B_DIRTY) {
+		buf->b_refcount++;
+		bcache_writeback(buf);
+		if (buf->b_refcount > 1 ||
+		    (buf->b_flags & (LIBXFS_B_DIRTY | LIBXFS_B_STALE))) {
+			bcache_rele(buf);
+			return;
+		}
+		buf->b_refcount = 0;
+	}
+	bcache_hash_remove(buf);
+	bcache->bc_evictions++;
+	libxfs_bfree(buf);
+}
+
+/*
+ * Evict least recently used buffers until "want" more bytes fit
+ * under the limit.  Buffers still held by someone are never on the
+ * LRU, so the cache may run over its limit if all of it is in use.
+ */
+static void
+bcache_shrink(size_t want)
+{
+	while (bcache->bc_lrutail != NULL &&
+	       bcache->bc_bytes + want > bcache->bc_maxbytes)
+		bcache_evict(bcache->bc_lrutail);
+}
+
+/*
+ * Take a held buffer off the hash.  Its holders keep it, detached,
+ * and it is freed without being written when the last one lets go.
+ */
+static void
+bcache_detach(xfs_buf_t *buf)
+{
+	ASSERT(buf->b_refcount > 0);
+	bcache_hash_remove(buf);
+	buf->b_flags |= LIBXFS_B_STALE;
+	buf->b_flags &= ~(LIBXFS_B_UPTODATE | LIBXFS_B_DIRTY);
+}
+
+/*
+ * Make a buffer from libxfs_getbuf() the cached copy of its block;
+ * called with bc_lock held.  Any older copy is written back first if
+ * dirty, so writes to the block stay in order, then freed or, if
+ * someone still holds it, detached.  The caller's reference becomes
+ * the buffer's first.
+ */
+static void
+bcache_publish(xfs_buf_t *buf)
+{
+	xfs_buf_t	*old;
+	xfs_buf_t	*next;
+	unsigned int	h;
+
+	if (bcache == NULL || !(buf->b_flags & LIBXFS_B_NEW))
+		return;
+	ASSERT(buf->b_refcount == 0);
+	h = bcache_hash(buf->b_dev, buf->b_blkno);
+	for (old = bcache->bc_hash[h]; old != NULL; old = next) {
+		next = old->b_hnext;
+		if (old->b_dev != buf->b_dev || old->b_blkno != buf->b_blkno)
+			continue;
+		if (old->b_flags & LIBXFS_B_DIRTY) {
+			/* the chain may change while this is written */
+			if (old->b_refcount++ == 0)
+				bcache_lru_remove(old);
+			bcache_writeback(old);
+			bcache_rele(old);
+			next = bcache->bc_hash[h];
+			continue;
+		}
+		if (old->b_refcount == 0)
+			bcache_evict(old);
+		else
+			bcache_detach(old);
+	}
+	buf->b_flags &= ~LIBXFS_B_NEW;
+	buf->b_flags |= LIBXFS_B_UPTODATE;
+	buf->b_refcount = 1;
+	bcache_hash_insert(buf);
+	bcache_shrink(0);
+}
+
+void
+libxfs_bcache_init(unsigned int hashsize, size_t maxbytes)
+{
+	int	i;
+
+	if (bcache != NULL || maxbytes == 0)
+		return;
+	if (hashsize == 0)
+		hashsize = LIBXFS_BHASHSIZE(maxbytes);
+	if ((bcache = calloc(1, sizeof(xfs_bcache_t))) == NULL ||
+	    (bcache->bc_hash = calloc(hashsize, sizeof(xfs_buf_t *))) == NULL) {
+		fprintf(stderr, "%s: buffer cache init failed (%u buckets): %s\n",
+			progname, hashsize, strerror(errno));
+		exit(1);
+	}
+	bcache->bc_hashsize = hashsize;
+	bcache->bc_maxbytes = maxbytes;
+	pthread_mutex_init(&bcache->bc_lock, NULL);
+	for (i = 0; i < BCACHE_IOLOCKS; i++)
+		pthread_mutex_init(&bcache->bc_iolock[i], NULL);
+}
+
+/*
+ * Write back every dirty buffer; returns the first error seen.  The
+ * dirty buffers are gathered up and written in disk address order so
+ * that a flush after a burst of delayed writes is mostly sequential.
+ * They are marked clean and held while bc_lock is dropped for the
+ * writes, so anyone dirtying one again meanwhile gets it written
+ * later, and one that fails to write is left dirty.
+ */
+int
+libxfs_bcache_flush(int die)
+{
+	xfs_buf_t	*buf;
+	xfs_buf_t	**bufs;
+	unsigned int	i;
+	int		count = 0;
+	int		error;
+
+	if (bcache == NULL)
+		return 0;
+	bcache_lock();
+	if (bcache->bc_count == 0) {
+		bcache_unlock();
+		return 0;
+	}
+	if ((bufs = malloc(bcache->bc_count * sizeof(xfs_buf_t *))) == NULL) {
+		fprintf(stderr, "%s: bcache flush can't allocate %u buffer "
+			"pointers: %s\n", progname, bcache->bc_count,
+			strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < bcache->bc_hashsize; i++) {
+		for (buf = bcache->bc_hash[i]; buf; buf = buf->b_hnext) {
+			if (!(buf->b_flags & LIBXFS_B_DIRTY))
+				continue;
+			if (buf->b_refcount++ == 0)
+				bcache_lru_remove(buf);
+			buf->b_flags &= ~LIBXFS_B_DIRTY;
+			bufs[count++] = buf;
+		}
+	}
+	bcache->bc_writebacks += count;
+	bcache_unlock();
+
+	qsort(bufs, count, sizeof(xfs_buf_t *), libxfs_bufcmp);
+	error = libxfs_bwritev(bufs, count, die);
+	for (i = 0; i < count; i++)
+		libxfs_putbuf(bufs[i]);
+	free(bufs);
+	return error;
+}
+
+/*
+ * Write back and drop every unreferenced buffer.
+ */
+void
+libxfs_bcache_purge(void)
+{
+	if (bcache == NULL)
+		return;
+	bcache_lock();
+	while (bcache->bc_lrutail != NULL)
+		bcache_evict(bcache->bc_lrutail);
+	bcache_unlock();
+	libxfs_bcache_flush(1);
+#ifdef IO_DEBUG
+	if (bcache->bc_count)
+		fprintf(stderr, "bcache purge: %u buffers still held\n",
+			bcache->bc_count);
+#endif
+}
+
+void
+libxfs_bcache_report(FILE *fp)
+{
+	__uint64_t	lookups;
+
+	if (bcache == NULL)
+		return;
+	bcache_lock();
+	lookups = bcache->bc_hits + bcache->bc_misses;
+	fprintf(fp, "buffer cache: %u buffers, %llu of %llu KB, "
+		"%llu hits / %llu lookups (%u%%), "
+		"%llu evictions, %llu writebacks\n",
+		bcache->bc_count,
+		(unsigned long long)bcache->bc_bytes >> 10,
+		(unsigned long long)bcache->bc_maxbytes >> 10,
+		(unsigned long long)bcache->bc_hits,
+		(unsigned long long)lookups,
+		lookups ? (unsigned int)(bcache->bc_hits * 100 / lookups) : 0,
+		(unsigned long long)bcache->bc_evictions,
+		(unsigned long long)bcache->bc_writebacks);
+	bcache_unlock();
+}
+
+/*
+ * Find or create the cached buffer for a block and take a reference
+ * to it; called with bc_lock held.
+ */
+static xfs_buf_t *
+bcache_lookup(dev_t device, xfs_daddr_t blkno, int len)
+{
+	xfs_buf_t	*buf;
+	xfs_buf_t	**bpp;
+	unsigned int	h;
+
+	h = bcache_hash(device, blkno);
+	bpp = &bcache->bc_hash[h];
+	while ((buf = *bpp) != NULL) {
+		if (buf->b_dev != device || buf->b_blkno != blkno) {
+			bpp = &buf->b_hnext;
+			continue;
+		}
+		if (buf->b_bcount == BBTOB(len)) {
+			if (buf->b_refcount++ == 0)
+				bcache_lru_remove(buf);
+			bcache->bc_hits++;
+			return buf;
+		}
+		/*
+		 * Same start, different length: retire the old buffer
+		 * so the two views cannot disagree.  If it is still
+		 * held we have to live with the alias.  Evicting may
+		 * drop bc_lock, so start the chain over afterwards.
+		 */
+		if (buf->b_refcount == 0) {
+			bcache_evict(buf);
+			bpp = &bcache->bc_hash[h];
+			continue;
+		}
+		bpp = &buf->b_hnext;
+	}
+
+	/*
+	 * Insert the new buffer before making room for it: shrinking
+	 * may drop bc_lock, and another thread must find this buffer
+	 * rather than add its own.
+	 */
+	bcache->bc_misses++;
+	buf = libxfs_balloc(device, blkno, len);
+	buf->b_refcount = 1;
+	bcache_hash_insert(buf);
+	bcache_shrink(0);
+	return buf;
+}
+
+/*
+ * Simple I/O interface
+ */
+
+/*
+ * Callers of getbuf are about to overwrite the block and have always
+ * been handed zeroed memory.  The buffer is private until it is
+ * written or marked dirty, see bcache_publish(); until then the cache
+ * and anyone holding the old contents are left alone.
+ */
+xfs_buf_t *
+libxfs_getbuf(dev_t device, xfs_daddr_t blkno, int len)
+{
+	xfs_buf_t	*buf;
+
+	buf = libxfs_balloc(device, blkno, len);
+	if (bcache != NULL)
+		buf->b_flags |= LIBXFS_B_NEW;
+	return buf;
 }
 
 int
 libxfs_readbufr(dev_t dev, xfs_daddr_t blkno, xfs_buf_t *buf, int len, int die)
 {
-	int	fd = libxfs_device_to_fd(dev);
+	int	rehash;
 
+	ASSERT(BBTOB(len) <= buf->b_bcount);
+	bcache_lock();
+	/*
+	 * A delayed write still pending on a cached buffer goes out to
+	 * the block it was meant for before the buffer is read over.
+	 */
+	while (bcache != NULL && buf->b_refcount > 0 &&
+	       (buf->b_flags & (LIBXFS_B_DIRTY | LIBXFS_B_STALE)) ==
+							LIBXFS_B_DIRTY)
+		bcache_writeback(buf);
+	rehash = bcache != NULL && buf->b_refcount > 0 &&
+		 !(buf->b_flags & LIBXFS_B_STALE) &&
+		 (buf->b_dev != dev || buf->b_blkno != blkno);
+	if (rehash)
+		bcache_hash_remove(buf);
 	buf->b_dev = dev;
 	buf->b_blkno = blkno;
-	ASSERT(BBTOB(len) <= buf->b_bcount);
+	if (rehash)
+		bcache_hash_insert(buf);
+	buf->b_flags &= ~LIBXFS_B_UPTODATE;
+	bcache_unlock();
 
-	if (lseek64(fd, BBTOOFF64(blkno), SEEK_SET) < 0) {
-		fprintf(stderr, "%s: lseek64 to %llu failed: %s\n",
+	/* positioned reads, other threads may share the descriptor */
+	if (libxfs_pread(dev, buf->b_addr, BBTOB(len), BBTOOFF64(blkno)) < 0) {
+		fprintf(stderr, "%s: read at %llu failed: %s\n",
 			progname, BBTOOFF64(blkno), strerror(errno));
-		ASSERT(0);
 		if (die)
 			exit(1);
 		return errno;
 	}
-	if (read(fd, buf->b_addr, BBTOB(len)) < 0) {
-		fprintf(stderr, "%s: read failed: %s\n",
-			progname, strerror(errno));
-		if (die)
-			exit(1);
-		return errno;
+	if (BBTOB(len) == buf->b_bcount) {
+		bcache_lock();
+		buf->b_flags |= LIBXFS_B_UPTODATE;
+		bcache_unlock();
 	}
 #ifdef IO_DEBUG
 	fprintf(stderr, "readbufr read %ubytes, blkno=%llu(%llu), %p\n",
@@ -221,12 +862,40 @@ xfs_buf_t *
 libxfs_readbuf(dev_t dev, xfs_daddr_t blkno, int len, int die)
 {
 	xfs_buf_t	*buf;
+	pthread_mutex_t	*iolock;
+	int		uptodate;
 	int		error;
 
-	buf = libxfs_getbuf(dev, blkno, len);
-	error = libxfs_readbufr(dev, blkno, buf, len, die);
+	if (bcache == NULL) {
+		buf = libxfs_balloc(dev, blkno, len);
+		error = libxfs_readbufr(dev, blkno, buf, len, die);
+		if (error) {
+			libxfs_putbuf(buf);
+			return NULL;
+		}
+		return buf;
+	}
+
+	bcache_lock();
+	buf = bcache_lookup(dev, blkno, len);
+	uptodate = buf->b_flags & LIBXFS_B_UPTODATE;
+	bcache_unlock();
+	if (uptodate)
+		return buf;
+
+	/*
+	 * Whoever gets the I/O lock first reads the block in, anyone
+	 * else looking for it at the same time finds it up to date.
+	 */
+	iolock = &bcache->bc_iolock[bcache_hash(dev, blkno) % BCACHE_IOLOCKS];
+	pthread_mutex_lock(iolock);
+	bcache_lock();
+	uptodate = buf->b_flags & LIBXFS_B_UPTODATE;
+	bcache_unlock();
+	error = uptodate ? 0 : libxfs_readbufr(dev, blkno, buf, len, die);
+	pthread_mutex_unlock(iolock);
 	if (error) {
-		libxfs_putbuf(buf);
+		libxfs_purgebuf(buf);
 		return NULL;
 	}
 	return buf;
@@ -239,29 +908,20 @@ libxfs_getsb(xfs_mount_t *mp, int die)
 				XFS_FSB_TO_BB(mp, 1), die);
 }
 
-int
-libxfs_writebuf_int(xfs_buf_t *buf, int die)
+static int
+libxfs_bwrite(xfs_buf_t *buf, int die)
 {
 	int	sts;
-	int	fd = libxfs_device_to_fd(buf->b_dev);
 
-	if (lseek64(fd, BBTOOFF64(buf->b_blkno), SEEK_SET) < 0) {
-		fprintf(stderr, "%s: lseek64 to %llu failed: %s\n",
-			progname, BBTOOFF64(buf->b_blkno), strerror(errno));
-		ASSERT(0);
-		if (die)
-			exit(1);
-		return errno;
-	}
 #ifdef IO_DEBUG
 	fprintf(stderr, "writing %ubytes at blkno=%llu(%llu), %p\n",
 		buf->b_bcount, BBTOOFF64(buf->b_blkno), buf->b_blkno, buf);
 #endif
-	sts = write(fd, buf->b_addr, buf->b_bcount);
+	sts = libxfs_pwrite(buf->b_dev, buf->b_addr, buf->b_bcount,
+			BBTOOFF64(buf->b_blkno));
 	if (sts < 0) {
 		fprintf(stderr, "%s: write failed: %s\n",
 			progname, strerror(errno));
-		ASSERT(0);
 		if (die)
 			exit(1);
 		return errno;
@@ -276,32 +936,271 @@ libxfs_writebuf_int(xfs_buf_t *buf, int die)
 	return 0;
 }
 
+int
+libxfs_writebuf_int(xfs_buf_t *buf, int die)
+{
+	int	error;
+
+	bcache_lock();
+	bcache_publish(buf);
+	buf->b_flags &= ~LIBXFS_B_DIRTY;
+	bcache_unlock();
+	if ((error = libxfs_bwrite(buf, die)) != 0) {
+		bcache_lock();
+		buf->b_flags |= LIBXFS_B_DIRTY;
+		bcache_unlock();
+	}
+	return error;
+}
+
 int
 libxfs_writebuf(xfs_buf_t *buf, int die)
 {
-	int error = libxfs_writebuf_int(buf, die);
+	int	error;
+
+	error = libxfs_writebuf_int(buf, die);
 	libxfs_putbuf(buf);
 	return error;
 }
 
-void
-libxfs_putbuf(xfs_buf_t *buf)
+/*
+ * Release a buffer and write it back later, if it is in the buffer
+ * cache; otherwise it is written now, as by libxfs_writebuf().
+ */
+int
+libxfs_writebuf_delwri(xfs_buf_t *buf, int die)
 {
-	if (buf != NULL) {
-                xfs_buf_log_item_t	*bip; 
-                extern xfs_zone_t       *xfs_buf_item_zone;   
-                    
-	        bip = XFS_BUF_FSPRIVATE(buf, xfs_buf_log_item_t *);
-                
-                if (bip)
-                    libxfs_zone_free(xfs_buf_item_zone, bip);
+	int	delwri = 0;
+
+	bcache_lock();
+	bcache_publish(buf);
+	if (bcache != NULL && buf->b_refcount > 0 &&
+	    !(buf->b_flags & LIBXFS_B_STALE)) {
+		buf->b_flags |= LIBXFS_B_DIRTY | LIBXFS_B_UPTODATE;
+		delwri = 1;
+	}
+	bcache_unlock();
+	if (!delwri)
+		return libxfs_writebuf(buf, die);
+	libxfs_putbuf(buf);
+	return 0;
+}
+
+static int
+libxfs_bufcmp(const void *a, const void *b)
+{
+	xfs_buf_t	*ba = *(xfs_buf_t **)a;
+	xfs_buf_t	*bb = *(xfs_buf_t **)b;
+
+	if (ba->b_dev != bb->b_dev)
+		return ba->b_dev < bb->b_dev ? -1 : 1;
+	if (ba->b_blkno != bb->b_blkno)
+		return ba->b_blkno < bb->b_blkno ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write out an array of distinct buffers sorted by disk address.
+ * Runs of adjacent buffers are gathered into a single write of up to
+ * BDSTRAT_SIZE bytes, so many small blocks laid down next to each
+ * other (a freshly built btree level, the inode and directory blocks
+ * of a big transaction) go out as a few large I/Os.  The caller holds
+ * the buffers and has marked them clean; any that don't make it to
+ * disk are marked dirty again.  Returns the first error seen.
+ */
+static int
+libxfs_bwritev(xfs_buf_t **bufs, int nbufs, int die)
+{
+	xfs_buf_t	*buf;
+	char		*z;
+	int		error;
+	int		first;
+	int		i;
+	int		j;
+	size_t		len;
+	ssize_t		sts;
+
+	z = NULL;
+	error = 0;
+	for (first = 0; first < nbufs; first = i) {
+		/*
+		 * find the run starting at bufs[first]
+		 */
+		buf = bufs[first];
+		len = buf->b_bcount;
+		for (i = first + 1; i < nbufs; i++) {
+			if (bufs[i]->b_dev != buf->b_dev ||
+			    bufs[i]->b_blkno != buf->b_blkno + BTOBB(len) ||
+			    len + bufs[i]->b_bcount > BDSTRAT_SIZE)
+				break;
+			len += bufs[i]->b_bcount;
+		}
+
+		if (i - first == 1) {
+			sts = libxfs_bwrite(buf, die);
+		} else {
+			if (z == NULL &&
+			    (z = memalign(getpagesize(), BDSTRAT_SIZE)) == NULL) {
+				fprintf(stderr, "%s: bwritev can't memalign "
+					"%d bytes: %s\n", progname,
+					BDSTRAT_SIZE, strerror(errno));
+				exit(1);
+			}
+			for (len = 0, j = first; j < i; j++) {
+				bcopy(bufs[j]->b_addr, z + len,
+					bufs[j]->b_bcount);
+				len += bufs[j]->b_bcount;
+			}
 #ifdef IO_DEBUG
-		fprintf(stderr, "putbuf released %ubytes, %p\n",
-			buf->b_bcount, buf);
+			fprintf(stderr, "bwritev %d buffers, %ubytes at "
+				"blkno=%llu\n", i - first, len, buf->b_blkno);
 #endif
-		free(buf);
-		buf = NULL;
+			sts = libxfs_pwrite(buf->b_dev, z, len,
+					BBTOOFF64(buf->b_blkno));
+			if (sts == len) {
+				sts = 0;
+			} else {
+				if (sts < 0)
+					fprintf(stderr, "%s: write failed: "
+						"%s\n", progname,
+						strerror(errno));
+				else
+					fprintf(stderr, "%s: error - wrote "
+						"only %d of %d bytes\n",
+						progname, (int)sts, (int)len);
+				if (die)
+					exit(1);
+				sts = sts < 0 ? errno : EIO;
+			}
+		}
+		if (sts == 0)
+			continue;
+		if (!error)
+			error = sts;
+		bcache_lock();
+		for (j = first; j < i; j++)
+			bufs[j]->b_flags |= LIBXFS_B_DIRTY;
+		bcache_unlock();
+	}
+	if (z != NULL)
+		free(z);
+	return error;
+}
+
+/*
+ * Write out and release a batch of buffers at once, in disk address
+ * order with adjacent buffers merged.  A buffer may appear more than
+ * once (several inodes in one cluster, say); it is written once and
+ * released as many times as it appears.  Unlike libxfs_writebuf()
+ * this always writes, cache or no cache.  Returns the first error
+ * seen; every buffer is released regardless.
+ */
+int
+libxfs_writebufs(xfs_buf_t **bufs, int nbufs, int die)
+{
+	xfs_buf_t	**uniq;
+	int		nuniq;
+	int		error;
+	int		i;
+
+	if (nbufs <= 0)
+		return 0;
+	qsort(bufs, nbufs, sizeof(xfs_buf_t *), libxfs_bufcmp);
+
+	if ((uniq = malloc(nbufs * sizeof(xfs_buf_t *))) == NULL) {
+		fprintf(stderr, "%s: writebufs can't allocate %d buffer "
+			"pointers: %s\n", progname, nbufs, strerror(errno));
+		exit(1);
+	}
+	bcache_lock();
+	for (nuniq = i = 0; i < nbufs; i++) {
+		if (nuniq == 0 || uniq[nuniq - 1] != bufs[i]) {
+			uniq[nuniq++] = bufs[i];
+			bcache_publish(bufs[i]);
+			bufs[i]->b_flags &= ~LIBXFS_B_DIRTY;
+		}
+	}
+	bcache_unlock();
+
+	error = libxfs_bwritev(uniq, nuniq, die);
+	free(uniq);
+
+	for (i = 0; i < nbufs; i++)
+		libxfs_putbuf(bufs[i]);
+	return error;
+}
+
+/*
+ * Mark a buffer as newer than the disk copy without releasing it,
+ * for callers that will write it out later with libxfs_writebufs().
+ * Until then, anyone reading the same block through the cache gets
+ * this copy rather than going back to the disk.
+ */
+void
+libxfs_bdirty(xfs_buf_t *buf)
+{
+	bcache_lock();
+	bcache_publish(buf);
+	buf->b_flags |= LIBXFS_B_DIRTY | LIBXFS_B_UPTODATE;
+	bcache_unlock();
+}
+
+int
+libxfs_bcache_enabled(void)
+{
+	return bcache != NULL;
+}
+
+void
+libxfs_putbuf(xfs_buf_t *buf)
+{
+	if (buf == NULL)
+		return;
+	/* buffers handed out before the cache was set up are private */
+	if (bcache == NULL || buf->b_refcount == 0) {
+		libxfs_bfree(buf);
+		return;
+	}
+	bcache_lock();
+	if (--buf->b_refcount > 0) {
+		bcache_unlock();
+		return;
+	}
+	if (buf->b_flags & LIBXFS_B_STALE) {
+		bcache_unlock();
+		libxfs_bfree(buf);
+		return;
 	}
+	/* the last holder takes any log item with it, as before */
+	if (XFS_BUF_FSPRIVATE(buf, void *) != NULL) {
+		extern xfs_zone_t	*xfs_buf_item_zone;
+
+		libxfs_zone_free(xfs_buf_item_zone,
+				XFS_BUF_FSPRIVATE(buf, void *));
+		XFS_BUF_SET_FSPRIVATE(buf, NULL);
+	}
+	bcache_lru_insert(buf);
+	if (bcache->bc_bytes > bcache->bc_maxbytes)
+		bcache_shrink(0);
+	bcache_unlock();
+}
+
+/*
+ * Release a buffer and make sure nobody sees its contents again:
+ * it is taken off the cache without being written back, and freed
+ * once the last holder lets go.
+ */
+void
+libxfs_purgebuf(xfs_buf_t *buf)
+{
+	if (buf == NULL)
+		return;
+	bcache_lock();
+	if (bcache != NULL && buf->b_refcount > 0 &&
+	    !(buf->b_flags & LIBXFS_B_STALE))
+		bcache_detach(buf);
+	bcache_unlock();
+	libxfs_putbuf(buf);
 }
 
 
@@ -403,14 +403,12 @@ libxfs_trans_read_buf(xfs_mount_t *mp, xfs_trans_t *tp, dev_t dev,
 {
 	xfs_buf_t		*bp;
 	xfs_buf_log_item_t	*bip;
-	int			error;
 	buftarg_t		bdev = { dev };
 
 	if (tp == NULL) {
-		bp = libxfs_getbuf(mp->m_dev, blkno, len);
-		error = libxfs_readbufr(dev, blkno, bp, len, 0);
+		bp = libxfs_readbuf(dev, blkno, len, 0);
 		*bpp = bp;
-		return error;
+		return bp ? 0 : EIO;
 	}
 
 	if (tp->t_items.lic_next == NULL)
@@ -426,11 +424,10 @@ libxfs_trans_read_buf(xfs_mount_t *mp, xfs_trans_t *tp, dev_t dev,
 		return 0;
 	}
 
-	bp = libxfs_getbuf(mp->m_dev, blkno, len);
-	error = libxfs_readbufr(dev, blkno, bp, len, 0);
-	if (error) {
+	bp = libxfs_readbuf(dev, blkno, len, 0);
+	if (bp == NULL) {
 		*bpp = NULL;
-		return error;
+		return EIO;
 	}
 #ifdef XACT_DEBUG
 	fprintf(stderr, "trans_read_buf buffer %p, transaction %p\n", bp, tp);
@@ -485,10 +482,65 @@ libxfs_trans_mod_sb(xfs_trans_t *tp, uint field, long delta)
 
 /*
  * Transaction commital code follows (i.e. write to disk in libxfs)
+ *
+ * Rather than writing each dirty buffer as its log item is processed,
+ * buffers being released are gathered on a list and handed over to
+ * libxfs_writebufs() once the whole transaction has been processed,
+ * so they go out sorted by address and merged into large writes.
+ * With delayed writes turned on by libxfs_trans_delwri() they are
+ * instead left dirty in the buffer cache until the next
+ * libxfs_bcache_flush().  Held buffers are still written at once.
  */
 
+typedef struct trans_wlist {
+	xfs_buf_t	**tw_bufs;
+	int		tw_count;
+	int		tw_size;
+} trans_wlist_t;
+
+static int	trans_delwri;
+
+int
+libxfs_trans_delwri(int on)
+{
+	int	old = trans_delwri;
+
+	trans_delwri = on;
+	return old;
+}
+
+static void
+trans_wlist_add(trans_wlist_t *twl, xfs_buf_t *bp)
+{
+	if (trans_delwri) {
+		libxfs_writebuf_delwri(bp, 0);
+		return;
+	}
+	if (twl->tw_count == twl->tw_size) {
+		twl->tw_size = twl->tw_size ? twl->tw_size * 2 : 32;
+		twl->tw_bufs = realloc(twl->tw_bufs,
+				twl->tw_size * sizeof(xfs_buf_t *));
+		if (twl->tw_bufs == NULL) {
+			fprintf(stderr, "%s: can't allocate commit write "
+				"list (%d buffers): %s\n", progname,
+				twl->tw_size, strerror(errno));
+			exit(1);
+		}
+	}
+	/* later readers of the block must see this copy, not the disk */
+	libxfs_bdirty(bp);
+	twl->tw_bufs[twl->tw_count++] = bp;
+}
+
+static void
+trans_wlist_flush(trans_wlist_t *twl)
+{
+	libxfs_writebufs(twl->tw_bufs, twl->tw_count, 0);
+	twl->tw_count = 0;
+}
+
 STATIC void
-inode_item_done(xfs_inode_log_item_t *iip)
+inode_item_done(xfs_inode_log_item_t *iip, trans_wlist_t *twl)
 {
 	xfs_dinode_t	*dip;
 	xfs_inode_t	*ip;
@@ -512,8 +564,12 @@ inode_item_done(xfs_inode_log_item_t *iip)
 	}
 
 	/*
-	 * Get the buffer containing the on-disk inode.
+	 * Get the buffer containing the on-disk inode.  Without a
+	 * buffer cache this is a fresh read, which has to see what
+	 * the items before us wrote to the same cluster.
 	 */
+	if (!libxfs_bcache_enabled())
+		trans_wlist_flush(twl);
 	error = libxfs_itobp(mp, NULL, ip, &dip, &bp, 0);
 	if (error) {
 		fprintf(stderr, "%s: warning - itobp failed (%d)\n",
@@ -532,18 +588,18 @@ inode_item_done(xfs_inode_log_item_t *iip)
 	ip->i_transp = NULL;	/* disassociate from transaction */
 	XFS_BUF_SET_FSPRIVATE(bp, NULL);	/* remove log item */
 	XFS_BUF_SET_FSPRIVATE2(bp, NULL);	/* remove xact ptr */
-	libxfs_writebuf_int(bp, 0);
 #ifdef XACT_DEBUG
 	fprintf(stderr, "flushing dirty inode %llu, buffer %p (hold=%u)\n",
 			ip->i_ino, bp, hold);
 #endif
 	if (hold) {
+		libxfs_writebuf_int(bp, 0);
 		iip->ili_flags &= ~XFS_ILI_HOLD;
 		return;
 	}
 	else {
 		/*libxfs_iput(iip->ili_inode, 0);	- nathans TODO? */
-		libxfs_putbuf(bp);
+		trans_wlist_add(twl, bp);
 	}
 
 ili_done:
@@ -555,7 +611,7 @@ ili_done:
 }
 
 STATIC void
-buf_item_done(xfs_buf_log_item_t *bip)
+buf_item_done(xfs_buf_log_item_t *bip, trans_wlist_t *twl)
 {
 	extern xfs_zone_t *xfs_buf_item_zone;
 	xfs_buf_t	*bp;
@@ -567,16 +623,19 @@ buf_item_done(xfs_buf_log_item_t *bip)
 	XFS_BUF_SET_FSPRIVATE2(bp, NULL);	/* remove xact ptr */
 
 	hold = (bip->bli_flags & XFS_BLI_HOLD);
-	if (bip->bli_flags & XFS_BLI_DIRTY) {
+	if ((bip->bli_format.blf_flags & XFS_BLI_CANCEL) && !hold) {
+		/* the block was freed, drop it without writing it */
+		libxfs_purgebuf(bp);
+	} else if (bip->bli_flags & XFS_BLI_DIRTY) {
 #ifdef XACT_DEBUG
 		fprintf(stderr, "flushing dirty buffer %p (hold=%d)\n",
 			bp, hold);
 #endif
-		libxfs_writebuf_int(bp, 0);
-		if (hold)
+		if (hold) {
+			libxfs_writebuf_int(bp, 0);
 			bip->bli_flags &= ~XFS_BLI_HOLD;
-		else
-			libxfs_putbuf(bp);
+		} else
+			trans_wlist_add(twl, bp);
 	}
 	/* release the buf item */
 	kmem_zone_free(xfs_buf_item_zone, bip);
@@ -587,7 +646,7 @@ buf_item_done(xfs_buf_log_item_t *bip)
  * item described by the given chunk.
  */
 static void
-trans_chunk_committed(xfs_log_item_chunk_t *licp)
+trans_chunk_committed(xfs_log_item_chunk_t *licp, trans_wlist_t *twl)
 {
 	xfs_log_item_desc_t	*lidp;
 	xfs_log_item_t		*lip;
@@ -599,9 +658,11 @@ trans_chunk_committed(xfs_log_item_chunk_t *licp)
 			continue;
 		lip = lidp->lid_item;
 		if (lip->li_type == XFS_LI_BUF)
-			buf_item_done((xfs_buf_log_item_t *)lidp->lid_item);
+			buf_item_done((xfs_buf_log_item_t *)lidp->lid_item,
+					twl);
 		else if (lip->li_type == XFS_LI_INODE)
-			inode_item_done((xfs_inode_log_item_t *)lidp->lid_item);
+			inode_item_done((xfs_inode_log_item_t *)lidp->lid_item,
+					twl);
 		else {
 			fprintf(stderr, "%s: unrecognised log item type\n",
 				progname);
@@ -611,20 +672,22 @@ trans_chunk_committed(xfs_log_item_chunk_t *licp)
 }
 
 /*
- * Calls trans_chunk_committed() to process the items in each chunk.
+ * Calls trans_chunk_committed() to process the items in each chunk,
+ * then writes out everything they released.
  */
 static void
 trans_committed(xfs_trans_t *tp)
 {
 	xfs_log_item_chunk_t	*licp;
 	xfs_log_item_chunk_t	*next_licp;
+	trans_wlist_t		twl = { NULL, 0, 0 };
 
 	/*
 	 * Special case the chunk embedded in the transaction.
 	 */
 	licp = &(tp->t_items);
 	if (!(XFS_LIC_ARE_ALL_FREE(licp))) {
-		trans_chunk_committed(licp);
+		trans_chunk_committed(licp, &twl);
 	}
 
 	/*
@@ -632,11 +695,15 @@ trans_committed(xfs_trans_t *tp)
 	 */
 	licp = licp->lic_next;
 	while (licp != NULL) {
-		trans_chunk_committed(licp);
+		trans_chunk_committed(licp, &twl);
 		next_licp = licp->lic_next;
 		kmem_free(licp, sizeof(xfs_log_item_chunk_t));
 		licp = next_licp;
 	}
+
+	trans_wlist_flush(&twl);
+	if (twl.tw_bufs != NULL)
+		free(twl.tw_bufs);
 }
 
 /*
@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+/*
+ * Log analysis (-S) and transaction filters (-I, -B).
+ *
+ * The transactional view already hands us every complete transaction
+ * between the tail and the head; instead of printing it we tally it.
+ * The summary answers "what is filling the log": transactions and
+ * bytes by transaction type, bytes by log item type, and which
+ * allocation groups and inodes are being logged most.
+ */
+
+#include "logprint.h"
+
+#define	STAT_NTRANS	64		/* slots for transaction types */
+#define	STAT_INOHASH	1024		/* inode heat hash buckets */
+#define	STAT_TOPINO	20		/* hottest inodes reported */
+
+typedef enum {
+	SI_BUF,		SI_INODE,	SI_EFI,		SI_EFD,
+	SI_DQUOT,	SI_QUOTAOFF,	SI_OTHER,
+	SI_NTYPES
+} stat_item_t;
+
+static char	*stat_item_name[SI_NTYPES] = {
+	"buffer",	"inode",	"efi",		"efd",
+	"dquot",	"quotaoff",	"other"
+};
+
+typedef struct stat_count {
+	__uint64_t	count;
+	__uint64_t	bytes;
+} stat_count_t;
+
+typedef struct stat_ino {
+	struct stat_ino	*next;
+	xfs_ino_t	ino;
+	stat_count_t	c;
+} stat_ino_t;
+
+static stat_count_t	stat_records;
+static stat_count_t	stat_trans[STAT_NTRANS];
+static stat_count_t	stat_items[SI_NTYPES];
+static stat_count_t	*stat_ag;
+static stat_ino_t	*stat_inohash[STAT_INOHASH];
+static int		stat_ninodes;
+
+/*
+ * Does any log item in the transaction touch the inode or the block
+ * range we were asked about?
+ */
+static int
+xlog_filter_range(
+	xfs_daddr_t	blkno,
+	int		len)
+{
+	return filter_len && blkno < filter_daddr + filter_len &&
+	       blkno + len > filter_daddr;
+}
+
+static int
+xlog_filter_extents(
+	xfs_extent_t	*ex,
+	uint		nextents)
+{
+	uint		i;
+
+	for (i = 0; i < nextents; i++, ex++) {
+		if (xlog_filter_range(XFS_FSB_TO_DADDR(&mp, ex->ext_start),
+				      XFS_FSB_TO_BB(&mp, ex->ext_len)))
+			return 1;
+	}
+	return 0;
+}
+
+static int
+xlog_filter_item(
+	xlog_recover_item_t	*item)
+{
+	xfs_buf_log_format_t	*bf;
+	xfs_buf_log_format_v1_t	*obf;
+	xfs_inode_log_format_t	*ilf;
+	xfs_dq_logformat_t	*qlf;
+	xfs_efi_log_format_t	*efi;
+	xfs_efd_log_format_t	*efd;
+
+	switch (ITEM_TYPE(item)) {
+	case XFS_LI_BUF:
+		bf = (xfs_buf_log_format_t *)item->ri_buf[0].i_addr;
+		return xlog_filter_range(bf->blf_blkno, bf->blf_len);
+	case XFS_LI_6_1_BUF:
+	case XFS_LI_5_3_BUF:
+		obf = (xfs_buf_log_format_v1_t *)item->ri_buf[0].i_addr;
+		return xlog_filter_range(obf->blf_blkno, obf->blf_len);
+	case XFS_LI_INODE:
+		ilf = (xfs_inode_log_format_t *)item->ri_buf[0].i_addr;
+		return ilf->ilf_ino == filter_ino ||
+		       xlog_filter_range(ilf->ilf_blkno, ilf->ilf_len);
+	case XFS_LI_6_1_INODE:
+	case XFS_LI_5_3_INODE:
+		ilf = (xfs_inode_log_format_t *)item->ri_buf[0].i_addr;
+		return ilf->ilf_ino == filter_ino;
+	case XFS_LI_DQUOT:
+		qlf = (xfs_dq_logformat_t *)item->ri_buf[0].i_addr;
+		return xlog_filter_range(qlf->qlf_blkno, qlf->qlf_len);
+	case XFS_LI_EFI:
+		efi = (xfs_efi_log_format_t *)item->ri_buf[0].i_addr;
+		return xlog_filter_extents(efi->efi_extents,
+					   efi->efi_nextents);
+	case XFS_LI_EFD:
+		efd = (xfs_efd_log_format_t *)item->ri_buf[0].i_addr;
+		return xlog_filter_extents(efd->efd_extents,
+					   efd->efd_nextents);
+	}
+	return 0;
+}
+
+int
+xlog_filter_active(void)
+{
+	return filter_ino != NULLFSINO || filter_len != 0;
+}
+
+int
+xlog_recover_filter_trans(
+	xlog_recover_t		*trans)
+{
+	xlog_recover_item_t	*first_item, *item;
+
+	if (!xlog_filter_active())
+		return 1;
+	if ((item = first_item = trans->r_itemq) == NULL)
+		return 0;
+	do {
+		if (xlog_filter_item(item))
+			return 1;
+		item = item->ri_next;
+	} while (first_item != item);
+	return 0;
+}
+
+/*
+ * Accounting.
+ */
+static void
+xlog_stat_ag(
+	xfs_agnumber_t	agno,
+	int		bytes)
+{
+	if (agno >= mp.m_sb.sb_agcount)
+		return;
+	if (stat_ag == NULL &&
+	    (stat_ag = calloc(mp.m_sb.sb_agcount, sizeof(*stat_ag))) == NULL)
+		xlog_exit("Can't allocate AG statistics");
+	stat_ag[agno].count++;
+	stat_ag[agno].bytes += bytes;
+}
+
+static void
+xlog_stat_ino(
+	xfs_ino_t	ino,
+	int		bytes)
+{
+	stat_ino_t	*sp;
+	int		i;
+
+	i = (int)(ino % STAT_INOHASH);
+	for (sp = stat_inohash[i]; sp; sp = sp->next)
+		if (sp->ino == ino)
+			break;
+	if (sp == NULL) {
+		if ((sp = calloc(1, sizeof(*sp))) == NULL)
+			xlog_exit("Can't allocate inode statistics");
+		sp->ino = ino;
+		sp->next = stat_inohash[i];
+		stat_inohash[i] = sp;
+		stat_ninodes++;
+	}
+	sp->c.count++;
+	sp->c.bytes += bytes;
+}
+
+void
+xlog_stat_record(
+	xlog_rec_header_t	*head)
+{
+	stat_records.count++;
+	stat_records.bytes += BBSIZE + INT_GET(head->h_len, ARCH_CONVERT);
+}
+
+void
+xlog_recover_stat_trans(
+	xlog_recover_t		*trans)
+{
+	xlog_recover_item_t	*first_item, *item;
+	xfs_buf_log_format_t	*bf;
+	xfs_buf_log_format_v1_t	*obf;
+	xfs_inode_log_format_t	*ilf;
+	xfs_dq_logformat_t	*qlf;
+	int			bytes;
+	int			i;
+	int			total;
+	stat_item_t		type;
+
+	total = 0;
+	item = first_item = trans->r_itemq;
+	while (item) {
+		for (i = bytes = 0; i < item->ri_cnt; i++)
+			bytes += item->ri_buf[i].i_len;
+		total += bytes;
+		switch (ITEM_TYPE(item)) {
+		case XFS_LI_BUF:
+			type = SI_BUF;
+			bf = (xfs_buf_log_format_t *)item->ri_buf[0].i_addr;
+			xlog_stat_ag(XFS_DADDR_TO_AGNO(&mp, bf->blf_blkno),
+				bytes);
+			break;
+		case XFS_LI_6_1_BUF:
+		case XFS_LI_5_3_BUF:
+			type = SI_BUF;
+			obf = (xfs_buf_log_format_v1_t *)item->ri_buf[0].i_addr;
+			xlog_stat_ag(XFS_DADDR_TO_AGNO(&mp, obf->blf_blkno),
+				bytes);
+			break;
+		case XFS_LI_INODE:
+		case XFS_LI_6_1_INODE:
+		case XFS_LI_5_3_INODE:
+			type = SI_INODE;
+			ilf = (xfs_inode_log_format_t *)item->ri_buf[0].i_addr;
+			xlog_stat_ino(ilf->ilf_ino, bytes);
+			xlog_stat_ag(XFS_INO_TO_AGNO(&mp, ilf->ilf_ino), bytes);
+			break;
+		case XFS_LI_EFI:
+			type = SI_EFI;
+			break;
+		case XFS_LI_EFD:
+			type = SI_EFD;
+			break;
+		case XFS_LI_DQUOT:
+			type = SI_DQUOT;
+			qlf = (xfs_dq_logformat_t *)item->ri_buf[0].i_addr;
+			xlog_stat_ag(XFS_DADDR_TO_AGNO(&mp, qlf->qlf_blkno),
+				bytes);
+			break;
+		case XFS_LI_QUOTAOFF:
+			type = SI_QUOTAOFF;
+			break;
+		default:
+			type = SI_OTHER;
+			break;
+		}
+		stat_items[type].count++;
+		stat_items[type].bytes += bytes;
+		if ((item = item->ri_next) == first_item)
+			break;
+	}
+
+	i = trans->r_theader.th_type;
+	if (i < 0 || i >= STAT_NTRANS)
+		i = 0;
+	stat_trans[i].count++;
+	stat_trans[i].bytes += total;
+}
+
+/*
+ * Reporting.
+ */
+static int
+xlog_stat_ino_cmp(
+	const void	*a,
+	const void	*b)
+{
+	const stat_ino_t *ia = *(const stat_ino_t **)a;
+	const stat_ino_t *ib = *(const stat_ino_t **)b;
+
+	if (ia->c.bytes != ib->c.bytes)
+		return ia->c.bytes < ib->c.bytes ? 1 : -1;
+	return ia->ino < ib->ino ? -1 : ia->ino > ib->ino;
+}
+
+static void
+xlog_stat_line(
+	char		*name,
+	stat_count_t	*c,
+	__uint64_t	total)
+{
+	printf("    %-20s %12llu %14llu %5.1f%%\n", name,
+		(unsigned long long)c->count, (unsigned long long)c->bytes,
+		total ? 100.0 * c->bytes / total : 0.0);
+}
+
+void
+xlog_stat_print(void)
+{
+	char		name[32];
+	stat_ino_t	**ilist;
+	stat_ino_t	*sp;
+	__uint64_t	total;
+	int		i, n;
+
+	total = 0;
+	for (i = 0; i < SI_NTYPES; i++)
+		total += stat_items[i].bytes;
+
+	printf("log records: %llu  bytes: %llu\n\n",
+		(unsigned long long)stat_records.count,
+		(unsigned long long)stat_records.bytes);
+
+	printf("transactions by type:\n");
+	printf("    %-20s %12s %14s %6s\n", "type", "count", "bytes", "");
+	for (i = 0; i < STAT_NTRANS; i++) {
+		if (stat_trans[i].count == 0)
+			continue;
+		if (i > 0 && i <= XFS_TRANS_SWAPEXT)
+			sprintf(name, "%s", trans_type[i]);
+		else
+			sprintf(name, "type %d", i);
+		xlog_stat_line(name, &stat_trans[i], total);
+	}
+
+	printf("\nlog items by type:\n");
+	printf("    %-20s %12s %14s %6s\n", "item", "count", "bytes", "");
+	for (i = 0; i < SI_NTYPES; i++) {
+		if (stat_items[i].count)
+			xlog_stat_line(stat_item_name[i], &stat_items[i],
+				total);
+	}
+
+	if (stat_ag) {
+		printf("\nlogged metadata by allocation group:\n");
+		printf("    %-20s %12s %14s %6s\n", "ag", "items", "bytes", "");
+		for (i = 0; i < mp.m_sb.sb_agcount; i++) {
+			if (stat_ag[i].count == 0)
+				continue;
+			sprintf(name, "%d", i);
+			xlog_stat_line(name, &stat_ag[i], total);
+		}
+	}
+
+	if (stat_ninodes == 0)
+		return;
+	if ((ilist = malloc(stat_ninodes * sizeof(*ilist))) == NULL)
+		xlog_exit("Can't allocate inode statistics");
+	for (i = n = 0; i < STAT_INOHASH; i++)
+		for (sp = stat_inohash[i]; sp; sp = sp->next)
+			ilist[n++] = sp;
+	qsort(ilist, n, sizeof(*ilist), xlog_stat_ino_cmp);
+	printf("\nmost logged inodes (%d of %d):\n",
+		MIN(n, STAT_TOPINO), n);
+	printf("    %-20s %12s %14s %6s\n", "inode", "items", "bytes", "");
+	for (i = 0; i < n && i < STAT_TOPINO; i++) {
+		sprintf(name, "%llu", (unsigned long long)ilist[i]->ino);
+		xlog_stat_line(name, &ilist[i]->c, total);
+	}
+	free(ilist);
+}
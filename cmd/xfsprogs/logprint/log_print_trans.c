@@ -47,7 +47,12 @@ xlog_recover_do_trans(xlog_t	     *log,
 		      xlog_recover_t *trans,
 		      int	     pass)
 {
-	xlog_recover_print_trans(trans, trans->r_itemq, 3);
+	if (!xlog_recover_filter_trans(trans))
+		return 0;
+	if (print_stats)
+		xlog_recover_stat_trans(trans);
+	else
+		xlog_recover_print_trans(trans, trans->r_itemq, 3);
 	return 0;
 }	/* xlog_recover_do_trans */
 
@@ -74,10 +79,14 @@ xfs_log_print_trans(xlog_t      *log,
         }
         printf("\n");
         
-        print_record_header=1;
+        /* record boundaries mean nothing once we filter or summarise */
+        print_record_header = !print_stats && !xlog_filter_active();
         if (xlog_do_recovery_pass(log, head_blk, tail_blk, XLOG_RECOVER_PASS1))
             exit(1);
 
+        if (print_stats)
+            xlog_stat_print();
+
 }	/* xfs_log_print_trans */
 
 static int
@@ -100,6 +109,8 @@ header_check_uuid(xfs_mount_t *mp, xlog_rec_header_t *head)
 int
 xlog_header_check_recover(xfs_mount_t *mp, xlog_rec_header_t *head)
 {
+    if (print_stats)
+        xlog_stat_record(head);
     if (print_record_header) 
         printf("\nLOG REC AT LSN cycle %d block %d (0x%x, 0x%x)\n",
 	       CYCLE_LSN(head->h_lsn, ARCH_CONVERT), 
@@ -44,6 +44,11 @@ int	print_overwrite;
 int     print_no_data;
 int     print_no_print;
 int     print_exit = 1; /* -e is now default. specify -c to override */
+int	print_stats;
+
+xfs_ino_t	filter_ino = NULLFSINO;
+xfs_daddr_t	filter_daddr;
+int		filter_len;
 
 libxfs_init_t	x;
 xfs_mount_t	mp;
@@ -63,6 +68,9 @@ Options:\n\
         -b          in transactional view, extract buffer info\n\
         -i          in transactional view, extract inode info\n\
         -q          in transactional view, extract quota info\n\
+    -S              summarise log usage instead of printing it\n\
+    -I <inode>      only transactions logging this inode\n\
+    -B <blk>[,<len>] only transactions logging these basic blocks\n\
     -D              print only data; no decoding\n\
     -V              print version information\n", 
         progname);
@@ -98,6 +106,7 @@ logstat(libxfs_init_t *x)
 	libxfs_xlate_sb(buf, &(mp.m_sb), 1, ARCH_CONVERT, XFS_SB_ALL_BITS);
 	sb = &(mp.m_sb);
 	mp.m_blkbb_log = sb->sb_blocklog - BBSHIFT;
+	mp.m_agino_log = sb->sb_inopblog + sb->sb_agblklog;
 
 	x->logBBsize = XFS_FSB_TO_BB(&mp, sb->sb_logblocks);
 	x->logBBstart = XFS_FSB_TO_DADDR(&mp, sb->sb_logstart);
@@ -127,17 +136,28 @@ main(int argc, char **argv)
 {
 	int		print_start = -1;
 	int		c;
+	char		*p;
         int             logfd;
         xlog_t	        log = {0};
 
 	progname = basename(argv[0]);
-	while ((c = getopt(argc, argv, "bel:iqnors:tDVvc")) != EOF) {
+	while ((c = getopt(argc, argv, "B:bel:iI:qnors:StDVvc")) != EOF) {
 		switch (c) {
 			case 'D': {
 				print_only_data++;
 				print_data++;
 				break;
 			}
+			case 'B': {
+				filter_daddr = strtoll(optarg, &p, 0);
+				filter_len = 1;
+				if (*p == ',')
+					filter_len = (int)strtol(p + 1, &p, 0);
+				if (*p != '\0' || filter_daddr < 0 ||
+				    filter_len <= 0)
+					usage();
+				break;
+			}
 			case 'b': {
 				print_buffer++;
 				break;
@@ -164,6 +184,12 @@ main(int argc, char **argv)
 				print_inode++;
 				break;
 			}
+			case 'I': {
+				filter_ino = strtoull(optarg, &p, 0);
+				if (*p != '\0')
+					usage();
+				break;
+			}
 			case 'q': {
 				print_quota++;
 				break;
@@ -180,6 +206,10 @@ main(int argc, char **argv)
 				print_start = atoi(optarg);
 				break;
 			}
+			case 'S': {
+				print_stats++;
+				break;
+			}
 			case 't': {
 				print_transactions++;
 				break;
@@ -238,7 +268,11 @@ main(int argc, char **argv)
 	log.l_logBBsize   = x.logBBsize;
         log.l_mp          = &mp;
  
-	if (print_transactions)
+	/*
+	 * Summaries and filters work on whole transactions, so they
+	 * imply the transactional view.
+	 */
+	if (print_transactions || print_stats || xlog_filter_active())
 		xfs_log_print_trans(&log, print_start);
 	else
 		xfs_log_print(&log, logfd, print_start);
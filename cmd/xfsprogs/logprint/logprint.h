@@ -108,6 +108,12 @@ extern int	print_overwrite;
 extern int	print_exit;
 extern int	print_no_data;
 extern int	print_no_print;
+extern int	print_stats;
+
+/* transaction filters */
+extern xfs_ino_t	filter_ino;
+extern xfs_daddr_t	filter_daddr;
+extern int		filter_len;
 
 /* exports */
 
@@ -115,6 +121,7 @@ extern char *trans_type[];
 
 /* libxfs parameters */
 extern libxfs_init_t	x;
+extern xfs_mount_t	mp;
 
 extern void xfs_log_print_trans(xlog_t          *log,
 				int		print_block_start);
@@ -147,6 +154,13 @@ extern void xlog_recover_print_trans(	xlog_recover_t		*trans,
 					xlog_recover_item_t	*itemq,
 					int			print);
 
+/* for analysis mode and filters */
+extern int  xlog_filter_active(void);
+extern int  xlog_recover_filter_trans(xlog_recover_t *trans);
+extern void xlog_recover_stat_trans(xlog_recover_t *trans);
+extern void xlog_stat_print(void);
+extern void xlog_stat_record(xlog_rec_header_t *head);
+
 extern int  xlog_do_recovery_pass(	xlog_t		*log,
 					xfs_daddr_t	head_blk,
 					xfs_daddr_t	tail_blk,
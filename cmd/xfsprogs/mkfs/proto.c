@@ -35,6 +35,8 @@
 #include <errno.h>
 #include "proto.h"
 #include <sys/stat.h>
+#include <dirent.h>
+#include <malloc.h>
 
 /*
  * Prototypes for internal functions.
@@ -49,7 +51,7 @@ static void getres(xfs_trans_t *tp, uint blocks);
 static void rsvfile(xfs_mount_t *mp, xfs_inode_t *ip, int64_t len);
 static int newfile(xfs_trans_t *tp, xfs_inode_t *ip, xfs_bmap_free_t *flist,
 	xfs_fsblock_t *first, int dolocal, int logit, char *buf, int len);
-static char *newregfile(char **pp, int *len); 
+static int newregfile(char **pp, int64_t *len);
 static void rtinit(xfs_mount_t *mp);
 static long filesize(int fd);
 
@@ -63,6 +65,30 @@ static long filesize(int fd);
 	((uint)(MKFS_BLOCKRES_INODE + XFS_DA_NODE_MAXDEPTH + \
 	(XFS_BM_MAXLEVELS(mp, XFS_DATA_FORK) - 1) + (rb)))
 
+#define	MKFS_COPY_SIZE	(1024 * 1024)	/* file data copied in at a time */
+
+#define	IF_REGULAR	0
+#define	IF_RESERVED	1
+#define	IF_BLOCK	2
+#define	IF_CHAR		3
+#define	IF_DIRECTORY	4
+#define	IF_SYMLINK	5
+#define	IF_FIFO		6
+
+/*
+ * One file to create, as described by a line of the prototype file
+ * or by an entry in a source directory tree.
+ */
+typedef struct protoent {
+	int		fmt;		/* IF_* */
+	int		mode;		/* permissions, suid/sgid */
+	cred_t		creds;
+	int		fd;		/* IF_REGULAR: source of the data */
+	int64_t		size;		/* IF_REGULAR, IF_RESERVED */
+	dev_t		rdev;		/* IF_BLOCK, IF_CHAR */
+	char		*target;	/* IF_SYMLINK */
+} protoent_t;
+
 
 char *
 setup_proto(
@@ -72,9 +98,12 @@ setup_proto(
 	static char	dflt[] = "d--755 0 0 $";
 	int		fd;
 	long		size;
+	struct stat64	st;
 
 	if (!fname)
 		return dflt;
+	if (stat64(fname, &st) == 0 && S_ISDIR(st.st_mode))
+		return NULL;		/* populated by parsedir() */
 	if ((fd = open(fname, O_RDONLY)) < 0 || (size = filesize(fd)) < 0) {
 		fprintf(stderr, "%s: failed to open %s: %s\n",
 			progname, fname, strerror(errno));
@@ -281,33 +310,118 @@ newfile(
 	return flags;
 }
 
-static char *
+static int
 newregfile(
 	char		**pp,
-	int		*len)
+	int64_t		*len)
 {
-	char		*buf;
 	int		fd;
 	char		*fname;
-	long		size;
+	struct stat64	st;
 
 	fname = getstr(pp);
-	if ((fd = open(fname, O_RDONLY)) < 0 || (size = filesize(fd)) < 0) {
+	if ((fd = open(fname, O_RDONLY)) < 0 || fstat64(fd, &st) < 0) {
 		fprintf(stderr, "%s: cannot open %s: %s\n",
 			progname, fname, strerror(errno));
 		exit(1);
 	}
-	if (*len = (int)size) {
-		buf = malloc(size);
-		if (read(fd, buf, size) < size) {
-			fprintf(stderr, "%s: read failed on %s: %s\n",
-				progname, fname, strerror(errno));
+	*len = st.st_size;
+	return fd;
+}
+
+/*
+ * Copy the part of a source file that lands in one extent, straight
+ * to the device in writes of up to MKFS_COPY_SIZE.  Past the end of
+ * the source the extent is zero filled.
+ */
+static void
+copyextent(
+	xfs_mount_t	*mp,
+	int		fd,
+	int64_t		size,
+	xfs_bmbt_irec_t	*map,
+	char		*buf)
+{
+	xfs_off_t	daddr;
+	xfs_off_t	end;
+	size_t		len;
+	ssize_t		n;
+	xfs_off_t	off;
+	size_t		want;
+
+	off = XFS_FSB_TO_B(mp, map->br_startoff);
+	end = off + XFS_FSB_TO_B(mp, map->br_blockcount);
+	daddr = (xfs_off_t)XFS_FSB_TO_DADDR(mp, map->br_startblock) << BBSHIFT;
+	while (off < end) {
+		len = (size_t)MIN(end - off, MKFS_COPY_SIZE);
+		want = off >= size ? 0 : (size_t)MIN(len, size - off);
+		if (want && (n = pread64(fd, buf, want, off)) != want) {
+			fprintf(stderr, "%s: read failed: %s\n", progname,
+				n < 0 ? strerror(errno) : "short read");
 			exit(1);
 		}
-	} else
-		buf = 0;
-	close(fd);
-	return buf;
+		if (want < len)
+			bzero(buf + want, len - want);
+		if (libxfs_pwrite(mp->m_dev, buf, len, daddr) != len) {
+			fprintf(stderr, "%s: write failed: %s\n",
+				progname, strerror(errno));
+			exit(1);
+		}
+		off += len;
+		daddr += len;
+	}
+}
+
+/*
+ * Allocate and fill in a regular file's data.  The data goes to the
+ * device directly in large sequential writes rather than through
+ * the buffer cache, and the source is never read into memory whole;
+ * the file may take as many extents as the allocator hands back.
+ */
+static void
+newfiledata(
+	xfs_trans_t	*tp,
+	xfs_inode_t	*ip,
+	xfs_bmap_free_t	*flist,
+	xfs_fsblock_t	*first,
+	int		fd,
+	int64_t		size)
+{
+	static char	*buf;
+	xfs_fileoff_t	bno;
+	int		error;
+	int		i;
+	xfs_bmbt_irec_t	map[XFS_BMAP_MAX_NMAP];
+	xfs_mount_t	*mp;
+	xfs_filblks_t	nb;
+	int		nmap;
+
+	mp = ip->i_mount;
+	ip->i_d.di_size = size;
+	if (size == 0)
+		return;
+	if (buf == NULL &&
+	    (buf = memalign(getpagesize(), MKFS_COPY_SIZE)) == NULL) {
+		fprintf(stderr, "%s: can't allocate copy buffer: %s\n",
+			progname, strerror(errno));
+		exit(1);
+	}
+	nb = XFS_B_TO_FSB(mp, size);
+	for (bno = 0; bno < nb; ) {
+		nmap = XFS_BMAP_MAX_NMAP;
+		error = libxfs_bmapi(tp, ip, bno, nb - bno, XFS_BMAPI_WRITE,
+				first, nb - bno, map, &nmap, flist);
+		if (error)
+			fail("error allocating space for a file", error);
+		if (nmap == 0) {
+			fprintf(stderr, "%s: cannot allocate space for file\n",
+				progname);
+			exit(1);
+		}
+		for (i = 0; i < nmap; i++)
+			copyextent(mp, fd, size, &map[i], buf);
+		bno = map[nmap - 1].br_startoff + map[nmap - 1].br_blockcount;
+	}
 }
 
 static void
@@ -351,117 +465,40 @@ newdirectory(
 		fail("directory create error", error);
 }
 
-void
-parseproto(
+/*
+ * Create one file, whichever source it was described by.  For a
+ * directory the new inode is returned, still held, so the caller can
+ * fill it in and release it; otherwise NULL.
+ */
+static xfs_inode_t *
+newnode(
 	xfs_mount_t	*mp,
 	xfs_inode_t	*pip,
-	char		**pp,
-	char		*name)
+	char		*name,
+	protoent_t	*pe)
 {
-#define	IF_REGULAR	0
-#define	IF_RESERVED	1
-#define	IF_BLOCK	2
-#define	IF_CHAR		3
-#define	IF_DIRECTORY	4
-#define	IF_SYMLINK	5
-#define	IF_FIFO		6
-
-	char		*buf;
 	int		committed;
 	int		error;
 	xfs_fsblock_t	first;
 	int		flags;
 	xfs_bmap_free_t	flist;
-	int		fmt;
 	int		i;
 	xfs_inode_t	*ip;
+	int		isroot = 0;
 	int		len;
-	int64_t		llen;
-	int		majdev;
-	int		mindev;
-	int		mode;
-	char		*mstr;
 	xfs_trans_t	*tp;
-	int		val;
-	int		isroot = 0;
-	cred_t		creds;
-	char		*value;
 
-	bzero(&creds, sizeof(creds));
-	mstr = getstr(pp);
-	switch (mstr[0]) {
-	case '-':
-		fmt = IF_REGULAR;
-		break;
-	case 'r':
-		fmt = IF_RESERVED;
-		break;
-	case 'b':
-		fmt = IF_BLOCK;
-		break;
-	case 'c':
-		fmt = IF_CHAR;
-		break;
-	case 'd':
-		fmt = IF_DIRECTORY;
-		break;
-	case 'l':
-		fmt = IF_SYMLINK;
-		break;
-	case 'p':
-		fmt = IF_FIFO;
-		break;
-	default:
-		fprintf(stderr, "%s: bad format string %s\n", progname, mstr);
-		exit(1);
-	}
-	mode = 0;
-	switch (mstr[1]) {
-	case '-':
-		break;
-	case 'u':
-		mode |= ISUID;
-		break;
-	default:
-		fprintf(stderr, "%s: bad format string %s\n", progname, mstr);
-		exit(1);
-	}
-	switch (mstr[2]) {
-	case '-':
-		break;
-	case 'g':
-		mode |= ISGID;
-		break;
-	default:
-		fprintf(stderr, "%s: bad format string %s\n", progname, mstr);
-		exit(1);
-	}
-	val = 0;
-	for (i = 3; i < 6; i++) {
-		if (mstr[i] < '0' || mstr[i] > '7') {
-			fprintf(stderr, "%s: bad format string %s\n",
-				progname, mstr);
-			exit(1);
-		}
-		val = val * 8 + mstr[i] - '0';
-	}
-	mode |= val;
-	creds.cr_uid = (int)getnum(pp);
-	creds.cr_gid = (int)getnum(pp);
 	tp = libxfs_trans_alloc(mp, 0);
 	flags = XFS_ILOG_CORE;
 	XFS_BMAP_INIT(&flist, &first);
-	switch (fmt) {
+	switch (pe->fmt) {
 	case IF_REGULAR:
-		buf = newregfile(pp, &len);
-		getres(tp, XFS_B_TO_FSB(mp, len));
-		error = libxfs_inode_alloc(&tp, pip, mode|IFREG, 1,
-					mp->m_dev, &creds, &ip);
+		getres(tp, XFS_B_TO_FSB(mp, pe->size));
+		error = libxfs_inode_alloc(&tp, pip, pe->mode|IFREG, 1,
+					mp->m_dev, &pe->creds, &ip);
 		if (error)
 			fail("Inode allocation failed", error);
-		flags |= newfile(tp, ip, &flist, &first, 0, 0, buf, len);
-		if (buf)
-			free(buf);
+		newfiledata(tp, ip, &flist, &first, pe->fd, pe->size);
 		libxfs_trans_ijoin(tp, pip, 0);
 		i = strlen(name);
 		newdirent(mp, tp, pip, name, i, ip->i_ino, &first, &flist, 1);
@@ -469,12 +506,10 @@ parseproto(
 		break;
 
 	case IF_RESERVED:			/* pre-allocated space only */
-		value = getstr(pp);
-		llen = cvtnum(mp->m_sb.sb_blocksize, value);
-		getres(tp, XFS_B_TO_FSB(mp, llen));
+		getres(tp, XFS_B_TO_FSB(mp, pe->size));
 
-		error = libxfs_inode_alloc(&tp, pip, mode|IFREG, 1,
-						mp->m_dev, &creds, &ip);
+		error = libxfs_inode_alloc(&tp, pip, pe->mode|IFREG, 1,
+						mp->m_dev, &pe->creds, &ip);
 		if (error)
 			fail("Inode pre-allocation failed", error);
 
@@ -489,15 +524,13 @@ parseproto(
 		if (error)
 			fail("Pre-allocated file creation failed", error);
 		libxfs_trans_commit(tp, 0, NULL);
-		rsvfile(mp, ip, llen);
-		return;
+		rsvfile(mp, ip, pe->size);
+		return NULL;
 
 	case IF_BLOCK:
 		getres(tp, 0);
-		majdev = (int)getnum(pp);
-		mindev = (int)getnum(pp);
-		error = libxfs_inode_alloc(&tp, pip, mode|IFBLK, 1,
-				makedev(majdev, mindev), &creds, &ip);
+		error = libxfs_inode_alloc(&tp, pip, pe->mode|IFBLK, 1,
+				pe->rdev, &pe->creds, &ip);
 		if (error) {
 			fail("Inode allocation failed", error);
 		}
@@ -510,10 +543,8 @@ parseproto(
 
 	case IF_CHAR:
 		getres(tp, 0);
-		majdev = (int)getnum(pp);
-		mindev = (int)getnum(pp);
-		error = libxfs_inode_alloc(&tp, pip, mode|IFCHR, 1,
-				makedev(majdev, mindev), &creds, &ip);
+		error = libxfs_inode_alloc(&tp, pip, pe->mode|IFCHR, 1,
+				pe->rdev, &pe->creds, &ip);
 		if (error)
 			fail("Inode allocation failed", error);
 		libxfs_trans_ijoin(tp, pip, 0);
@@ -525,8 +556,8 @@ parseproto(
 
 	case IF_FIFO:
 		getres(tp, 0);
-		error = libxfs_inode_alloc(&tp, pip, mode|IFIFO, 1,
-				mp->m_dev, &creds, &ip);
+		error = libxfs_inode_alloc(&tp, pip, pe->mode|IFIFO, 1,
+				mp->m_dev, &pe->creds, &ip);
 		if (error)
 			fail("Inode allocation failed", error);
 		libxfs_trans_ijoin(tp, pip, 0);
@@ -535,14 +566,13 @@ parseproto(
 		libxfs_trans_ihold(tp, pip);
 		break;
 	case IF_SYMLINK:
-		buf = getstr(pp);
-		len = (int)strlen(buf);
+		len = (int)strlen(pe->target);
 		getres(tp, XFS_B_TO_FSB(mp, len));
-		error = libxfs_inode_alloc(&tp, pip, mode|IFLNK, 1,
-				mp->m_dev, &creds, &ip);
+		error = libxfs_inode_alloc(&tp, pip, pe->mode|IFLNK, 1,
+				mp->m_dev, &pe->creds, &ip);
 		if (error)
 			fail("Inode allocation failed", error);
-		flags |= newfile(tp, ip, &flist, &first, 1, 1, buf, len);
+		flags |= newfile(tp, ip, &flist, &first, 1, 1, pe->target, len);
 		libxfs_trans_ijoin(tp, pip, 0);
 		i = strlen(name);
 		newdirent(mp, tp, pip, name, i, ip->i_ino, &first, &flist, 1);
@@ -550,8 +580,8 @@ parseproto(
 		break;
 	case IF_DIRECTORY:
 		getres(tp, 0);
-		error = libxfs_inode_alloc(&tp, pip, mode|IFDIR, 1,
-				mp->m_dev, &creds, &ip);
+		error = libxfs_inode_alloc(&tp, pip, pe->mode|IFDIR, 1,
+				mp->m_dev, &pe->creds, &ip);
 		if (error)
 			fail("Inode allocation failed", error);
 		ip->i_d.di_nlink++;		/* account for . */
@@ -583,15 +613,7 @@ parseproto(
 		 */
 		if (isroot)
 			rtinit(mp);
-		tp = NULL;
-		for (;;) {
-			name = getstr(pp);
-			if (strcmp(name, "$") == 0)
-				break;
-			parseproto(mp, ip, pp, name);
-		}
-		libxfs_iput(ip, 0);
-		return;
+		return ip;
 	}
 	libxfs_trans_log_inode(tp, ip, flags);
 	error = libxfs_bmap_finish(&tp, &flist, first, &committed);
@@ -599,6 +621,218 @@ parseproto(
 		fail("Error encountered creating file from prototype", error);
 	}
 	libxfs_trans_commit(tp, 0, NULL);
+	return NULL;
+}
+
+void
+parseproto(
+	xfs_mount_t	*mp,
+	xfs_inode_t	*pip,
+	char		**pp,
+	char		*name)
+{
+	int		i;
+	xfs_inode_t	*ip;
+	int		majdev;
+	int		mindev;
+	char		*mstr;
+	protoent_t	pe;
+	int		val;
+	char		*value;
+
+	bzero(&pe, sizeof(pe));
+	mstr = getstr(pp);
+	switch (mstr[0]) {
+	case '-':
+		pe.fmt = IF_REGULAR;
+		break;
+	case 'r':
+		pe.fmt = IF_RESERVED;
+		break;
+	case 'b':
+		pe.fmt = IF_BLOCK;
+		break;
+	case 'c':
+		pe.fmt = IF_CHAR;
+		break;
+	case 'd':
+		pe.fmt = IF_DIRECTORY;
+		break;
+	case 'l':
+		pe.fmt = IF_SYMLINK;
+		break;
+	case 'p':
+		pe.fmt = IF_FIFO;
+		break;
+	default:
+		fprintf(stderr, "%s: bad format string %s\n", progname, mstr);
+		exit(1);
+	}
+	switch (mstr[1]) {
+	case '-':
+		break;
+	case 'u':
+		pe.mode |= ISUID;
+		break;
+	default:
+		fprintf(stderr, "%s: bad format string %s\n", progname, mstr);
+		exit(1);
+	}
+	switch (mstr[2]) {
+	case '-':
+		break;
+	case 'g':
+		pe.mode |= ISGID;
+		break;
+	default:
+		fprintf(stderr, "%s: bad format string %s\n", progname, mstr);
+		exit(1);
+	}
+	val = 0;
+	for (i = 3; i < 6; i++) {
+		if (mstr[i] < '0' || mstr[i] > '7') {
+			fprintf(stderr, "%s: bad format string %s\n",
+				progname, mstr);
+			exit(1);
+		}
+		val = val * 8 + mstr[i] - '0';
+	}
+	pe.mode |= val;
+	pe.creds.cr_uid = (int)getnum(pp);
+	pe.creds.cr_gid = (int)getnum(pp);
+	switch (pe.fmt) {
+	case IF_REGULAR:
+		pe.fd = newregfile(pp, &pe.size);
+		break;
+	case IF_RESERVED:
+		value = getstr(pp);
+		pe.size = cvtnum(mp->m_sb.sb_blocksize, value);
+		break;
+	case IF_BLOCK:
+	case IF_CHAR:
+		majdev = (int)getnum(pp);
+		mindev = (int)getnum(pp);
+		pe.rdev = makedev(majdev, mindev);
+		break;
+	case IF_SYMLINK:
+		pe.target = getstr(pp);
+		break;
+	}
+	ip = newnode(mp, pip, name, &pe);
+	if (pe.fmt == IF_REGULAR)
+		close(pe.fd);
+	if (ip == NULL)
+		return;
+	for (;;) {
+		name = getstr(pp);
+		if (strcmp(name, "$") == 0)
+			break;
+		parseproto(mp, ip, pp, name);
+	}
+	libxfs_iput(ip, 0);
+}
+
+/*
+ * Populate the filesystem from an existing directory tree instead of
+ * a prototype file.  Ownership, permissions and the file type come
+ * from lstat(); entries are created in name order so that the same
+ * tree always gives the same image.  Hard links are copied as
+ * separate files, and sockets are skipped.
+ */
+void
+parsedir(
+	xfs_mount_t	*mp,
+	xfs_inode_t	*pip,
+	char		*path,
+	char		*name)
+{
+	char		*cpath;
+	int		i;
+	xfs_inode_t	*ip;
+	int		n;
+	struct dirent	**names;
+	protoent_t	pe;
+	struct stat64	st;
+
+	if (lstat64(path, &st) < 0) {
+		fprintf(stderr, "%s: cannot stat %s: %s\n",
+			progname, path, strerror(errno));
+		exit(1);
+	}
+	bzero(&pe, sizeof(pe));
+	pe.mode = st.st_mode & (ISUID | ISGID | ISVTX | 0777);
+	pe.creds.cr_uid = st.st_uid;
+	pe.creds.cr_gid = st.st_gid;
+	switch (st.st_mode & S_IFMT) {
+	case S_IFREG:
+		pe.fmt = IF_REGULAR;
+		pe.size = st.st_size;
+		if ((pe.fd = open(path, O_RDONLY)) < 0) {
+			fprintf(stderr, "%s: cannot open %s: %s\n",
+				progname, path, strerror(errno));
+			exit(1);
+		}
+		break;
+	case S_IFDIR:
+		pe.fmt = IF_DIRECTORY;
+		break;
+	case S_IFLNK:
+		pe.fmt = IF_SYMLINK;
+		if ((pe.target = malloc(st.st_size + 1)) == NULL ||
+		    (n = readlink(path, pe.target, st.st_size)) < 0) {
+			fprintf(stderr, "%s: cannot read link %s: %s\n",
+				progname, path, strerror(errno));
+			exit(1);
+		}
+		pe.target[n] = '\0';
+		break;
+	case S_IFBLK:
+		pe.fmt = IF_BLOCK;
+		pe.rdev = st.st_rdev;
+		break;
+	case S_IFCHR:
+		pe.fmt = IF_CHAR;
+		pe.rdev = st.st_rdev;
+		break;
+	case S_IFIFO:
+		pe.fmt = IF_FIFO;
+		break;
+	default:
+		fprintf(stderr, "%s: skipping %s: unsupported file type\n",
+			progname, path);
+		return;
+	}
+
+	ip = newnode(mp, pip, name, &pe);
+	if (pe.fmt == IF_REGULAR)
+		close(pe.fd);
+	if (pe.fmt == IF_SYMLINK)
+		free(pe.target);
+	if (ip == NULL)
+		return;
+
+	if ((n = scandir(path, &names, NULL, alphasort)) < 0) {
+		fprintf(stderr, "%s: cannot read directory %s: %s\n",
+			progname, path, strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		name = names[i]->d_name;
+		if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+			if ((cpath = malloc(strlen(path) + strlen(name) + 2))
+			    == NULL) {
+				fprintf(stderr, "%s: out of memory\n",
+					progname);
+				exit(1);
+			}
+			sprintf(cpath, "%s/%s", path, name);
+			parsedir(mp, ip, cpath, name);
+			free(cpath);
+		}
+		free(names[i]);
+	}
+	free(names);
+	libxfs_iput(ip, 0);
 }
 
 /*
@@ -32,4 +32,5 @@
 
 char *setup_proto(char *fname);
 void parseproto(xfs_mount_t *mp, xfs_inode_t *pip, char **pp, char *name);
+void parsedir(xfs_mount_t *mp, xfs_inode_t *pip, char *path, char *name);
 void res_failed(int err);
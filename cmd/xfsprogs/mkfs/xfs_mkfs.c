@@ -33,6 +33,7 @@
 #include <libxfs.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include "xfs_mkfs.h"
 #include "proto.h"
 #include "volume.h"
@@ -59,6 +60,44 @@ static void unknown(char opt, char *s);
 static int  ispow2(unsigned int i);
 static int  max_trans_res(xfs_mount_t *mp);
 
+/*
+ * Records for the single-block free space and inode btrees laid down
+ * in each AG, fed to the libxfs bulk loader: at most two free extents,
+ * either side of a stripe aligned internal log.
+ */
+typedef struct mkfs_btsrc {
+	xfs_agblock_t	agbno;		/* the tree's only block */
+	int		nrecs;
+	int		next;
+	xfs_agblock_t	start[2];
+	xfs_extlen_t	len[2];
+} mkfs_btsrc_t;
+
+static void write_btree_root(xfs_mount_t *mp, xfs_agnumber_t agno,
+			     __uint32_t magic, mkfs_btsrc_t *src);
+
+/*
+ * What init_ag() needs to know to lay down an AG's headers, and the
+ * work queue the AG threads share.
+ */
+typedef struct mkfs_aginit {
+	xfs_mount_t	*mp;
+	xfs_sb_t	*sbp;
+	xfs_agnumber_t	agcount;
+	__uint64_t	agsize;		/* all but the last AG */
+	xfs_drfsbno_t	dblocks;
+	int		loginternal;
+	xfs_agnumber_t	logagno;
+	xfs_dfsbno_t	logstart;
+	xfs_drfsbno_t	logblocks;
+	int		lalign;
+	pthread_mutex_t	lock;
+	xfs_agnumber_t	next;		/* next AG to hand out */
+	int		worst_freelist;	/* max over all AGFs */
+} mkfs_aginit_t;
+
+static void init_ags(mkfs_aginit_t *ai);
+
 /*
  * option tables for getsubopt calls
  */
@@ -373,12 +412,9 @@ int
 main(int argc, char **argv)
 {
 	__uint64_t		agcount;
-	xfs_agf_t		*agf;
-	xfs_agi_t		*agi;
+	mkfs_aginit_t		ai;
 	xfs_agnumber_t		agno;
 	__uint64_t		agsize;
-	xfs_alloc_rec_t		*arec;
-	xfs_btree_sblock_t	*block;
 	int			blflag;
 	int			blocklog;
 	int			blocksize;
@@ -427,7 +463,6 @@ main(int argc, char **argv)
 	xfs_extlen_t		nbmblocks;
 	int			nlflag;
 	int			nodsflag;
-	xfs_alloc_rec_t		*nrec;
 	int			nsflag;
 	int			nvflag;
 	char			*p;
@@ -1102,6 +1137,7 @@ main(int argc, char **argv)
 		fprintf(stderr, "no device name given in argument list\n");
 		usage();
 	}
+	libxfs_bcache_init(0, XFS_DFL_BCACHE_SIZE);
 
 	/*
 	 * Check whether this partition contains a known filesystem.
@@ -1599,166 +1635,22 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
-	for (agno = 0; agno < agcount; agno++) {
-		/*
-		 * Superblock.
-		 */
-		buf = libxfs_getbuf(xi.ddev,
-				XFS_AG_DADDR(mp, agno, XFS_SB_DADDR), 1);
-		bzero(XFS_BUF_PTR(buf), BBSIZE);
-                libxfs_xlate_sb(XFS_BUF_PTR(buf), sbp, -1, ARCH_CONVERT,
-				XFS_SB_ALL_BITS);
-		libxfs_writebuf(buf, 1);
-
-		/*
-		 * AG header block: freespace
-		 */
-		buf = libxfs_getbuf(mp->m_dev,
-				XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR), 1);
-		agf = XFS_BUF_TO_AGF(buf);
-		bzero(agf, BBSIZE);
-		if (agno == agcount - 1)
-			agsize = dblocks - (xfs_drfsbno_t)(agno * agsize);
-		INT_SET(agf->agf_magicnum, ARCH_CONVERT, XFS_AGF_MAGIC);
-		INT_SET(agf->agf_versionnum, ARCH_CONVERT, XFS_AGF_VERSION);
-		INT_SET(agf->agf_seqno, ARCH_CONVERT, agno);
-		INT_SET(agf->agf_length, ARCH_CONVERT, (xfs_agblock_t)agsize);
-		INT_SET(agf->agf_roots[XFS_BTNUM_BNOi], ARCH_CONVERT,
-				XFS_BNO_BLOCK(mp));
-		INT_SET(agf->agf_roots[XFS_BTNUM_CNTi], ARCH_CONVERT,
-				XFS_CNT_BLOCK(mp));
-		INT_SET(agf->agf_levels[XFS_BTNUM_BNOi], ARCH_CONVERT, 1);
-		INT_SET(agf->agf_levels[XFS_BTNUM_CNTi], ARCH_CONVERT, 1);
-		INT_SET(agf->agf_flfirst, ARCH_CONVERT, 0);
-		INT_SET(agf->agf_fllast, ARCH_CONVERT, XFS_AGFL_SIZE - 1);
-		INT_SET(agf->agf_flcount, ARCH_CONVERT, 0);
-		nbmblocks = (xfs_extlen_t)(agsize - XFS_PREALLOC_BLOCKS(mp));
-		INT_SET(agf->agf_freeblks, ARCH_CONVERT, nbmblocks);
-		INT_SET(agf->agf_longest, ARCH_CONVERT, nbmblocks);
-		if (loginternal && agno == logagno) {
-			INT_MOD(agf->agf_freeblks, ARCH_CONVERT, -logblocks);
-			INT_SET(agf->agf_longest, ARCH_CONVERT, agsize - 
-				XFS_FSB_TO_AGBNO(mp, logstart) - logblocks);
-		}
-		if (XFS_MIN_FREELIST(agf, mp) > worst_freelist)
-			worst_freelist = XFS_MIN_FREELIST(agf, mp);
-		libxfs_writebuf(buf, 1);
-
-		/*
-		 * AG header block: inodes
-		 */
-		buf = libxfs_getbuf(mp->m_dev,
-				XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR), 1);
-		agi = XFS_BUF_TO_AGI(buf);
-		bzero(agi, BBSIZE);
-		INT_SET(agi->agi_magicnum, ARCH_CONVERT, XFS_AGI_MAGIC);
-		INT_SET(agi->agi_versionnum, ARCH_CONVERT, XFS_AGI_VERSION);
-		INT_SET(agi->agi_seqno, ARCH_CONVERT, agno);
-		INT_SET(agi->agi_length, ARCH_CONVERT, (xfs_agblock_t)agsize);
-		INT_SET(agi->agi_count, ARCH_CONVERT, 0);
-		INT_SET(agi->agi_root, ARCH_CONVERT, XFS_IBT_BLOCK(mp));
-		INT_SET(agi->agi_level, ARCH_CONVERT, 1);
-		INT_SET(agi->agi_freecount, ARCH_CONVERT, 0);
-		INT_SET(agi->agi_newino, ARCH_CONVERT, NULLAGINO);
-		INT_SET(agi->agi_dirino, ARCH_CONVERT, NULLAGINO);
-		for (i = 0; i < XFS_AGI_UNLINKED_BUCKETS; i++)
-			INT_SET(agi->agi_unlinked[i], ARCH_CONVERT, NULLAGINO);
-		libxfs_writebuf(buf, 1);
-
-		/*
-		 * BNO btree root block
-		 */
-		buf = libxfs_getbuf(mp->m_dev,
-				XFS_AGB_TO_DADDR(mp, agno, XFS_BNO_BLOCK(mp)),
-				bsize);
-		block = XFS_BUF_TO_SBLOCK(buf);
-		bzero(block, blocksize);
-		INT_SET(block->bb_magic, ARCH_CONVERT, XFS_ABTB_MAGIC);
-		INT_SET(block->bb_level, ARCH_CONVERT, 0);
-		INT_SET(block->bb_numrecs, ARCH_CONVERT, 1);
-		INT_SET(block->bb_leftsib, ARCH_CONVERT, NULLAGBLOCK);
-		INT_SET(block->bb_rightsib, ARCH_CONVERT, NULLAGBLOCK);
-		arec = XFS_BTREE_REC_ADDR(blocksize, xfs_alloc, block, 1,
-			XFS_BTREE_BLOCK_MAXRECS(blocksize, xfs_alloc, 1));
-		INT_SET(arec->ar_startblock, ARCH_CONVERT,
-			XFS_PREALLOC_BLOCKS(mp));
-		if (loginternal && agno == logagno) {
-			if (lalign) {
-				/*
-				 * Have to insert two records
-				 */
-				INT_SET(arec->ar_blockcount, ARCH_CONVERT, 
-					(xfs_extlen_t)(XFS_FSB_TO_AGBNO(
-						mp, logstart)
-				  	- (INT_GET(arec->ar_startblock,
-						ARCH_CONVERT))));
-				nrec = arec + 1;
-				INT_SET(nrec->ar_startblock, ARCH_CONVERT,
-					INT_GET(arec->ar_startblock,
-						ARCH_CONVERT) +
-					INT_GET(arec->ar_blockcount,
-						ARCH_CONVERT));
-				arec = nrec;
-				INT_MOD(block->bb_numrecs, ARCH_CONVERT, 1);
-			} 
-			INT_MOD(arec->ar_startblock, ARCH_CONVERT, logblocks);
-		} 
-		INT_SET(arec->ar_blockcount, ARCH_CONVERT,
-			(xfs_extlen_t)(agsize -
-				INT_GET(arec->ar_startblock, ARCH_CONVERT)));
-		libxfs_writebuf(buf, 1);
-
-		/*
-		 * CNT btree root block
-		 */
-		buf = libxfs_getbuf(mp->m_dev,
-				XFS_AGB_TO_DADDR(mp, agno, XFS_CNT_BLOCK(mp)),
-				bsize);
-		block = XFS_BUF_TO_SBLOCK(buf);
-		bzero(block, blocksize);
-		INT_SET(block->bb_magic, ARCH_CONVERT, XFS_ABTC_MAGIC);
-		INT_SET(block->bb_level, ARCH_CONVERT, 0);
-		INT_SET(block->bb_numrecs, ARCH_CONVERT, 1);
-		INT_SET(block->bb_leftsib, ARCH_CONVERT, NULLAGBLOCK);
-		INT_SET(block->bb_rightsib, ARCH_CONVERT, NULLAGBLOCK);
-		arec = XFS_BTREE_REC_ADDR(blocksize, xfs_alloc, block, 1,
-			XFS_BTREE_BLOCK_MAXRECS(blocksize, xfs_alloc, 1));
-		INT_SET(arec->ar_startblock, ARCH_CONVERT,
-			XFS_PREALLOC_BLOCKS(mp));
-		if (loginternal && agno == logagno) {
-			if (lalign) {
-				INT_SET(arec->ar_blockcount, ARCH_CONVERT,
-				    (xfs_extlen_t)( XFS_FSB_TO_AGBNO(
-					mp, logstart) - (INT_GET(
-					arec->ar_startblock, ARCH_CONVERT)) )
-				);
-				nrec = arec + 1;
-				INT_SET(nrec->ar_startblock, ARCH_CONVERT,
-				    INT_GET(arec->ar_startblock, ARCH_CONVERT) +
-				    INT_GET(arec->ar_blockcount, ARCH_CONVERT));
-				arec = nrec;
-				INT_MOD(block->bb_numrecs, ARCH_CONVERT, 1);
-			}
-			INT_MOD(arec->ar_startblock, ARCH_CONVERT, logblocks);
-		}	
-		INT_SET(arec->ar_blockcount, ARCH_CONVERT, (xfs_extlen_t)
-			(agsize - INT_GET(arec->ar_startblock, ARCH_CONVERT)));
-		libxfs_writebuf(buf, 1);
-		/*
-		 * INO btree root block
-		 */
-		buf = libxfs_getbuf(mp->m_dev,
-				XFS_AGB_TO_DADDR(mp, agno, XFS_IBT_BLOCK(mp)),
-				bsize);
-		block = XFS_BUF_TO_SBLOCK(buf);
-		bzero(block, blocksize);
-		INT_SET(block->bb_magic, ARCH_CONVERT, XFS_IBT_MAGIC);
-		INT_SET(block->bb_level, ARCH_CONVERT, 0);
-		INT_SET(block->bb_numrecs, ARCH_CONVERT, 0);
-		INT_SET(block->bb_leftsib, ARCH_CONVERT, NULLAGBLOCK);
-		INT_SET(block->bb_rightsib, ARCH_CONVERT, NULLAGBLOCK);
-		libxfs_writebuf(buf, 1);
-	}
+	/*
+	 * AG headers and btree roots.
+	 */
+	bzero(&ai, sizeof(ai));
+	ai.mp = mp;
+	ai.sbp = sbp;
+	ai.agcount = (xfs_agnumber_t)agcount;
+	ai.agsize = agsize;
+	ai.dblocks = dblocks;
+	ai.loginternal = loginternal;
+	ai.logagno = logagno;
+	ai.logstart = logstart;
+	ai.logblocks = logblocks;
+	ai.lalign = lalign;
+	init_ags(&ai);
+	worst_freelist = ai.worst_freelist;
 
 	/*
 	 * Touch last block, make fs the right size if it's a file.
@@ -1800,7 +1692,12 @@ main(int argc, char **argv)
 	 * Allocate the root inode and anything else in the proto file.
 	 */
 	mp->m_rootip = NULL;
-	parseproto(mp, NULL, &protostring, NULL);
+	libxfs_trans_delwri(1);
+	if (protostring)
+		parseproto(mp, NULL, &protostring, NULL);
+	else
+		parsedir(mp, NULL, protofile, NULL);
+	libxfs_trans_delwri(0);
 
 	/*
 	 * protect ourselves against possible stupidity
@@ -1841,8 +1738,9 @@ main(int argc, char **argv)
 	}
 
 	/*
-	 * Mark the filesystem ok.
+	 * Mark the filesystem ok, once everything else is on disk.
 	 */
+	libxfs_bcache_flush(1);
 	buf = libxfs_getsb(mp, 1);
 	(XFS_BUF_TO_SBP(buf))->sb_inprogress = 0;
 	libxfs_writebuf(buf, 1);
@@ -1918,6 +1816,235 @@ unknown(
 	usage();
 }
 
+static xfs_agblock_t
+btsrc_alloc(void *priv, int level)
+{
+	return ((mkfs_btsrc_t *)priv)->agbno;
+}
+
+static int
+btsrc_getrec(void *priv, void *rec, void *key)
+{
+	mkfs_btsrc_t	*src = priv;
+	xfs_alloc_rec_t	*arec = rec;
+
+	if (src->next >= src->nrecs)
+		return 0;
+	INT_SET(arec->ar_startblock, ARCH_CONVERT, src->start[src->next]);
+	INT_SET(arec->ar_blockcount, ARCH_CONVERT, src->len[src->next]);
+	if (key != NULL)
+		*(xfs_alloc_key_t *)key = *arec;
+	src->next++;
+	return 1;
+}
+
+static void
+write_btree_root(
+	xfs_mount_t	*mp,
+	xfs_agnumber_t	agno,
+	__uint32_t	magic,
+	mkfs_btsrc_t	*src)
+{
+	libxfs_bload_t	bl;
+
+	bzero(&bl, sizeof(bl));
+	bl.bl_mp = mp;
+	bl.bl_agno = agno;
+	bl.bl_magic = magic;
+	if (magic == XFS_IBT_MAGIC) {
+		bl.bl_recsize = sizeof(xfs_inobt_rec_t);
+		bl.bl_keysize = sizeof(xfs_inobt_key_t);
+	} else {
+		bl.bl_recsize = sizeof(xfs_alloc_rec_t);
+		bl.bl_keysize = sizeof(xfs_alloc_key_t);
+	}
+	bl.bl_alloc = btsrc_alloc;
+	bl.bl_getrec = btsrc_getrec;
+	bl.bl_priv = src;
+
+	src->next = 0;
+	libxfs_bload_geometry(&bl, src->nrecs);
+	ASSERT(bl.bl_nlevels == 1);
+	if (libxfs_bload(&bl)) {
+		fprintf(stderr, "%s: failed to write btree root in AG %u\n",
+			progname, agno);
+		exit(1);
+	}
+}
+
+/*
+ * Lay down the headers and the free space and inode btree roots of
+ * one AG.  The superblock, AGF and AGI are adjacent sectors and go
+ * out together in one write.
+ */
+static void
+init_ag(
+	mkfs_aginit_t	*ai,
+	xfs_agnumber_t	agno)
+{
+	xfs_agf_t	*agf;
+	xfs_agi_t	*agi;
+	__uint64_t	agsize;
+	xfs_buf_t	*bufs[3];
+	mkfs_btsrc_t	btsrc;
+	int		freelist;
+	int		i;
+	xfs_mount_t	*mp;
+	xfs_extlen_t	nbmblocks;
+
+	mp = ai->mp;
+	agsize = ai->agsize;
+	if (agno == ai->agcount - 1)
+		agsize = ai->dblocks - (xfs_drfsbno_t)(agno * agsize);
+
+	/*
+	 * Superblock.
+	 */
+	bufs[0] = libxfs_getbuf(mp->m_dev,
+			XFS_AG_DADDR(mp, agno, XFS_SB_DADDR), 1);
+	bzero(XFS_BUF_PTR(bufs[0]), BBSIZE);
+	libxfs_xlate_sb(XFS_BUF_PTR(bufs[0]), ai->sbp, -1, ARCH_CONVERT,
+			XFS_SB_ALL_BITS);
+
+	/*
+	 * AG header block: freespace
+	 */
+	bufs[1] = libxfs_getbuf(mp->m_dev,
+			XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR), 1);
+	agf = XFS_BUF_TO_AGF(bufs[1]);
+	bzero(agf, BBSIZE);
+	INT_SET(agf->agf_magicnum, ARCH_CONVERT, XFS_AGF_MAGIC);
+	INT_SET(agf->agf_versionnum, ARCH_CONVERT, XFS_AGF_VERSION);
+	INT_SET(agf->agf_seqno, ARCH_CONVERT, agno);
+	INT_SET(agf->agf_length, ARCH_CONVERT, (xfs_agblock_t)agsize);
+	INT_SET(agf->agf_roots[XFS_BTNUM_BNOi], ARCH_CONVERT,
+			XFS_BNO_BLOCK(mp));
+	INT_SET(agf->agf_roots[XFS_BTNUM_CNTi], ARCH_CONVERT,
+			XFS_CNT_BLOCK(mp));
+	INT_SET(agf->agf_levels[XFS_BTNUM_BNOi], ARCH_CONVERT, 1);
+	INT_SET(agf->agf_levels[XFS_BTNUM_CNTi], ARCH_CONVERT, 1);
+	INT_SET(agf->agf_flfirst, ARCH_CONVERT, 0);
+	INT_SET(agf->agf_fllast, ARCH_CONVERT, XFS_AGFL_SIZE - 1);
+	INT_SET(agf->agf_flcount, ARCH_CONVERT, 0);
+	nbmblocks = (xfs_extlen_t)(agsize - XFS_PREALLOC_BLOCKS(mp));
+	INT_SET(agf->agf_freeblks, ARCH_CONVERT, nbmblocks);
+	INT_SET(agf->agf_longest, ARCH_CONVERT, nbmblocks);
+	if (ai->loginternal && agno == ai->logagno) {
+		INT_MOD(agf->agf_freeblks, ARCH_CONVERT, -ai->logblocks);
+		INT_SET(agf->agf_longest, ARCH_CONVERT, agsize - 
+			XFS_FSB_TO_AGBNO(mp, ai->logstart) - ai->logblocks);
+	}
+	freelist = XFS_MIN_FREELIST(agf, mp);
+
+	/*
+	 * AG header block: inodes
+	 */
+	bufs[2] = libxfs_getbuf(mp->m_dev,
+			XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR), 1);
+	agi = XFS_BUF_TO_AGI(bufs[2]);
+	bzero(agi, BBSIZE);
+	INT_SET(agi->agi_magicnum, ARCH_CONVERT, XFS_AGI_MAGIC);
+	INT_SET(agi->agi_versionnum, ARCH_CONVERT, XFS_AGI_VERSION);
+	INT_SET(agi->agi_seqno, ARCH_CONVERT, agno);
+	INT_SET(agi->agi_length, ARCH_CONVERT, (xfs_agblock_t)agsize);
+	INT_SET(agi->agi_count, ARCH_CONVERT, 0);
+	INT_SET(agi->agi_root, ARCH_CONVERT, XFS_IBT_BLOCK(mp));
+	INT_SET(agi->agi_level, ARCH_CONVERT, 1);
+	INT_SET(agi->agi_freecount, ARCH_CONVERT, 0);
+	INT_SET(agi->agi_newino, ARCH_CONVERT, NULLAGINO);
+	INT_SET(agi->agi_dirino, ARCH_CONVERT, NULLAGINO);
+	for (i = 0; i < XFS_AGI_UNLINKED_BUCKETS; i++)
+		INT_SET(agi->agi_unlinked[i], ARCH_CONVERT, NULLAGINO);
+
+	libxfs_writebufs(bufs, 3, 1);
+
+	pthread_mutex_lock(&ai->lock);
+	if (freelist > ai->worst_freelist)
+		ai->worst_freelist = freelist;
+	pthread_mutex_unlock(&ai->lock);
+
+	/*
+	 * BNO and CNT btree root blocks, both describing the
+	 * space after the preallocated blocks less any internal log
+	 */
+	btsrc.start[0] = XFS_PREALLOC_BLOCKS(mp);
+	btsrc.nrecs = 1;
+	if (ai->loginternal && agno == ai->logagno) {
+		if (ai->lalign) {
+			/*
+			 * Have to insert two records
+			 */
+			btsrc.len[0] = (xfs_extlen_t)(XFS_FSB_TO_AGBNO(
+				mp, ai->logstart) - btsrc.start[0]);
+			btsrc.start[1] = btsrc.start[0] + btsrc.len[0];
+			btsrc.nrecs = 2;
+		}
+		btsrc.start[btsrc.nrecs - 1] += ai->logblocks;
+	}
+	btsrc.len[btsrc.nrecs - 1] = (xfs_extlen_t)(agsize -
+			btsrc.start[btsrc.nrecs - 1]);
+
+	btsrc.agbno = XFS_BNO_BLOCK(mp);
+	write_btree_root(mp, agno, XFS_ABTB_MAGIC, &btsrc);
+	btsrc.agbno = XFS_CNT_BLOCK(mp);
+	write_btree_root(mp, agno, XFS_ABTC_MAGIC, &btsrc);
+
+	/*
+	 * INO btree root block
+	 */
+	btsrc.agbno = XFS_IBT_BLOCK(mp);
+	btsrc.nrecs = 0;
+	write_btree_root(mp, agno, XFS_IBT_MAGIC, &btsrc);
+}
+
+static void *
+init_ag_worker(
+	void		*arg)
+{
+	mkfs_aginit_t	*ai = arg;
+	xfs_agnumber_t	agno;
+
+	for (;;) {
+		pthread_mutex_lock(&ai->lock);
+		agno = ai->next;
+		if (agno < ai->agcount)
+			ai->next++;
+		pthread_mutex_unlock(&ai->lock);
+		if (agno >= ai->agcount)
+			return NULL;
+		init_ag(ai, agno);
+	}
+}
+
+/*
+ * AGs don't depend on one another, so a few threads take them in
+ * turn; with hundreds of AGs the header writes are what mkfs spends
+ * its time waiting for.  The calling thread works too, so if no
+ * thread can be started this is just the old loop.
+ */
+static void
+init_ags(
+	mkfs_aginit_t	*ai)
+{
+	int		i;
+	int		n;
+	pthread_t	tid[XFS_DFL_AGTHREADS];
+
+	pthread_mutex_init(&ai->lock, NULL);
+	ai->next = 0;
+	n = (int)MIN(XFS_DFL_AGTHREADS, ai->agcount);
+	for (i = 1; i < n; i++) {
+		if (pthread_create(&tid[i], NULL, init_ag_worker, ai) != 0) {
+			n = i;
+			break;
+		}
+	}
+	init_ag_worker(ai);
+	for (i = 1; i < n; i++)
+		pthread_join(tid[i], NULL);
+	pthread_mutex_destroy(&ai->lock);
+}
+
 static int
 max_trans_res(
 	xfs_mount_t			*mp)
@@ -44,6 +44,8 @@
 #define	XFS_MIN_LOG_FACTOR	3		/* min log size factor */
 #define	XFS_DFL_LOG_FACTOR	16		/* default log size, factor */
 						/* with max trans reservation */
+#define	XFS_DFL_BCACHE_SIZE	(16 << 20)	/* libxfs buffer cache, bytes */
+#define	XFS_DFL_AGTHREADS	8		/* threads writing AG headers */
 extern void  usage (void);
 extern int64_t cvtnum (int blocksize, char *s);
 
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+#include <libxfs.h>
+#include "globals.h"
+#include "arena.h"
+#include "threads.h"
+#include "err_protos.h"
+
+/*
+ * block header, padded so the records after it stay 64-bit aligned
+ */
+typedef union arena_blk  {
+	union arena_blk		*next;
+	__uint64_t		pad;
+} arena_blk_t;
+
+static pthread_mutex_t	arena_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static arena_stats_t	*arena_stats_list;
+
+void
+arena_init(arena_t *arena, arena_stats_t *stats, int perblock)
+{
+	arena->a_stats = stats;
+	arena->a_objsize = roundup(MAX(stats->as_objsize, sizeof(void *)),
+					sizeof(__uint64_t));
+	arena->a_perblock = MAX(perblock, 1);
+	arena->a_blocks = NULL;
+	arena->a_next = NULL;
+	arena->a_left = 0;
+	arena->a_free = NULL;
+	pthread_mutex_init(&arena->a_lock, NULL);
+}
+
+static void
+arena_account(arena_t *arena, __int64_t bytes)
+{
+	arena_stats_t	*stats = arena->a_stats;
+
+	XR_LOCK(&arena_stats_lock);
+	if (!stats->as_listed)  {
+		stats->as_next = arena_stats_list;
+		arena_stats_list = stats;
+		stats->as_listed = 1;
+	}
+	stats->as_bytes += bytes;
+	if (bytes > 0)
+		stats->as_blocks++;
+	if (stats->as_bytes > stats->as_peak)
+		stats->as_peak = stats->as_bytes;
+	XR_UNLOCK(&arena_stats_lock);
+}
+
+void *
+arena_alloc(arena_t *arena)
+{
+	arena_blk_t	*blk;
+	void		*obj;
+	size_t		size;
+
+	XR_LOCK(&arena->a_lock);
+	if ((obj = arena->a_free) != NULL)  {
+		arena->a_free = *(void **) obj;
+		XR_UNLOCK(&arena->a_lock);
+		return(obj);
+	}
+
+	if (arena->a_left == 0)  {
+		size = sizeof(arena_blk_t) + arena->a_perblock * arena->a_objsize;
+		if ((blk = malloc(size)) == NULL)
+			do_error("couldn't allocate %s (%u bytes)\n",
+				arena->a_stats->as_name, size);
+		blk->next = arena->a_blocks;
+		arena->a_blocks = blk;
+		arena->a_next = (char *) (blk + 1);
+		arena->a_left = arena->a_perblock;
+		arena_account(arena, size);
+	}
+
+	obj = arena->a_next;
+	arena->a_next += arena->a_objsize;
+	arena->a_left--;
+	XR_UNLOCK(&arena->a_lock);
+
+	return(obj);
+}
+
+void
+arena_free(arena_t *arena, void *obj)
+{
+	XR_LOCK(&arena->a_lock);
+	*(void **) obj = arena->a_free;
+	arena->a_free = obj;
+	XR_UNLOCK(&arena->a_lock);
+}
+
+/*
+ * free every record in the arena.  the arena can be used again.
+ */
+void
+arena_reset(arena_t *arena)
+{
+	arena_blk_t	*blk;
+	arena_blk_t	*next;
+	__int64_t	bytes = 0;
+
+	XR_LOCK(&arena->a_lock);
+	for (blk = arena->a_blocks; blk != NULL; blk = next)  {
+		next = blk->next;
+		free(blk);
+		bytes += sizeof(arena_blk_t) +
+				arena->a_perblock * arena->a_objsize;
+	}
+	arena->a_blocks = NULL;
+	arena->a_next = NULL;
+	arena->a_left = 0;
+	arena->a_free = NULL;
+	XR_UNLOCK(&arena->a_lock);
+
+	if (bytes)
+		arena_account(arena, -bytes);
+}
+
+void
+arena_report(FILE *fp)
+{
+	arena_stats_t	*stats;
+
+	XR_LOCK(&arena_stats_lock);
+	for (stats = arena_stats_list; stats != NULL; stats = stats->as_next)
+		fprintf(fp, "%-24s %4u byte records, "
+			"%8llu KB now, %8llu KB peak, %llu blocks\n",
+			stats->as_name, (unsigned int) stats->as_objsize,
+			(unsigned long long) stats->as_bytes >> 10,
+			(unsigned long long) stats->as_peak >> 10,
+			(unsigned long long) stats->as_blocks);
+	XR_UNLOCK(&arena_stats_lock);
+}
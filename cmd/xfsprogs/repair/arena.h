@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+#include <pthread.h>
+
+/*
+ * arenas hand out fixed-size records carved from large blocks, and
+ * give every block back at once when the structure the records
+ * belong to is torn down.  that saves a malloc header per record
+ * and the time it takes to free millions of them one at a time.
+ * single records can still be returned with arena_free(), they are
+ * reused before any new space is carved.
+ *
+ * arenas of the same kind (e.g. the inode records of every AG) share
+ * an arena_stats_t, which is what the memory report prints.  the
+ * stats are only touched when a block is allocated or freed.
+ *
+ * each arena has its own lock, taken only when repair is running
+ * more than one worker thread.
+ */
+typedef struct arena_stats  {
+	char			*as_name;
+	size_t			as_objsize;
+	__uint64_t		as_bytes;	/* held in blocks now */
+	__uint64_t		as_peak;	/* most ever held */
+	__uint64_t		as_blocks;	/* blocks ever allocated */
+	struct arena_stats	*as_next;	/* on the report list */
+	int			as_listed;
+} arena_stats_t;
+
+#define	ARENA_STATS_INIT(name, type)	{ (name), sizeof(type) }
+
+typedef struct arena  {
+	arena_stats_t		*a_stats;
+	size_t			a_objsize;	/* rounded up for alignment */
+	int			a_perblock;	/* records per block */
+	void			*a_blocks;	/* blocks, linked by 1st word */
+	char			*a_next;	/* uncarved space in newest */
+	int			a_left;		/* records left to carve */
+	void			*a_free;	/* returned records */
+	pthread_mutex_t		a_lock;
+} arena_t;
+
+void		arena_init(arena_t *arena, arena_stats_t *stats, int perblock);
+void		*arena_alloc(arena_t *arena);
+void		arena_free(arena_t *arena, void *obj);
+void		arena_reset(arena_t *arena);
+void		arena_report(FILE *fp);
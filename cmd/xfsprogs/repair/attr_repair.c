@@ -352,12 +352,6 @@ rmtval_get(xfs_mount_t *mp, xfs_ino_t ino, blkmap_t *blkmap,
 	return (clearit);
 }
 
-/*
- * freespace map for directory and attribute leaf blocks (1 bit per byte)
- * 1 == used, 0 == free
- */
-static da_freemap_t attr_freemap[DA_BMAP_SIZE];
-
 /* The block is read in. The magic number and forward / backward
  * links are checked by the caller process_leaf_attr.
  * If any problems occur the routine returns with non-zero. In
@@ -381,6 +375,11 @@ process_leaf_attr_block(
 	xfs_attr_leaf_name_local_t *local;
 	xfs_attr_leaf_name_remote_t *remotep;
 	int  i, start, stop, clearit, usedbs, firstb, thissize;
+	/*
+	 * freespace map for the block (1 bit per byte)
+	 * 1 == used, 0 == free
+	 */
+	da_freemap_t attr_freemap[DA_BMAP_SIZE];
 
 	clearit = usedbs = 0;
 	*repair = 0;
@@ -0,0 +1,415 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+#include <libxfs.h>
+#include "avl.h"
+#include "globals.h"
+#include "arena.h"
+#include "bptree.h"
+#include "err_protos.h"
+
+/*
+ * see bptree.h.  interior node keys are kept equal to the smallest
+ * key under them, so a search that finds no key <= value at some
+ * level can stop -- there is nothing that small in the tree.
+ */
+
+#define	BPT_NODES_PER_BLOCK	16
+
+static arena_stats_t	bpt_stats = ARENA_STATS_INIT("in-core b+tree nodes",
+						bptree_node_t);
+
+static bptree_node_t *
+bpt_alloc(bptree_desc_t *tree, int level)
+{
+	bptree_node_t	*node;
+
+	node = arena_alloc(&tree->bpt_arena);
+	node->bn_nkeys = 0;
+	node->bn_level = level;
+
+	return(node);
+}
+
+/*
+ * index of the last key <= value, -1 if they're all bigger
+ */
+static int
+bpt_search(bptree_node_t *node, __psunsigned_t value)
+{
+	int	lo = 0;
+	int	hi = node->bn_nkeys - 1;
+	int	mid;
+
+	while (lo <= hi)  {
+		mid = (lo + hi) / 2;
+		if (node->bn_keys[mid] <= value)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return(hi);
+}
+
+static void
+bpt_insert_at(bptree_node_t *node, int pos, __psunsigned_t key, void *ptr)
+{
+	int	n = node->bn_nkeys - pos;
+
+	ASSERT(node->bn_nkeys < BPT_MAXKEYS);
+	ASSERT(pos >= 0 && pos <= node->bn_nkeys);
+
+	memmove(&node->bn_keys[pos + 1], &node->bn_keys[pos],
+		n * sizeof(__psunsigned_t));
+	memmove(&node->bn_ptrs[pos + 1], &node->bn_ptrs[pos],
+		n * sizeof(void *));
+	node->bn_keys[pos] = key;
+	node->bn_ptrs[pos] = ptr;
+	node->bn_nkeys++;
+}
+
+static void
+bpt_remove_at(bptree_node_t *node, int pos)
+{
+	int	n = node->bn_nkeys - pos - 1;
+
+	ASSERT(pos >= 0 && pos < node->bn_nkeys);
+
+	memmove(&node->bn_keys[pos], &node->bn_keys[pos + 1],
+		n * sizeof(__psunsigned_t));
+	memmove(&node->bn_ptrs[pos], &node->bn_ptrs[pos + 1],
+		n * sizeof(void *));
+	node->bn_nkeys--;
+}
+
+/*
+ * move the upper half of a full node into a new right sibling
+ */
+static bptree_node_t *
+bpt_split(bptree_desc_t *tree, bptree_node_t *node)
+{
+	bptree_node_t	*right;
+	int		half = node->bn_nkeys / 2;
+
+	right = bpt_alloc(tree, node->bn_level);
+	right->bn_nkeys = node->bn_nkeys - half;
+	memcpy(right->bn_keys, &node->bn_keys[half],
+		right->bn_nkeys * sizeof(__psunsigned_t));
+	memcpy(right->bn_ptrs, &node->bn_ptrs[half],
+		right->bn_nkeys * sizeof(void *));
+	node->bn_nkeys = half;
+
+	return(right);
+}
+
+/*
+ * walk down to the leaf that value belongs in.  path[] and slot[]
+ * get the node and index used at each level, indexed by level.
+ * returns the leaf index of the last key <= value, or -1.
+ */
+static int
+bpt_descend(bptree_desc_t *tree, __psunsigned_t value,
+	bptree_node_t **path, int *slot)
+{
+	bptree_node_t	*node = tree->bpt_root;
+	int		i;
+
+	for (;;)  {
+		i = bpt_search(node, value);
+		path[node->bn_level] = node;
+		slot[node->bn_level] = MAX(i, 0);
+		if (node->bn_level == 0)
+			return(i);
+		node = node->bn_ptrs[MAX(i, 0)];
+	}
+}
+
+/*
+ * record with the largest start <= value
+ */
+static avlnode_t *
+bpt_lookup(bptree_desc_t *tree, __psunsigned_t value)
+{
+	bptree_node_t	*node = tree->bpt_root;
+	int		i;
+
+	while (node != NULL)  {
+		if ((i = bpt_search(node, value)) < 0)
+			return(NULL);
+		if (node->bn_level == 0)
+			return((avlnode_t *) node->bn_ptrs[i]);
+		node = node->bn_ptrs[i];
+	}
+
+	return(NULL);
+}
+
+void
+bptree_init(bptree_desc_t *tree, avlops_t *ops)
+{
+	tree->bpt_root = NULL;
+	tree->bpt_firstino = NULL;
+	tree->bpt_ops = ops;
+	arena_init(&tree->bpt_arena, &bpt_stats, BPT_NODES_PER_BLOCK);
+}
+
+/*
+ * drop every record.  the records themselves belong to the caller.
+ */
+void
+bptree_clear(bptree_desc_t *tree)
+{
+	tree->bpt_root = NULL;
+	tree->bpt_firstino = NULL;
+	arena_reset(&tree->bpt_arena);
+}
+
+/*
+ * returns newnode, or NULL if it overlaps a record already in the tree
+ */
+avlnode_t *
+bptree_insert(bptree_desc_t *tree, avlnode_t *newnode)
+{
+	bptree_node_t	*path[BPT_MAXLEVELS];
+	int		slot[BPT_MAXLEVELS];
+	bptree_node_t	*node;
+	bptree_node_t	*right;
+	avlnode_t	*prev;
+	avlnode_t	*next;
+	__psunsigned_t	start = BPT_START(tree, newnode);
+	__psunsigned_t	end = BPT_END(tree, newnode);
+	__psunsigned_t	key;
+	void		*ptr;
+	int		level;
+	int		pos;
+	int		i;
+
+	newnode->avl_nextino = NULL;
+	newnode->avl_forw = newnode->avl_back = newnode->avl_parent = NULL;
+
+	if (tree->bpt_root == NULL)  {
+		node = bpt_alloc(tree, 0);
+		bpt_insert_at(node, 0, start, newnode);
+		tree->bpt_root = node;
+		tree->bpt_firstino = newnode;
+		return(newnode);
+	}
+
+	i = bpt_descend(tree, start, path, slot);
+	node = path[0];
+
+	prev = (i >= 0) ? (avlnode_t *) node->bn_ptrs[i] : NULL;
+	if (prev != NULL && (node->bn_keys[i] == start ||
+			BPT_END(tree, prev) > start))
+		return(NULL);
+	next = (prev != NULL) ? prev->avl_nextino : tree->bpt_firstino;
+	if (next != NULL && BPT_START(tree, next) < end)
+		return(NULL);
+
+	newnode->avl_nextino = next;
+	if (prev != NULL)
+		prev->avl_nextino = newnode;
+	else
+		tree->bpt_firstino = newnode;
+
+	/*
+	 * new smallest record, it went down the left edge of the tree
+	 */
+	if (i < 0)  {
+		for (level = 1; level <= tree->bpt_root->bn_level; level++)
+			path[level]->bn_keys[0] = start;
+	}
+
+	key = start;
+	ptr = newnode;
+	pos = i + 1;
+	for (level = 0; ; level++)  {
+		node = path[level];
+		if (node->bn_nkeys < BPT_MAXKEYS)  {
+			bpt_insert_at(node, pos, key, ptr);
+			return(newnode);
+		}
+
+		right = bpt_split(tree, node);
+		if (pos > node->bn_nkeys)
+			bpt_insert_at(right, pos - node->bn_nkeys, key, ptr);
+		else
+			bpt_insert_at(node, pos, key, ptr);
+		key = right->bn_keys[0];
+		ptr = right;
+
+		if (node == tree->bpt_root)  {
+			if (level + 1 >= BPT_MAXLEVELS)
+				do_error("in-core b+tree too deep\n");
+			tree->bpt_root = bpt_alloc(tree, level + 1);
+			bpt_insert_at(tree->bpt_root, 0, node->bn_keys[0], node);
+			bpt_insert_at(tree->bpt_root, 1, key, ptr);
+			return(newnode);
+		}
+		pos = slot[level + 1] + 1;
+	}
+}
+
+/*
+ * pull a record that's in the tree back out.  like avl_delete(),
+ * the record's own avl_nextino is left alone so a caller walking
+ * the list can delete as it goes.
+ */
+void
+bptree_delete(bptree_desc_t *tree, avlnode_t *np)
+{
+	bptree_node_t	*path[BPT_MAXLEVELS];
+	int		slot[BPT_MAXLEVELS];
+	bptree_node_t	*node;
+	avlnode_t	*prev;
+	__psunsigned_t	start = BPT_START(tree, np);
+	int		level;
+	int		i;
+
+	ASSERT(tree->bpt_root != NULL);
+
+	i = bpt_descend(tree, start, path, slot);
+	node = path[0];
+	ASSERT(i >= 0 && node->bn_keys[i] == start && node->bn_ptrs[i] == np);
+
+	if (i > 0)
+		prev = (avlnode_t *) node->bn_ptrs[i - 1];
+	else
+		prev = (start > 0) ? bpt_lookup(tree, start - 1) : NULL;
+	if (prev != NULL)
+		prev->avl_nextino = np->avl_nextino;
+	else
+		tree->bpt_firstino = np->avl_nextino;
+
+	/*
+	 * take the entry out, and the node out of its parent if that
+	 * empties it
+	 */
+	for (level = 0; ; level++)  {
+		node = path[level];
+		i = slot[level];
+		bpt_remove_at(node, i);
+		if (node->bn_nkeys > 0)
+			break;
+		arena_free(&tree->bpt_arena, node);
+		if (node == tree->bpt_root)  {
+			tree->bpt_root = NULL;
+			return;
+		}
+	}
+
+	/*
+	 * if the smallest key went, the separators above change
+	 */
+	while (i == 0 && level < tree->bpt_root->bn_level)  {
+		path[level + 1]->bn_keys[slot[level + 1]] =
+			path[level]->bn_keys[0];
+		level++;
+		i = slot[level];
+	}
+
+	while (tree->bpt_root->bn_level > 0 && tree->bpt_root->bn_nkeys == 1)  {
+		node = tree->bpt_root;
+		tree->bpt_root = node->bn_ptrs[0];
+		arena_free(&tree->bpt_arena, node);
+	}
+}
+
+/*
+ * record starting at exactly value
+ */
+avlnode_t *
+bptree_find(bptree_desc_t *tree, __psunsigned_t value)
+{
+	avlnode_t	*np = bpt_lookup(tree, value);
+
+	if (np != NULL && BPT_START(tree, np) == value)
+		return(np);
+
+	return(NULL);
+}
+
+/*
+ * record whose range contains value
+ */
+avlnode_t *
+bptree_findrange(bptree_desc_t *tree, __psunsigned_t value)
+{
+	avlnode_t	*np = bpt_lookup(tree, value);
+
+	if (np != NULL && value < BPT_END(tree, np))
+		return(np);
+
+	return(NULL);
+}
+
+/*
+ * first and last records that overlap [start, end), same as
+ * avl_findranges().  the ones in between hang off avl_nextino.
+ */
+void
+bptree_findranges(bptree_desc_t *tree, __psunsigned_t start,
+	__psunsigned_t end, avlnode_t **startp, avlnode_t **endp)
+{
+	avlnode_t	*np;
+
+	*startp = *endp = NULL;
+
+	np = bpt_lookup(tree, start);
+	if (np == NULL)
+		np = tree->bpt_firstino;
+	else if (start >= BPT_END(tree, np))
+		np = np->avl_nextino;
+
+	if (np == NULL || end <= BPT_START(tree, np))
+		return;
+
+	*startp = np;
+	*endp = bpt_lookup(tree, end - 1);
+	ASSERT(*endp != NULL);
+}
+
+avlnode_t *
+bptree_lastino(bptree_desc_t *tree)
+{
+	bptree_node_t	*node = tree->bpt_root;
+
+	if (node == NULL)
+		return(NULL);
+
+	while (node->bn_level > 0)
+		node = node->bn_ptrs[node->bn_nkeys - 1];
+
+	return((avlnode_t *) node->bn_ptrs[node->bn_nkeys - 1]);
+}
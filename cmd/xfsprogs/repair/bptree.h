@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+/*
+ * in-core B+trees for the per-AG inode and free extent trees.
+ *
+ * the records are the same ones the AVL code uses and still start
+ * with an avlnode_t.  only avl_nextino is used -- the tree keeps it
+ * pointing at the next record in key order, so the record walking
+ * macros in incore.h work on either kind of tree.  everything else
+ * is in the tree nodes, which hold the starting values of up to
+ * BPT_MAXKEYS records (or subtrees) in one array so a lookup touches
+ * a few cache lines per level instead of one scattered node per
+ * level.  the start/end of a record come from the same avlops_t the
+ * AVL trees use; start is copied into the tree when the record goes
+ * in, so the callbacks are only made for range checks.
+ *
+ * ranges in a tree can't overlap and starting values must be unique,
+ * same as an AVL tree without AVLF_DUPLICITY.  nodes come out of an
+ * arena owned by the tree and an emptied node is freed rather than
+ * merged with its neighbour -- these trees are mostly built up and
+ * then thrown away whole with bptree_clear().
+ *
+ * no locking here, callers serialize as they did for the AVL trees.
+ */
+#define	BPT_MAXKEYS	32
+#define	BPT_MAXLEVELS	12		/* 32^12 records is plenty */
+
+typedef struct bptree_node  {
+	int			bn_nkeys;
+	int			bn_level;	/* 0 for leaves */
+	__psunsigned_t		bn_keys[BPT_MAXKEYS];
+	void			*bn_ptrs[BPT_MAXKEYS];
+} bptree_node_t;
+
+typedef struct bptree_desc  {
+	bptree_node_t		*bpt_root;
+	avlnode_t		*bpt_firstino;
+	avlops_t		*bpt_ops;
+	arena_t			bpt_arena;	/* tree nodes */
+} bptree_desc_t;
+
+#define	BPT_START(tree, n)	(*(tree)->bpt_ops->avl_start)(n)
+#define	BPT_END(tree, n)	(*(tree)->bpt_ops->avl_end)(n)
+
+void		bptree_init(bptree_desc_t *tree, avlops_t *ops);
+void		bptree_clear(bptree_desc_t *tree);
+avlnode_t	*bptree_insert(bptree_desc_t *tree, avlnode_t *newnode);
+void		bptree_delete(bptree_desc_t *tree, avlnode_t *np);
+avlnode_t	*bptree_find(bptree_desc_t *tree, __psunsigned_t value);
+avlnode_t	*bptree_findrange(bptree_desc_t *tree, __psunsigned_t value);
+void		bptree_findranges(bptree_desc_t *tree, __psunsigned_t start,
+			__psunsigned_t end, avlnode_t **startp,
+			avlnode_t **endp);
+avlnode_t	*bptree_lastino(bptree_desc_t *tree);
+
+#define	bptree_firstino(tree)	((tree)->bpt_firstino)
+#define	bptree_empty(tree)	((tree)->bpt_root == NULL)
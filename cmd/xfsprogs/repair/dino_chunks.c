@@ -40,6 +40,8 @@
 #include "dir.h"
 #include "dinode.h"
 #include "versions.h"
+#include "threads.h"
+#include "prefetch.h"
 
 /*
  * validates inode block or chunk, returns # of good inodes
@@ -705,8 +707,10 @@ process_inode_chunk(xfs_mount_t *mp, xfs_agnumber_t agno, int num_inos,
 	}
 
 	/*
-	 * mark block as an inode block in the incore bitmap
+	 * mark block as an inode block in the incore bitmap.
+	 * inodes in other ags may be claiming blocks in this one.
 	 */
+	lock_ag(agno);
 	switch (state = get_agbno_state(mp, agno, agbno))  {
 	case XR_E_INO:	/* already marked */
 		break;
@@ -724,6 +728,7 @@ process_inode_chunk(xfs_mount_t *mp, xfs_agnumber_t agno, int num_inos,
 			XFS_AGB_TO_FSB(mp, agno, agbno), state);
 		break;
 	}
+	unlock_ag(agno);
 
 	while (!done)  {
 		/*
@@ -876,6 +881,7 @@ process_inode_chunk(xfs_mount_t *mp, xfs_agnumber_t agno, int num_inos,
 			ibuf_offset = 0;
 			agbno++;
 
+			lock_ag(agno);
 			switch (state = get_agbno_state(mp, agno, agbno))  {
 			case XR_E_INO:	/* already marked */
 				break;
@@ -895,6 +901,7 @@ process_inode_chunk(xfs_mount_t *mp, xfs_agnumber_t agno, int num_inos,
 					XFS_AGB_TO_FSB(mp, agno, agbno), state);
 				break;
 			}
+			unlock_ag(agno);
 
 		} else if (irec_offset == XFS_INODES_PER_CHUNK)  {
 			/*
@@ -926,6 +933,9 @@ process_aginodes(xfs_mount_t *mp, xfs_agnumber_t agno,
 {
 	int num_inos, bogus;
 	ino_tree_node_t *ino_rec, *first_ino_rec, *prev_ino_rec;
+	prefetch_t *pf;
+
+	pf = prefetch_inode_chunks(mp, agno);
 
 	first_ino_rec = ino_rec = findfirst_inode_rec(agno);
 	while (ino_rec != NULL)  {
@@ -955,6 +965,7 @@ process_aginodes(xfs_mount_t *mp, xfs_agnumber_t agno,
 			/* XXX - i/o error, we've got a problem */
 			abort();
 		}
+		prefetch_advance(pf);
 
 		if (!bogus)
 			first_ino_rec = ino_rec = next_ino_rec(ino_rec);
@@ -984,6 +995,8 @@ process_aginodes(xfs_mount_t *mp, xfs_agnumber_t agno,
 			first_ino_rec = ino_rec;
 		}
 	}
+
+	prefetch_stop(pf);
 }
 
 /*
@@ -44,6 +44,7 @@
 #include "versions.h"
 #include "attr_repair.h"
 #include "bmap.h"
+#include "threads.h"
 
 /*
  * inode clearing routines
@@ -516,6 +517,8 @@ process_bmbt_reclist_int(
 	xfs_dfsbno_t		sp = 0;		/* prev start */
 	xfs_dfiloff_t		o = 0;		/* offset */
 	xfs_dfiloff_t		op = 0;		/* prev offset */
+	xfs_agnumber_t		agno;
+	xfs_agnumber_t		locked_agno;
 	char			*ftype;
 	char			*forkname;
 	int			i;
@@ -635,6 +638,7 @@ process_bmbt_reclist_int(
 					continue;
 				}
 
+				lock_rt();
 				state = get_rtbno_state(mp, ext);
 
 				switch (state)  {
@@ -663,6 +667,7 @@ process_bmbt_reclist_int(
 				case XR_E_INUSE:
 				case XR_E_MULT:
 					set_rtbno_state(mp, ext, XR_E_MULT);
+					unlock_rt();
 					do_warn(
 			"%s fork in rt inode %llu claims used rt block %llu\n",
 						forkname, ino, ext);
@@ -673,6 +678,7 @@ process_bmbt_reclist_int(
 				"illegal state %d in %s block map %llu\n",
 						state, ftype, b);
 				}
+				unlock_rt();
 			}
 
 			/*
@@ -693,6 +699,7 @@ process_bmbt_reclist_int(
 		 */
 		if (blkmapp && *blkmapp)
 			blkmap_set_ext(blkmapp, o, s, c);
+		locked_agno = NULLAGNUMBER;
 		for (b = s; b < s + c; b++)  {
 			if (check_dups == 1)  {
 				/*
@@ -717,9 +724,25 @@ process_bmbt_reclist_int(
 	 		 * in regular data space, not realtime partion.
 			 */
 		        if (type == XR_INO_RTDATA && whichfork == XFS_ATTR_FORK) {
-			  if (mp->m_sb.sb_agcount < XFS_FSB_TO_AGNO(mp, b))
+			  if (mp->m_sb.sb_agcount < XFS_FSB_TO_AGNO(mp, b))  {
+				if (locked_agno != NULLAGNUMBER)
+					unlock_ag(locked_agno);
 				return(1);
+			  }
 			}	
+
+			/*
+			 * the block map of the AG holding the block may be
+			 * in use by another thread.  extents don't cross AGs
+			 * so this normally locks once per extent.
+			 */
+			agno = XFS_FSB_TO_AGNO(mp, b);
+			if (agno != locked_agno)  {
+				if (locked_agno != NULLAGNUMBER)
+					unlock_ag(locked_agno);
+				lock_ag(agno);
+				locked_agno = agno;
+			}
 		
 			state = get_fsbno_state(mp, b);
 			switch (state)  {
@@ -739,6 +762,7 @@ process_bmbt_reclist_int(
 			case XR_E_FS_MAP:
 			case XR_E_INO:
 			case XR_E_INUSE_FS:
+				unlock_ag(locked_agno);
 				do_warn(
 				"%s fork in inode %llu claims metadata block %llu\n",
 					forkname, ino, (__uint64_t) b);
@@ -746,6 +770,7 @@ process_bmbt_reclist_int(
 			case XR_E_INUSE:
 			case XR_E_MULT:
 				set_fsbno_state(mp, b, XR_E_MULT);
+				unlock_ag(locked_agno);
 				do_warn(
 				"%s fork in %s inode %llu claims used block %llu\n",
 					forkname, ftype, ino, (__uint64_t) b);
@@ -756,6 +781,8 @@ process_bmbt_reclist_int(
 				abort();
 			}
 		}
+		if (locked_agno != NULLAGNUMBER)
+			unlock_ag(locked_agno);
 		*tot += c;
 	}
 
@@ -104,14 +104,13 @@ process_shortform_dir(
 	int			max_size;
 	__int64_t		ino_dir_size;
 	int			num_entries;
-	int			ino_off;
+	int			ino_free;
 	int			namelen;
 	int			i;
 	int			junkit;
 	int			tmp_len;
 	int			tmp_elen;
 	int			bad_sfnamelen;
-	ino_tree_node_t		*irec_p;
 	char			name[MAXNAMELEN + 1];
 
 #ifdef XR_DIR_TRACE
@@ -188,8 +187,7 @@ process_shortform_dir(
 	"entry in shorform dir %llu references group quota inode %llu\n",
 				ino, lino);
 			junkit = 1;
-		} else if ((irec_p = find_inode_rec(XFS_INO_TO_AGNO(mp, lino),
-					XFS_INO_TO_AGINO(mp, lino))) != NULL)  {
+		} else if (find_inode_state(mp, lino, &ino_free))  {
 			/*
 			 * if inode is marked free and we're in inode
 			 * discovery mode, leave the entry alone for now.
@@ -199,11 +197,7 @@ process_shortform_dir(
 			 * after we've finished inode discovery and blow
 			 * out the entry then.
 			 */
-			ino_off = XFS_INO_TO_AGINO(mp, lino) -
-				irec_p->ino_startnum;
-			ASSERT(is_inode_confirmed(irec_p, ino_off));
-
-			if (!ino_discovery && is_inode_free(irec_p, ino_off))  {
+			if (!ino_discovery && ino_free)  {
 				do_warn(
 	"entry references free inode %llu in shortform directory %llu\n",
 					lino, ino);
@@ -505,12 +499,6 @@ do_warn("corrected entry count in directory %llu, was %d, now %d\n",
 	return(0);
 }
 
-/*
- * freespace map for directory leaf blocks (1 bit per byte)
- * 1 == used, 0 == free
- */
-static da_freemap_t dir_freemap[DA_BMAP_SIZE];
-
 #if 0
 unsigned char *
 alloc_da_freemap(xfs_mount_t *mp)
@@ -1644,8 +1632,6 @@ junk_zerolen_dir_leaf_entries(
 }
 #endif
 
-static char dirbuf[64 * 1024];
-
 /*
  * called by both node dir and leaf dir processing routines
  * validates all contents *but* the sibling pointers (forw/back)
@@ -1702,7 +1688,6 @@ process_leaf_dir_block(
 	xfs_dir_leafblock_t		*new_leaf;
 	char				*first_byte;
 	xfs_dir_leaf_name_t		*namest;
-	ino_tree_node_t			*irec_p;
 	int				num_entries;
 	xfs_dahash_t			hashval;
 	int				i;
@@ -1711,7 +1696,7 @@ process_leaf_dir_block(
 	int				start;
 	int				stop;
 	int				res = 0;
-	int				ino_off;
+	int				ino_free;
 	int				first_used;
 	int				bytes_used;
 	int				reset_holes;
@@ -1719,33 +1704,19 @@ process_leaf_dir_block(
 	char				fname[MAXNAMELEN + 1];
 	da_hole_map_t			holemap;
 	da_hole_map_t			bholemap;
-#if 0
-	unsigned char			*dir_freemap;
-#endif
+	da_freemap_t			dir_freemap[DA_BMAP_SIZE];
 
 #ifdef XR_DIR_TRACE
 	fprintf(stderr, "\tprocess_leaf_dir_block - ino %I64u\n", ino);
 #endif
 
 	/*
-	 * clear static dir block freespace bitmap
+	 * clear dir block freespace bitmap (1 bit per byte,
+	 * 1 == used, 0 == free).  it lives on the stack so that
+	 * AGs can be processed in parallel.
 	 */
 	init_da_freemap(dir_freemap);
 
-#if 0
-	/*
-	 * XXX - alternatively, do this for parallel usage.
-	 * set up block freespace map.  head part of dir leaf block
-	 * including all entries are packed so we can use sizeof
-	 * and not worry about alignment.
-	 */
-
-	if ((dir_freemap = alloc_da_freemap(mp)) == NULL)  {
-		do_error("couldn't allocate directory block freemap\n");
-		abort();
-	}
-#endif
-
 	*buf_dirty = 0;
 	first_used = mp->m_sb.sb_blocksize;
 	zero_len_entries = 0;
@@ -1945,16 +1916,7 @@ process_leaf_dir_block(
 			 * already been marked TBD since old_orphanage_ino
 			 * is set non-zero.
 			 */
-		} else if ((irec_p = find_inode_rec(
-				XFS_INO_TO_AGNO(mp, lino),
-				XFS_INO_TO_AGINO(mp, lino))) != NULL)  {
-			/*
-			 * inode recs should have only confirmed
-			 * inodes in them
-			 */
-			ino_off = XFS_INO_TO_AGINO(mp, lino) -
-					irec_p->ino_startnum;
-			ASSERT(is_inode_confirmed(irec_p, ino_off));
+		} else if (find_inode_state(mp, lino, &ino_free))  {
 			/*
 			 * if inode is marked free and we're in inode
 			 * discovery mode, leave the entry alone for now.
@@ -1964,7 +1926,7 @@ process_leaf_dir_block(
 			 * after we've finished inode discovery and blow
 			 * out the entry then.
 			 */
-			if (!ino_discovery && is_inode_free(irec_p, ino_off))  {
+			if (!ino_discovery && ino_free)  {
 				if (!no_modify)  {
 					do_warn(
 "entry references free inode %llu in directory %llu, will clear entry\n",
@@ -2465,7 +2427,9 @@ process_leaf_dir_block(
 		"- compacting block %u in dir inode %llu\n",
 					da_bno, ino);
 
-			new_leaf = (xfs_dir_leafblock_t *) &dirbuf[0];
+			if ((new_leaf = malloc(mp->m_sb.sb_blocksize)) == NULL)
+				do_error(
+			"couldn't allocate directory block compaction buffer\n");
 
 			/*
 			 * copy leaf block header
@@ -2566,6 +2530,7 @@ process_leaf_dir_block(
 			 * final step, copy block back
 			 */
 			bcopy(new_leaf, leaf, mp->m_sb.sb_blocksize);
+			free(new_leaf);
 
 			*buf_dirty = 1;
 		} else  {
@@ -39,6 +39,7 @@
 #include "dir.h"
 #include "dir2.h"
 #include "bmap.h"
+#include "threads.h"
 
 /*
  * Tag bad directory entries with this.
@@ -56,6 +57,7 @@ typedef struct dir2_bad {
 	struct dir2_bad	*next;
 } dir2_bad_t;
 dir2_bad_t *dir2_bad_list;
+static pthread_mutex_t dir2_bad_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void
 dir2_add_badlist(
@@ -68,9 +70,11 @@ dir2_add_badlist(
 			sizeof(dir2_bad_t), ino);
 		exit(1);
 	}
+	l->ino = ino;
+	XR_LOCK(&dir2_bad_lock);
 	l->next = dir2_bad_list;
 	dir2_bad_list = l;
-	l->ino = ino;
+	XR_UNLOCK(&dir2_bad_lock);
 }
 
 int
@@ -79,7 +83,11 @@ dir2_is_badino(
 {
 	dir2_bad_t	*l;
 
-	for (l = dir2_bad_list; l; l = l->next)
+	/* entries are only ever pushed on the front */
+	XR_LOCK(&dir2_bad_lock);
+	l = dir2_bad_list;
+	XR_UNLOCK(&dir2_bad_lock);
+	for (; l; l = l->next)
 		if (l->ino == ino)
 			return 1;
 	return 0;
@@ -816,8 +824,7 @@ process_sf_dir2(
 	int			i;
 	int			i8;
 	__int64_t		ino_dir_size;
-	int			ino_off;
-	ino_tree_node_t		*irec_p;
+	int			ino_free;
 	int			junkit;
 	char			*junkreason = NULL;
 	xfs_ino_t		lino;
@@ -893,8 +900,7 @@ process_sf_dir2(
 		} else if (lino == mp->m_sb.sb_gquotino)  {
 			junkit = 1;
 			junkreason = "group quota";
-		} else if ((irec_p = find_inode_rec(XFS_INO_TO_AGNO(mp, lino),
-					XFS_INO_TO_AGINO(mp, lino))) != NULL) {
+		} else if (find_inode_state(mp, lino, &ino_free)) {
 			/*
 			 * if inode is marked free and we're in inode
 			 * discovery mode, leave the entry alone for now.
@@ -904,10 +910,7 @@ process_sf_dir2(
 			 * after we've finished inode discovery and blow
 			 * out the entry then.
 			 */
-			ino_off = XFS_INO_TO_AGINO(mp, lino) -
-				irec_p->ino_startnum;
-			ASSERT(is_inode_confirmed(irec_p, ino_off));
-			if (is_inode_free(irec_p, ino_off) && !ino_discovery) {
+			if (ino_free && !ino_discovery) {
 				junkit = 1;
 				junkreason = "free";
 			}
@@ -1290,8 +1293,7 @@ process_dir2_data(
 	xfs_dir2_data_unused_t	*dup;
 	int			freeseen;
 	int			i;
-	int			ino_off;
-	ino_tree_node_t		*irec_p;
+	int			ino_free;
 	int			junkit;
 	int			lastfree;
 	int			nm_illegal;
@@ -1411,16 +1413,8 @@ process_dir2_data(
 			 * non-zero.
 			 */
 			clearino = 0;
-		} else if ((irec_p = find_inode_rec(
-				XFS_INO_TO_AGNO(mp, INT_GET(dep->inumber, ARCH_CONVERT)),
-				XFS_INO_TO_AGINO(mp, INT_GET(dep->inumber, ARCH_CONVERT)))) != NULL) {
-			/*
-			 * Inode recs should have only confirmed inodes in them.
-			 */
-			ino_off =
-				XFS_INO_TO_AGINO(mp, INT_GET(dep->inumber, ARCH_CONVERT)) -
-				irec_p->ino_startnum;
-			ASSERT(is_inode_confirmed(irec_p, ino_off));
+		} else if (find_inode_state(mp,
+				INT_GET(dep->inumber, ARCH_CONVERT), &ino_free)) {
 			/*
 			 * If inode is marked free and we're in inode discovery
 			 * mode, leave the entry alone for now.  If the inode
@@ -1429,7 +1423,7 @@ process_dir2_data(
 			 * code again in phase 4 after we've finished inode
 			 * discovery and blow out the entry then.
 			 */
-			if (!ino_discovery && is_inode_free(irec_p, ino_off)) {
+			if (!ino_discovery && ino_free) {
 				clearino = 1;
 				clearreason = "free";
 			} else
@@ -128,6 +128,14 @@ EXTERN int	assume_xfs;		/* assume we have an xfs fs */
 EXTERN int	pre_65_beta;		/* fs was mkfs'ed by a version earlier * than 6.5-beta */
 EXTERN char *log_name;			/* Name of log device */
 EXTERN int log_spec;			/* Log dev specified as option */
+EXTERN int	bcache_size;		/* libxfs buffer cache size (MB) */
+EXTERN int	thread_count;		/* # of per-AG worker threads */
+EXTERN int	prefetch_threads;	/* # of readahead threads, 0 = off */
+EXTERN int	btree_fill;		/* % full to make rebuilt btree blocks */
+EXTERN int	direct_io;		/* bypass the page cache (O_DIRECT) */
+
+#define XR_DFL_BCACHE_SIZE	64	/* default buffer cache size (MB) */
+#define XR_DFL_PREFETCH_THREADS	4	/* default # of readahead threads */
 
 /* misc status variables */
 
@@ -169,6 +177,12 @@ EXTERN __int64_t	fs_max_file_offset;
 
 EXTERN __uint64_t	**ba_bmap;	/* see incore.h */
 EXTERN __uint64_t	*rt_ba_bmap;	/* see incore.h */
+EXTERN struct rl_chunk	**ba_rlmap;	/* see incore.h */
+EXTERN int		bmap_type;	/* XR_BMAP_* */
+
+#define XR_BMAP_AUTO	0	/* flat unless it takes too much memory */
+#define XR_BMAP_FLAT	1
+#define XR_BMAP_RUNS	2
 
 /* realtime info */
 
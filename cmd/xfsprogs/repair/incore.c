@@ -68,12 +68,52 @@ free_allocations(ba_rec_t *list)
 
 /* ba bmap setupstuff.  setting/getting state is in incore.h  */
 
+/*
+ * use the run-length map if the flat one would take more than
+ * 1/XR_BMAP_MEM_FRAC of physical memory.  the rest is needed for
+ * the inode and extent trees and the buffer cache.
+ */
+#define XR_BMAP_MEM_FRAC	4
+
+static int
+use_rl_bmap(xfs_agnumber_t agno, xfs_agblock_t numblocks)
+{
+	__uint64_t	flat;
+	__uint64_t	mem;
+	long		pages;
+	long		pagesize;
+
+	if (bmap_type != XR_BMAP_AUTO)
+		return(bmap_type == XR_BMAP_RUNS);
+
+	pages = sysconf(_SC_PHYS_PAGES);
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (pages <= 0 || pagesize <= 0)
+		return(0);
+
+	flat = (__uint64_t) agno * XR_BB_BYTES(numblocks);
+	mem = (__uint64_t) pages * pagesize;
+
+	if (flat <= mem / XR_BMAP_MEM_FRAC)
+		return(0);
+
+	do_log("        - flat block map needs %llu MB, using run-length map\n",
+		flat >> 20);
+	return(1);
+}
+
 void
 setup_bmap(xfs_agnumber_t agno, xfs_agblock_t numblocks, xfs_drtbno_t rtblocks)
 {
 	int i;
 	xfs_drfsbno_t size;
 
+	if (use_rl_bmap(agno, numblocks))  {
+		ba_bmap = NULL;
+		setup_rl_bmap(agno, numblocks);
+		goto setup_rt;
+	}
+
         ba_bmap = (__uint64_t**)malloc(agno*sizeof(__uint64_t *));
         if (!ba_bmap)  {
 		do_error("couldn't allocate block map pointers\n");
@@ -82,7 +122,7 @@ setup_bmap(xfs_agnumber_t agno, xfs_agblock_t numblocks, xfs_drtbno_t rtblocks)
 	for (i = 0; i < agno; i++)  {
                 int size;
                 
-                size = roundup(numblocks * (NBBY/XR_BB),sizeof(__uint64_t));
+                size = XR_BB_BYTES(numblocks);
                 
                 ba_bmap[i] = (__uint64_t*)memalign(sizeof(__uint64_t), size);
                 if (!ba_bmap[i]) {
@@ -93,12 +133,13 @@ setup_bmap(xfs_agnumber_t agno, xfs_agblock_t numblocks, xfs_drtbno_t rtblocks)
 		bzero(ba_bmap[i], size);
 	}
 
+setup_rt:
 	if (rtblocks == 0)  {
 		rt_ba_bmap = NULL;
 		return;
 	}
 
-	size = roundup(rtblocks * (NBBY/XR_BB), sizeof(__uint64_t));
+	size = XR_BB_BYTES(rtblocks);
 
         rt_ba_bmap=(__uint64_t*)memalign(sizeof(__uint64_t), size);
 	if (!rt_ba_bmap) {
@@ -128,10 +169,14 @@ teardown_rt_bmap(xfs_mount_t *mp)
 	return;
 }
 
-/* ARGSUSED */
 void
 teardown_ag_bmap(xfs_mount_t *mp, xfs_agnumber_t agno)
 {
+	if (ba_bmap == NULL)  {
+		teardown_rl_ag_bmap(agno, mp->m_sb.sb_agblocks);
+		return;
+	}
+
 	ASSERT(ba_bmap[agno] != NULL);
 
 	free(ba_bmap[agno]);
@@ -140,12 +185,30 @@ teardown_ag_bmap(xfs_mount_t *mp, xfs_agnumber_t agno)
 	return;
 }
 
+/*
+ * set every block in the AG back to XR_E_UNKNOWN
+ */
+void
+reset_ag_bmap(xfs_mount_t *mp, xfs_agnumber_t agno)
+{
+	if (ba_bmap == NULL)  {
+		reset_rl_ag_bmap(agno, mp->m_sb.sb_agblocks);
+		return;
+	}
+
+	bzero(ba_bmap[agno], XR_BB_BYTES(mp->m_sb.sb_agblocks));
+
+	return;
+}
+
 /* ARGSUSED */
 void
 teardown_bmap_finish(xfs_mount_t *mp)
 {
 	free(ba_bmap);
 	ba_bmap = NULL;
+	free(ba_rlmap);
+	ba_rlmap = NULL;
 
 	return;
 }
@@ -178,7 +241,7 @@ set_bmap_rt(xfs_drtbno_t num)
 	 * for now, initialize all realtime blocks to be free
 	 * (state == XR_E_FREE)
 	 */
-	size = howmany(num * (NBBY/XR_BB), sizeof(__uint64_t));
+	size = howmany(num, XR_BB_NUM);
 
 	for (j = 0; j < size; j++)
 		rt_ba_bmap[j] = 0x2222222222222222;
@@ -273,6 +336,9 @@ get_agbno_state(xfs_mount_t *mp, xfs_agnumber_t agno,
 {
 	__uint64_t *addr;
 
+	if (ba_bmap == NULL)
+		return(get_rl_state(agno, ag_blockno));
+
 	addr = ba_bmap[(agno)] + (ag_blockno)/XR_BB_NUM;
 
 	return((*addr >> (((ag_blockno)%XR_BB_NUM)*XR_BB)) & XR_BB_MASK);
@@ -283,6 +349,11 @@ void set_agbno_state(xfs_mount_t *mp, xfs_agnumber_t agno,
 {
 	__uint64_t *addr;
 
+	if (ba_bmap == NULL)  {
+		set_rl_state(agno, ag_blockno, state);
+		return;
+	}
+
 	addr = ba_bmap[(agno)] + (ag_blockno)/XR_BB_NUM;
 
 	*addr = (((*addr) &
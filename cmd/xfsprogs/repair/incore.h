@@ -56,6 +56,7 @@ void			free_allocations(ba_rec_t *list);
 void			set_bmap_rt(xfs_drfsbno_t numblocks);
 void			set_bmap_log(xfs_mount_t *mp);
 void			set_bmap_fs(xfs_mount_t *mp);
+void			reset_ag_bmap(xfs_mount_t *mp, xfs_agnumber_t agno);
 void			teardown_bmap(xfs_mount_t *mp);
 
 void			teardown_rt_bmap(xfs_mount_t *mp);
@@ -71,6 +72,45 @@ void			teardown_bmap_finish(xfs_mount_t *mp);
 #define XR_BB_NUM	(XR_BB_UNIT/XR_BB)	/* number of records per unit */
 #define XR_BB_MASK	0xF			/* block record mask */
 
+/* bytes of flat bitstring needed for n blocks */
+#define XR_BB_BYTES(n)	(howmany((n), XR_BB_NUM) * sizeof(__uint64_t))
+
+/*
+ * run-length block map.  when the flat bitstrings won't fit in
+ * memory ba_bmap is NULL and ba_rlmap holds an array of chunks per
+ * AG instead.  each chunk covers XR_RL_CHUNK blocks as a sorted list
+ * of runs, a run lasting up to the start of the next one.  a chunk
+ * that breaks up into so many runs that they'd take more space than
+ * its flat bitstring is converted to one.  the AG lock covers the
+ * chunks the same way it covers the flat map, see threads.h.
+ */
+#define XR_RL_CHUNK_LOG	16
+#define XR_RL_CHUNK	(1 << XR_RL_CHUNK_LOG)	/* blocks per chunk */
+#define XR_RL_MAXRUNS	(XR_BB_BYTES(XR_RL_CHUNK) / sizeof(rl_run_t))
+
+typedef struct rl_run  {
+	__uint16_t	start;		/* first block, chunk relative */
+	__uint8_t	state;
+} rl_run_t;
+
+typedef struct rl_chunk  {
+	rl_run_t	*runs;		/* NULL once the chunk is flat */
+	__uint64_t	*flat;
+	int		nruns;
+	int		size;		/* runs allocated */
+} rl_chunk_t;
+
+void			setup_rl_bmap(xfs_agnumber_t agcount,
+					xfs_agblock_t numblocks);
+void			reset_rl_ag_bmap(xfs_agnumber_t agno,
+					xfs_agblock_t numblocks);
+void			teardown_rl_ag_bmap(xfs_agnumber_t agno,
+					xfs_agblock_t numblocks);
+int			get_rl_state(xfs_agnumber_t agno,
+					xfs_agblock_t agbno);
+void			set_rl_state(xfs_agnumber_t agno,
+					xfs_agblock_t agbno, int state);
+
 /*
  * bitstring ops -- set/get block states, either in filesystem
  * bno's or in agbno's.  turns out that fsbno addressing is
@@ -99,14 +139,18 @@ void set_fsbno_state(xfs_mount_t *mp, xfs_dfsbno_t blockno, int state);
  */
 
 #define get_agbno_state(mp, agno, ag_blockno) \
-			((int) (*(ba_bmap[(agno)] + (ag_blockno)/XR_BB_NUM) \
+	(ba_bmap != NULL ? \
+		((int) (*(ba_bmap[(agno)] + (ag_blockno)/XR_BB_NUM) \
 				 >> (((ag_blockno)%XR_BB_NUM)*XR_BB)) \
-				& XR_BB_MASK)
+				& XR_BB_MASK) : \
+		get_rl_state((agno), (ag_blockno)))
 #define set_agbno_state(mp, agno, ag_blockno, state) \
-	*(ba_bmap[(agno)] + (ag_blockno)/XR_BB_NUM) = \
+	(ba_bmap != NULL ? \
+	 (void) (*(ba_bmap[(agno)] + (ag_blockno)/XR_BB_NUM) = \
 		((*(ba_bmap[(agno)] + (ag_blockno)/XR_BB_NUM) & \
 	  (~((__uint64_t) XR_BB_MASK << (((ag_blockno)%XR_BB_NUM)*XR_BB)))) | \
-	 (((__uint64_t) (state)) << (((ag_blockno)%XR_BB_NUM)*XR_BB)))
+	 (((__uint64_t) (state)) << (((ag_blockno)%XR_BB_NUM)*XR_BB)))) : \
+	 set_rl_state((agno), (ag_blockno), (state)))
 
 #define get_fsbno_state(mp, blockno) \
 		get_agbno_state(mp, XFS_FSB_TO_AGNO(mp, (blockno)), \
@@ -256,9 +300,10 @@ int		search_rt_dup_extent(xfs_mount_t	*mp,
  */
 
 /*
- * return an extent node to the extent node free list
+ * return a bno/bcnt extent node to the AG's free extent arena
  */
-void		release_extent_tree_node(extent_tree_node_t *node);
+void		release_extent_tree_node(xfs_agnumber_t agno,
+					extent_tree_node_t *node);
 
 /*
  * recycle all the nodes in the per-AG tree
@@ -364,6 +409,7 @@ void		get_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec);
 
 ino_tree_node_t *findfirst_inode_rec(xfs_agnumber_t agno);
 ino_tree_node_t *find_inode_rec(xfs_agnumber_t agno, xfs_agino_t ino);
+int		find_inode_state(xfs_mount_t *mp, xfs_ino_t ino, int *isfree);
 void		find_inode_rec_range(xfs_agnumber_t agno,
 			xfs_agino_t start_ino, xfs_agino_t end_ino,
 			ino_tree_node_t **first, ino_tree_node_t **last);
@@ -37,16 +37,16 @@
 #include "agheader.h"
 #include "protos.h"
 #include "err_protos.h"
+#include "threads.h"
+#include "arena.h"
+#include "bptree.h"
 #include "avl64.h"
 #define ALLOC_NUM_EXTS		100
+#define ARENA_NUM_EXTS		1000
 
 /*
  * paranoia -- account for any weird padding, 64/32-bit alignment, etc.
  */
-typedef struct extent_alloc_rec  {
-	ba_rec_t		alloc_rec;
-	extent_tree_node_t	extents[ALLOC_NUM_EXTS];
-} extent_alloc_rec_t;
 
 typedef struct rt_extent_alloc_rec  {
 	ba_rec_t		alloc_rec;
@@ -56,9 +56,9 @@ typedef struct rt_extent_alloc_rec  {
 /*
  * note:  there are 4 sets of incore things handled here:
  * block bitmaps, extent trees, uncertain inode list,
- * and inode tree.  The tree-based code uses the AVL
- * tree package used by the IRIX kernel VM code
- * (sys/avl.h).  The inode list code uses the same records
+ * and inode tree.  The per-AG trees are the in-core
+ * B+trees in bptree.c, the realtime tree is still an AVL
+ * tree (avl64.c).  The inode list code uses the same records
  * as the inode tree code for convenience.  The bitmaps
  * and bitmap operators are mostly macros defined in incore.h.
  * There are one of everything per AG except for extent
@@ -69,12 +69,18 @@ typedef struct rt_extent_alloc_rec  {
  * phase 5.  The uncertain inode list goes away at the end of
  * phase 3.  The inode tree and bno/bnct trees go away after phase 5.
  */
-typedef struct ext_flist_s  {
-	extent_tree_node_t	*list;
-	int			cnt;
-} ext_flist_t;
+/*
+ * extent nodes come from per-AG arenas, one for the duplicate extent
+ * tree and one shared by the bno and bcnt trees.  each is emptied in
+ * one go when its trees are released.  see arena.h.
+ */
+static arena_t		*dup_ext_arenas;
+static arena_t		*free_ext_arenas;
 
-static ext_flist_t ext_flist;
+static arena_stats_t	dup_ext_stats = ARENA_STATS_INIT(
+				"duplicate extent records", extent_tree_node_t);
+static arena_stats_t	free_ext_stats = ARENA_STATS_INIT(
+				"free extent records", extent_tree_node_t);
 
 typedef struct rt_ext_flist_s  {
 	rt_extent_tree_node_t	*list;
@@ -85,15 +91,15 @@ static rt_ext_flist_t rt_ext_flist;
 
 static avl64tree_desc_t	*rt_ext_tree_ptr;	/* dup extent tree for rt */
 
-static avltree_desc_t	**extent_tree_ptrs;	/* array of extent tree ptrs */
+static bptree_desc_t	**extent_tree_ptrs;	/* array of extent tree ptrs */
 						/* one per ag for dups */
-static avltree_desc_t	**extent_bno_ptrs;	/*
+static bptree_desc_t	**extent_bno_ptrs;	/*
 						 * array of extent tree ptrs
 						 * one per ag for free extents
 						 * sorted by starting block
 						 * number
 						 */
-static avltree_desc_t	**extent_bcnt_ptrs;	/*
+static bptree_desc_t	**extent_bcnt_ptrs;	/*
 						 * array of extent tree ptrs
 						 * one per ag for free extents
 						 * sorted by size
@@ -102,46 +108,20 @@ static avltree_desc_t	**extent_bcnt_ptrs;	/*
 /*
  * list of allocated "blocks" for easy freeing later
  */
-static ba_rec_t		*ba_list;
 static ba_rec_t		*rt_ba_list;
 
 /*
- * extent tree stuff is avl trees of duplicate extents,
+ * extent tree stuff is B+trees of duplicate extents,
  * sorted in order by block number.  there is one tree per ag.
  */
 
 static extent_tree_node_t *
-mk_extent_tree_nodes(xfs_agblock_t new_startblock,
+mk_extent_tree_nodes(arena_t *arena, xfs_agblock_t new_startblock,
 	xfs_extlen_t new_blockcount, extent_state_t new_state)
 {
-	int i;
 	extent_tree_node_t *new;
-	extent_alloc_rec_t *rec;
-
-	if (ext_flist.cnt == 0)  {
-		ASSERT(ext_flist.list == NULL);
-
-		if ((rec = malloc(sizeof(extent_alloc_rec_t))) == NULL)
-			do_error("couldn't allocate new extent descriptors.\n");
 
-		record_allocation(&rec->alloc_rec, ba_list);
-
-		new = &rec->extents[0];
-
-		for (i = 0; i < ALLOC_NUM_EXTS; i++)  {
-			new->avl_node.avl_nextino = (avlnode_t *)
-							ext_flist.list;
-			ext_flist.list = new;
-			ext_flist.cnt++;
-			new++;
-		}
-	}
-
-	ASSERT(ext_flist.list != NULL);
-
-	new = ext_flist.list;
-	ext_flist.list = (extent_tree_node_t *) new->avl_node.avl_nextino;
-	ext_flist.cnt--;
+	new = arena_alloc(arena);
 	new->avl_node.avl_nextino = NULL;
 
 	/* initialize node */
@@ -154,55 +134,13 @@ mk_extent_tree_nodes(xfs_agblock_t new_startblock,
 	return(new);
 }
 
-void
-release_extent_tree_node(extent_tree_node_t *node)
-{
-	node->avl_node.avl_nextino = (avlnode_t *) ext_flist.list;
-	ext_flist.list = node;
-	ext_flist.cnt++;
-
-	return;
-}
-
 /*
- * routines to recycle all nodes in a tree.  it walks the tree
- * and puts all nodes back on the free list so the nodes can be
- * reused.  the duplicate and bno/bcnt extent trees for each AG
- * are recycled after they're no longer needed to save memory
+ * return a node pulled out of the AG's bno or bcnt tree
  */
 void
-release_extent_tree(avltree_desc_t *tree)
+release_extent_tree_node(xfs_agnumber_t agno, extent_tree_node_t *node)
 {
-	extent_tree_node_t	*ext;
-	extent_tree_node_t	*tmp;
-	extent_tree_node_t	*lext;
-	extent_tree_node_t	*ltmp;
-
-	if (tree->avl_firstino == NULL)
-		return;
-
-	ext = (extent_tree_node_t *) tree->avl_firstino;
-
-	while (ext != NULL)  {
-		tmp = (extent_tree_node_t *) ext->avl_node.avl_nextino;
-
-		/*
-		 * ext->next is guaranteed to be set only in bcnt trees
-		 */
-		if (ext->next != NULL)  {
-			lext = ext->next;
-			while (lext != NULL)  {
-				ltmp = lext->next;
-				release_extent_tree_node(lext);
-				lext = ltmp;
-			}
-		}
-
-		release_extent_tree_node(ext);
-		ext = tmp;
-	}
-
-	tree->avl_root = tree->avl_firstino = NULL;
+	arena_free(&free_ext_arenas[agno], node);
 
 	return;
 }
@@ -210,18 +148,31 @@ release_extent_tree(avltree_desc_t *tree)
 /*
  * top-level (visible) routines
  */
+/*
+ * recycle all nodes in a tree.  the duplicate and bno/bcnt extent
+ * trees for each AG are recycled after they're no longer needed to
+ * save memory.  the nodes go back with their arena so there's no
+ * need to walk the tree.
+ */
 void
 release_dup_extent_tree(xfs_agnumber_t agno)
 {
-	release_extent_tree(extent_tree_ptrs[agno]);
+	bptree_clear(extent_tree_ptrs[agno]);
+	arena_reset(&dup_ext_arenas[agno]);
 
 	return;
 }
 
+/*
+ * the bno and bcnt trees share nodes from the same arena, which
+ * can only be emptied once both are gone
+ */
 void
 release_agbno_extent_tree(xfs_agnumber_t agno)
 {
-	release_extent_tree(extent_bno_ptrs[agno]);
+	bptree_clear(extent_bno_ptrs[agno]);
+	if (bptree_empty(extent_bcnt_ptrs[agno]))
+		arena_reset(&free_ext_arenas[agno]);
 
 	return;
 }
@@ -229,7 +180,9 @@ release_agbno_extent_tree(xfs_agnumber_t agno)
 void
 release_agbcnt_extent_tree(xfs_agnumber_t agno)
 {
-	release_extent_tree(extent_bcnt_ptrs[agno]);
+	bptree_clear(extent_bcnt_ptrs[agno]);
+	if (bptree_empty(extent_bno_ptrs[agno]))
+		arena_reset(&free_ext_arenas[agno]);
 
 	return;
 }
@@ -248,9 +201,10 @@ add_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 	ASSERT(extent_bno_ptrs != NULL);
 	ASSERT(extent_bno_ptrs[agno] != NULL);
 
-	ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_FREE);
+	ext = mk_extent_tree_nodes(&free_ext_arenas[agno], startblock,
+				blockcount, XR_E_FREE);
 
-	if (avl_insert(extent_bno_ptrs[agno], (avlnode_t *) ext) == NULL)  {
+	if (bptree_insert(extent_bno_ptrs[agno], (avlnode_t *) ext) == NULL)  {
 		do_error("xfs_repair:  duplicate bno extent range\n");
 	}
 }
@@ -261,7 +215,7 @@ findfirst_bno_extent(xfs_agnumber_t agno)
 	ASSERT(extent_bno_ptrs != NULL);
 	ASSERT(extent_bno_ptrs[agno] != NULL);
 
-	return((extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino);
+	return((extent_tree_node_t *) bptree_firstino(extent_bno_ptrs[agno]));
 }
 
 extent_tree_node_t *
@@ -270,7 +224,7 @@ find_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock)
 	ASSERT(extent_bno_ptrs != NULL);
 	ASSERT(extent_bno_ptrs[agno] != NULL);
 
-	return((extent_tree_node_t *) avl_find(extent_bno_ptrs[agno],
+	return((extent_tree_node_t *) bptree_find(extent_bno_ptrs[agno],
 						startblock));
 }
 
@@ -283,7 +237,7 @@ get_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
 	ASSERT(extent_bno_ptrs != NULL);
 	ASSERT(extent_bno_ptrs[agno] != NULL);
 
-	avl_delete(extent_bno_ptrs[agno], &ext->avl_node);
+	bptree_delete(extent_bno_ptrs[agno], &ext->avl_node);
 
 	return;
 }
@@ -313,7 +267,8 @@ add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 	ASSERT(extent_bcnt_ptrs != NULL);
 	ASSERT(extent_bcnt_ptrs[agno] != NULL);
 
-	ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_FREE);
+	ext = mk_extent_tree_nodes(&free_ext_arenas[agno], startblock,
+				blockcount, XR_E_FREE);
 
 	ASSERT(ext->next == NULL);
 
@@ -321,10 +276,10 @@ add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 	fprintf(stderr, "adding bcnt: agno = %d, start = %u, count = %u\n",
 			agno, startblock, blockcount);
 #endif
-	if ((current = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
+	if ((current = (extent_tree_node_t *) bptree_find(extent_bcnt_ptrs[agno],
 							blockcount)) != NULL)  {
 		/*
-		 * avl tree code doesn't handle dups so insert
+		 * tree code doesn't handle dups so insert
 		 * onto linked list in increasing startblock order
 		 */
 		top = prev = current;
@@ -366,7 +321,7 @@ add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		return;
 	}
 
-	if (avl_insert(extent_bcnt_ptrs[agno], (avlnode_t *) ext) == NULL)  {
+	if (bptree_insert(extent_bcnt_ptrs[agno], (avlnode_t *) ext) == NULL)  {
 		do_error("xfs_repair:  duplicate bno extent range\n");
 	}
 
@@ -379,18 +334,16 @@ findfirst_bcnt_extent(xfs_agnumber_t agno)
 	ASSERT(extent_bcnt_ptrs != NULL);
 	ASSERT(extent_bcnt_ptrs[agno] != NULL);
 
-	return((extent_tree_node_t *) extent_bcnt_ptrs[agno]->avl_firstino);
+	return((extent_tree_node_t *) bptree_firstino(extent_bcnt_ptrs[agno]));
 }
 
 extent_tree_node_t *
 findbiggest_bcnt_extent(xfs_agnumber_t agno)
 {
-	extern avlnode_t *avl_lastino(avlnode_t *root);
-
 	ASSERT(extent_bcnt_ptrs != NULL);
 	ASSERT(extent_bcnt_ptrs[agno] != NULL);
 
-	return((extent_tree_node_t *) avl_lastino(extent_bcnt_ptrs[agno]->avl_root));
+	return((extent_tree_node_t *) bptree_lastino(extent_bcnt_ptrs[agno]));
 }
 
 extent_tree_node_t *
@@ -406,9 +359,9 @@ findnext_bcnt_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
 		/*
 		 * have to look at the top of the list to get the
 		 * correct avl_nextino pointer since that pointer
-		 * is maintained and altered by the AVL code.
+		 * is maintained and altered by the tree code.
 		 */
-		nextino = avl_find(extent_bcnt_ptrs[agno], ext->ex_blockcount);
+		nextino = bptree_find(extent_bcnt_ptrs[agno], ext->ex_blockcount);
 		ASSERT(nextino != NULL);
 		if (nextino->avl_nextino != NULL)  {
 			ASSERT(ext->ex_blockcount < ((extent_tree_node_t *)
@@ -436,7 +389,7 @@ get_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 	ASSERT(extent_bcnt_ptrs != NULL);
 	ASSERT(extent_bcnt_ptrs[agno] != NULL);
 
-	if ((ext = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
+	if ((ext = (extent_tree_node_t *) bptree_find(extent_bcnt_ptrs[agno],
 							blockcount)) == NULL)
 		return(NULL);
 	
@@ -461,7 +414,7 @@ get_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 			 * pointers to the piece of memory that
 			 * is the head of the list so pulling
 			 * the item out of the list and hence
-			 * the avl tree would be a bad idea.
+			 * the tree would be a bad idea.
 			 * 
 			 * (cheaper than the alternative, a tree
 			 * delete of this node followed by a tree
@@ -491,7 +444,7 @@ get_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		/*
 		 * no list, just one node.  simply delete
 		 */
-		avl_delete(extent_bcnt_ptrs[agno], &ext->avl_node);
+		bptree_delete(extent_bcnt_ptrs[agno], &ext->avl_node);
 	}
 
 	ASSERT(ext->ex_startblock == startblock);
@@ -516,7 +469,7 @@ add_dup_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 #ifdef XR_DUP_TRACE
 	fprintf(stderr, "Adding dup extent - %d/%d %d\n", agno, startblock, blockcount);
 #endif
-	avl_findranges(extent_tree_ptrs[agno], startblock - 1,
+	bptree_findranges(extent_tree_ptrs[agno], startblock - 1,
 		startblock + blockcount + 1,
 		(avlnode_t **) &first, (avlnode_t **) &last);
 	/*
@@ -525,9 +478,10 @@ add_dup_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 	if (first == NULL && last == NULL)  {
 		/* nothing, just make and insert new extent */
 
-		ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_MULT);
+		ext = mk_extent_tree_nodes(&dup_ext_arenas[agno], startblock,
+				blockcount, XR_E_MULT);
 
-		if (avl_insert(extent_tree_ptrs[agno],
+		if (bptree_insert(extent_tree_ptrs[agno],
 				(avlnode_t *) ext) == NULL)  {
 			do_error("xfs_repair:  duplicate extent range\n");
 		}
@@ -572,14 +526,15 @@ add_dup_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 							ext->ex_blockcount -
 							new_startblock;
 
-			avl_delete(extent_tree_ptrs[agno], (avlnode_t *) ext);
+			bptree_delete(extent_tree_ptrs[agno], (avlnode_t *) ext);
 			continue;
 		}
 	}
 
-	ext = mk_extent_tree_nodes(new_startblock, new_blockcount, XR_E_MULT);
+	ext = mk_extent_tree_nodes(&dup_ext_arenas[agno], new_startblock,
+				new_blockcount, XR_E_MULT);
 
-	if (avl_insert(extent_tree_ptrs[agno], (avlnode_t *) ext) == NULL)  {
+	if (bptree_insert(extent_tree_ptrs[agno], (avlnode_t *) ext) == NULL)  {
 		do_error("xfs_repair:  duplicate extent range\n");
 	}
 
@@ -595,7 +550,7 @@ search_dup_extent(xfs_mount_t *mp, xfs_agnumber_t agno, xfs_agblock_t agbno)
 {
 	ASSERT(agno < glob_agcount);
 
-	if (avl_findrange(extent_tree_ptrs[agno], agbno) != NULL)
+	if (bptree_findrange(extent_tree_ptrs[agno], agbno) != NULL)
 		return(1);
 
 	return(0);
@@ -874,37 +829,36 @@ incore_ext_init(xfs_mount_t *mp)
 	int i;
 	xfs_agnumber_t agcount = mp->m_sb.sb_agcount;
 
-	ba_list = NULL;
 	rt_ba_list = NULL;
 
 	if ((extent_tree_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+					sizeof(bptree_desc_t *))) == NULL)
 		do_error("couldn't malloc dup extent tree descriptor table\n");
 
 	if ((extent_bno_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+					sizeof(bptree_desc_t *))) == NULL)
 		do_error("couldn't malloc free by-bno extent tree descriptor table\n");
 
 	if ((extent_bcnt_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+					sizeof(bptree_desc_t *))) == NULL)
 		do_error("couldn't malloc free by-bcnt extent tree descriptor table\n");
 
 	for (i = 0; i < agcount; i++)  {
 		if ((extent_tree_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
+				malloc(sizeof(bptree_desc_t))) == NULL)
 			do_error("couldn't malloc dup extent tree descriptor\n");
 		if ((extent_bno_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
+				malloc(sizeof(bptree_desc_t))) == NULL)
 			do_error("couldn't malloc bno extent tree descriptor\n");
 		if ((extent_bcnt_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
+				malloc(sizeof(bptree_desc_t))) == NULL)
 			do_error("couldn't malloc bcnt extent tree descriptor\n");
 	}
 
 	for (i = 0; i < agcount; i++)  {
-		avl_init_tree(extent_tree_ptrs[i], &avl_extent_tree_ops);
-		avl_init_tree(extent_bno_ptrs[i], &avl_extent_tree_ops);
-		avl_init_tree(extent_bcnt_ptrs[i], &avl_extent_bcnt_tree_ops);
+		bptree_init(extent_tree_ptrs[i], &avl_extent_tree_ops);
+		bptree_init(extent_bno_ptrs[i], &avl_extent_tree_ops);
+		bptree_init(extent_bcnt_ptrs[i], &avl_extent_bcnt_tree_ops);
 	}
 
 	if ((rt_ext_tree_ptr = malloc(sizeof(avltree_desc_t))) == NULL)
@@ -912,8 +866,15 @@ incore_ext_init(xfs_mount_t *mp)
 
 	avl64_init_tree(rt_ext_tree_ptr, &avl64_extent_tree_ops);
 
-	ext_flist.cnt = 0;
-	ext_flist.list = NULL;
+	if ((dup_ext_arenas = malloc(agcount * sizeof(arena_t))) == NULL ||
+	    (free_ext_arenas = malloc(agcount * sizeof(arena_t))) == NULL)
+		do_error("couldn't malloc extent record arenas\n");
+
+	for (i = 0; i < agcount; i++)  {
+		arena_init(&dup_ext_arenas[i], &dup_ext_stats, ARENA_NUM_EXTS);
+		arena_init(&free_ext_arenas[i], &free_ext_stats,
+				ARENA_NUM_EXTS);
+	}
 
 	return;
 }
@@ -926,9 +887,12 @@ incore_ext_teardown(xfs_mount_t *mp)
 {
 	xfs_agnumber_t i;
 
-	free_allocations(ba_list);
-
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
+		arena_reset(&dup_ext_arenas[i]);
+		arena_reset(&free_ext_arenas[i]);
+		bptree_clear(extent_tree_ptrs[i]);
+		bptree_clear(extent_bno_ptrs[i]);
+		bptree_clear(extent_bcnt_ptrs[i]);
 		free(extent_tree_ptrs[i]);
 		free(extent_bno_ptrs[i]);
 		free(extent_bcnt_ptrs[i]);
@@ -940,16 +904,20 @@ incore_ext_teardown(xfs_mount_t *mp)
 
 	extent_bcnt_ptrs = extent_bno_ptrs = extent_tree_ptrs = NULL;
 
+	free(dup_ext_arenas);
+	free(free_ext_arenas);
+	dup_ext_arenas = free_ext_arenas = NULL;
+
 	return;
 }
 
 int
-count_extents(xfs_agnumber_t agno, avltree_desc_t *tree, int whichtree)
+count_extents(xfs_agnumber_t agno, bptree_desc_t *tree, int whichtree)
 {
 	extent_tree_node_t *node;
 	int i = 0;
 
-	node = (extent_tree_node_t *) tree->avl_firstino;
+	node = (extent_tree_node_t *) bptree_firstino(tree);
 
 	while (node != NULL)  {
 		i++;
@@ -973,7 +941,7 @@ count_bno_extents_blocks(xfs_agnumber_t agno, uint *numblocks)
 
 	nblocks = 0;
 
-	node = (extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino;
+	node = (extent_tree_node_t *) bptree_firstino(extent_bno_ptrs[agno]);
 
 	while (node != NULL) {
 		nblocks += node->ex_blockcount;
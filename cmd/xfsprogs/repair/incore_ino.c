@@ -38,30 +38,38 @@
 #include "agheader.h"
 #include "protos.h"
 #include "err_protos.h"
-
-extern avlnode_t	*avl_firstino(avlnode_t *root);
+#include "threads.h"
+#include "arena.h"
+#include "bptree.h"
 
 /*
  * array of inode tree ptrs, one per ag
  */
-static avltree_desc_t	**inode_tree_ptrs;
+static bptree_desc_t	**inode_tree_ptrs;
 
 /*
  * ditto for uncertain inodes
  */
-static avltree_desc_t	**inode_uncertain_tree_ptrs;
-
-#define ALLOC_NUM_INOS		100
+static bptree_desc_t	**inode_uncertain_tree_ptrs;
 
-/* free lists -- inode nodes and extent nodes */
+#define ALLOC_NUM_INOS		1000
+#define ALLOC_NUM_PLISTS	1000
+#define ALLOC_NUM_BPTRS		1000
 
-typedef struct ino_flist_s  {
-	ino_tree_node_t		*list;
-	ino_tree_node_t		*last;
-	__int64_t		cnt;
-} ino_flist_t;
+/*
+ * inode records come from a per-AG arena, the parent lists and
+ * back pointers hung off them from shared ones.  see arena.h.
+ */
+static arena_t		*ino_arenas;
+static arena_t		plist_arena;
+static arena_t		bptr_arena;
 
-static ino_flist_t ino_flist;	/* free list must be initialized before use */
+static arena_stats_t	ino_stats = ARENA_STATS_INIT("inode records",
+						ino_tree_node_t);
+static arena_stats_t	plist_stats = ARENA_STATS_INIT("inode parent lists",
+						parent_list_t);
+static arena_stats_t	bptr_stats = ARENA_STATS_INIT("inode back pointers",
+						backptrs_t);
 
 /*
  * next is the uncertain inode list -- a sorted (in ascending order)
@@ -76,35 +84,13 @@ static ino_flist_t ino_flist;	/* free list must be initialized before use */
  * IMPORTANT:  all inodes (inode records) start off as free and
  *		unconfirmed.
  */
-/* ARGSUSED */
 static ino_tree_node_t *
-mk_ino_tree_nodes(xfs_agino_t starting_ino)
+mk_ino_tree_nodes(xfs_agnumber_t agno, xfs_agino_t starting_ino)
 {
-	int i;
 	ino_tree_node_t *new;
 	avlnode_t *node;
 
-	if (ino_flist.cnt == 0)  {
-		ASSERT(ino_flist.list == NULL);
-
-		if ((new = malloc(sizeof(ino_tree_node_t[ALLOC_NUM_INOS])))
-					== NULL)
-			do_error("inode map malloc failed\n");
-
-		for (i = 0; i < ALLOC_NUM_INOS; i++)  {
-			new->avl_node.avl_nextino =
-				(avlnode_t *) ino_flist.list;
-			ino_flist.list = new;
-			ino_flist.cnt++;
-			new++;
-		}
-	}
-
-	ASSERT(ino_flist.list != NULL);
-
-	new = ino_flist.list;
-	ino_flist.list = (ino_tree_node_t *) new->avl_node.avl_nextino;
-	ino_flist.cnt--;
+	new = arena_alloc(&ino_arenas[agno]);
 	node = &new->avl_node;
 	node->avl_nextino = node->avl_forw = node->avl_back = NULL;
 
@@ -119,35 +105,37 @@ mk_ino_tree_nodes(xfs_agino_t starting_ino)
 	return(new);
 }
 
+static void
+free_parent_list(parent_list_t *plist)
+{
+	free(plist->pentries);
+	arena_free(&plist_arena, plist);
+}
+
 /*
- * return inode record to free list, will be initialized when
- * it gets pulled off list
+ * return inode record to the AG's arena, it will be initialized
+ * when it gets handed out again
  */
 static void
-free_ino_tree_node(ino_tree_node_t *ino_rec)
+free_ino_tree_node(xfs_agnumber_t agno, ino_tree_node_t *ino_rec)
 {
-	ino_rec->avl_node.avl_nextino = NULL;
-	ino_rec->avl_node.avl_forw = NULL;
-	ino_rec->avl_node.avl_back = NULL;
-
-	if (ino_flist.list != NULL)  {
-		ASSERT(ino_flist.cnt > 0);
-		ino_rec->avl_node.avl_nextino = (avlnode_t *) ino_flist.list;
-	} else  {
-		ASSERT(ino_flist.cnt == 0);
-		ino_rec->avl_node.avl_nextino = NULL;
-	}
-
-	ino_flist.list = ino_rec;
-	ino_flist.cnt++;
-
+	/*
+	 * done with the record before it goes back, another thread
+	 * may pull it straight back out
+	 */
 	if (ino_rec->ino_un.backptrs != NULL)  {
-		if (full_backptrs && ino_rec->ino_un.backptrs->parents != NULL)
-			free(ino_rec->ino_un.backptrs->parents);
-		if (ino_rec->ino_un.plist != NULL)
-			free(ino_rec->ino_un.plist);
+		if (!full_backptrs)
+			free_parent_list(ino_rec->ino_un.plist);
+		else  {
+			if (ino_rec->ino_un.backptrs->parents != NULL)
+				free_parent_list(
+					ino_rec->ino_un.backptrs->parents);
+			arena_free(&bptr_arena, ino_rec->ino_un.backptrs);
+		}
 	}
 
+	arena_free(&ino_arenas[agno], ino_rec);
+
 	return;
 }
 
@@ -177,6 +165,11 @@ add_aginode_uncertain(xfs_agnumber_t agno, xfs_agino_t ino, int free)
 
 	s_ino = rounddown(ino, XFS_INODES_PER_CHUNK);
 
+	/*
+	 * directory processing in other AGs can add to this list
+	 */
+	lock_ag(agno);
+
 	/*
 	 * check for a cache hit
 	 */
@@ -187,6 +180,7 @@ add_aginode_uncertain(xfs_agnumber_t agno, xfs_agino_t ino, int free)
 		else
 			set_inode_used(last_rec[agno], offset);
 
+		unlock_ag(agno);
 		return;
 	}
 
@@ -195,12 +189,12 @@ add_aginode_uncertain(xfs_agnumber_t agno, xfs_agino_t ino, int free)
 	 * if not, add it
 	 */
 	if ((ino_rec = (ino_tree_node_t *)
-			avl_findrange(inode_uncertain_tree_ptrs[agno],
+			bptree_findrange(inode_uncertain_tree_ptrs[agno],
 				s_ino)) == NULL)  {
-		ino_rec = mk_ino_tree_nodes(s_ino);
+		ino_rec = mk_ino_tree_nodes(agno, s_ino);
 		ino_rec->ino_startnum = s_ino;
 
-		if (avl_insert(inode_uncertain_tree_ptrs[agno],
+		if (bptree_insert(inode_uncertain_tree_ptrs[agno],
 				(avlnode_t *) ino_rec) == NULL)  {
 			do_error("xfs_repair:  duplicate inode range\n");
 		}
@@ -215,6 +209,7 @@ add_aginode_uncertain(xfs_agnumber_t agno, xfs_agino_t ino, int free)
 	 * set cache entry
 	 */
 	last_rec[agno] = ino_rec;
+	unlock_ag(agno);
 
 	return;
 }
@@ -239,7 +234,9 @@ get_uncertain_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec)
 	ASSERT(inode_tree_ptrs != NULL);
 	ASSERT(inode_tree_ptrs[agno] != NULL);
 
-	avl_delete(inode_uncertain_tree_ptrs[agno], &ino_rec->avl_node);
+	lock_ag(agno);
+	bptree_delete(inode_uncertain_tree_ptrs[agno], &ino_rec->avl_node);
+	unlock_ag(agno);
 
 	ino_rec->avl_node.avl_nextino = NULL;
 	ino_rec->avl_node.avl_forw = NULL;
@@ -250,20 +247,22 @@ ino_tree_node_t *
 findfirst_uncertain_inode_rec(xfs_agnumber_t agno)
 {
 	return((ino_tree_node_t *)
-		inode_uncertain_tree_ptrs[agno]->avl_firstino);
+		bptree_firstino(inode_uncertain_tree_ptrs[agno]));
 }
 
 void
 clear_uncertain_ino_cache(xfs_agnumber_t agno)
 {
+	lock_ag(agno);
 	last_rec[agno] = NULL;
+	unlock_ag(agno);
 
 	return;
 }
 
 
 /*
- * next comes the inode trees.  One per ag.  AVL trees
+ * next comes the inode trees.  One per ag.  B+trees
  * of inode records, each inode record tracking 64 inodes
  */
 /*
@@ -291,13 +290,15 @@ add_inode(xfs_agnumber_t agno, xfs_agino_t ino)
 
 	/* no record exists, make some and put them into the tree */
 
-	ino_rec = mk_ino_tree_nodes(ino);
+	ino_rec = mk_ino_tree_nodes(agno, ino);
 	ino_rec->ino_startnum = ino;
 
-	if (avl_insert(inode_tree_ptrs[agno],
+	lock_ag(agno);
+	if (bptree_insert(inode_tree_ptrs[agno],
 			(avlnode_t *) ino_rec) == NULL)  {
 		do_error("xfs_repair:  duplicate inode range\n");
 	}
+	unlock_ag(agno);
 
 	return(ino_rec);
 }
@@ -311,7 +312,9 @@ get_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec)
 	ASSERT(inode_tree_ptrs != NULL);
 	ASSERT(inode_tree_ptrs[agno] != NULL);
 
-	avl_delete(inode_tree_ptrs[agno], &ino_rec->avl_node);
+	lock_ag(agno);
+	bptree_delete(inode_tree_ptrs[agno], &ino_rec->avl_node);
+	unlock_ag(agno);
 
 	ino_rec->avl_node.avl_nextino = NULL;
 	ino_rec->avl_node.avl_forw = NULL;
@@ -321,11 +324,10 @@ get_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec)
 /*
  * free the designated inode record (return it to the free pool)
  */
-/* ARGSUSED */
 void
 free_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec)
 {
-	free_ino_tree_node(ino_rec);
+	free_ino_tree_node(agno, ino_rec);
 
 	return;
 }
@@ -339,7 +341,41 @@ ino_tree_node_t *
 find_inode_rec(xfs_agnumber_t agno, xfs_agino_t ino)
 {
 	return((ino_tree_node_t *)
-		avl_findrange(inode_tree_ptrs[agno], ino));
+		bptree_findrange(inode_tree_ptrs[agno], ino));
+}
+
+/*
+ * like find_inode_rec() but safe to use on an AG that another
+ * worker thread may be changing.  returns 1 and sets *isfree if
+ * the inode is in the tree, 0 if it isn't.  the record itself is
+ * never handed back since its owner is free to tear it down.
+ */
+int
+find_inode_state(xfs_mount_t *mp, xfs_ino_t ino, int *isfree)
+{
+	ino_tree_node_t	*ino_rec;
+	xfs_agnumber_t	agno;
+	xfs_agino_t	agino;
+	int		offset;
+
+	agno = XFS_INO_TO_AGNO(mp, ino);
+	agino = XFS_INO_TO_AGINO(mp, ino);
+
+	lock_ag(agno);
+	ino_rec = (ino_tree_node_t *) bptree_findrange(inode_tree_ptrs[agno],
+							agino);
+	if (ino_rec != NULL)  {
+		offset = agino - ino_rec->ino_startnum;
+		/*
+		 * inode recs should have only confirmed
+		 * inodes in them
+		 */
+		ASSERT(is_inode_confirmed(ino_rec, offset));
+		*isfree = is_inode_free(ino_rec, offset);
+	}
+	unlock_ag(agno);
+
+	return(ino_rec != NULL);
 }
 
 void
@@ -349,7 +385,7 @@ find_inode_rec_range(xfs_agnumber_t agno, xfs_agino_t start_ino,
 {
 	*first = *last = NULL;
 
-	avl_findranges(inode_tree_ptrs[agno], start_ino,
+	bptree_findranges(inode_tree_ptrs[agno], start_ino,
 		end_ino, (avlnode_t **) first, (avlnode_t **) last);
 	return;
 }
@@ -399,7 +435,7 @@ set_inode_free_alloc(xfs_agnumber_t agno, xfs_agino_t ino)
 ino_tree_node_t *
 findfirst_inode_rec(xfs_agnumber_t agno)
 {
-	return((ino_tree_node_t *) inode_tree_ptrs[agno]->avl_firstino);
+	return((ino_tree_node_t *) bptree_firstino(inode_tree_ptrs[agno]));
 }
 
 void
@@ -465,11 +501,8 @@ set_inode_parent(ino_tree_node_t *irec, int offset, xfs_ino_t parent)
 	ASSERT(full_backptrs == 0);
 
 	if (irec->ino_un.plist == NULL)  {
-                irec->ino_un.plist = 
-                        (parent_list_t*)malloc(sizeof(parent_list_t));
-                if (!irec->ino_un.plist)
-			do_error("couldn't malloc parent list table\n");
-                
+		irec->ino_un.plist = arena_alloc(&plist_arena);
+
 		irec->ino_un.plist->pmask = (__int64)1 << offset;
 		irec->ino_un.plist->pentries = 
                         (xfs_ino_t*)memalign(sizeof(xfs_ino_t), sizeof(xfs_ino_t));
@@ -692,9 +725,7 @@ get_backptr(void)
 {
 	backptrs_t *ptr;
 
-	if ((ptr = malloc(sizeof(backptrs_t))) == NULL)
-		do_error("could not malloc back pointer table\n");
-	
+	ptr = arena_alloc(&bptr_arena);
 	bzero(ptr, sizeof(backptrs_t));
 
 	return(ptr);
@@ -782,28 +813,32 @@ incore_ino_init(xfs_mount_t *mp)
 	int agcount = mp->m_sb.sb_agcount;
 
 	if ((inode_tree_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+					sizeof(bptree_desc_t *))) == NULL)
 		do_error("couldn't malloc inode tree descriptor table\n");
 	if ((inode_uncertain_tree_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+					sizeof(bptree_desc_t *))) == NULL)
 		do_error("couldn't malloc uncertain ino tree descriptor table\n");
 
 	for (i = 0; i < agcount; i++)  {
 		if ((inode_tree_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
+				malloc(sizeof(bptree_desc_t))) == NULL)
 			do_error("couldn't malloc inode tree descriptor\n");
 		if ((inode_uncertain_tree_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
+				malloc(sizeof(bptree_desc_t))) == NULL)
 			do_error(
 			"couldn't malloc uncertain ino tree descriptor\n");
 	}
 	for (i = 0; i < agcount; i++)  {
-		avl_init_tree(inode_tree_ptrs[i], &avl_ino_tree_ops);
-		avl_init_tree(inode_uncertain_tree_ptrs[i], &avl_ino_tree_ops);
+		bptree_init(inode_tree_ptrs[i], &avl_ino_tree_ops);
+		bptree_init(inode_uncertain_tree_ptrs[i], &avl_ino_tree_ops);
 	}
 
-	ino_flist.cnt = 0;
-	ino_flist.list = NULL;
+	if ((ino_arenas = malloc(agcount * sizeof(arena_t))) == NULL)
+		do_error("couldn't malloc inode record arenas\n");
+	for (i = 0; i < agcount; i++)
+		arena_init(&ino_arenas[i], &ino_stats, ALLOC_NUM_INOS);
+	arena_init(&plist_arena, &plist_stats, ALLOC_NUM_PLISTS);
+	arena_init(&bptr_arena, &bptr_stats, ALLOC_NUM_BPTRS);
 
 	if ((last_rec = malloc(sizeof(ino_tree_node_t *) * agcount)) == NULL)
 		do_error("couldn't malloc uncertain inode cache area\n");
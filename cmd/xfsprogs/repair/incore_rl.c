@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+#include <libxfs.h>
+#include "avl.h"
+#include "globals.h"
+#include "incore.h"
+#include "err_protos.h"
+
+/*
+ * run-length block map, see incore.h.  the flat and run-length maps
+ * record the same 4-bit state per block, get_agbno_state() and
+ * set_agbno_state() pick whichever one was set up.
+ */
+
+#define XR_RL_INITRUNS	4
+
+#define rl_chunk(agno, agbno)	\
+	(&ba_rlmap[(agno)][(agbno) >> XR_RL_CHUNK_LOG])
+#define rl_offset(agbno)	((agbno) & (XR_RL_CHUNK - 1))
+
+static void
+init_rl_chunk(rl_chunk_t *chunk)
+{
+	if ((chunk->runs = malloc(XR_RL_INITRUNS * sizeof(rl_run_t))) == NULL)
+		do_error("couldn't allocate run-length block map\n");
+
+	chunk->runs[0].start = 0;
+	chunk->runs[0].state = XR_E_UNKNOWN;
+	chunk->nruns = 1;
+	chunk->size = XR_RL_INITRUNS;
+	chunk->flat = NULL;
+}
+
+static void
+free_rl_chunk(rl_chunk_t *chunk)
+{
+	free(chunk->runs);
+	free(chunk->flat);
+	chunk->runs = NULL;
+	chunk->flat = NULL;
+	chunk->nruns = chunk->size = 0;
+}
+
+void
+setup_rl_bmap(xfs_agnumber_t agcount, xfs_agblock_t numblocks)
+{
+	xfs_agnumber_t	agno;
+	int		nchunks;
+	int		i;
+
+	if ((ba_rlmap = malloc(agcount * sizeof(rl_chunk_t *))) == NULL)
+		do_error("couldn't allocate block map pointers\n");
+
+	nchunks = howmany(numblocks, XR_RL_CHUNK);
+
+	for (agno = 0; agno < agcount; agno++)  {
+		ba_rlmap[agno] = malloc(nchunks * sizeof(rl_chunk_t));
+		if (ba_rlmap[agno] == NULL)
+			do_error("couldn't allocate run-length block map\n");
+		for (i = 0; i < nchunks; i++)
+			init_rl_chunk(&ba_rlmap[agno][i]);
+	}
+}
+
+void
+reset_rl_ag_bmap(xfs_agnumber_t agno, xfs_agblock_t numblocks)
+{
+	int	i;
+
+	for (i = 0; i < howmany(numblocks, XR_RL_CHUNK); i++)  {
+		free_rl_chunk(&ba_rlmap[agno][i]);
+		init_rl_chunk(&ba_rlmap[agno][i]);
+	}
+}
+
+void
+teardown_rl_ag_bmap(xfs_agnumber_t agno, xfs_agblock_t numblocks)
+{
+	int	i;
+
+	ASSERT(ba_rlmap[agno] != NULL);
+
+	for (i = 0; i < howmany(numblocks, XR_RL_CHUNK); i++)
+		free_rl_chunk(&ba_rlmap[agno][i]);
+
+	free(ba_rlmap[agno]);
+	ba_rlmap[agno] = NULL;
+}
+
+/*
+ * index of the run holding block off
+ */
+static int
+rl_find(rl_chunk_t *chunk, int off)
+{
+	int	lo;
+	int	hi;
+	int	mid;
+
+	lo = 0;
+	hi = chunk->nruns - 1;
+
+	while (lo < hi)  {
+		mid = (lo + hi + 1) / 2;
+		if (chunk->runs[mid].start <= off)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return(lo);
+}
+
+static void
+rl_insert(rl_chunk_t *chunk, int i, int start, int state)
+{
+	if (chunk->nruns == chunk->size)  {
+		chunk->size *= 2;
+		chunk->runs = realloc(chunk->runs,
+					chunk->size * sizeof(rl_run_t));
+		if (chunk->runs == NULL)
+			do_error("couldn't grow run-length block map\n");
+	}
+
+	memmove(&chunk->runs[i + 1], &chunk->runs[i],
+		(chunk->nruns - i) * sizeof(rl_run_t));
+	chunk->runs[i].start = start;
+	chunk->runs[i].state = state;
+	chunk->nruns++;
+}
+
+static void
+rl_remove(rl_chunk_t *chunk, int i)
+{
+	chunk->nruns--;
+	memmove(&chunk->runs[i], &chunk->runs[i + 1],
+		(chunk->nruns - i) * sizeof(rl_run_t));
+}
+
+/*
+ * turn a chunk with too many runs into a flat bitstring
+ */
+static void
+rl_flatten(rl_chunk_t *chunk)
+{
+	__uint64_t	*flat;
+	int		i;
+	int		off;
+	int		end;
+
+	if ((flat = malloc(XR_BB_BYTES(XR_RL_CHUNK))) == NULL)
+		do_error("couldn't allocate block map chunk\n");
+	bzero(flat, XR_BB_BYTES(XR_RL_CHUNK));
+
+	for (i = 0; i < chunk->nruns; i++)  {
+		end = (i + 1 < chunk->nruns) ? chunk->runs[i + 1].start :
+						XR_RL_CHUNK;
+		for (off = chunk->runs[i].start; off < end; off++)
+			flat[off / XR_BB_NUM] |= (__uint64_t)
+				chunk->runs[i].state << ((off % XR_BB_NUM) * XR_BB);
+	}
+
+	free(chunk->runs);
+	chunk->runs = NULL;
+	chunk->nruns = chunk->size = 0;
+	chunk->flat = flat;
+}
+
+int
+get_rl_state(xfs_agnumber_t agno, xfs_agblock_t agbno)
+{
+	rl_chunk_t	*chunk = rl_chunk(agno, agbno);
+	int		off = rl_offset(agbno);
+
+	if (chunk->flat != NULL)
+		return((int) (chunk->flat[off / XR_BB_NUM] >>
+				((off % XR_BB_NUM) * XR_BB)) & XR_BB_MASK);
+
+	return(chunk->runs[rl_find(chunk, off)].state);
+}
+
+void
+set_rl_state(xfs_agnumber_t agno, xfs_agblock_t agbno, int state)
+{
+	rl_chunk_t	*chunk = rl_chunk(agno, agbno);
+	int		off = rl_offset(agbno);
+	int		i;
+	int		end;
+	int		old;
+
+	/*
+	 * two more runs is the most one block can add
+	 */
+	if (chunk->flat == NULL && chunk->nruns + 2 > XR_RL_MAXRUNS)
+		rl_flatten(chunk);
+
+	if (chunk->flat != NULL)  {
+		chunk->flat[off / XR_BB_NUM] =
+			(chunk->flat[off / XR_BB_NUM] &
+			 ~((__uint64_t) XR_BB_MASK << ((off % XR_BB_NUM) * XR_BB))) |
+			((__uint64_t) state << ((off % XR_BB_NUM) * XR_BB));
+		return;
+	}
+
+	i = rl_find(chunk, off);
+	old = chunk->runs[i].state;
+	if (old == state)
+		return;
+
+	end = (i + 1 < chunk->nruns) ? chunk->runs[i + 1].start : XR_RL_CHUNK;
+
+	if (off == chunk->runs[i].start && off == end - 1)  {
+		/*
+		 * the whole run changes, it may join up with either
+		 * neighbour.
+		 */
+		chunk->runs[i].state = state;
+		if (i + 1 < chunk->nruns && chunk->runs[i + 1].state == state)
+			rl_remove(chunk, i + 1);
+		if (i > 0 && chunk->runs[i - 1].state == state)
+			rl_remove(chunk, i);
+	} else if (off == chunk->runs[i].start)  {
+		/*
+		 * first block of the run.  marking an extent block
+		 * by block in ascending order ends up here and just
+		 * grows the previous run.
+		 */
+		chunk->runs[i].start++;
+		if (i == 0 || chunk->runs[i - 1].state != state)
+			rl_insert(chunk, i, off, state);
+	} else if (off == end - 1)  {
+		/*
+		 * last block of the run
+		 */
+		if (i + 1 < chunk->nruns && chunk->runs[i + 1].state == state)
+			chunk->runs[i + 1].start--;
+		else
+			rl_insert(chunk, i + 1, off, state);
+	} else  {
+		/*
+		 * split the run around the block
+		 */
+		rl_insert(chunk, i + 1, off + 1, old);
+		rl_insert(chunk, i + 1, off, state);
+	}
+}
@@ -61,6 +61,7 @@ xfs_init(libxfs_init_t *args)
 	args->notvolmsg = "you should never get this message - %s";
 	args->notvolok = 1;
 	args->setblksize = 1;
+	args->directio = direct_io;
 
 	if (no_modify)
 		args->isreadonly = (LIBXFS_ISREADONLY | LIBXFS_ISINACTIVE);
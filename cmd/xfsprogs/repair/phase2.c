@@ -37,10 +37,21 @@
 #include "protos.h"
 #include "err_protos.h"
 #include "incore.h"
+#include "threads.h"
 
 void	set_mp(xfs_mount_t *mpp);
 void	scan_ag(xfs_agnumber_t agno);
 
+/* ARGSUSED */
+static void
+scan_ag_work(xfs_mount_t *mp, xfs_agnumber_t agno, void *arg)
+{
+	scan_ag(agno);
+#ifdef XR_INODE_TRACE
+	print_inode_list(agno);
+#endif
+}
+
 static void
 zero_log(xfs_mount_t *mp, libxfs_init_t *args)
 {
@@ -65,7 +76,6 @@ zero_log(xfs_mount_t *mp, libxfs_init_t *args)
 void
 phase2(xfs_mount_t *mp, libxfs_init_t *args)
 {
-	xfs_agnumber_t		i;
 	xfs_agblock_t		b;
 	int			j;
 	ino_tree_node_t		*ino_rec;
@@ -103,12 +113,7 @@ phase2(xfs_mount_t *mp, libxfs_init_t *args)
 
 	bad_ino_btree = 0;
 
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		scan_ag(i);
-#ifdef XR_INODE_TRACE
-		print_inode_list(i);
-#endif
-	}
+	do_ag_work(mp, scan_ag_work, NULL);
 
 	/*
 	 * make sure we know about the root inode chunk
@@ -38,6 +38,7 @@
 #include "protos.h"
 #include "err_protos.h"
 #include "dinode.h"
+#include "threads.h"
 
 /*
  * walks an unlinked list, returns 1 on an error (bogus pointer) or
@@ -157,6 +158,29 @@ process_agi_unlinked(xfs_mount_t *mp, xfs_agnumber_t agno)
 		libxfs_putbuf(bp);
 }
 
+/* ARGSUSED */
+static void
+process_ag_unlinked(xfs_mount_t *mp, xfs_agnumber_t agno, void *arg)
+{
+	/*
+	 * walk unlinked list to add more potential inodes to list
+	 */
+	process_agi_unlinked(mp, agno);
+	check_uncertain_aginodes(mp, agno);
+}
+
+/* ARGSUSED */
+static void
+process_ag_inodes(xfs_mount_t *mp, xfs_agnumber_t agno, void *arg)
+{
+	do_log("        - agno = %d\n", agno);
+	/*
+	 * turn on directory processing (inode discovery) and 
+	 * attribute processing (extra_attr_check)
+	 */
+	process_aginodes(mp, agno, 1, 0, 1);
+}
+
 void
 phase3(xfs_mount_t *mp)
 {
@@ -171,30 +195,20 @@ phase3(xfs_mount_t *mp)
 	/*
 	 * first, let's look at the possibly bogus inodes
 	 */
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		/*
-		 * walk unlinked list to add more potential inodes to list
-		 */
-		process_agi_unlinked(mp, i);
-		check_uncertain_aginodes(mp, i);
-	}
+	do_ag_work(mp, process_ag_unlinked, NULL);
 
 	/* ok, now that the tree's ok, let's take a good look */
 
 	printf(
 	    "        - process known inodes and perform inode discovery...\n");
 
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		do_log("        - agno = %d\n", i);
-		/*
-		 * turn on directory processing (inode discovery) and 
-		 * attribute processing (extra_attr_check)
-		 */
-		process_aginodes(mp, i, 1, 0, 1);
-	}
+	do_ag_work(mp, process_ag_inodes, NULL);
 
 	/*
-	 * process newly discovered inode chunks
+	 * process newly discovered inode chunks.  this stays single
+	 * threaded: processing one ag's uncertain inodes can add
+	 * uncertain inodes to any other ag while that ag's list is
+	 * being torn down.
 	 */
 	printf("        - process newly discovered inodes...\n");
 	do  {
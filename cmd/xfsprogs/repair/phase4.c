@@ -42,6 +42,7 @@
 #include "bmap.h"
 #include "versions.h"
 #include "dir2.h"
+#include "threads.h"
 
 
 /* ARGSUSED */
@@ -1120,6 +1121,92 @@ quota_sb_check(xfs_mount_t *mp)
 }
 
 
+/*
+ * set up the duplicate extent list for one ag.  arg points
+ * at the number of ag header blocks to skip.
+ */
+static void
+setup_dup_extents(xfs_mount_t *mp, xfs_agnumber_t agno, void *arg)
+{
+	int			ag_hdr_block = *(int *) arg;
+	xfs_agblock_t		ag_end;
+	xfs_agblock_t		extent_start;
+	xfs_extlen_t		extent_len;
+	xfs_agblock_t		j;
+	int			bstate;
+
+	ag_end = (agno < mp->m_sb.sb_agcount - 1) ? mp->m_sb.sb_agblocks :
+		mp->m_sb.sb_dblocks -
+			(xfs_drfsbno_t) mp->m_sb.sb_agblocks * agno;
+	extent_start = extent_len = 0;
+
+	for (j = ag_hdr_block; j < ag_end; j++)  {
+
+		bstate = get_agbno_state(mp, agno, j);
+
+		switch (bstate)  {
+		case XR_E_BAD_STATE:
+		default:
+			do_warn("unknown block state, ag %d, block %d\n",
+				agno, j);
+			/* fall through .. */
+		case XR_E_UNKNOWN:
+		case XR_E_FREE1:
+		case XR_E_FREE:
+		case XR_E_INUSE:
+		case XR_E_INUSE_FS:
+		case XR_E_INO:
+		case XR_E_FS_MAP:
+			if (extent_start == 0)
+				continue;
+			else  {
+				/*
+				 * add extent and reset extent state
+				 */
+				add_dup_extent(agno, extent_start,
+						extent_len);
+				extent_start = 0;
+				extent_len = 0;
+			}
+			break;
+		case XR_E_MULT:
+			if (extent_start == 0)  {
+				extent_start = j;
+				extent_len = 1;
+			} else if (extent_len == MAXEXTLEN)  {
+				add_dup_extent(agno, extent_start,
+						extent_len);
+				extent_start = j;
+				extent_len = 1;
+			} else
+				extent_len++;
+			break;
+		}
+	}
+	/*
+	 * catch tail-case, extent hitting the end of the ag
+	 */
+	if (extent_start != 0)
+		add_dup_extent(agno, extent_start, extent_len);
+}
+
+/* ARGSUSED */
+static void
+process_ag_dups(xfs_mount_t *mp, xfs_agnumber_t agno, void *arg)
+{
+	/*
+	 * ok, now process the inodes -- signal 2-pass check per inode.
+	 * first pass checks if the inode conflicts with a known
+	 * duplicate extent.  if so, the inode is cleared and second
+	 * pass is skipped.  second pass sets the block bitmap
+	 * for all blocks claimed by the inode.  directory
+	 * and attribute processing is turned OFF since we did that 
+	 * already in phase 3.
+	 */
+	do_log("        - agno = %d\n", agno);
+	process_aginodes(mp, agno, 0, 1, 0);
+}
+
 void
 phase4(xfs_mount_t *mp)
 {
@@ -1130,8 +1217,6 @@ phase4(xfs_mount_t *mp)
 	xfs_agnumber_t		i;
 	xfs_agblock_t		j;
 	xfs_agblock_t		ag_end;
-	xfs_agblock_t		extent_start;
-	xfs_extlen_t		extent_len;
 	int			ag_hdr_len = 4 * mp->m_sb.sb_sectsize;
 	int			ag_hdr_block;
 	int			bstate;
@@ -1168,64 +1253,10 @@ phase4(xfs_mount_t *mp)
 			delete_orphanage(mp);
 	}
 
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		ag_end = (i < mp->m_sb.sb_agcount - 1) ? mp->m_sb.sb_agblocks :
-			mp->m_sb.sb_dblocks -
-				(xfs_drfsbno_t) mp->m_sb.sb_agblocks * i;
-		extent_start = extent_len = 0;
-		/*
-		 * set up duplicate extent list for this ag
-		 */
-		for (j = ag_hdr_block; j < ag_end; j++)  {
-
-			bstate = get_agbno_state(mp, i, j);
-
-			switch (bstate)  {
-			case XR_E_BAD_STATE:
-			default:
-				do_warn("unknown block state, ag %d, \
-block %d\n",
-					i, j);
-				/* fall through .. */
-			case XR_E_UNKNOWN:
-			case XR_E_FREE1:
-			case XR_E_FREE:
-			case XR_E_INUSE:
-			case XR_E_INUSE_FS:
-			case XR_E_INO:
-			case XR_E_FS_MAP:
-				if (extent_start == 0)
-					continue;
-				else  {
-					/*
-					 * add extent and reset extent state
-					 */
-					add_dup_extent(i, extent_start,
-							extent_len);
-					extent_start = 0;
-					extent_len = 0;
-				}
-				break;
-			case XR_E_MULT:
-				if (extent_start == 0)  {
-					extent_start = j;
-					extent_len = 1;
-				} else if (extent_len == MAXEXTLEN)  {
-					add_dup_extent(i, extent_start,
-							extent_len);
-					extent_start = j;
-					extent_len = 1;
-				} else
-					extent_len++;
-				break;
-			}
-		}
-		/*
-		 * catch tail-case, extent hitting the end of the ag
-		 */
-		if (extent_start != 0)
-			add_dup_extent(i, extent_start, extent_len);
-	}
+	/*
+	 * set up duplicate extent lists for all ags
+	 */
+	do_ag_work(mp, setup_dup_extents, &ag_hdr_block);
 
 	/*
 	 * initialize realtime bitmap
@@ -1293,8 +1324,7 @@ block %d\n",
 		/*
 		 * now reset the bitmap for all ags
 		 */
-		bzero(ba_bmap[i], roundup(mp->m_sb.sb_agblocks*(NBBY/XR_BB),
-						sizeof(__uint64_t)));
+		reset_ag_bmap(mp, i);
 		for (j = 0; j < ag_hdr_block; j++)
 			set_agbno_state(mp, i, j, XR_E_INUSE_FS);
 	}
@@ -1303,24 +1333,15 @@ block %d\n",
 	set_bmap_fs(mp);
 
 	printf("        - check for inodes claiming duplicate blocks...\n");
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		/*
-		 * ok, now process the inodes -- signal 2-pass check per inode.
-		 * first pass checks if the inode conflicts with a known
-		 * duplicate extent.  if so, the inode is cleared and second
-		 * pass is skipped.  second pass sets the block bitmap
-		 * for all blocks claimed by the inode.  directory
-		 * and attribute processing is turned OFF since we did that 
-		 * already in phase 3.
-		 */
-		do_log("        - agno = %d\n", i);
-		process_aginodes(mp, i, 0, 1, 0);
+	do_ag_work(mp, process_ag_dups, NULL);
 
-		/*
-		 * now recycle the per-AG duplicate extent records
-		 */
+	/*
+	 * now recycle the per-AG duplicate extent records.  inodes
+	 * in any ag can claim blocks in any other, so none of the
+	 * lists can go until every ag has been checked.
+	 */
+	for (i = 0; i < mp->m_sb.sb_agcount; i++)
 		release_dup_extent_tree(i);
-	}
 
 	/*
 	 * free up memory used to track trealtime duplicate extents
@@ -42,38 +42,17 @@
 #include "versions.h"
 
 /*
- * we maintain the current slice (path from root to leaf)
- * of the btree incore.  when we need a new block, we ask
- * the block allocator for the address of a block on that
- * level, map the block in, and set up the appropriate
- * pointers (child, silbing, etc.) and keys that should
- * point to the new block.
+ * the on-disk btrees are built by the libxfs bulk loader.  the
+ * blocks each tree will need are taken out of the incore free space
+ * trees up front by setup_cursor() and handed to the loader one at a
+ * time by get_next_blockaddr(), any left over go into the AGFL.
+ * the loader pulls records from the incore extent or inode trees
+ * through the ext_ptr/ino_rec cursors.
  */
-typedef struct bt_stat_level  {
-	/*
-	 * set in setup_cursor routine and maintained in the tree-building
-	 * routines
-	 */
-	xfs_buf_t		*buf_p;		/* 2 buffer pointers to ... */
-	xfs_buf_t		*prev_buf_p;
-	xfs_agblock_t		agbno;		/* current block being filled */
-	xfs_agblock_t		prev_agbno;	/* previous block */
-	/*
-	 * set in calculate/init cursor routines for each btree level
-	 */
-	int			num_recs_tot;	/* # tree recs in level */
-	int			num_blocks;	/* # tree blocks in level */
-	int			num_recs_pb;	/* num_recs_tot / num_blocks */
-	int			modulo;		/* num_recs_tot % num_blocks */
-} bt_stat_level_t;
-
 typedef struct bt_status  {
 	int			init;		/* cursor set up once? */
-	int			num_levels;	/* # of levels in btree */
 	xfs_extlen_t		num_tot_blocks;	/* # blocks alloc'ed for tree */
 	xfs_extlen_t		num_free_blocks;/* # blocks currently unused */
-
-	xfs_agblock_t		root;		/* root block */
 	/*
 	 * list of blocks to be used to set up this tree
 	 * and pointer to the first unused block on the list
@@ -81,9 +60,16 @@ typedef struct bt_status  {
 	xfs_agblock_t		*btree_blocks;		/* block list */
 	xfs_agblock_t		*free_btree_blocks;	/* first unused block */
 	/*
-	 * per-level status info
+	 * tree geometry, root and # of levels
+	 */
+	libxfs_bload_t		bload;
+	/*
+	 * next record to load and running totals
 	 */
-	bt_stat_level_t		level[XFS_BTREE_MAXLEVELS];
+	extent_tree_node_t	*ext_ptr;
+	ino_tree_node_t		*ino_rec;
+	__uint64_t		count;		/* free blocks or inodes */
+	__uint64_t		freecount;	/* free inodes */
 } bt_status_t;
 
 
@@ -154,7 +140,7 @@ mk_incore_fstree(xfs_mount_t *mp, xfs_agnumber_t agno)
 			if (in_extent)  {
 				/*
 				 * free extent ends here, add extent to the
-				 * 2 incore extent (avl-to-be-B+) trees
+				 * 2 incore extent (bno and bcnt) trees
 				 */
 				in_extent = 0;
 #if defined(XR_BLD_FREE_TRACE) && defined(XR_BLD_ADD_EXTENT)
@@ -246,7 +232,6 @@ setup_cursor(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *curs)
 	}
 
 	agb_ptr = curs->btree_blocks;
-	j = curs->level[0].num_blocks;
 
 	/*
 	 * set up the free block array
@@ -278,11 +263,11 @@ setup_cursor(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *curs)
 						ext_ptr->ex_startblock);
 			ASSERT(bno_ext_ptr != NULL);
 			get_bno_extent(agno, bno_ext_ptr);
-			release_extent_tree_node(bno_ext_ptr);
+			release_extent_tree_node(agno, bno_ext_ptr);
 
 			ext_ptr = get_bcnt_extent(agno, ext_ptr->ex_startblock,
 					ext_ptr->ex_blockcount);
-			release_extent_tree_node(ext_ptr);
+			release_extent_tree_node(agno, ext_ptr);
 #ifdef XR_BLD_FREE_TRACE
 			fprintf(stderr, "releasing extent: %u [%u %u]\n",
 				agno, ext_ptr->ex_startblock,
@@ -307,12 +292,12 @@ setup_cursor(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *curs)
 		bno_ext_ptr = find_bno_extent(agno, ext_ptr->ex_startblock);
 		ASSERT(bno_ext_ptr != NULL);
 		get_bno_extent(agno, bno_ext_ptr);
-		release_extent_tree_node(bno_ext_ptr);
+		release_extent_tree_node(agno, bno_ext_ptr);
 
 		ext_ptr = get_bcnt_extent(agno, ext_ptr->ex_startblock,
 				ext_ptr->ex_blockcount);
 		ASSERT(ext_ptr != NULL);
-		release_extent_tree_node(ext_ptr);
+		release_extent_tree_node(agno, ext_ptr);
 
 		ext_ptr = findfirst_bcnt_extent(agno);
 	}
@@ -322,21 +307,37 @@ setup_cursor(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *curs)
 #endif
 }
 
-void
-write_cursor(bt_status_t *curs)
+static xfs_agblock_t
+bload_alloc_block(void *priv, int level)
 {
-	int i;
+	bt_status_t	*curs = priv;
 
-	for (i = 0; i < curs->num_levels; i++)  {
-#if defined(XR_BLD_FREE_TRACE) || defined(XR_BLD_INO_TRACE)
-		fprintf(stderr, "writing bt block %u\n", curs->level[i].agbno);
-#endif
-		if (curs->level[i].prev_buf_p != NULL)  {
-			ASSERT(curs->level[i].prev_agbno != NULLAGBLOCK);
-			libxfs_writebuf(curs->level[i].prev_buf_p, 0);
-		}
-		libxfs_writebuf(curs->level[i].buf_p, 0);
+	return(get_next_blockaddr(curs->bload.bl_agno, level, curs));
+}
+
+/*
+ * set up the parts of the bulk loader that don't change between
+ * the geometry calculation and the actual tree build
+ */
+static void
+init_bload(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *curs,
+	__uint32_t magic)
+{
+	libxfs_bload_t	*bl = &curs->bload;
+
+	bzero(bl, sizeof(libxfs_bload_t));
+	bl->bl_mp = mp;
+	bl->bl_agno = agno;
+	bl->bl_magic = magic;
+	if (magic == XFS_IBT_MAGIC)  {
+		bl->bl_recsize = sizeof(xfs_inobt_rec_t);
+		bl->bl_keysize = sizeof(xfs_inobt_key_t);
+	} else  {
+		bl->bl_recsize = sizeof(xfs_alloc_rec_t);
+		bl->bl_keysize = sizeof(xfs_alloc_key_t);
 	}
+	bl->bl_fill = btree_fill;
+	bl->bl_alloc = bload_alloc_block;
 }
 
 void
@@ -346,24 +347,6 @@ finish_cursor(bt_status_t *curs)
 	free(curs->btree_blocks);
 }
 
-/*
- * no-cursor versions of the XFS equivalents.  The address calculators
- * should be used only for interior btree nodes.
- * these are adapted from xfs_alloc_btree.h and xfs_tree.h
- */
-#define XR_ALLOC_KEY_ADDR(mp, bp, i) \
-	(xfs_alloc_key_t *) ((char *) (bp) + sizeof(xfs_alloc_block_t) \
-				+ ((i)-1) * sizeof(xfs_alloc_key_t))
-
-#define XR_ALLOC_PTR_ADDR(mp, bp, i) \
-	(xfs_alloc_ptr_t *) ((char *) (bp) + sizeof(xfs_alloc_block_t) \
-			+ (mp)->m_alloc_mxr[1] * sizeof(xfs_alloc_key_t) \
-			+ ((i)-1) * sizeof(xfs_alloc_ptr_t))
-
-#define XR_ALLOC_BLOCK_MAXRECS(mp, level) \
-			XFS_BTREE_BLOCK_MAXRECS((mp)->m_sb.sb_blocksize, \
-						xfs_alloc, (level) == 0)
-
 /*
  * this calculates a freespace cursor for an ag.
  * btree_curs is an in/out.  returns the number of
@@ -378,17 +361,11 @@ calculate_freespace_cursor(xfs_mount_t *mp, xfs_agnumber_t agno,
 	xfs_extlen_t		blocks_allocated_pt;	/* per tree */
 	xfs_extlen_t		blocks_allocated_total;	/* for both trees */
 	xfs_agblock_t		num_extents;
-	int			i;
 	int			extents_used;
 	int			extra_blocks;
-	bt_stat_level_t		*lptr;
-	bt_stat_level_t		*p_lptr;
+	int			num_leaves;
 	extent_tree_node_t	*ext_ptr;
-	int			level;
-#ifdef XR_BLD_FREE_TRACE
-	int			old_state;
-	int			state = XR_E_BAD_STATE;
-#endif
+	libxfs_bload_t		*bl;
 #ifdef XR_BLD_FREE_TRACE
 	fprintf(stderr,
 		"in init_freespace_cursor, agno = %d\n", agno);
@@ -399,42 +376,16 @@ calculate_freespace_cursor(xfs_mount_t *mp, xfs_agnumber_t agno,
 
 	ASSERT(num_extents != 0);
 
-	lptr = &btree_curs->level[0];
+	init_bload(mp, agno, btree_curs, XFS_ABTB_MAGIC);
+	bl = &btree_curs->bload;
 	btree_curs->init = 1;
 
 	/*
-	 * figure out how much space we need for the leaf level
-	 * of the tree and set up the cursor for the leaf level
-	 * (note that the same code is duplicated further down)
+	 * figure out how much space we need for the tree
+	 * (note that this is done again further down)
 	 */
-	lptr->num_blocks = howmany(num_extents, XR_ALLOC_BLOCK_MAXRECS(mp, 0));
-	lptr->num_recs_pb = num_extents / lptr->num_blocks;
-	lptr->modulo = num_extents % lptr->num_blocks;
-	lptr->num_recs_tot = num_extents;
-	level = 1;
-
-	/*
-	 * if we need more levels, set them up.  # of records
-	 * per level is the # of blocks in the level below it
-	 */
-	if (lptr->num_blocks > 1)  {
-		for (; btree_curs->level[level - 1].num_blocks > 1
-				&& level < XFS_BTREE_MAXLEVELS;
-				level++)  {
-			lptr = &btree_curs->level[level];
-			p_lptr = &btree_curs->level[level - 1];
-			lptr->num_blocks = howmany(p_lptr->num_blocks,
-					XR_ALLOC_BLOCK_MAXRECS(mp, level));
-			lptr->modulo = p_lptr->num_blocks
-					% lptr->num_blocks;
-			lptr->num_recs_pb = p_lptr->num_blocks
-					/ lptr->num_blocks;
-			lptr->num_recs_tot = p_lptr->num_blocks;
-		}
-	}
-
-	ASSERT(lptr->num_blocks == 1);
-	btree_curs->num_levels = level;
+	blocks_needed = libxfs_bload_geometry(bl, num_extents);
+	num_leaves = bl->bl_level[0].bll_nblocks;
 
 	/*
 	 * ok, now we have a hypothetical cursor that
@@ -450,9 +401,6 @@ calculate_freespace_cursor(xfs_mount_t *mp, xfs_agnumber_t agno,
 	 * if the number of extra blocks is more than that,
 	 * we'll have to be called again.
 	 */
-	for (blocks_needed = 0, i = 0; i < level; i++)  {
-		blocks_needed += btree_curs->level[i].num_blocks;
-	}
 
 	/*
 	 * record the # of blocks we've allocated
@@ -471,7 +419,6 @@ calculate_freespace_cursor(xfs_mount_t *mp, xfs_agnumber_t agno,
 		exit(1);
 	}
 
-	i = 0;
 	while (ext_ptr != NULL && blocks_needed > 0)  {
 		if (ext_ptr->ex_blockcount <= blocks_needed)  {
 			blocks_needed -= ext_ptr->ex_blockcount;
@@ -502,120 +449,61 @@ calculate_freespace_cursor(xfs_mount_t *mp, xfs_agnumber_t agno,
 	num_extents -= extents_used;
 
 	/*
-	 * see if the number of leaf blocks will change as a result
-	 * of the number of extents changing
+	 * if we've used up all the free blocks trying to lay
+	 * out the leaf level, go to a one block (empty) btree
+	 * and put the already allocated blocks into the AGFL
 	 */
-	if (howmany(num_extents, XR_ALLOC_BLOCK_MAXRECS(mp, 0))
-			!= btree_curs->level[0].num_blocks)  {
-		/*
-		 * yes -- recalculate the cursor.  If the number of
-		 * excess (overallocated) blocks is < XFS_AGFL_SIZE/2, we're ok.
-		 * we can put those into the AGFL.  we don't try
-		 * and get things to converge exactly (reach a
-		 * state with zero excess blocks) because there
-		 * exist pathological cases which will never
-		 * converge.  first, check for the zero-case.
-		 */
-		if (num_extents == 0)  {
+	if (num_extents == 0)  {
+		if (num_leaves != 1)  {
 			/*
-			 * ok, we've used up all the free blocks
-			 * trying to lay out the leaf level. go
-			 * to a one block (empty) btree and put the
-			 * already allocated blocks into the AGFL
+			 * we really needed more blocks because
+			 * the old tree had more than one level.
+			 * this is bad.
 			 */
-			if (btree_curs->level[0].num_blocks != 1)  {
-				/*
-				 * we really needed more blocks because
-				 * the old tree had more than one level.
-				 * this is bad.
-				 */
-				 do_warn("not enough free blocks left to "
-					"describe all free blocks in AG %u\n",
-					agno);
-			}
+			 do_warn("not enough free blocks left to "
+				"describe all free blocks in AG %u\n",
+				agno);
+		}
 #ifdef XR_BLD_FREE_TRACE
-			fprintf(stderr,
-				"ag %u -- no free extents, alloc'ed %d\n",
-				agno, blocks_allocated_pt);
+		fprintf(stderr,
+			"ag %u -- no free extents, alloc'ed %d\n",
+			agno, blocks_allocated_pt);
 #endif
-			lptr->num_blocks = 1;
-			lptr->modulo = 0;
-			lptr->num_recs_pb = 0;
-			lptr->num_recs_tot = 0;
-
-			btree_curs->num_levels = 1;
-
-			/*
-			 * don't reset the allocation stats, assume
-			 * they're all extra blocks
-			 * don't forget to return the total block count
-			 * not the per-tree block count.  these are the
-			 * extras that will go into the AGFL.  subtract
-			 * two for the root blocks.
-			 */
-			btree_curs->num_tot_blocks = blocks_allocated_pt;
-			btree_curs->num_free_blocks = blocks_allocated_pt;
-
-			*extents = 0;
-
-			return(blocks_allocated_total - 2);
-		}
-
-		lptr = &btree_curs->level[0];
-		lptr->num_blocks = howmany(num_extents,
-					XR_ALLOC_BLOCK_MAXRECS(mp, 0));
-		lptr->num_recs_pb = num_extents / lptr->num_blocks;
-		lptr->modulo = num_extents % lptr->num_blocks;
-		lptr->num_recs_tot = num_extents;
-		level = 1;
+		(void) libxfs_bload_geometry(bl, 0);
 
 		/*
-		 * if we need more levels, set them up
+		 * don't reset the allocation stats, assume
+		 * they're all extra blocks
+		 * don't forget to return the total block count
+		 * not the per-tree block count.  these are the
+		 * extras that will go into the AGFL.  subtract
+		 * two for the root blocks.
 		 */
-		if (lptr->num_blocks > 1)  {
-			for (level = 1; btree_curs->level[level-1].num_blocks
-					> 1 && level < XFS_BTREE_MAXLEVELS;
-					level++)  {
-				lptr = &btree_curs->level[level];
-				p_lptr = &btree_curs->level[level-1];
-				lptr->num_blocks = howmany(p_lptr->num_blocks,
-						XR_ALLOC_BLOCK_MAXRECS(mp,
-								level));
-				lptr->modulo = p_lptr->num_blocks
-						% lptr->num_blocks;
-				lptr->num_recs_pb = p_lptr->num_blocks
-						/ lptr->num_blocks;
-				lptr->num_recs_tot = p_lptr->num_blocks;
-			}
-		}
-		ASSERT(lptr->num_blocks == 1);
-		btree_curs->num_levels = level;
+		btree_curs->num_tot_blocks = blocks_allocated_pt;
+		btree_curs->num_free_blocks = blocks_allocated_pt;
 
-		/*
-		 * now figure out the number of excess blocks
-		 */
-		for (blocks_needed = 0, i = 0; i < level; i++)  {
-			blocks_needed += btree_curs->level[i].num_blocks;
-		}
-		blocks_needed *= 2;
+		*extents = 0;
 
+		return(blocks_allocated_total - 2);
+	}
+
+	/*
+	 * redo the geometry for the extents that are left.
+	 * the interior levels only depend on the number of
+	 * leaves so if that hasn't changed, neither has the
+	 * number of blocks we need.  If it has, the excess
+	 * (overallocated) blocks go into the AGFL.  we don't
+	 * try and get things to converge exactly (reach a
+	 * state with zero excess blocks) because there
+	 * exist pathological cases which will never converge.
+	 */
+	blocks_needed = libxfs_bload_geometry(bl, num_extents) * 2;
+
+	if (bl->bl_level[0].bll_nblocks != num_leaves)  {
 		ASSERT(blocks_allocated_total >= blocks_needed);
 		extra_blocks = blocks_allocated_total - blocks_needed;
 	} else  {
-		if (extents_used > 0) {
-			/*
-			 * reset the leaf level geometry to account
-			 * for consumed extents.  we can leave the
-			 * rest of the cursor alone since the number
-			 * of leaf blocks hasn't changed.
-			 */
-			lptr = &btree_curs->level[0];
-
-			lptr->num_recs_pb = num_extents / lptr->num_blocks;
-			lptr->modulo = num_extents % lptr->num_blocks;
-			lptr->num_recs_tot = num_extents;
-		}
-
+		ASSERT(blocks_allocated_total == blocks_needed);
 		extra_blocks = 0;
 	}
 
@@ -627,92 +515,33 @@ calculate_freespace_cursor(xfs_mount_t *mp, xfs_agnumber_t agno,
 	return(extra_blocks);
 }
 
-void
-prop_freespace_cursor(xfs_mount_t *mp, xfs_agnumber_t agno,
-		bt_status_t *btree_curs, xfs_agblock_t startblock,
-		xfs_extlen_t blockcount, int level, __uint32_t magic)
+/*
+ * bulk loader record source for the freespace trees
+ */
+static int
+get_freespace_rec(void *priv, void *rec, void *key)
 {
-	xfs_alloc_block_t	*bt_hdr;
-	xfs_alloc_key_t		*bt_key;
-	xfs_alloc_ptr_t		*bt_ptr;
-	xfs_agblock_t		agbno;
-	bt_stat_level_t		*lptr;
-
-	level++;
-
-	if (level >= btree_curs->num_levels)
-		return;
-
-	lptr = &btree_curs->level[level];
-	bt_hdr = XFS_BUF_TO_ALLOC_BLOCK(lptr->buf_p);
-
-	if (INT_GET(bt_hdr->bb_numrecs, ARCH_CONVERT) == 0)  {
-		/*
-		 * only happens once when initializing the
-		 * left-hand side of the tree.
-		 */
-		prop_freespace_cursor(mp, agno, btree_curs, startblock,
-				blockcount, level, magic);
-	}
-
-	if (INT_GET(bt_hdr->bb_numrecs, ARCH_CONVERT) ==
-			lptr->num_recs_pb + (lptr->modulo > 0))  {
-		/*
-		 * write out current prev block, grab us a new block,
-		 * and set the rightsib pointer of current block
-		 */
-#ifdef XR_BLD_FREE_TRACE
-		fprintf(stderr, " %d ", lptr->prev_agbno);
-#endif
-		if (lptr->prev_agbno != NULLAGBLOCK) {
-			ASSERT(lptr->prev_buf_p != NULL);
-			libxfs_writebuf(lptr->prev_buf_p, 0);
-		}
-		lptr->prev_agbno = lptr->agbno;;
-		lptr->prev_buf_p = lptr->buf_p;
-		agbno = get_next_blockaddr(agno, level, btree_curs);
-
-		INT_SET(bt_hdr->bb_rightsib, ARCH_CONVERT, agbno);
+	bt_status_t		*btree_curs = priv;
+	extent_tree_node_t	*ext_ptr = btree_curs->ext_ptr;
+	xfs_alloc_rec_t		*bt_rec = rec;
+	xfs_alloc_key_t		*bt_key = key;
 
-		lptr->buf_p = libxfs_getbuf(mp->m_dev,
-					XFS_AGB_TO_DADDR(mp, agno, agbno),
-					XFS_FSB_TO_BB(mp, 1));
-		lptr->agbno = agbno;
+	if (ext_ptr == NULL)
+		return(0);
 
-		if (lptr->modulo)
-			lptr->modulo--;
+	INT_SET(bt_rec->ar_startblock, ARCH_CONVERT, ext_ptr->ex_startblock);
+	INT_SET(bt_rec->ar_blockcount, ARCH_CONVERT, ext_ptr->ex_blockcount);
+	if (bt_key != NULL)
+		*bt_key = *bt_rec;
 
-		/*
-		 * initialize block header
-		 */
-		bt_hdr = XFS_BUF_TO_ALLOC_BLOCK(lptr->buf_p);
-		bzero(bt_hdr, mp->m_sb.sb_blocksize);
-
-		INT_SET(bt_hdr->bb_magic, ARCH_CONVERT, magic);
-		INT_SET(bt_hdr->bb_level, ARCH_CONVERT, level);
-		INT_SET(bt_hdr->bb_leftsib, ARCH_CONVERT, lptr->prev_agbno);
-		INT_SET(bt_hdr->bb_rightsib, ARCH_CONVERT, NULLAGBLOCK);
-		INT_ZERO(bt_hdr->bb_numrecs, ARCH_CONVERT);
-
-		/*
-		 * propagate extent record for first extent in new block up
-		 */
-		prop_freespace_cursor(mp, agno, btree_curs, startblock,
-				blockcount, level, magic);
-	}
-	/*
-	 * add extent info to current block
-	 */
-	INT_MOD(bt_hdr->bb_numrecs, ARCH_CONVERT, +1);
+	btree_curs->count += ext_ptr->ex_blockcount;
 
-	bt_key = XR_ALLOC_KEY_ADDR(mp, bt_hdr,
-			INT_GET(bt_hdr->bb_numrecs, ARCH_CONVERT));
-	bt_ptr = XR_ALLOC_PTR_ADDR(mp, bt_hdr,
-			INT_GET(bt_hdr->bb_numrecs, ARCH_CONVERT));
-
-	INT_SET(bt_key->ar_startblock, ARCH_CONVERT, startblock);
-	INT_SET(bt_key->ar_blockcount, ARCH_CONVERT, blockcount);
-	INT_SET(*bt_ptr, ARCH_CONVERT, btree_curs->level[level-1].agbno);
+	if (btree_curs->bload.bl_magic == XFS_ABTB_MAGIC)
+		btree_curs->ext_ptr = findnext_bno_extent(ext_ptr);
+	else
+		btree_curs->ext_ptr = findnext_bcnt_extent(
+					btree_curs->bload.bl_agno, ext_ptr);
+	return(1);
 }
 
 /*
@@ -724,174 +553,35 @@ xfs_extlen_t
 build_freespace_tree(xfs_mount_t *mp, xfs_agnumber_t agno,
 		bt_status_t *btree_curs, __uint32_t magic)
 {
-	xfs_agnumber_t		i;
-	xfs_agblock_t		j;
-	xfs_alloc_block_t	*bt_hdr;
-	xfs_alloc_rec_t		*bt_rec;
-	int			level;
-	xfs_agblock_t		agbno;
-	extent_tree_node_t	*ext_ptr;
-	bt_stat_level_t		*lptr;
-	xfs_extlen_t		freeblks;
+	libxfs_bload_t		*bl = &btree_curs->bload;
 
 #ifdef XR_BLD_FREE_TRACE
 	fprintf(stderr, "in build_freespace_tree, agno = %d\n", agno);
 #endif
-	level = btree_curs->num_levels;
-	freeblks = 0;
-
-	ASSERT(level > 0);
+	ASSERT(bl->bl_nlevels > 0);
 
 	/*
-	 * initialize the first block on each btree level
+	 * the bno and bcnt cursors start out as copies of each other
 	 */
-	for (i = 0; i < level; i++)  {
-		lptr = &btree_curs->level[i];
+	bl->bl_magic = magic;
+	bl->bl_priv = btree_curs;
+	bl->bl_getrec = get_freespace_rec;
 
-		agbno = get_next_blockaddr(agno, i, btree_curs);
-		lptr->buf_p = libxfs_getbuf(mp->m_dev,
-					XFS_AGB_TO_DADDR(mp, agno, agbno),
-					XFS_FSB_TO_BB(mp, 1));
-
-		if (i == btree_curs->num_levels - 1)
-			btree_curs->root = agbno;
-
-		lptr->agbno = agbno;
-		lptr->prev_agbno = NULLAGBLOCK;
-		lptr->prev_buf_p = NULL;
-		/*
-		 * initialize block header
-		 */
-		bt_hdr = XFS_BUF_TO_ALLOC_BLOCK(lptr->buf_p);
-		bzero(bt_hdr, mp->m_sb.sb_blocksize);
-
-		INT_SET(bt_hdr->bb_magic, ARCH_CONVERT, magic);
-		INT_SET(bt_hdr->bb_level, ARCH_CONVERT, i);
-		INT_SET(bt_hdr->bb_leftsib, ARCH_CONVERT,
-				bt_hdr->bb_rightsib = NULLAGBLOCK);
-		INT_ZERO(bt_hdr->bb_numrecs, ARCH_CONVERT);
-	}
-	/*
-	 * run along leaf, setting up records.  as we have to switch
-	 * blocks, call the prop_freespace_cursor routine to set up the new
-	 * pointers for the parent.  that can recurse up to the root
-	 * if required.  set the sibling pointers for leaf level here.
-	 */
+	btree_curs->count = 0;
 	if (magic == XFS_ABTB_MAGIC)
-		ext_ptr = findfirst_bno_extent(agno);
+		btree_curs->ext_ptr = findfirst_bno_extent(agno);
 	else 
-		ext_ptr = findfirst_bcnt_extent(agno);
-
-#ifdef XR_BLD_FREE_TRACE
-	fprintf(stderr, "bft, agno = %d, start = %u, count = %u\n",
-		agno, ext_ptr->ex_startblock, ext_ptr->ex_blockcount);
-#endif
-
-	lptr = &btree_curs->level[0];
-
-	for (i = 0; i < btree_curs->level[0].num_blocks; i++)  {
-		/*
-		 * block initialization, lay in block header
-		 */
-		bt_hdr = XFS_BUF_TO_ALLOC_BLOCK(lptr->buf_p);
-		bzero(bt_hdr, mp->m_sb.sb_blocksize);
-
-		INT_SET(bt_hdr->bb_magic, ARCH_CONVERT, magic);
-		INT_ZERO(bt_hdr->bb_level, ARCH_CONVERT);
-		INT_SET(bt_hdr->bb_leftsib, ARCH_CONVERT, lptr->prev_agbno);
-		INT_SET(bt_hdr->bb_rightsib, ARCH_CONVERT, NULLAGBLOCK);
-		INT_SET(bt_hdr->bb_numrecs, ARCH_CONVERT,
-				lptr->num_recs_pb + (lptr->modulo > 0));
-#ifdef XR_BLD_FREE_TRACE
-		fprintf(stderr, "bft, bb_numrecs = %d\n",
-				INT_GET(bt_hdr->bb_numrecs, ARCH_CONVERT));
-#endif
+		btree_curs->ext_ptr = findfirst_bcnt_extent(agno);
 
-		if (lptr->modulo > 0)
-			lptr->modulo--;
+	if (libxfs_bload(bl))
+		do_error("couldn't write %s btree for ag %u\n",
+			magic == XFS_ABTB_MAGIC ? "bno" : "bcnt", agno);
 
-		/*
-		 * initialize values in the path up to the root if
-		 * this is a multi-level btree
-		 */
-		if (btree_curs->num_levels > 1)
-			prop_freespace_cursor(mp, agno, btree_curs,
-					ext_ptr->ex_startblock,
-					ext_ptr->ex_blockcount,
-					0, magic);
-
-		bt_rec = (xfs_alloc_rec_t *) ((char *) bt_hdr +
-						sizeof(xfs_alloc_block_t));
-		for (j = 0; j < INT_GET(bt_hdr->bb_numrecs,ARCH_CONVERT); j++) {
-			ASSERT(ext_ptr != NULL);
-			INT_SET(bt_rec[j].ar_startblock, ARCH_CONVERT,
-				ext_ptr->ex_startblock);
-			INT_SET(bt_rec[j].ar_blockcount, ARCH_CONVERT,
-				ext_ptr->ex_blockcount);
-			freeblks += ext_ptr->ex_blockcount;
-			if (magic == XFS_ABTB_MAGIC)
-				ext_ptr = findnext_bno_extent(ext_ptr);
-			else
-				ext_ptr = findnext_bcnt_extent(agno, ext_ptr);
-#if 0
-#ifdef XR_BLD_FREE_TRACE
-			if (ext_ptr == NULL)
-				fprintf(stderr, "null extent pointer, j = %d\n",
-					j);
-			else
-				fprintf(stderr,
-				"bft, agno = %d, start = %u, count = %u\n",
-					agno, ext_ptr->ex_startblock,
-					ext_ptr->ex_blockcount);
-#endif
-#endif
-		}
+	ASSERT(btree_curs->ext_ptr == NULL);
 
-		if (ext_ptr != NULL)  {
-			/*
-			 * get next leaf level block
-			 */
-			if (lptr->prev_buf_p != NULL)  {
-#ifdef XR_BLD_FREE_TRACE
-				fprintf(stderr, " writing fst agbno %u\n",
-					lptr->prev_agbno);
-#endif
-				ASSERT(lptr->prev_agbno != NULLAGBLOCK);
-				libxfs_writebuf(lptr->prev_buf_p, 0);
-			}
-			lptr->prev_buf_p = lptr->buf_p;
-			lptr->prev_agbno = lptr->agbno;
-
-			INT_SET(bt_hdr->bb_rightsib, ARCH_CONVERT, lptr->agbno =
-				get_next_blockaddr(agno, 0, btree_curs));
-
-			lptr->buf_p = libxfs_getbuf(mp->m_dev,
-					XFS_AGB_TO_DADDR(mp, agno, lptr->agbno),
-					XFS_FSB_TO_BB(mp, 1));
-		}
-	}
-
-	return(freeblks);
+	return(btree_curs->count);
 }
 
-/*
- * no-cursor versions of the XFS equivalents.  The address calculators
- * should be used only for interior btree nodes.
- * these are adapted from xfs_ialloc_btree.h and xfs_tree.h
- */
-#define XR_INOBT_KEY_ADDR(mp, bp, i) \
-	(xfs_inobt_key_t *) ((char *) (bp) + sizeof(xfs_inobt_block_t) \
-				+ ((i)-1) * sizeof(xfs_inobt_key_t))
-
-#define XR_INOBT_PTR_ADDR(mp, bp, i) \
-	(xfs_inobt_ptr_t *) ((char *) (bp) + sizeof(xfs_inobt_block_t) \
-			+ (mp)->m_inobt_mxr[1] * sizeof(xfs_inobt_key_t) \
-			+ ((i)-1) * sizeof(xfs_inobt_ptr_t))
-
-#define XR_INOBT_BLOCK_MAXRECS(mp, level) \
-			XFS_BTREE_BLOCK_MAXRECS((mp)->m_sb.sb_blocksize, \
-						xfs_inobt, (level) == 0)
-
 /*
  * we don't have to worry here about how chewing up free extents
  * may perturb things because inode tree building happens before
@@ -905,38 +595,18 @@ init_ino_cursor(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *btree_curs,
 	__uint64_t		nfinos;
 	ino_tree_node_t		*ino_rec;
 	int			num_recs;
-	int			level;
-	bt_stat_level_t		*lptr;
-	bt_stat_level_t		*p_lptr;
-	xfs_extlen_t		blocks_allocated;
 	int			i;
 
 	*num_inos = *num_free_inos = 0;
 	ninos = nfinos = 0;
 
-	lptr = &btree_curs->level[0];
+	init_bload(mp, agno, btree_curs, XFS_IBT_MAGIC);
 	btree_curs->init = 1;
 
-	if ((ino_rec = findfirst_inode_rec(agno)) == NULL)  {
-		/*
-		 * easy corner-case -- no inode records
-		 */
-		lptr->num_blocks = 1;
-		lptr->modulo = 0;
-		lptr->num_recs_pb = 0;
-		lptr->num_recs_tot = 0;
-
-		btree_curs->num_levels = 1;
-		btree_curs->num_tot_blocks = btree_curs->num_free_blocks = 1;
-
-		setup_cursor(mp, agno, btree_curs);
-
-		return;
-	}
-
 	/*
 	 * build up statistics
 	 */
+	ino_rec = findfirst_inode_rec(agno);
 	for (num_recs = 0; ino_rec != NULL; ino_rec = next_ino_rec(ino_rec))  {
 		ninos += XFS_INODES_PER_CHUNK;
 		num_recs++;
@@ -947,35 +617,12 @@ init_ino_cursor(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *btree_curs,
 		}
 	}
 
-	blocks_allocated = lptr->num_blocks = howmany(num_recs,
-					XR_INOBT_BLOCK_MAXRECS(mp, 0));
-
-	lptr->modulo = num_recs % lptr->num_blocks;
-	lptr->num_recs_pb = num_recs / lptr->num_blocks;
-	lptr->num_recs_tot = num_recs;
-	level = 1;
-
-	if (lptr->num_blocks > 1)  {
-		for (; btree_curs->level[level-1].num_blocks > 1
-				&& level < XFS_BTREE_MAXLEVELS;
-				level++)  {
-			lptr = &btree_curs->level[level];
-			p_lptr = &btree_curs->level[level - 1];
-			lptr->num_blocks = howmany(p_lptr->num_blocks,
-				XR_INOBT_BLOCK_MAXRECS(mp, level));
-			lptr->modulo = p_lptr->num_blocks % lptr->num_blocks;
-			lptr->num_recs_pb = p_lptr->num_blocks
-					/ lptr->num_blocks;
-			lptr->num_recs_tot = p_lptr->num_blocks;
-
-			blocks_allocated += lptr->num_blocks;
-		}
-	}
-	ASSERT(lptr->num_blocks == 1);
-	btree_curs->num_levels = level;
-
-	btree_curs->num_tot_blocks = btree_curs->num_free_blocks
-			= blocks_allocated;
+	/*
+	 * no inode records is the easy corner-case -- a single
+	 * empty leaf
+	 */
+	btree_curs->num_tot_blocks = btree_curs->num_free_blocks =
+			libxfs_bload_geometry(&btree_curs->bload, num_recs);
 
 	setup_cursor(mp, agno, btree_curs);
 
@@ -985,90 +632,6 @@ init_ino_cursor(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *btree_curs,
 	return;
 }
 
-void
-prop_ino_cursor(xfs_mount_t *mp, xfs_agnumber_t agno, bt_status_t *btree_curs,
-	xfs_agino_t startino, int level)
-{
-	xfs_inobt_block_t	*bt_hdr;
-	xfs_inobt_key_t		*bt_key;
-	xfs_inobt_ptr_t		*bt_ptr;
-	xfs_agblock_t		agbno;
-	bt_stat_level_t		*lptr;
-
-	level++;
-
-	if (level >= btree_curs->num_levels)
-		return;
-
-	lptr = &btree_curs->level[level];
-	bt_hdr = XFS_BUF_TO_INOBT_BLOCK(lptr->buf_p);
-
-	if (INT_GET(bt_hdr->bb_numrecs, ARCH_CONVERT) == 0)  {
-		/*
-		 * this only happens once to initialize the
-		 * first path up the left side of the tree
-		 * where the agbno's are already set up
-		 */
-		prop_ino_cursor(mp, agno, btree_curs, startino, level);
-	}
-
-	if (INT_GET(bt_hdr->bb_numrecs, ARCH_CONVERT) ==
-				lptr->num_recs_pb + (lptr->modulo > 0))  {
-		/*
-		 * write out current prev block, grab us a new block,
-		 * and set the rightsib pointer of current block
-		 */
-#ifdef XR_BLD_INO_TRACE
-		fprintf(stderr, " ino prop agbno %d ", lptr->prev_agbno);
-#endif
-		if (lptr->prev_agbno != NULLAGBLOCK)  {
-			ASSERT(lptr->prev_buf_p != NULL);
-			libxfs_writebuf(lptr->prev_buf_p, 0);
-		}
-		lptr->prev_agbno = lptr->agbno;;
-		lptr->prev_buf_p = lptr->buf_p;
-		agbno = get_next_blockaddr(agno, level, btree_curs);
-
-		INT_SET(bt_hdr->bb_rightsib, ARCH_CONVERT, agbno);
-
-		lptr->buf_p = libxfs_getbuf(mp->m_dev,
-					XFS_AGB_TO_DADDR(mp, agno, agbno),
-					XFS_FSB_TO_BB(mp, 1));
-		lptr->agbno = agbno;
-
-		if (lptr->modulo)
-			lptr->modulo--;
-
-		/*
-		 * initialize block header
-		 */
-		bt_hdr = XFS_BUF_TO_INOBT_BLOCK(lptr->buf_p);
-		bzero(bt_hdr, mp->m_sb.sb_blocksize);
-
-		INT_SET(bt_hdr->bb_magic, ARCH_CONVERT, XFS_IBT_MAGIC);
-		INT_SET(bt_hdr->bb_level, ARCH_CONVERT, level);
-		INT_SET(bt_hdr->bb_leftsib, ARCH_CONVERT, lptr->prev_agbno);
-		INT_SET(bt_hdr->bb_rightsib, ARCH_CONVERT, NULLAGBLOCK);
-		INT_ZERO(bt_hdr->bb_numrecs, ARCH_CONVERT);
-		/*
-		 * propagate extent record for first extent in new block up
-		 */
-		prop_ino_cursor(mp, agno, btree_curs, startino, level);
-	}
-	/*
-	 * add inode info to current block
-	 */
-	INT_MOD(bt_hdr->bb_numrecs, ARCH_CONVERT, +1);
-
-	bt_key = XR_INOBT_KEY_ADDR(mp, bt_hdr,
-			INT_GET(bt_hdr->bb_numrecs, ARCH_CONVERT));
-	bt_ptr = XR_INOBT_PTR_ADDR(mp, bt_hdr,
-			INT_GET(bt_hdr->bb_numrecs, ARCH_CONVERT));
-
-	INT_SET(bt_key->ir_startino, ARCH_CONVERT, startino);
-	INT_SET(*bt_ptr, ARCH_CONVERT, btree_curs->level[level-1].agbno);
-}
-
 void
 build_agi(xfs_mount_t *mp, xfs_agnumber_t agno,
 		bt_status_t *btree_curs, xfs_agino_t first_agino,
@@ -1093,8 +656,8 @@ build_agi(xfs_mount_t *mp, xfs_agnumber_t agno,
 		INT_SET(agi->agi_length, ARCH_CONVERT, mp->m_sb.sb_dblocks -
 			(xfs_drfsbno_t) mp->m_sb.sb_agblocks * agno);
 	INT_SET(agi->agi_count, ARCH_CONVERT, count);
-	INT_SET(agi->agi_root, ARCH_CONVERT, btree_curs->root);
-	INT_SET(agi->agi_level, ARCH_CONVERT, btree_curs->num_levels);
+	INT_SET(agi->agi_root, ARCH_CONVERT, btree_curs->bload.bl_root);
+	INT_SET(agi->agi_level, ARCH_CONVERT, btree_curs->bload.bl_nlevels);
 	INT_SET(agi->agi_freecount, ARCH_CONVERT, freecount);
 	INT_SET(agi->agi_newino, ARCH_CONVERT, first_agino);
 	INT_SET(agi->agi_dirino, ARCH_CONVERT, NULLAGINO);
@@ -1106,6 +669,43 @@ build_agi(xfs_mount_t *mp, xfs_agnumber_t agno,
 	libxfs_writebuf(agi_buf, 0);
 }
 
+/*
+ * bulk loader record source for the inode tree
+ */
+static int
+get_ino_rec(void *priv, void *rec, void *key)
+{
+	bt_status_t		*btree_curs = priv;
+	ino_tree_node_t		*ino_rec = btree_curs->ino_rec;
+	xfs_inobt_rec_t		*bt_rec = rec;
+	xfs_inobt_key_t		*bt_key = key;
+	int			inocnt;
+	int			k;
+
+	if (ino_rec == NULL)
+		return(0);
+
+	INT_SET(bt_rec->ir_startino, ARCH_CONVERT, ino_rec->ino_startnum);
+	INT_SET(bt_rec->ir_free, ARCH_CONVERT, ino_rec->ir_free);
+
+	inocnt = 0;
+	for (k = 0; k < sizeof(xfs_inofree_t)*NBBY; k++)  {
+		ASSERT(is_inode_confirmed(ino_rec, k));
+		inocnt += is_inode_free(ino_rec, k);
+	}
+	INT_SET(bt_rec->ir_freecount, ARCH_CONVERT, inocnt);
+
+	if (bt_key != NULL)
+		INT_SET(bt_key->ir_startino, ARCH_CONVERT,
+			ino_rec->ino_startnum);
+
+	btree_curs->freecount += inocnt;
+	btree_curs->count += XFS_INODES_PER_CHUNK;
+	btree_curs->ino_rec = next_ino_rec(ino_rec);
+
+	return(1);
+}
+
 /*
  * rebuilds an inode tree given a cursor.  We're lazy here and call
  * the routine that builds the agi
@@ -1114,128 +714,29 @@ void
 build_ino_tree(xfs_mount_t *mp, xfs_agnumber_t agno,
 		bt_status_t *btree_curs)
 {
-	xfs_agnumber_t		i;
-	xfs_agblock_t		j;
-	xfs_agblock_t		agbno;
+	libxfs_bload_t		*bl = &btree_curs->bload;
 	xfs_agino_t		first_agino;
-	xfs_inobt_block_t	*bt_hdr;
-	xfs_inobt_rec_t		*bt_rec;
-	ino_tree_node_t		*ino_rec;
-	bt_stat_level_t		*lptr;
-	xfs_agino_t		count = 0;
-	xfs_agino_t		freecount = 0;
-	int			inocnt;
-	int			k;
-	int			level = btree_curs->num_levels;
 
-	for (i = 0; i < level; i++)  {
-		lptr = &btree_curs->level[i];
+	ASSERT(bl->bl_nlevels > 0);
 
-		agbno = get_next_blockaddr(agno, i, btree_curs);
-		lptr->buf_p = libxfs_getbuf(mp->m_dev,
-					XFS_AGB_TO_DADDR(mp, agno, agbno),
-					XFS_FSB_TO_BB(mp, 1));
+	bl->bl_priv = btree_curs;
+	bl->bl_getrec = get_ino_rec;
 
-		if (i == btree_curs->num_levels - 1)
-			btree_curs->root = agbno;
-
-		lptr->agbno = agbno;
-		lptr->prev_agbno = NULLAGBLOCK;
-		lptr->prev_buf_p = NULL;
-		/*
-		 * initialize block header
-		 */
-		bt_hdr = XFS_BUF_TO_INOBT_BLOCK(lptr->buf_p);
-		bzero(bt_hdr, mp->m_sb.sb_blocksize);
-
-		INT_SET(bt_hdr->bb_magic, ARCH_CONVERT, XFS_IBT_MAGIC);
-		INT_SET(bt_hdr->bb_level, ARCH_CONVERT, i);
-		INT_SET(bt_hdr->bb_leftsib, ARCH_CONVERT,
-				bt_hdr->bb_rightsib = NULLAGBLOCK);
-		INT_ZERO(bt_hdr->bb_numrecs, ARCH_CONVERT);
-	}
-	/*
-	 * run along leaf, setting up records.  as we have to switch
-	 * blocks, call the prop_ino_cursor routine to set up the new
-	 * pointers for the parent.  that can recurse up to the root
-	 * if required.  set the sibling pointers for leaf level here.
-	 */
-	ino_rec = findfirst_inode_rec(agno);
+	btree_curs->ino_rec = findfirst_inode_rec(agno);
+	btree_curs->count = btree_curs->freecount = 0;
 
-	if (ino_rec != NULL)
-		first_agino = ino_rec->ino_startnum;
+	if (btree_curs->ino_rec != NULL)
+		first_agino = btree_curs->ino_rec->ino_startnum;
 	else
 		first_agino = NULLAGINO;
 
-	lptr = &btree_curs->level[0];
+	if (libxfs_bload(bl))
+		do_error("couldn't write inode btree for ag %u\n", agno);
 
-	for (i = 0; i < lptr->num_blocks; i++)  {
-		/*
-		 * block initialization, lay in block header
-		 */
-		bt_hdr = XFS_BUF_TO_INOBT_BLOCK(lptr->buf_p);
-		bzero(bt_hdr, mp->m_sb.sb_blocksize);
-
-		INT_SET(bt_hdr->bb_magic, ARCH_CONVERT, XFS_IBT_MAGIC);
-		INT_ZERO(bt_hdr->bb_level, ARCH_CONVERT);
-		INT_SET(bt_hdr->bb_leftsib, ARCH_CONVERT, lptr->prev_agbno);
-		INT_SET(bt_hdr->bb_rightsib, ARCH_CONVERT, NULLAGBLOCK);
-		INT_SET(bt_hdr->bb_numrecs, ARCH_CONVERT,
-				lptr->num_recs_pb + (lptr->modulo > 0));
-
-		if (lptr->modulo > 0)
-			lptr->modulo--;
-
-		if (lptr->num_recs_pb > 0)
-			prop_ino_cursor(mp, agno, btree_curs,
-					ino_rec->ino_startnum, 0);
-
-		bt_rec = (xfs_inobt_rec_t *) ((char *) bt_hdr +
-						sizeof(xfs_inobt_block_t));
-		for (j = 0; j < INT_GET(bt_hdr->bb_numrecs,ARCH_CONVERT); j++) {
-			ASSERT(ino_rec != NULL);
-			INT_SET(bt_rec[j].ir_startino, ARCH_CONVERT,
-					ino_rec->ino_startnum);
-			INT_SET(bt_rec[j].ir_free, ARCH_CONVERT,
-					ino_rec->ir_free);
-
-			inocnt = 0;
-			for (k = 0; k < sizeof(xfs_inofree_t)*NBBY; k++)  {
-				ASSERT(is_inode_confirmed(ino_rec, k));
-				inocnt += is_inode_free(ino_rec, k);
-			}
-
-			INT_SET(bt_rec[j].ir_freecount, ARCH_CONVERT, inocnt);
-			freecount += inocnt;
-			count += XFS_INODES_PER_CHUNK;
-			ino_rec = next_ino_rec(ino_rec);
-		}
-
-		if (ino_rec != NULL)  {
-			/*
-			 * get next leaf level block
-			 */
-			if (lptr->prev_buf_p != NULL)  {
-#ifdef XR_BLD_INO_TRACE
-				fprintf(stderr, "writing inobt agbno %u\n",
-					lptr->prev_agbno);
-#endif
-				ASSERT(lptr->prev_agbno != NULLAGBLOCK);
-				libxfs_writebuf(lptr->prev_buf_p, 0);
-			}
-			lptr->prev_buf_p = lptr->buf_p;
-			lptr->prev_agbno = lptr->agbno;
-
-			INT_SET(bt_hdr->bb_rightsib, ARCH_CONVERT, lptr->agbno=
-				get_next_blockaddr(agno, 0, btree_curs));
-
-			lptr->buf_p = libxfs_getbuf(mp->m_dev,
-					XFS_AGB_TO_DADDR(mp, agno, lptr->agbno),
-					XFS_FSB_TO_BB(mp, 1));
-		}
-	}
+	ASSERT(btree_curs->ino_rec == NULL);
 
-	build_agi(mp, agno, btree_curs, first_agino, count, freecount);
+	build_agi(mp, agno, btree_curs, first_agino, btree_curs->count,
+		btree_curs->freecount);
 }
 
 /*
@@ -1281,12 +782,14 @@ build_agf_agfl(xfs_mount_t	*mp,
 		INT_SET(agf->agf_length, ARCH_CONVERT, mp->m_sb.sb_dblocks -
 			(xfs_drfsbno_t) mp->m_sb.sb_agblocks * agno);
 
-	INT_SET(agf->agf_roots[XFS_BTNUM_BNO], ARCH_CONVERT, bno_bt->root);
+	INT_SET(agf->agf_roots[XFS_BTNUM_BNO], ARCH_CONVERT,
+			bno_bt->bload.bl_root);
 	INT_SET(agf->agf_levels[XFS_BTNUM_BNO], ARCH_CONVERT,
-			bno_bt->num_levels);
-	INT_SET(agf->agf_roots[XFS_BTNUM_CNT], ARCH_CONVERT, bcnt_bt->root);
+			bno_bt->bload.bl_nlevels);
+	INT_SET(agf->agf_roots[XFS_BTNUM_CNT], ARCH_CONVERT,
+			bcnt_bt->bload.bl_root);
 	INT_SET(agf->agf_levels[XFS_BTNUM_CNT], ARCH_CONVERT,
-			bcnt_bt->num_levels);
+			bcnt_bt->bload.bl_nlevels);
 	INT_SET(agf->agf_freeblks, ARCH_CONVERT, freeblks);
 
 #ifdef XR_BLD_FREE_TRACE
@@ -1453,10 +956,6 @@ phase5(xfs_mount_t *mp)
 		XFS_BTREE_BLOCK_MAXRECS(mp->m_sb.sb_blocksize, xfs_inobt, 1),
 		XFS_BTREE_BLOCK_MINRECS(mp->m_sb.sb_blocksize, xfs_inobt, 1)
 		);
-	fprintf(stderr, "xr inobt level 0 (leaf), maxrec = %d\n",
-		XR_INOBT_BLOCK_MAXRECS(mp, 0));
-	fprintf(stderr, "xr inobt level 1 (int), maxrec = %d\n",
-		XR_INOBT_BLOCK_MAXRECS(mp, 1));
 	fprintf(stderr, "bnobt level 1, maxrec = %d, minrec = %d\n",
 		XFS_BTREE_BLOCK_MAXRECS(mp->m_sb.sb_blocksize, xfs_alloc, 0),
 		XFS_BTREE_BLOCK_MINRECS(mp->m_sb.sb_blocksize, xfs_alloc, 0));
@@ -1582,11 +1081,9 @@ phase5(xfs_mount_t *mp)
 #ifdef XR_BLD_FREE_TRACE
 		fprintf(stderr, "# of free blocks == %d\n", freeblks1);
 #endif
-		write_cursor(&bno_btree_curs);
 
 		freeblks2 = build_freespace_tree(mp, agno, &bcnt_btree_curs,
 					XFS_ABTC_MAGIC);
-		write_cursor(&bcnt_btree_curs);
 
 		ASSERT(freeblks1 == freeblks2);
 
@@ -1599,7 +1096,6 @@ phase5(xfs_mount_t *mp)
 		 * build inode allocation tree.  this also build the agi
 		 */
 		build_ino_tree(mp, agno, &ino_btree_curs);
-		write_cursor(&ino_btree_curs);
 		/*
 		 * tear down cursors
 		 */
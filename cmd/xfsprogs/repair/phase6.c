@@ -43,6 +43,10 @@
 #include "err_protos.h"
 #include "dinode.h"
 #include "versions.h"
+#include "prefetch.h"
+#include "arena.h"
+#include "bptree.h"
+#include "threads.h"
 
 static cred_t zerocr;
 static int orphanage_entered;
@@ -59,6 +63,7 @@ typedef struct dir_hash_ent {
 } dir_hash_ent_t;
 
 typedef struct dir_hash_tab {
+	arena_t			arena;	/* entries, freed all at once */
 	int			size;	/* size of hash table */
 	dir_hash_ent_t		*tab[1];/* actual hash table, variable size */
 } dir_hash_tab_t;
@@ -66,6 +71,9 @@ typedef struct dir_hash_tab {
 	(offsetof(dir_hash_tab_t, tab) + (sizeof(dir_hash_ent_t *) * (n)))
 #define	DIR_HASH_FUNC(t,a)	((a) % (t)->size)
 
+static arena_stats_t	dir_hash_stats = ARENA_STATS_INIT(
+				"directory hash entries", dir_hash_ent_t);
+
 /*
  * Track the contents of the freespace table in a directory.
  */
@@ -80,6 +88,58 @@ typedef struct freetab {
 #define	FREETAB_SIZE(n)	\
 	(offsetof(freetab_t, ents) + (sizeof(struct freetab_ent) * (n)))
 
+static freetab_t *
+freetab_alloc(
+	xfs_mount_t	*mp,
+	xfs_inode_t	*ip)
+{
+	freetab_t	*freetab;
+	int		i;
+
+	freetab = malloc(FREETAB_SIZE(ip->i_d.di_size / mp->m_dirblksize));
+	if (!freetab) {
+		do_error("malloc failed in freetab_alloc (%u bytes)\n",
+			FREETAB_SIZE(ip->i_d.di_size / mp->m_dirblksize));
+		exit(1);
+	}
+	freetab->naents = ip->i_d.di_size / mp->m_dirblksize;
+	freetab->nents = 0;
+	for (i = 0; i < freetab->naents; i++) {
+		freetab->ents[i].v = NULLDATAOFF;
+		freetab->ents[i].s = 0;
+	}
+	return freetab;
+}
+
+/*
+ * make room for data block db in the freespace table
+ */
+static void
+freetab_extend(
+	freetab_t		**freetabp,
+	xfs_dir2_db_t		db)
+{
+	freetab_t		*freetab = *freetabp;
+	struct freetab_ent	e;
+	int			i;
+
+	if (freetab->naents <= db) {
+		*freetabp = freetab = realloc(freetab, FREETAB_SIZE(db + 1));
+		if (!freetab) {
+			do_error("realloc failed in freetab_extend (%u bytes)\n",
+				FREETAB_SIZE(db + 1));
+			exit(1);
+		}
+		e.v = NULLDATAOFF;
+		e.s = 0;
+		for (i = freetab->naents; i < db; i++)
+			freetab->ents[i] = e;
+		freetab->naents = db + 1;
+	}
+	if (freetab->nents < db + 1)
+		freetab->nents = db + 1;
+}
+
 #define	DIR_HASH_CK_OK		0
 #define	DIR_HASH_CK_DUPLEAF	1
 #define	DIR_HASH_CK_BADHASH	2
@@ -98,11 +158,7 @@ dir_hash_add(
 	dir_hash_ent_t		*p;
 
 	i = DIR_HASH_FUNC(hashtab, addr);
-	if ((p = malloc(sizeof(*p))) == NULL) {
-		do_error("malloc failed in dir_hash_add (%u bytes)\n",
-			sizeof(*p));
-		exit(1);
-	}
+	p = arena_alloc(&hashtab->arena);
 	p->next = hashtab->tab[i];
 	hashtab->tab[i] = p;
 	if (!(p->junkit = junk))
@@ -131,7 +187,8 @@ static int
 dir_hash_check(
 	dir_hash_tab_t	*hashtab,
 	xfs_inode_t	*ip,
-	int		seeval)
+	int		seeval,
+	int		quiet)
 {
 	static char	*seevalstr[] = {
 		"ok",
@@ -146,6 +203,8 @@ dir_hash_check(
 		seeval = DIR_HASH_CK_NOLEAF;
 	if (seeval == DIR_HASH_CK_OK)
 		return 0;
+	if (quiet)
+		return 1;
 	do_warn("bad hash table for directory inode %llu (%s): ", ip->i_ino,
 		seevalstr[seeval]);
 	if (!no_modify)
@@ -159,16 +218,7 @@ static void
 dir_hash_done(
 	dir_hash_tab_t	*hashtab)
 {
-	int		i;
-	dir_hash_ent_t	*n;
-	dir_hash_ent_t	*p;
-
-	for (i = 0; i < hashtab->size; i++) {
-		for (p = hashtab->tab[i]; p; p = n) {
-			n = p->next;
-			free(p);
-		}
-	}
+	arena_reset(&hashtab->arena);
 	free(hashtab);
 }
 
@@ -189,6 +239,7 @@ dir_hash_init(
 		exit(1);
 	}
 	hashtab->size = hsize;
+	arena_init(&hashtab->arena, &dir_hash_stats, hsize);
 	return hashtab;
 }
 
@@ -1677,6 +1728,58 @@ dir2_kill_block(
 	libxfs_trans_commit(tp, 0, 0);
 }
 
+/*
+ * find the end of the entries in a data block and step over them
+ * without looking inside.  returns 1 if the entries and free spaces
+ * tile the block exactly, 0 if the block is corrupt.
+ */
+static int
+longform_dir2_data_walk(
+	xfs_mount_t		*mp,
+	xfs_dir2_data_t		*d,
+	int			isblock,
+	char			**endptrp)
+{
+	xfs_dir2_leaf_entry_t	*blp;
+	xfs_dir2_block_tail_t	*btp;
+	xfs_dir2_data_entry_t	*dep;
+	xfs_dir2_data_unused_t	*dup;
+	char			*endptr;
+	char			*ptr;
+
+	if (isblock) {
+		btp = XFS_DIR2_BLOCK_TAIL_P(mp, d);
+		blp = XFS_DIR2_BLOCK_LEAF_P_ARCH(btp, ARCH_CONVERT);
+		endptr = (char *)blp;
+		if (endptr > (char *)btp)
+			endptr = (char *)btp;
+	} else
+		endptr = (char *)d + mp->m_dirblksize;
+	*endptrp = endptr;
+	ptr = (char *)d->u;
+	while (ptr < endptr) {
+		dup = (xfs_dir2_data_unused_t *)ptr;
+		if (INT_GET(dup->freetag, ARCH_CONVERT) == XFS_DIR2_DATA_FREE_TAG) {
+			if (ptr + INT_GET(dup->length, ARCH_CONVERT) > endptr || INT_GET(dup->length, ARCH_CONVERT) == 0 ||
+			    (INT_GET(dup->length, ARCH_CONVERT) & (XFS_DIR2_DATA_ALIGN - 1)))
+				break;
+			if (INT_GET(*XFS_DIR2_DATA_UNUSED_TAG_P_ARCH(dup, ARCH_CONVERT), ARCH_CONVERT) != 
+			    (char *)dup - (char *)d)
+				break;
+			ptr += INT_GET(dup->length, ARCH_CONVERT);
+			if (ptr >= endptr)
+				break;
+		}
+		dep = (xfs_dir2_data_entry_t *)ptr;
+		if (ptr + XFS_DIR2_DATA_ENTSIZE(dep->namelen) > endptr)
+			break;
+		if (INT_GET(*XFS_DIR2_DATA_ENTRY_TAG_P(dep), ARCH_CONVERT) != (char *)dep - (char *)d)
+			break;
+		ptr += XFS_DIR2_DATA_ENTSIZE(dep->namelen);
+	}
+	return ptr == endptr;
+}
+
 /*
  * process a data block, also checks for .. entry
  * and corrects it to match what we think .. should be
@@ -1697,9 +1800,7 @@ longform_dir2_entry_check_data(
 	int			isblock)
 {
 	xfs_dir2_dataptr_t	addr;
-	xfs_dir2_leaf_entry_t	*blp;
 	xfs_dabuf_t		*bp;
-	xfs_dir2_block_tail_t	*btp;
 	int			committed;
 	xfs_dir2_data_t		*d;
 	xfs_dir2_db_t		db;
@@ -1711,7 +1812,6 @@ longform_dir2_entry_check_data(
 	xfs_bmap_free_t		flist;
 	char			fname[MAXNAMELEN + 1];
 	freetab_t		*freetab;
-	int			i;
 	int			ino_offset;
 	ino_tree_node_t		*irec;
 	int			junkit;
@@ -1727,61 +1827,13 @@ longform_dir2_entry_check_data(
 
 	bp = *bpp;
 	d = bp->data;
-	ptr = (char *)d->u;
 	nbad = 0;
 	needscan = needlog = 0;
-	freetab = *freetabp;
-	if (isblock) {
-		btp = XFS_DIR2_BLOCK_TAIL_P(mp, d);
-		blp = XFS_DIR2_BLOCK_LEAF_P_ARCH(btp, ARCH_CONVERT);
-		endptr = (char *)blp;
-		if (endptr > (char *)btp)
-			endptr = (char *)btp;
-		wantmagic = XFS_DIR2_BLOCK_MAGIC;
-	} else {
-		endptr = (char *)d + mp->m_dirblksize;
-		wantmagic = XFS_DIR2_DATA_MAGIC;
-	}
+	wantmagic = isblock ? XFS_DIR2_BLOCK_MAGIC : XFS_DIR2_DATA_MAGIC;
 	db = XFS_DIR2_DA_TO_DB(mp, da_bno);
-	if (freetab->naents <= db) {
-		struct freetab_ent e;
-
-		*freetabp = freetab = realloc(freetab, FREETAB_SIZE(db + 1));
-		if (!freetab) {
-			do_error(
-		"realloc failed in longform_dir2_entry_check_data (%u bytes)\n",
-				FREETAB_SIZE(db + 1));
-			exit(1);
-		}
-		e.v = NULLDATAOFF;
-		e.s = 0;
-		for (i = freetab->naents; i < db; i++)
-			freetab->ents[i] = e;
-		freetab->naents = db + 1;
-	}
-	if (freetab->nents < db + 1)
-		freetab->nents = db + 1;
-	while (ptr < endptr) {
-		dup = (xfs_dir2_data_unused_t *)ptr;
-		if (INT_GET(dup->freetag, ARCH_CONVERT) == XFS_DIR2_DATA_FREE_TAG) {
-			if (ptr + INT_GET(dup->length, ARCH_CONVERT) > endptr || INT_GET(dup->length, ARCH_CONVERT) == 0 ||
-			    (INT_GET(dup->length, ARCH_CONVERT) & (XFS_DIR2_DATA_ALIGN - 1)))
-				break;
-			if (INT_GET(*XFS_DIR2_DATA_UNUSED_TAG_P_ARCH(dup, ARCH_CONVERT), ARCH_CONVERT) != 
-			    (char *)dup - (char *)d)
-				break;
-			ptr += INT_GET(dup->length, ARCH_CONVERT);
-			if (ptr >= endptr)
-				break;
-		}
-		dep = (xfs_dir2_data_entry_t *)ptr;
-		if (ptr + XFS_DIR2_DATA_ENTSIZE(dep->namelen) > endptr)
-			break;
-		if (INT_GET(*XFS_DIR2_DATA_ENTRY_TAG_P(dep), ARCH_CONVERT) != (char *)dep - (char *)d)
-			break;
-		ptr += XFS_DIR2_DATA_ENTSIZE(dep->namelen);
-	}
-	if (ptr != endptr) {
+	freetab_extend(freetabp, db);
+	freetab = *freetabp;
+	if (!longform_dir2_data_walk(mp, d, isblock, &endptr)) {
 		do_warn("corrupt block %u in directory inode %llu: ",
 			da_bno, ip->i_ino);
 		if (!no_modify) {
@@ -2033,7 +2085,8 @@ longform_dir2_check_leaf(
 	xfs_mount_t		*mp,
 	xfs_inode_t		*ip,
 	dir_hash_tab_t		*hashtab,
-	freetab_t		*freetab)
+	freetab_t		*freetab,
+	int			quiet)
 {
 	int			badtail;
 	xfs_dir2_data_off_t	*bestsp;
@@ -2058,14 +2111,15 @@ longform_dir2_check_leaf(
 	    INT_GET(leaf->hdr.count, ARCH_CONVERT) < INT_GET(leaf->hdr.stale, ARCH_CONVERT) ||
 	    INT_GET(leaf->hdr.count, ARCH_CONVERT) > XFS_DIR2_MAX_LEAF_ENTS(mp) ||
 	    (char *)&leaf->ents[INT_GET(leaf->hdr.count, ARCH_CONVERT)] > (char *)bestsp) {
-		do_warn("leaf block %u for directory inode %llu bad header\n",
-			da_bno, ip->i_ino);
+		if (!quiet)
+			do_warn("leaf block %u for directory inode %llu bad header\n",
+				da_bno, ip->i_ino);
 		libxfs_da_brelse(NULL, bp);
 		return 1;
 	}
 	seeval = dir_hash_see_all(hashtab, leaf->ents, INT_GET(leaf->hdr.count, ARCH_CONVERT),
 		INT_GET(leaf->hdr.stale, ARCH_CONVERT));
-	if (dir_hash_check(hashtab, ip, seeval)) {
+	if (dir_hash_check(hashtab, ip, seeval, quiet)) {
 		libxfs_da_brelse(NULL, bp);
 		return 1;
 	}
@@ -2075,8 +2129,9 @@ longform_dir2_check_leaf(
 		badtail = freetab->ents[i].v != INT_GET(bestsp[i], ARCH_CONVERT);
 	}
 	if (badtail) {
-		do_warn("leaf block %u for directory inode %llu bad tail\n",
-			da_bno, ip->i_ino);
+		if (!quiet)
+			do_warn("leaf block %u for directory inode %llu bad tail\n",
+				da_bno, ip->i_ino);
 		libxfs_da_brelse(NULL, bp);
 		return 1;
 	}
@@ -2093,7 +2148,8 @@ longform_dir2_check_node(
 	xfs_mount_t		*mp,
 	xfs_inode_t		*ip,
 	dir_hash_tab_t		*hashtab,
-	freetab_t		*freetab)
+	freetab_t		*freetab,
+	int			quiet)
 {
 	xfs_dabuf_t		*bp;
 	xfs_dablk_t		da_bno;
@@ -2124,17 +2180,19 @@ longform_dir2_check_node(
 				libxfs_da_brelse(NULL, bp);
 				continue;
 			}
-			do_warn("unknown magic number %#x for block %u in "
-				"directory inode %llu\n",
-				INT_GET(leaf->hdr.info.magic, ARCH_CONVERT), da_bno, ip->i_ino);
+			if (!quiet)
+				do_warn("unknown magic number %#x for block %u in "
+					"directory inode %llu\n",
+					INT_GET(leaf->hdr.info.magic, ARCH_CONVERT), da_bno, ip->i_ino);
 			libxfs_da_brelse(NULL, bp);
 			return 1;
 		}
 		if (INT_GET(leaf->hdr.count, ARCH_CONVERT) < INT_GET(leaf->hdr.stale, ARCH_CONVERT) ||
 		    INT_GET(leaf->hdr.count, ARCH_CONVERT) > XFS_DIR2_MAX_LEAF_ENTS(mp)) {
-			do_warn("leaf block %u for directory inode %llu bad "
-				"header\n",
-				da_bno, ip->i_ino);
+			if (!quiet)
+				do_warn("leaf block %u for directory inode %llu bad "
+					"header\n",
+					da_bno, ip->i_ino);
 			libxfs_da_brelse(NULL, bp);
 			return 1;
 		}
@@ -2144,7 +2202,7 @@ longform_dir2_check_node(
 		if (seeval != DIR_HASH_CK_OK)
 			return 1;
 	}
-	if (dir_hash_check(hashtab, ip, seeval))
+	if (dir_hash_check(hashtab, ip, seeval, quiet))
 		return 1;
 	for (da_bno = mp->m_dirfreeblk, next_da_bno = 0;
 	     next_da_bno != NULLFILEOFF;
@@ -2166,9 +2224,10 @@ longform_dir2_check_node(
 			(fdb - XFS_DIR2_FREE_FIRSTDB(mp)) *
 			XFS_DIR2_MAX_FREE_BESTS(mp) ||
 		    INT_GET(free->hdr.nvalid, ARCH_CONVERT) < INT_GET(free->hdr.nused, ARCH_CONVERT)) {
-			do_warn("free block %u for directory inode %llu bad "
-				"header\n",
-				da_bno, ip->i_ino);
+			if (!quiet)
+				do_warn("free block %u for directory inode %llu bad "
+					"header\n",
+					da_bno, ip->i_ino);
 			libxfs_da_brelse(NULL, bp);
 			return 1;
 		}
@@ -2176,9 +2235,10 @@ longform_dir2_check_node(
 			if (i + INT_GET(free->hdr.firstdb, ARCH_CONVERT) >= freetab->nents ||
 			    freetab->ents[i + INT_GET(free->hdr.firstdb, ARCH_CONVERT)].v !=
 			    INT_GET(free->bests[i], ARCH_CONVERT)) {
-				do_warn("free block %u entry %i for directory "
-					"ino %llu bad\n",
-					da_bno, i, ip->i_ino);
+				if (!quiet)
+					do_warn("free block %u entry %i for directory "
+						"ino %llu bad\n",
+						da_bno, i, ip->i_ino);
 				libxfs_da_brelse(NULL, bp);
 				return 1;
 			}
@@ -2186,9 +2246,10 @@ longform_dir2_check_node(
 			freetab->ents[i + INT_GET(free->hdr.firstdb, ARCH_CONVERT)].s = 1;
 		}
 		if (used != INT_GET(free->hdr.nused, ARCH_CONVERT)) {
-			do_warn("free block %u for directory inode %llu bad "
-				"nused\n",
-				da_bno, ip->i_ino);
+			if (!quiet)
+				do_warn("free block %u for directory inode %llu bad "
+					"nused\n",
+					da_bno, ip->i_ino);
 			libxfs_da_brelse(NULL, bp);
 			return 1;
 		}
@@ -2196,9 +2257,10 @@ longform_dir2_check_node(
 	}
 	for (i = 0; i < freetab->nents; i++) {
 		if (freetab->ents[i].s == 0) {
-			do_warn("missing freetab entry %u for directory inode "
-				"%llu\n",
-				i, ip->i_ino);
+			if (!quiet)
+				do_warn("missing freetab entry %u for directory inode "
+					"%llu\n",
+					i, ip->i_ino);
 			return 1;
 		}
 	}
@@ -2584,30 +2646,19 @@ longform_dir2_entry_check(xfs_mount_t	*mp,
 	xfs_dablk_t		da_bno;
 	freetab_t		*freetab;
 	dir_hash_tab_t		*hashtab;
-	int			i;
 	int			isblock;
 	int			isleaf;
 	xfs_fileoff_t		next_da_bno;
 	int			seeval;
 	int			fixit;
+	prefetch_t		*pf;
 
 	*need_dot = 1;
-	freetab = malloc(FREETAB_SIZE(ip->i_d.di_size / mp->m_dirblksize));
-	if (!freetab) {
-		do_error(
-		"malloc failed in longform_dir2_entry_check (%u bytes)\n",
-			FREETAB_SIZE(ip->i_d.di_size / mp->m_dirblksize));
-		exit(1);
-	}
-	freetab->naents = ip->i_d.di_size / mp->m_dirblksize;
-	freetab->nents = 0;
-	for (i = 0; i < freetab->naents; i++) {
-		freetab->ents[i].v = NULLDATAOFF;
-		freetab->ents[i].s = 0;
-	}
+	freetab = freetab_alloc(mp, ip);
 	libxfs_dir2_isblock(NULL, ip, &isblock);
 	libxfs_dir2_isleaf(NULL, ip, &isleaf);
 	hashtab = dir_hash_init(ip->i_d.di_size);
+	pf = prefetch_dir_blocks(mp, ip);
 	for (da_bno = 0, next_da_bno = 0;
 	     next_da_bno != NULLFILEOFF && da_bno < mp->m_dirleafblk;
 	     da_bno = (xfs_dablk_t)next_da_bno) {
@@ -2633,21 +2684,513 @@ longform_dir2_entry_check(xfs_mount_t	*mp,
 		btp = XFS_DIR2_BLOCK_TAIL_P(mp, block);
 		blp = XFS_DIR2_BLOCK_LEAF_P_ARCH(btp, ARCH_CONVERT);
 		seeval = dir_hash_see_all(hashtab, blp, INT_GET(btp->count, ARCH_CONVERT), INT_GET(btp->stale, ARCH_CONVERT));
-		if (dir_hash_check(hashtab, ip, seeval))
+		if (dir_hash_check(hashtab, ip, seeval, 0))
 			fixit |= 1;
 		libxfs_da_brelse(NULL, bp);
 	} else if (isleaf) {
-		fixit |= longform_dir2_check_leaf(mp, ip, hashtab, freetab);
+		fixit |= longform_dir2_check_leaf(mp, ip, hashtab, freetab, 0);
 	} else {
-		fixit |= longform_dir2_check_node(mp, ip, hashtab, freetab);
+		fixit |= longform_dir2_check_node(mp, ip, hashtab, freetab, 0);
 	}
 	dir_hash_done(hashtab);
+	/*
+	 * the rebuild builds new blocks in getbuf() buffers over the
+	 * old ones, so the readahead must be finished before it starts.
+	 */
+	prefetch_stop(pf);
 	if (!no_modify && fixit)
 		longform_dir2_rebuild(mp, ino, ip, num_illegal, freetab,
 			isblock);
 	free(freetab);
 }
 
+/*
+ * with more than one thread, the longform (version 2) directories
+ * are read ahead of the traversal, one AG per worker, to find the
+ * ones the traversal has nothing to fix in: every block sound, the
+ * hash and freespace tables right, and every entry pointing at an
+ * in-use inode (and for subdirectories, one whose .. points back).
+ * the workers change nothing on disk or in core.  each clean
+ * directory gets a summary holding the inode numbers its entries
+ * point to, and the traversal takes its references from that
+ * instead of reading the directory again.
+ *
+ * everything else goes through longform_dir2_entry_check() in the
+ * traversal as before, so all fixes, rebuilds and lost+found moves
+ * are still made one directory at a time.
+ *
+ * the entry lists are held to a share of physical memory per AG,
+ * directories past that just don't get a summary.
+ */
+typedef struct dir_summary {
+	avlnode_t		avl_node;
+	xfs_agino_t		ds_agino;
+	int			ds_nents;
+	xfs_ino_t		*ds_ents;
+} dir_summary_t;
+
+typedef struct dir_ents_blk {
+	struct dir_ents_blk	*next;
+	int			size;
+	int			used;
+	xfs_ino_t		ents[1];	/* variable size */
+} dir_ents_blk_t;
+#define	DIR_ENTS_BLK_SIZE(n)	\
+	(offsetof(dir_ents_blk_t, ents) + (sizeof(xfs_ino_t) * (n)))
+
+typedef struct dir_precheck {
+	bptree_desc_t		dp_tree;	/* dir_summary_t by agino */
+	arena_t			dp_arena;	/* the dir_summary_t's */
+	dir_ents_blk_t		*dp_blks;	/* entry lists */
+	__uint64_t		dp_budget;	/* bytes left for them */
+} dir_precheck_t;
+
+/*
+ * a worker's scratch lists for the directory it's checking
+ */
+typedef struct dir_ents {
+	xfs_ino_t		*ents;
+	int			nents;
+	int			maxents;
+	xfs_ino_t		*dirs;		/* the subdirectories */
+	int			ndirs;
+	int			maxdirs;
+} dir_ents_t;
+
+#define	DIR_ENTS_PER_BLK	8192
+#define	DIR_SUMMARIES_PER_BLK	1024
+#define	DIR_PRECHECK_MEM_FRAC	8
+
+static dir_precheck_t	*dir_prechecks;
+
+static arena_stats_t	dir_summary_stats = ARENA_STATS_INIT(
+				"directory summaries", dir_summary_t);
+
+static __psunsigned_t
+avl_dir_summary_start(avlnode_t *node)
+{
+	return((__psunsigned_t) ((dir_summary_t *) node)->ds_agino);
+}
+
+static __psunsigned_t
+avl_dir_summary_end(avlnode_t *node)
+{
+	return((__psunsigned_t) ((dir_summary_t *) node)->ds_agino + 1);
+}
+
+static avlops_t dir_summary_ops = {
+	avl_dir_summary_start,
+	avl_dir_summary_end
+};
+
+static void
+dir_ents_add(
+	xfs_ino_t	**listp,
+	int		*np,
+	int		*maxp,
+	xfs_ino_t	ino)
+{
+	if (*np == *maxp) {
+		*maxp = MAX(*maxp * 2, 64);
+		if ((*listp = realloc(*listp, *maxp * sizeof(xfs_ino_t))) == NULL)
+			do_error("realloc failed in dir_ents_add (%u bytes)\n",
+				*maxp * sizeof(xfs_ino_t));
+	}
+	(*listp)[(*np)++] = ino;
+}
+
+static int
+dir_ino_cmp(
+	const void	*a,
+	const void	*b)
+{
+	xfs_ino_t	ia = *(xfs_ino_t *)a;
+	xfs_ino_t	ib = *(xfs_ino_t *)b;
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+/*
+ * the traversal junks the second entry for a subdirectory, so a
+ * directory with two can't be taken from a summary
+ */
+static int
+dir_ents_dup_dirs(
+	dir_ents_t	*de)
+{
+	int		i;
+
+	if (de->ndirs < 2)
+		return 0;
+	qsort(de->dirs, de->ndirs, sizeof(xfs_ino_t), dir_ino_cmp);
+	for (i = 1; i < de->ndirs; i++)
+		if (de->dirs[i] == de->dirs[i - 1])
+			return 1;
+	return 0;
+}
+
+/*
+ * read-only version of longform_dir2_entry_check_data().  returns 1
+ * if the block is clean, adding its entries to the scratch list.
+ */
+static int
+longform_dir2_precheck_data(
+	xfs_mount_t		*mp,
+	xfs_inode_t		*ip,
+	xfs_dabuf_t		*bp,
+	dir_hash_tab_t		*hashtab,
+	freetab_t		**freetabp,
+	xfs_dablk_t		da_bno,
+	int			isblock,
+	dir_ents_t		*de)
+{
+	xfs_dir2_dataptr_t	addr;
+	xfs_dir2_data_t		*d;
+	xfs_dir2_db_t		db;
+	xfs_dir2_data_entry_t	*dep;
+	xfs_dir2_data_unused_t	*dup;
+	char			*endptr;
+	freetab_t		*freetab;
+	xfs_ino_t		inum;
+	int			ino_offset;
+	ino_tree_node_t		*irec;
+	int			lastfree;
+	char			*ptr;
+
+	d = bp->data;
+	db = XFS_DIR2_DA_TO_DB(mp, da_bno);
+	freetab_extend(freetabp, db);
+	freetab = *freetabp;
+	if (!longform_dir2_data_walk(mp, d, isblock, &endptr))
+		return 0;
+	if (INT_GET(d->hdr.magic, ARCH_CONVERT) !=
+	    (isblock ? XFS_DIR2_BLOCK_MAGIC : XFS_DIR2_DATA_MAGIC))
+		return 0;
+	lastfree = 0;
+	ptr = (char *)d->u;
+	while (ptr < endptr) {
+		dup = (xfs_dir2_data_unused_t *)ptr;
+		if (INT_GET(dup->freetag, ARCH_CONVERT) == XFS_DIR2_DATA_FREE_TAG) {
+			if (lastfree)
+				return 0;
+			ptr += INT_GET(dup->length, ARCH_CONVERT);
+			lastfree = 1;
+			continue;
+		}
+		addr = XFS_DIR2_DB_OFF_TO_DATAPTR(mp, db, ptr - (char *)d);
+		dep = (xfs_dir2_data_entry_t *)ptr;
+		ptr += XFS_DIR2_DATA_ENTSIZE(dep->namelen);
+		lastfree = 0;
+		if (dep->name[0] == '/')
+			return 0;
+		dir_hash_add(hashtab,
+			libxfs_da_hashname((char *)dep->name, dep->namelen),
+			addr, 0);
+		if (dep->namelen == 2 && dep->name[0] == '.' &&
+		    dep->name[1] == '.')
+			continue;
+		inum = INT_GET(dep->inumber, ARCH_CONVERT);
+		if (inum == ip->i_ino) {
+			if (dep->namelen != 1 || dep->name[0] != '.')
+				return 0;
+			dir_ents_add(&de->ents, &de->nents, &de->maxents, inum);
+			continue;
+		}
+		if (inum == orphanage_ino &&
+		    dep->namelen == strlen(ORPHANAGE) &&
+		    bcmp(dep->name, ORPHANAGE, dep->namelen) == 0)
+			continue;
+		if (verify_inum(mp, inum)) {
+			if (no_modify)
+				continue;
+			return 0;
+		}
+		irec = find_inode_rec(XFS_INO_TO_AGNO(mp, inum),
+			XFS_INO_TO_AGINO(mp, inum));
+		if (irec == NULL)
+			return 0;
+		ino_offset = XFS_INO_TO_AGINO(mp, inum) - irec->ino_startnum;
+		if (is_inode_free(irec, ino_offset))
+			return 0;
+		if (inode_isadir(irec, ino_offset)) {
+			if (get_inode_parent(irec, ino_offset) != ip->i_ino)
+				return 0;
+			dir_ents_add(&de->dirs, &de->ndirs, &de->maxdirs, inum);
+		}
+		dir_ents_add(&de->ents, &de->nents, &de->maxents, inum);
+	}
+	freetab->ents[db].v = INT_GET(d->hdr.bestfree[0].length, ARCH_CONVERT);
+	freetab->ents[db].s = 0;
+	return 1;
+}
+
+static void
+dir_summary_add(
+	dir_precheck_t		*dp,
+	xfs_agino_t		agino,
+	dir_ents_t		*de)
+{
+	dir_ents_blk_t		*blk;
+	dir_summary_t		*ds;
+	int			n;
+
+	blk = dp->dp_blks;
+	if (blk == NULL || blk->size - blk->used < de->nents) {
+		n = MAX(DIR_ENTS_PER_BLK, de->nents);
+		if (DIR_ENTS_BLK_SIZE(n) > dp->dp_budget)
+			return;
+		if ((blk = malloc(DIR_ENTS_BLK_SIZE(n))) == NULL)
+			return;
+		dp->dp_budget -= DIR_ENTS_BLK_SIZE(n);
+		blk->size = n;
+		blk->used = 0;
+		blk->next = dp->dp_blks;
+		dp->dp_blks = blk;
+	}
+	ds = arena_alloc(&dp->dp_arena);
+	ds->ds_agino = agino;
+	ds->ds_nents = de->nents;
+	ds->ds_ents = &blk->ents[blk->used];
+	bcopy(de->ents, ds->ds_ents, de->nents * sizeof(xfs_ino_t));
+	blk->used += de->nents;
+	if (bptree_insert(&dp->dp_tree, &ds->avl_node) == NULL)
+		do_error("duplicate directory summary for inode %u\n", agino);
+}
+
+/*
+ * read-only version of longform_dir2_entry_check()
+ */
+static void
+longform_dir2_precheck(
+	xfs_mount_t		*mp,
+	xfs_agnumber_t		agno,
+	xfs_agino_t		agino,
+	dir_ents_t		*de)
+{
+	xfs_dir2_block_t	*block;
+	xfs_dir2_leaf_entry_t	*blp;
+	xfs_dabuf_t		*bp;
+	xfs_dir2_block_tail_t	*btp;
+	int			clean;
+	xfs_dablk_t		da_bno;
+	freetab_t		*freetab;
+	dir_hash_tab_t		*hashtab;
+	xfs_ino_t		ino;
+	xfs_inode_t		*ip;
+	int			isblock;
+	int			isleaf;
+	xfs_fileoff_t		next_da_bno;
+	prefetch_t		*pf;
+	int			seeval;
+
+	ino = XFS_AGINO_TO_INO(mp, agno, agino);
+	if (dir2_is_badino(ino) || libxfs_iget(mp, NULL, ino, 0, &ip, 0))
+		return;
+	if (ip->i_d.di_format != XFS_DINODE_FMT_EXTENTS &&
+	    ip->i_d.di_format != XFS_DINODE_FMT_BTREE) {
+		libxfs_iput(ip, 0);
+		return;
+	}
+	de->nents = de->ndirs = 0;
+	clean = 1;
+	bp = NULL;
+	freetab = freetab_alloc(mp, ip);
+	libxfs_dir2_isblock(NULL, ip, &isblock);
+	libxfs_dir2_isleaf(NULL, ip, &isleaf);
+	hashtab = dir_hash_init(ip->i_d.di_size);
+	pf = prefetch_dir_blocks(mp, ip);
+	for (da_bno = 0, next_da_bno = 0;
+	     clean && next_da_bno != NULLFILEOFF && da_bno < mp->m_dirleafblk;
+	     da_bno = (xfs_dablk_t)next_da_bno) {
+		next_da_bno = da_bno + mp->m_dirblkfsbs - 1;
+		if (libxfs_bmap_next_offset(NULL, ip, &next_da_bno, XFS_DATA_FORK))
+			break;
+		if (libxfs_da_read_bufr(NULL, ip, da_bno, -1, &bp,
+				XFS_DATA_FORK)) {
+			bp = NULL;
+			clean = 0;
+			break;
+		}
+		clean = longform_dir2_precheck_data(mp, ip, bp, hashtab,
+				&freetab, da_bno, isblock, de);
+		if (!isblock || !clean) {
+			libxfs_da_brelse(NULL, bp);
+			bp = NULL;
+		}
+	}
+	prefetch_stop(pf);
+	if (clean && isblock) {
+		if (bp != NULL) {
+			block = bp->data;
+			btp = XFS_DIR2_BLOCK_TAIL_P(mp, block);
+			blp = XFS_DIR2_BLOCK_LEAF_P_ARCH(btp, ARCH_CONVERT);
+			seeval = dir_hash_see_all(hashtab, blp,
+					INT_GET(btp->count, ARCH_CONVERT),
+					INT_GET(btp->stale, ARCH_CONVERT));
+			clean = !dir_hash_check(hashtab, ip, seeval, 1);
+		} else
+			clean = 0;
+	} else if (clean && isleaf)
+		clean = !longform_dir2_check_leaf(mp, ip, hashtab, freetab, 1);
+	else if (clean)
+		clean = !longform_dir2_check_node(mp, ip, hashtab, freetab, 1);
+	if (bp != NULL)
+		libxfs_da_brelse(NULL, bp);
+	dir_hash_done(hashtab);
+	free(freetab);
+	libxfs_iput(ip, 0);
+
+	if (clean && !dir_ents_dup_dirs(de))
+		dir_summary_add(&dir_prechecks[agno], agino, de);
+}
+
+/* ARGSUSED */
+static void
+dir_precheck_ag(
+	xfs_mount_t		*mp,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	dir_ents_t		de;
+	ino_tree_node_t		*irec;
+	int			j;
+
+	bzero(&de, sizeof(de));
+	for (irec = findfirst_inode_rec(agno); irec != NULL;
+	     irec = next_ino_rec(irec)) {
+		for (j = 0; j < XFS_INODES_PER_CHUNK; j++) {
+			if (is_inode_confirmed(irec, j) &&
+			    !is_inode_free(irec, j) && inode_isadir(irec, j))
+				longform_dir2_precheck(mp, agno,
+					irec->ino_startnum + j, &de);
+		}
+	}
+	free(de.ents);
+	free(de.dirs);
+}
+
+static void
+dir_precheck(
+	xfs_mount_t		*mp)
+{
+	__uint64_t		budget;
+	long			pages;
+	long			pagesize;
+	int			i;
+
+	if (ag_locks == NULL || !XFS_SB_VERSION_HASDIRV2(&mp->m_sb))
+		return;
+
+	pages = sysconf(_SC_PHYS_PAGES);
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (pages <= 0 || pagesize <= 0)
+		return;
+	budget = (__uint64_t) pages * pagesize / DIR_PRECHECK_MEM_FRAC /
+			mp->m_sb.sb_agcount;
+
+	if ((dir_prechecks = malloc(mp->m_sb.sb_agcount *
+					sizeof(dir_precheck_t))) == NULL)
+		do_error("couldn't malloc directory summary table\n");
+	for (i = 0; i < mp->m_sb.sb_agcount; i++) {
+		bptree_init(&dir_prechecks[i].dp_tree, &dir_summary_ops);
+		arena_init(&dir_prechecks[i].dp_arena, &dir_summary_stats,
+				DIR_SUMMARIES_PER_BLK);
+		dir_prechecks[i].dp_blks = NULL;
+		dir_prechecks[i].dp_budget = budget;
+	}
+
+	do_log("        - checking directories ahead of traversal ... \n");
+	do_ag_work(mp, dir_precheck_ag, NULL);
+}
+
+static void
+dir_precheck_done(
+	xfs_mount_t		*mp)
+{
+	dir_ents_blk_t		*blk;
+	int			i;
+
+	if (dir_prechecks == NULL)
+		return;
+
+	for (i = 0; i < mp->m_sb.sb_agcount; i++) {
+		bptree_clear(&dir_prechecks[i].dp_tree);
+		arena_reset(&dir_prechecks[i].dp_arena);
+		while ((blk = dir_prechecks[i].dp_blks) != NULL) {
+			dir_prechecks[i].dp_blks = blk->next;
+			free(blk);
+		}
+	}
+	free(dir_prechecks);
+	dir_prechecks = NULL;
+}
+
+/*
+ * take a directory's references from its summary, if it has one.
+ * the summary was made before the traversal started, so the
+ * subdirectories it names have to be checked again -- one reached
+ * from somewhere else since means an entry to junk, and that's
+ * left to longform_dir2_entry_check(), as is a directory with no
+ * summary or one naming an inode that's no longer in the inode tree.
+ * returns 1 if the directory was handled.
+ */
+static int
+longform_dir2_apply_summary(
+	xfs_mount_t		*mp,
+	xfs_ino_t		ino,
+	int			*need_dot,
+	dir_stack_t		*stack,
+	ino_tree_node_t		*current_irec,
+	int			current_ino_offset)
+{
+	dir_summary_t		*ds;
+	xfs_ino_t		inum;
+	ino_tree_node_t		*irec;
+	int			ino_offset;
+	int			i;
+
+	if (dir_prechecks == NULL)
+		return 0;
+	ds = (dir_summary_t *) bptree_find(
+		&dir_prechecks[XFS_INO_TO_AGNO(mp, ino)].dp_tree,
+		XFS_INO_TO_AGINO(mp, ino));
+	if (ds == NULL)
+		return 0;
+
+	for (i = 0; i < ds->ds_nents; i++) {
+		if ((inum = ds->ds_ents[i]) == ino)
+			continue;
+		irec = find_inode_rec(XFS_INO_TO_AGNO(mp, inum),
+			XFS_INO_TO_AGINO(mp, inum));
+		if (irec == NULL)
+			return 0;
+		ino_offset = XFS_INO_TO_AGINO(mp, inum) - irec->ino_startnum;
+		if (inode_isadir(irec, ino_offset) &&
+		    is_inode_reached(irec, ino_offset))
+			return 0;
+	}
+
+	*need_dot = 1;
+	for (i = 0; i < ds->ds_nents; i++) {
+		if ((inum = ds->ds_ents[i]) == ino) {
+			add_inode_ref(current_irec, current_ino_offset);
+			*need_dot = 0;
+			continue;
+		}
+		irec = find_inode_rec(XFS_INO_TO_AGNO(mp, inum),
+			XFS_INO_TO_AGINO(mp, inum));
+		ASSERT(irec != NULL);
+		ino_offset = XFS_INO_TO_AGINO(mp, inum) - irec->ino_startnum;
+		add_inode_reached(irec, ino_offset);
+		if (!inode_isadir(irec, ino_offset))
+			continue;
+		add_inode_ref(current_irec, current_ino_offset);
+		if (!is_inode_refchecked(inum, irec, ino_offset))
+			push_dir(stack, inum);
+	}
+	return 1;
+}
+
 /*
  * shortform directory processing routines -- entry verification and
  * bad entry deletion (pruning).
@@ -3354,6 +3897,7 @@ process_dirstack(xfs_mount_t *mp, dir_stack_t *stack)
 	xfs_trans_t		*tp;
 	xfs_dahash_t		hashval;
 	ino_tree_node_t		*irec;
+	prefetch_t		*pf;
 	int			ino_offset, need_dot, committed;
 	int			dirty, num_illegal, error, nres;
 
@@ -3443,17 +3987,28 @@ process_dirstack(xfs_mount_t *mp, dir_stack_t *stack)
 			 * missing .. entries are added if required when
 			 * the directory is connected to lost+found. but
 			 * we need to create '.' entries here.
+			 *
+			 * the directory blocks are read ahead while
+			 * the entries are checked, unless the directory
+			 * was already found clean.  version 2 directories
+			 * do their own readahead so it can be stopped
+			 * before a rebuild.
 			 */
-			if (XFS_SB_VERSION_HASDIRV2(&mp->m_sb))
+			if (longform_dir2_apply_summary(mp, ino, &need_dot,
+					stack, irec, ino_offset))
+				break;
+			if (XFS_SB_VERSION_HASDIRV2(&mp->m_sb))  {
 				longform_dir2_entry_check(mp, ino, ip,
 							&num_illegal, &need_dot,
 							stack, irec,
 							ino_offset);
-			else
-				longform_dir_entry_check(mp, ino, ip,
-							&num_illegal, &need_dot,
-							stack, irec,
-							ino_offset);
+				break;
+			}
+			pf = prefetch_dir_blocks(mp, ip);
+			longform_dir_entry_check(mp, ino, ip,
+						&num_illegal, &need_dot,
+						stack, irec, ino_offset);
+			prefetch_stop(pf);
 			break;
 		case XFS_DINODE_FMT_LOCAL:
 			tp = libxfs_trans_alloc(mp, 0);
@@ -3845,6 +4400,8 @@ phase6(xfs_mount_t *mp)
 
 	mark_standalone_inodes(mp);
 
+	dir_precheck(mp);
+
 	/*
 	 * push root dir on stack, then go
 	 */
@@ -3915,6 +4472,8 @@ phase6(xfs_mount_t *mp)
 		}
 	}
 
+	dir_precheck_done(mp);
+
 	do_log("        - traversals finished ... \n");
 	do_log("        - moving disconnected inodes to lost+found ... \n");
 
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+#include <libxfs.h>
+#include "avl.h"
+#include "globals.h"
+#include "incore.h"
+#include "prefetch.h"
+#include "threads.h"
+#include "err_protos.h"
+
+static int		pf_nthreads;	/* 0 means prefetching is off */
+static dev_t		pf_dev;
+static size_t		pf_budget;	/* bytes one stream may read ahead */
+
+/*
+ * pf_lock covers the active list and every field of an active stream
+ * except pf_ext, which doesn't change once the stream is started.
+ */
+static pthread_mutex_t	pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	pf_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	pf_idle = PTHREAD_COND_INITIALIZER;
+static prefetch_t	*pf_head;
+static prefetch_t	*pf_tail;
+
+/*
+ * find a stream with something to read, and rotate it to the end of
+ * the list so that concurrent walks take turns.  called with pf_lock.
+ */
+static prefetch_t *
+pf_next_stream(void)
+{
+	prefetch_t	*pf;
+	prefetch_t	*prev;
+
+	for (prev = NULL, pf = pf_head; pf != NULL;
+			prev = pf, pf = pf->pf_link)  {
+		if (pf->pf_next >= pf->pf_count)
+			continue;
+		if (pf->pf_window != 0 &&
+				pf->pf_next - pf->pf_done >= pf->pf_window)
+			continue;
+
+		if (pf != pf_tail)  {
+			if (prev == NULL)
+				pf_head = pf->pf_link;
+			else
+				prev->pf_link = pf->pf_link;
+			pf->pf_link = NULL;
+			pf_tail->pf_link = pf;
+			pf_tail = pf;
+		}
+		return(pf);
+	}
+
+	return(NULL);
+}
+
+/* ARGSUSED */
+static void *
+pf_reader(void *arg)
+{
+	prefetch_t	*pf;
+	pf_extent_t	ext;
+	xfs_buf_t	*bp;
+
+	pthread_mutex_lock(&pf_lock);
+	for (;;)  {
+		while ((pf = pf_next_stream()) == NULL)
+			pthread_cond_wait(&pf_work, &pf_lock);
+
+		ext = pf->pf_ext[pf->pf_next++];
+		pf->pf_busy++;
+		pthread_mutex_unlock(&pf_lock);
+
+		/*
+		 * errors are left for the caller to trip over and
+		 * report when it reads the block itself.
+		 */
+		if ((bp = libxfs_readbuf(pf_dev, ext.daddr, ext.len, 0)))
+			libxfs_putbuf(bp);
+
+		pthread_mutex_lock(&pf_lock);
+		if (--pf->pf_busy == 0)
+			pthread_cond_broadcast(&pf_idle);
+	}
+	/* NOTREACHED */
+}
+
+/*
+ * start the reader threads.  they run until the process exits.
+ * prefetching is only worth doing into the buffer cache, so it is
+ * off if that is.
+ */
+void
+prefetch_init(xfs_mount_t *mp)
+{
+	pthread_attr_t	attr;
+	pthread_t	tid;
+	int		err;
+	int		i;
+
+	pf_nthreads = 0;
+
+	if (prefetch_threads <= 0 || bcache_size <= 0)
+		return;
+
+	pf_dev = mp->m_dev;
+
+	/*
+	 * leave most of the cache to what the workers are holding and
+	 * what later phases will come back for.
+	 */
+	pf_budget = ((size_t)bcache_size << 20) / 4 / MAX(thread_count, 1);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (i = 0; i < prefetch_threads; i++)  {
+		if ((err = pthread_create(&tid, &attr, pf_reader, NULL)) != 0)
+			do_error("couldn't create prefetch thread: %s\n",
+				strerror(err));
+	}
+
+	pthread_attr_destroy(&attr);
+	pf_nthreads = prefetch_threads;
+}
+
+prefetch_t *
+prefetch_alloc(int count)
+{
+	prefetch_t	*pf;
+
+	if (pf_nthreads == 0)
+		return(NULL);
+
+	if (count < 1)
+		count = 1;
+
+	if ((pf = malloc(sizeof(prefetch_t))) == NULL ||
+	    (pf->pf_ext = malloc(count * sizeof(pf_extent_t))) == NULL)
+		do_error("couldn't allocate prefetch stream\n");
+
+	pf->pf_count = 0;
+	pf->pf_size = count;
+	pf->pf_next = 0;
+	pf->pf_done = 0;
+	pf->pf_window = 0;
+	pf->pf_busy = 0;
+	pf->pf_link = NULL;
+
+	return(pf);
+}
+
+/*
+ * extents can only be added before the stream is started
+ */
+void
+prefetch_add(prefetch_t *pf, xfs_daddr_t daddr, int len)
+{
+	if (pf == NULL)
+		return;
+
+	if (pf->pf_count == pf->pf_size)  {
+		pf->pf_size *= 2;
+		pf->pf_ext = realloc(pf->pf_ext,
+					pf->pf_size * sizeof(pf_extent_t));
+		if (pf->pf_ext == NULL)
+			do_error("couldn't grow prefetch stream\n");
+	}
+
+	pf->pf_ext[pf->pf_count].daddr = daddr;
+	pf->pf_ext[pf->pf_count].len = len;
+	pf->pf_count++;
+}
+
+static int
+pf_extent_cmp(const void *a, const void *b)
+{
+	xfs_daddr_t	da = ((pf_extent_t *)a)->daddr;
+	xfs_daddr_t	db = ((pf_extent_t *)b)->daddr;
+
+	return(da < db ? -1 : da > db);
+}
+
+void
+prefetch_start(prefetch_t *pf, int window)
+{
+	if (pf == NULL)
+		return;
+
+	if (pf->pf_count == 0)
+		return;
+
+	if (window == 0)
+		qsort(pf->pf_ext, pf->pf_count, sizeof(pf_extent_t),
+			pf_extent_cmp);
+	pf->pf_window = window;
+
+	pthread_mutex_lock(&pf_lock);
+	if (pf_tail == NULL)
+		pf_head = pf;
+	else
+		pf_tail->pf_link = pf;
+	pf_tail = pf;
+	pthread_cond_broadcast(&pf_work);
+	pthread_mutex_unlock(&pf_lock);
+}
+
+/*
+ * the caller is done with the next extent in the stream, let the
+ * readers move the window along.
+ */
+void
+prefetch_advance(prefetch_t *pf)
+{
+	if (pf == NULL || pf->pf_window == 0)
+		return;
+
+	pthread_mutex_lock(&pf_lock);
+	pf->pf_done++;
+	if (pf->pf_next < pf->pf_count)
+		pthread_cond_signal(&pf_work);
+	pthread_mutex_unlock(&pf_lock);
+}
+
+/*
+ * take the stream off the active list, wait for any reads still
+ * using it and free it.  whatever hasn't been read by now won't be.
+ */
+void
+prefetch_stop(prefetch_t *pf)
+{
+	prefetch_t	*p;
+	prefetch_t	*prev;
+
+	if (pf == NULL)
+		return;
+
+	pthread_mutex_lock(&pf_lock);
+	for (prev = NULL, p = pf_head; p != NULL; prev = p, p = p->pf_link)  {
+		if (p != pf)
+			continue;
+		if (prev == NULL)
+			pf_head = p->pf_link;
+		else
+			prev->pf_link = p->pf_link;
+		if (pf_tail == p)
+			pf_tail = prev;
+		break;
+	}
+	while (pf->pf_busy > 0)
+		pthread_cond_wait(&pf_idle, &pf_lock);
+	pthread_mutex_unlock(&pf_lock);
+
+	free(pf->pf_ext);
+	free(pf);
+}
+
+/*
+ * one extent for every inode chunk buffer process_aginodes() will
+ * read, in the same order.  the inode tree is already sorted by disk
+ * address, so the window only keeps us from running too far ahead.
+ * the caller must own the AG.
+ */
+prefetch_t *
+prefetch_inode_chunks(xfs_mount_t *mp, xfs_agnumber_t agno)
+{
+	ino_tree_node_t	*irec;
+	prefetch_t	*pf;
+	xfs_agblock_t	agbno;
+	xfs_agblock_t	last_agbno;
+	int		len;
+	int		window;
+
+	if (pf_nthreads == 0)
+		return(NULL);
+
+	if ((irec = findfirst_inode_rec(agno)) == NULL)
+		return(NULL);
+
+	len = XFS_FSB_TO_BB(mp, XFS_IALLOC_BLOCKS(mp));
+	window = MAX(pf_budget / BBTOB(len), 1);
+
+	pf = prefetch_alloc(MIN(window, 1024));
+
+	for (last_agbno = NULLAGBLOCK; irec != NULL;
+			irec = next_ino_rec(irec))  {
+		agbno = XFS_AGINO_TO_AGBNO(mp, irec->ino_startnum);
+		if (agbno == last_agbno)
+			continue;
+		prefetch_add(pf, XFS_AGB_TO_DADDR(mp, agno, agbno), len);
+		last_agbno = agbno;
+	}
+
+	prefetch_start(pf, window);
+	return(pf);
+}
+
+/*
+ * every mapped block of a directory, split the way xfs_da_read_buf()
+ * asks for it, up to what one stream may read ahead.  directory
+ * blocks aren't visited in disk order so this stream has no window
+ * and is read sorted by disk address.
+ */
+prefetch_t *
+prefetch_dir_blocks(xfs_mount_t *mp, xfs_inode_t *ip)
+{
+	xfs_bmbt_irec_t	map[XFS_BMAP_MAX_NMAP];
+	xfs_fsblock_t	fblock;
+	xfs_fileoff_t	off;
+	xfs_fileoff_t	end;
+	xfs_fileoff_t	pos;
+	xfs_fileoff_t	next;
+	xfs_fileoff_t	mend;
+	prefetch_t	*pf;
+	size_t		bytes;
+	int		dirfsbs;
+	int		nmap;
+	int		i;
+
+	if (pf_nthreads == 0)
+		return(NULL);
+
+	if (ip->i_d.di_format != XFS_DINODE_FMT_EXTENTS &&
+	    ip->i_d.di_format != XFS_DINODE_FMT_BTREE)
+		return(NULL);
+
+	if (XFS_SB_VERSION_HASDIRV2(&mp->m_sb))  {
+		dirfsbs = mp->m_dirblkfsbs;
+		end = XFS_B_TO_FSB(mp, XFS_DIR2_FREE_OFFSET +
+					XFS_DIR2_SPACE_SIZE);
+	} else  {
+		dirfsbs = 1;
+		end = XFS_B_TO_FSB(mp, ip->i_d.di_size);
+	}
+
+	pf = prefetch_alloc(ip->i_d.di_nextents);
+	bytes = 0;
+
+	for (off = 0; off < end && bytes < pf_budget; off = mend)  {
+		nmap = XFS_BMAP_MAX_NMAP;
+		fblock = NULLFSBLOCK;
+		if (libxfs_bmapi(NULL, ip, off, end - off, XFS_BMAPI_METADATA,
+				&fblock, 0, map, &nmap, NULL) || nmap == 0)
+			break;
+
+		for (i = 0; i < nmap && bytes < pf_budget; i++)  {
+			mend = map[i].br_startoff + map[i].br_blockcount;
+			if (map[i].br_startblock == HOLESTARTBLOCK)
+				continue;
+			for (pos = map[i].br_startoff; pos < mend; pos = next) {
+				next = MIN((pos / dirfsbs + 1) * dirfsbs, mend);
+				prefetch_add(pf, XFS_FSB_TO_DADDR(mp,
+					map[i].br_startblock +
+					(pos - map[i].br_startoff)),
+					XFS_FSB_TO_BB(mp, next - pos));
+				bytes += XFS_FSB_TO_B(mp, next - pos);
+			}
+		}
+		mend = map[nmap - 1].br_startoff + map[nmap - 1].br_blockcount;
+	}
+
+	prefetch_start(pf, 0);
+	return(pf);
+}
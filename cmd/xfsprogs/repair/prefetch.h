@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+#include <pthread.h>
+
+/*
+ * readahead for the inode chunk, btree and directory walks.  a caller
+ * that knows which blocks it is about to read describes them as a
+ * prefetch stream.  a small pool of reader threads pulls the blocks
+ * into the libxfs buffer cache while the caller checks the ones it
+ * already has, so the caller's own libxfs_readbuf() calls find them
+ * cached (or wait on the read already in flight) instead of seeking.
+ *
+ * a stream with a window never gets more than that many extents ahead
+ * of the caller, who reports progress with prefetch_advance().  this
+ * keeps readahead from pushing the blocks being worked on out of the
+ * cache, and the extents are read in the order they were added.  a
+ * stream without a window is read in disk address order as fast as
+ * the readers can go.
+ *
+ * with prefetching off (-o prefetch=0 or no buffer cache)
+ * prefetch_alloc() returns NULL and the rest are no-ops on NULL, so
+ * callers don't need to check.
+ */
+typedef struct pf_extent  {
+	xfs_daddr_t		daddr;
+	int			len;		/* in basic blocks */
+} pf_extent_t;
+
+typedef struct prefetch  {
+	pf_extent_t		*pf_ext;
+	int			pf_count;	/* extents added */
+	int			pf_size;	/* extents allocated */
+	int			pf_next;	/* next extent to read */
+	int			pf_done;	/* extents the caller is past */
+	int			pf_window;	/* max pf_next - pf_done, 0=none */
+	int			pf_busy;	/* reads in flight */
+	struct prefetch		*pf_link;	/* on the active list */
+} prefetch_t;
+
+#define	PF_BTREE_WINDOW		16	/* btree children read ahead */
+
+void		prefetch_init(xfs_mount_t *mp);
+prefetch_t	*prefetch_alloc(int count);
+void		prefetch_add(prefetch_t *pf, xfs_daddr_t daddr, int len);
+void		prefetch_start(prefetch_t *pf, int window);
+void		prefetch_advance(prefetch_t *pf);
+void		prefetch_stop(prefetch_t *pf);
+
+prefetch_t	*prefetch_inode_chunks(xfs_mount_t *mp, xfs_agnumber_t agno);
+prefetch_t	*prefetch_dir_blocks(xfs_mount_t *mp, xfs_inode_t *ip);
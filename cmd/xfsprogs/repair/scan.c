@@ -41,22 +41,39 @@
 #include "scan.h"
 #include "versions.h"
 #include "bmap.h"
+#include "threads.h"
+#include "prefetch.h"
 
 extern int verify_set_agheader(xfs_mount_t *mp, xfs_buf_t *sbuf, xfs_sb_t *sb,
 		xfs_agf_t *agf, xfs_agi_t *agi, xfs_agnumber_t i);
 
 static xfs_mount_t	*mp = NULL;
-static xfs_extlen_t	bno_agffreeblks;
-static xfs_extlen_t	cnt_agffreeblks;
-static xfs_extlen_t	bno_agflongest;
-static xfs_extlen_t	cnt_agflongest;
-static xfs_agino_t	agicount;
-static xfs_agino_t	agifreecount;
+
+/*
+ * free space and inode counts gathered from the btrees,
+ * one set per ag so that ags can be scanned in parallel
+ */
+typedef struct ag_counts  {
+	xfs_extlen_t	bno_agffreeblks;
+	xfs_extlen_t	cnt_agffreeblks;
+	xfs_extlen_t	bno_agflongest;
+	xfs_extlen_t	cnt_agflongest;
+	xfs_agino_t	agicount;
+	xfs_agino_t	agifreecount;
+} ag_counts_t;
+
+static ag_counts_t	*ag_counts;
 
 void
 set_mp(xfs_mount_t *mpp)
 {
 	mp = mpp;
+
+	if (ag_counts != NULL)
+		free(ag_counts);
+	ag_counts = calloc(mp->m_sb.sb_agcount, sizeof(ag_counts_t));
+	if (ag_counts == NULL)
+		do_error("couldn't allocate per-ag btree counters\n");
 }
 
 void
@@ -166,7 +183,9 @@ scanfunc_bmap(
 	xfs_bmbt_rec_32_t	*rp;
 	xfs_dfiloff_t		first_key;
 	xfs_dfiloff_t		last_key;
+	xfs_agnumber_t		agno;
 	char			*forkname;
+	prefetch_t		*pf;
 
 	if (whichfork == XFS_DATA_FORK)
 		forkname = "data";
@@ -251,6 +270,12 @@ scanfunc_bmap(
 		bm_cursor->level[level].left_fsbno = INT_GET(block->bb_leftsib, ARCH_CONVERT);
 		bm_cursor->level[level].right_fsbno = INT_GET(block->bb_rightsib, ARCH_CONVERT);
 
+		/*
+		 * the block may live in an ag another thread is checking
+		 */
+		agno = XFS_FSB_TO_AGNO(mp, bno);
+		lock_ag(agno);
+
 		switch (get_fsbno_state(mp, bno))  {
 		case XR_E_UNKNOWN:
 		case XR_E_FREE1:
@@ -298,6 +323,7 @@ scanfunc_bmap(
 				ino, (__uint64_t) bno);
 			break;
 		}
+		unlock_ag(agno);
 	} else  {
 		/*
 		 * attribute fork for realtime files is in the regular
@@ -379,6 +405,20 @@ do_warn("inode 0x%llx bad # of bmap records (%u, min - %u, max - %u)\n",
 
 	last_key = NULLDFILOFF;
 
+	/*
+	 * read the children ahead of the walk, up to the first
+	 * pointer we're going to bail out on.
+	 */
+	pf = prefetch_alloc(INT_GET(block->bb_numrecs, ARCH_CONVERT));
+	for (i = 0; i < INT_GET(block->bb_numrecs, ARCH_CONVERT); i++)  {
+		if (!verify_dfsbno(mp, INT_GET(pp[i], ARCH_CONVERT)))
+			break;
+		prefetch_add(pf, XFS_FSB_TO_DADDR(mp,
+				INT_GET(pp[i], ARCH_CONVERT)),
+				XFS_FSB_TO_BB(mp, 1));
+	}
+	prefetch_start(pf, PF_BTREE_WINDOW);
+
 	for (i = 0, err = 0; i < INT_GET(block->bb_numrecs, ARCH_CONVERT); i++)  {
 		/*
 		 * XXX - if we were going to fix up the interior btree nodes,
@@ -388,14 +428,18 @@ do_warn("inode 0x%llx bad # of bmap records (%u, min - %u, max - %u)\n",
 		if (!verify_dfsbno(mp, INT_GET(pp[i], ARCH_CONVERT)))  {
 			do_warn("bad bmap btree ptr 0x%llx in ino %llu\n",
 				INT_GET(pp[i], ARCH_CONVERT), ino);
+			prefetch_stop(pf);
 			return(1);
 		}
 
 		err = scan_lbtree(INT_GET(pp[i], ARCH_CONVERT), level, scanfunc_bmap, type, whichfork,
 				ino, tot, nex, blkmapp, bm_cursor, 0,
 				check_dups);
-		if (err)
+		prefetch_advance(pf);
+		if (err)  {
+			prefetch_stop(pf);
 			return(1);
+		}
 
 		/*
 		 * fix key (offset) mismatches between the first key
@@ -432,6 +476,7 @@ do_warn("inode 0x%llx bad # of bmap records (%u, min - %u, max - %u)\n",
 			}
 		}
 	}
+	prefetch_stop(pf);
 
 	/*
 	 * Check that the last child block's forward sibling pointer
@@ -538,9 +583,9 @@ scanfunc_bno(
 				INT_GET(rp[i].ar_blockcount, ARCH_CONVERT) > MAXEXTLEN)
 				continue;
 
-			bno_agffreeblks += INT_GET(rp[i].ar_blockcount, ARCH_CONVERT);
-			if (INT_GET(rp[i].ar_blockcount, ARCH_CONVERT) > bno_agflongest)
-				bno_agflongest = INT_GET(rp[i].ar_blockcount, ARCH_CONVERT);
+			ag_counts[agno].bno_agffreeblks += INT_GET(rp[i].ar_blockcount, ARCH_CONVERT);
+			if (INT_GET(rp[i].ar_blockcount, ARCH_CONVERT) > ag_counts[agno].bno_agflongest)
+				ag_counts[agno].bno_agflongest = INT_GET(rp[i].ar_blockcount, ARCH_CONVERT);
 			for (b = INT_GET(rp[i].ar_startblock, ARCH_CONVERT);
 			     b < INT_GET(rp[i].ar_startblock, ARCH_CONVERT) + INT_GET(rp[i].ar_blockcount, ARCH_CONVERT);
 			     b++)  {
@@ -681,9 +726,9 @@ scanfunc_cnt(
 				INT_GET(rp[i].ar_blockcount, ARCH_CONVERT) > MAXEXTLEN)
 				continue;
 
-			cnt_agffreeblks += INT_GET(rp[i].ar_blockcount, ARCH_CONVERT);
-			if (INT_GET(rp[i].ar_blockcount, ARCH_CONVERT) > cnt_agflongest)
-				cnt_agflongest = INT_GET(rp[i].ar_blockcount, ARCH_CONVERT);
+			ag_counts[agno].cnt_agffreeblks += INT_GET(rp[i].ar_blockcount, ARCH_CONVERT);
+			if (INT_GET(rp[i].ar_blockcount, ARCH_CONVERT) > ag_counts[agno].cnt_agflongest)
+				ag_counts[agno].cnt_agflongest = INT_GET(rp[i].ar_blockcount, ARCH_CONVERT);
 			for (b = INT_GET(rp[i].ar_startblock, ARCH_CONVERT);
 			     b < INT_GET(rp[i].ar_startblock, ARCH_CONVERT) + INT_GET(rp[i].ar_blockcount, ARCH_CONVERT);
 			     b++)  {
@@ -785,6 +830,7 @@ scanfunc_ino(
 	int			state;
 	xfs_inobt_ptr_t		*pp;
 	xfs_inobt_rec_t		*rp;
+	prefetch_t		*pf;
 	ino_tree_node_t		*ino_rec, *first_rec, *last_rec;
 	int			hdr_errors;
 
@@ -977,8 +1023,8 @@ scanfunc_ino(
 					continue;
 			}
 
-			agicount += XFS_INODES_PER_CHUNK;
-			agifreecount += INT_GET(rp[i].ir_freecount, ARCH_CONVERT);
+			ag_counts[agno].agicount += XFS_INODES_PER_CHUNK;
+			ag_counts[agno].agifreecount += INT_GET(rp[i].ir_freecount, ARCH_CONVERT);
 			nfree = 0;
 
 			/*
@@ -1059,11 +1105,23 @@ scanfunc_ino(
 		else suspect++;
 	}
 
+	pf = prefetch_alloc(numrecs);
 	for (i = 0; i < numrecs; i++)  {
 		if (INT_GET(pp[i], ARCH_CONVERT) != 0 && verify_agbno(mp, agno, INT_GET(pp[i], ARCH_CONVERT)))
+			prefetch_add(pf, XFS_AGB_TO_DADDR(mp, agno,
+					INT_GET(pp[i], ARCH_CONVERT)),
+					XFS_FSB_TO_BB(mp, 1));
+	}
+	prefetch_start(pf, PF_BTREE_WINDOW);
+
+	for (i = 0; i < numrecs; i++)  {
+		if (INT_GET(pp[i], ARCH_CONVERT) != 0 && verify_agbno(mp, agno, INT_GET(pp[i], ARCH_CONVERT)))  {
 			scan_sbtree(INT_GET(pp[i], ARCH_CONVERT), level, agno, suspect,
 					scanfunc_ino, 0);
+			prefetch_advance(pf);
+		}
 	}
+	prefetch_stop(pf);
 }
 
 void
@@ -1132,13 +1190,10 @@ scan_ag(
 	int		sb_dirty;
 	int		status;
 
-	cnt_agffreeblks = cnt_agflongest = 0;
-	bno_agffreeblks = bno_agflongest = 0;
+	bzero(&ag_counts[agno], sizeof(ag_counts_t));
 
 	agi_dirty = agf_dirty = sb_dirty = 0;
 
-	agicount = agifreecount = 0;
-
 	sbbuf = libxfs_readbuf(mp->m_dev, XFS_AG_DADDR(mp, agno, XFS_SB_DADDR),
 				1, 0);
 	if (!sbbuf)  {
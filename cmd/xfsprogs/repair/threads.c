@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+#include <libxfs.h>
+#include "globals.h"
+#include "threads.h"
+#include "err_protos.h"
+
+/*
+ * directory and attribute leaf processing keeps its freespace maps
+ * on the stack, so don't trust the default thread stack size.
+ */
+#define	XR_THREAD_STACKSIZE	(4 * 1024 * 1024)
+
+pthread_mutex_t	*ag_locks;
+pthread_mutex_t	rt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct ag_work  {
+	xfs_mount_t	*mp;
+	ag_work_func_t	func;
+	void		*arg;
+	pthread_mutex_t	lock;		/* protects next_agno */
+	xfs_agnumber_t	next_agno;
+} ag_work_t;
+
+/*
+ * set up the per-AG locks.  anything less than two threads or two
+ * AGs runs the old serial code paths.
+ */
+void
+thread_init(xfs_mount_t *mp)
+{
+	xfs_agnumber_t	i;
+
+	ag_locks = NULL;
+
+	if (thread_count <= 1 || mp->m_sb.sb_agcount <= 1)
+		return;
+
+	ag_locks = malloc(mp->m_sb.sb_agcount * sizeof(pthread_mutex_t));
+	if (ag_locks == NULL)
+		do_error("couldn't allocate per-ag locks\n");
+
+	for (i = 0; i < mp->m_sb.sb_agcount; i++)
+		pthread_mutex_init(&ag_locks[i], NULL);
+}
+
+static void *
+ag_worker(void *arg)
+{
+	ag_work_t	*work = arg;
+	xfs_agnumber_t	agno;
+
+	for (;;)  {
+		pthread_mutex_lock(&work->lock);
+		agno = work->next_agno++;
+		pthread_mutex_unlock(&work->lock);
+
+		if (agno >= work->mp->m_sb.sb_agcount)
+			break;
+
+		(*work->func)(work->mp, agno, work->arg);
+	}
+
+	return(NULL);
+}
+
+/*
+ * run func on every AG, in parallel if we were asked to.  fatal
+ * errors in a worker exit the whole process just as they always have.
+ */
+void
+do_ag_work(xfs_mount_t *mp, ag_work_func_t func, void *arg)
+{
+	ag_work_t	work;
+	pthread_attr_t	attr;
+	pthread_t	*threads;
+	xfs_agnumber_t	agno;
+	int		nthreads;
+	int		err;
+	int		i;
+
+	if (ag_locks == NULL)  {
+		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+			(*func)(mp, agno, arg);
+		return;
+	}
+
+	nthreads = MIN(thread_count, mp->m_sb.sb_agcount);
+
+	if ((threads = malloc(nthreads * sizeof(pthread_t))) == NULL)
+		do_error("couldn't allocate worker thread table\n");
+
+	work.mp = mp;
+	work.func = func;
+	work.arg = arg;
+	work.next_agno = 0;
+	pthread_mutex_init(&work.lock, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, XR_THREAD_STACKSIZE);
+
+	for (i = 0; i < nthreads; i++)  {
+		if ((err = pthread_create(&threads[i], &attr,
+				ag_worker, &work)) != 0)
+			do_error("couldn't create worker thread: %s\n",
+				strerror(err));
+	}
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_attr_destroy(&attr);
+	pthread_mutex_destroy(&work.lock);
+	free(threads);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ * 
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ * 
+ * http://www.sgi.com 
+ * 
+ * For further information regarding this notice, see: 
+ * 
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+
+#include <pthread.h>
+
+/*
+ * worker pool for the phases that walk the filesystem one AG at a
+ * time.  do_ag_work() hands out AGs in ascending order to up to
+ * thread_count workers and returns once every AG has been done.
+ *
+ * locking rules while the workers run:
+ *
+ *	- an AG's inode tree and uncertain inode tree are changed only
+ *	  under that AG's lock.  the worker that owns the AG may read
+ *	  its own trees without the lock, anyone else must go through
+ *	  find_inode_state().
+ *	- block map entries that can be claimed from another AG (file
+ *	  data and bmap btree blocks, inode chunk blocks in phases 3
+ *	  and 4) are checked and set under the lock of the AG that owns
+ *	  the block.  the realtime map has its own lock.
+ *	- phase 2 only touches the AG being scanned so it needs neither.
+ *
+ * with one thread ag_locks is NULL and all of this compiles down to
+ * a pointer test.
+ */
+extern pthread_mutex_t	*ag_locks;
+extern pthread_mutex_t	rt_lock;
+
+#define	XR_LOCK(m)	\
+	do { if (ag_locks != NULL) pthread_mutex_lock(m); } while (0)
+#define	XR_UNLOCK(m)	\
+	do { if (ag_locks != NULL) pthread_mutex_unlock(m); } while (0)
+
+#define	lock_ag(agno)	XR_LOCK(&ag_locks[(agno)])
+#define	unlock_ag(agno)	XR_UNLOCK(&ag_locks[(agno)])
+#define	lock_rt()	XR_LOCK(&rt_lock)
+#define	unlock_rt()	XR_UNLOCK(&rt_lock)
+
+typedef void	(*ag_work_func_t)(xfs_mount_t *mp, xfs_agnumber_t agno,
+				void *arg);
+
+void		thread_init(xfs_mount_t *mp);
+void		do_ag_work(xfs_mount_t *mp, ag_work_func_t func, void *arg);
@@ -39,6 +39,9 @@
 #include "protos.h"
 #include "incore.h"
 #include "err_protos.h"
+#include "threads.h"
+#include "prefetch.h"
+#include "arena.h"
 
 #define	rounddown(x, y)	(((x)/(y))*(y))
 
@@ -66,13 +69,23 @@ char *o_opts[] = {
 	"assume_xfs",
 #define PRE_65_BETA	1
 	"fs_is_pre_65_beta",
+#define BCACHE_SIZE	2
+	"bcache",
+#define PREFETCH	3
+	"prefetch",
+#define BMAP_TYPE	4
+	"bmap",
+#define BTREE_FILL	5
+	"btree_fill",
+#define DIRECT_IO	6
+	"direct",
 	NULL
 };
 
 static void
 usage(void)
 {
-	do_warn("Usage: %s [-nV] [-o subopt[=value]] [-l logdevice] devname\n",
+	do_warn("Usage: %s [-nV] [-o subopt[=value]] [-l logdevice] [-t threads] devname\n",
 		progname);
 	exit(1);
 }
@@ -164,12 +177,18 @@ process_args(int argc, char **argv)
 	fs_has_extflgbit_allowed = 1;
 	pre_65_beta = 0;
 	fs_shared_allowed = 1;
+	bcache_size = XR_DFL_BCACHE_SIZE;
+	thread_count = 1;
+	prefetch_threads = XR_DFL_PREFETCH_THREADS;
+	bmap_type = XR_BMAP_AUTO;
+	btree_fill = 100;
+	direct_io = 0;
 
 	/*
 	 * XXX have to add suboption processing here
 	 * attributes, quotas, nlinks, aligned_inos, sb_fbits
 	 */
-	while ((c = getopt(argc, argv, "o:fnDvVl:")) != EOF)  {
+	while ((c = getopt(argc, argv, "o:fnDvVl:t:")) != EOF)  {
 		switch (c) {
 		case 'D':
 			dumpcore = 1;
@@ -178,6 +197,7 @@ process_args(int argc, char **argv)
 			p = optarg;
 			while (*p != '\0')  {
 				char *val;
+				char *end;
 
 				switch (getsubopt(&p, (constpp)o_opts, &val))  {
 				case ASSUME_XFS:
@@ -195,6 +215,64 @@ process_args(int argc, char **argv)
 							PRE_65_BETA);
 					pre_65_beta = 1;
 					break;
+				case BCACHE_SIZE:
+					if (!val)  {
+						do_warn(
+				"-o bcache requires a size in megabytes\n");
+						usage();
+					}
+					bcache_size = (int)strtol(val, &end, 10);
+					if (*end != '\0' || bcache_size < 0)  {
+						do_warn(
+			"-o bcache size must be a non-negative number\n");
+						usage();
+					}
+					break;
+				case PREFETCH:
+					if (!val)  {
+						do_warn(
+				"-o prefetch requires a thread count\n");
+						usage();
+					}
+					prefetch_threads = (int)strtol(val,
+								&end, 10);
+					if (*end != '\0' || prefetch_threads < 0)  {
+						do_warn(
+		"-o prefetch thread count must be a non-negative number\n");
+						usage();
+					}
+					break;
+				case BMAP_TYPE:
+					if (val && strcmp(val, "flat") == 0)
+						bmap_type = XR_BMAP_FLAT;
+					else if (val && strcmp(val, "runs") == 0)
+						bmap_type = XR_BMAP_RUNS;
+					else  {
+						do_warn(
+				"-o bmap must be \"flat\" or \"runs\"\n");
+						usage();
+					}
+					break;
+				case BTREE_FILL:
+					if (!val)  {
+						do_warn(
+				"-o btree_fill requires a percentage\n");
+						usage();
+					}
+					btree_fill = atoi(val);
+					if (btree_fill < 50 || btree_fill > 100) {
+						do_warn(
+				"-o btree_fill must be between 50 and 100\n");
+						usage();
+					}
+					break;
+				case DIRECT_IO:
+					if (val)
+						noval('o', o_opts, DIRECT_IO);
+					if (direct_io)
+						respec('o', o_opts, DIRECT_IO);
+					direct_io = 1;
+					break;
 				default:
 					unknown('o', val);
 					break;
@@ -205,6 +283,13 @@ process_args(int argc, char **argv)
 			log_name = optarg;
 			log_spec = 1;
 			break;
+		case 't':
+			thread_count = atoi(optarg);
+			if (thread_count < 1)  {
+				do_warn("-t requires a positive thread count\n");
+				usage();
+			}
+			break;
 		case 'f':
 			isa_file = 1;
 			break;
@@ -415,6 +500,7 @@ main(int argc, char **argv)
 
 	process_args(argc, argv);
 	xfs_init(&args);
+	libxfs_bcache_init(0, (size_t)bcache_size << 20);
 
 	/* do phase1 to make sure we have a superblock */
 	phase1(temp_mp);
@@ -459,6 +545,8 @@ main(int argc, char **argv)
 	 * check sb filesystem stats and initialize in-core data structures
 	 */
 	incore_init(mp);
+	thread_init(mp);
+	prefetch_init(mp);
 
 	if (parse_sb_version(&mp->m_sb))  {
 		do_warn(
@@ -480,9 +568,20 @@ main(int argc, char **argv)
 		phase5(mp);
 
 	if (!bad_ino_btree)  {
+		/*
+		 * the directory and link count fixes are lots of small
+		 * transactions, let them sit in the buffer cache and
+		 * write them out together at the end of each phase
+		 */
+		libxfs_trans_delwri(1);
 		phase6(mp);
+		if (libxfs_bcache_flush(0))
+			do_error("couldn't write back phase 6 changes\n");
 
 		phase7(mp);
+		if (libxfs_bcache_flush(0))
+			do_error("couldn't write back phase 7 changes\n");
+		libxfs_trans_delwri(0);
 	} else  {
 		do_warn(
 	"Inode allocation btrees are too corrupted, skipping phases 6 and 7\n");
@@ -534,6 +633,11 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (verbose)  {
+		libxfs_bcache_report(stderr);
+		arena_report(stderr);
+	}
+
 	if (no_modify)  {
 		do_log(
 	"No modify flag set, skipping filesystem flush and exiting.\n");
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2000 Silicon Graphics, Inc.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Further, this software is distributed without any warranty that it is
+ * free of the rightful claim of any third person regarding infringement
+ * or the like.  Any license provided herein, whether implied or
+ * otherwise, applies only to this software file.  Patent licenses, if
+ * any, provided herein do not apply to combinations of this program with
+ * other software, or any other product whatsoever.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston MA 02111-1307, USA.
+ *
+ * Contact information: Silicon Graphics, Inc., 1600 Amphitheatre Pkwy,
+ * Mountain View, CA  94043, or:
+ *
+ * http://www.sgi.com
+ *
+ * For further information regarding this notice, see:
+ *
+ * http://oss.sgi.com/projects/GenInfo/SGIGPLNoticeExplan/
+ */
+
+/*
+ * bloadgeom: check the tree shapes libxfs_bload_geometry() picks.
+ *
+ * For a range of record counts, block sizes, record sizes and fill
+ * percentages, every level of more than one block must put between
+ * minrecs (half of maxrecs) and maxrecs entries in each block, and
+ * the top level must be a single block.  Prints each bad shape and
+ * exits non-zero if there were any.
+ */
+
+#include <libxfs.h>
+
+char	*progname = "bloadgeom";
+
+static int	blocksizes[] = { 512, 1024, 4096 };
+static int	fills[] = { 0, 50, 51, 66, 75, 90, 99, 100 };
+static struct {
+	int	recsize;
+	int	keysize;
+} shapes[] = {
+	{ sizeof(xfs_alloc_rec_t), sizeof(xfs_alloc_key_t) },
+	{ sizeof(xfs_inobt_rec_t), sizeof(xfs_inobt_key_t) },
+};
+
+#define NELEM(a)	(sizeof(a) / sizeof((a)[0]))
+
+static int
+maxrecs(int blocksize, libxfs_bload_t *bl, int level)
+{
+	int	size = blocksize - sizeof(xfs_btree_sblock_t);
+
+	if (level == 0)
+		return size / bl->bl_recsize;
+	return size / (bl->bl_keysize + sizeof(xfs_agblock_t));
+}
+
+static int
+check(int blocksize, libxfs_bload_t *bl, __uint64_t nrecs)
+{
+	libxfs_bload_level_t	*lp;
+	int			level;
+	int			max;
+	int			most;
+	int			bad = 0;
+
+	libxfs_bload_geometry(bl, nrecs);
+	for (level = 0; level < bl->bl_nlevels; level++) {
+		lp = &bl->bl_level[level];
+		max = maxrecs(blocksize, bl, level);
+		most = lp->bll_recs_pb + (lp->bll_modulo ? 1 : 0);
+		if (level == bl->bl_nlevels - 1 && lp->bll_nblocks != 1)
+			bad = 1;
+		if (most > max)
+			bad = 1;
+		if (lp->bll_nblocks > 1 && lp->bll_recs_pb < max / 2)
+			bad = 1;
+		if (bad) {
+			printf("blocksize %d recsize %d fill %d nrecs %llu: "
+				"level %d has %d blocks of %d (+1 for %d), "
+				"maxrecs %d\n",
+				blocksize, bl->bl_recsize, bl->bl_fill,
+				(unsigned long long)nrecs, level,
+				lp->bll_nblocks, lp->bll_recs_pb,
+				lp->bll_modulo, max);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	xfs_mount_t	mount;
+	libxfs_bload_t	bl;
+	__uint64_t	nrecs;
+	int		errors = 0;
+	int		b;
+	int		f;
+	int		s;
+
+	for (b = 0; b < NELEM(blocksizes); b++) {
+		memset(&mount, 0, sizeof(mount));
+		mount.m_sb.sb_blocksize = blocksizes[b];
+		for (s = 0; s < NELEM(shapes); s++) {
+			for (f = 0; f < NELEM(fills); f++) {
+				memset(&bl, 0, sizeof(bl));
+				bl.bl_mp = &mount;
+				bl.bl_recsize = shapes[s].recsize;
+				bl.bl_keysize = shapes[s].keysize;
+				bl.bl_fill = fills[f];
+				/* every count up to a few leaves, then a sample */
+				for (nrecs = 0; nrecs < 5000; nrecs++)
+					errors += check(blocksizes[b], &bl, nrecs);
+				for (; nrecs < 10000000; nrecs += nrecs / 7)
+					errors += check(blocksizes[b], &bl, nrecs);
+			}
+		}
+	}
+	return errors != 0;
+}